@@ -0,0 +1,160 @@
+#!/usr/bin/env python3
+#
+# Copyright 2012 Alexander Ankudinov
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+"""Reference fork server for saferun_forkserver_start()
+
+Usage: saferun-forkserver.py [module ...]
+
+Imports the modules once, then forks a test for every request of the
+library and runs the script given as the first argument of the test as
+__main__. Protocol is described in libsaferun/forkserver.cpp.
+
+Needs Python 3.3 or newer inside the jail.
+"""
+
+import gc
+import os
+import runpy
+import select
+import signal
+import socket
+import struct
+import sys
+import traceback
+
+CONTROL_FD = 3  # SAFERUN_FORKSERVER_FD
+READY = b"SRRD"
+GO = b"SRGO"
+EXIT = b"SREX"
+MAX_SIZE = 64 * 1024
+
+
+def recv_request(ctl):
+    """Return (run socket, stdio fds, args), or None if the library is gone."""
+    fds = []
+    data, ancdata, flags, addr = ctl.recvmsg(MAX_SIZE, socket.CMSG_SPACE(4 * 4))
+    for level, type, cdata in ancdata:
+        if level == socket.SOL_SOCKET and type == socket.SCM_RIGHTS:
+            n = len(cdata) - len(cdata) % 4
+            fds.extend(struct.unpack("%di" % (n // 4), cdata[:n]))
+    if not data:
+        return None
+
+    mask, = struct.unpack("I", data[:4])
+    args = [a.decode() for a in data[4:].split(b"\0")[:-1]]
+    run = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET, fileno=fds[0])
+    stdio = {}
+    for i, fd in zip([i for i in range(3) if mask & (1 << i)], fds[1:]):
+        stdio[i] = fd
+    return run, stdio, args
+
+
+def run_test(run, stdio, args):
+    """Body of the forked test, never returns."""
+    code = 1
+    try:
+        run.send(READY)
+        if run.recv(4) != GO:
+            os._exit(1)
+        run.close()
+
+        for to_fd, fd in stdio.items():
+            os.dup2(fd, to_fd)
+            os.close(fd)
+        sys.stdin = open(0, "r", closefd=False)
+        sys.stdout = open(1, "w", closefd=False)
+        sys.stderr = open(2, "w", closefd=False)
+
+        sys.argv = args
+        runpy.run_path(args[0], run_name="__main__")
+        code = 0
+    except SystemExit as e:
+        if e.code is None:
+            code = 0
+        elif isinstance(e.code, int):
+            code = e.code
+        else:
+            sys.stderr.write("%s\n" % e.code)
+    except BaseException:
+        traceback.print_exc()
+    try:
+        sys.stdout.flush()
+        sys.stderr.flush()
+    except BaseException:
+        code = code or 1
+    os._exit(code)
+
+
+def main():
+    for name in sys.argv[1:]:
+        __import__(name)
+
+    ctl = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET, fileno=CONTROL_FD)
+    wake_r, wake_w = os.pipe()
+    os.set_blocking(wake_w, False)
+    signal.set_wakeup_fd(wake_w)
+    signal.signal(signal.SIGCHLD, lambda signum, frame: None)
+
+    # Objects of warm-up are not touched by gc in tests, so their pages stay shared
+    gc.collect()
+    if hasattr(gc, "freeze"):
+        gc.freeze()
+
+    ctl.send(READY)
+    tests = {}  # pid -> run socket
+    while True:
+        readable = select.select([ctl, wake_r], [], [])[0]
+        if wake_r in readable:
+            os.read(wake_r, 4096)
+            while True:
+                try:
+                    pid, status = os.waitpid(-1, os.WNOHANG)
+                except ChildProcessError:
+                    break
+                if not pid:
+                    break
+                # processes orphaned by tests are reaped too, server is init of the jail
+                run = tests.pop(pid, None)
+                if run is not None:
+                    try:
+                        run.send(EXIT + struct.pack("i", status))
+                    except OSError:
+                        pass
+                    run.close()
+
+        if ctl in readable:
+            request = recv_request(ctl)
+            if request is None:
+                break
+            run, stdio, args = request
+            pid = os.fork()
+            if pid == 0:
+                signal.set_wakeup_fd(-1)
+                signal.signal(signal.SIGCHLD, signal.SIG_DFL)
+                os.close(wake_r)
+                os.close(wake_w)
+                ctl.close()
+                for sock in tests.values():
+                    sock.close()
+                run_test(run, stdio, args)
+            for fd in stdio.values():
+                os.close(fd)
+            tests[pid] = run
+
+
+if __name__ == "__main__":
+    main()
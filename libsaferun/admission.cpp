@@ -0,0 +1,260 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "saferun.h"
+#include "admission.h"
+#include "metrics.h"
+#include "utils.h"
+#include "log.h"
+
+/*
+ * Admission is process-wide: all instances and pools of the process
+ * share one config, one count of running tasks and one queue.
+ */
+
+/* How often a queued run rechecks pressure, in microseconds */
+#define ADMISSION_POLL (50*1000)
+
+/* PSI averages are updated every 2 seconds, no need to read them more often */
+#define PRESSURE_TTL (500*1000)
+
+static pthread_mutex_t admission_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t admission_cond = PTHREAD_COND_INITIALIZER;
+
+static saferun_admission config; /**< all zeros means admission is disabled */
+static int running;              /**< runs admitted and not finished yet */
+static long long reserved;       /**< predicted memory of admitted runs, in bytes */
+
+/*
+ * Queued runs in order of arrival. Later runs may pass the first one
+ * while it waits less than max_wait, so small runs fill memory left by
+ * big ones, then they wait behind it.
+ */
+struct waiter {
+    long long start;
+    waiter *next;
+};
+static waiter *waiters;
+
+static double pressure[3];       /**< cpu, memory and io "some avg10", -1 if unknown */
+static long long pressure_time;  /**< when pressure was read, in microseconds */
+
+static const char *pressure_files[3] = {
+    "/proc/pressure/cpu", "/proc/pressure/memory", "/proc/pressure/io"
+};
+
+/**
+ * Read "some avg10" value of PSI file
+ *
+ * @return percent of time some tasks were stalled, -1 if PSI is not available
+ */
+static double read_pressure(const char *path)
+{
+    double avg10;
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return -1;
+
+    int k = fscanf(file, "some avg10=%lf", &avg10);
+    fclose(file);
+    return k == 1 ? avg10 : -1;
+}
+
+/**
+ * Check if pressure on the host is below all thresholds.
+ *
+ * Should be called with admission_lock held.
+ */
+static int pressure_ok(long long now)
+{
+    const double limits[3] = {config.cpu_pressure, config.memory_pressure, config.io_pressure};
+
+    if (now - pressure_time >= PRESSURE_TTL) {
+        for (int i = 0; i < 3; ++i)
+            pressure[i] = limits[i] > 0 ? read_pressure(pressure_files[i]) : -1;
+        pressure_time = now;
+    }
+
+    for (int i = 0; i < 3; ++i)
+        if (limits[i] > 0 && pressure[i] > limits[i]) {
+            DEBUG("%s is %.2f, over %.2f", pressure_files[i], pressure[i], limits[i]);
+            return 0;
+        }
+    return 1;
+}
+
+static int enabled()
+{
+    return config.max_running > 0 || config.cpu_pressure > 0
+        || config.memory_pressure > 0 || config.io_pressure > 0
+        || config.max_memory > 0;
+}
+
+/**
+ * Memory reserved for the run while it`s in progress.
+ *
+ * Peak memory predicted from history with a quarter more for variance,
+ * memory limit if the task is new. A run never takes more than its limit.
+ */
+static long long run_memory(const saferun_limits *limits, const saferun_stat *stat)
+{
+    if (!stat->predicted.runs)
+        return limits->mem;
+    long long mem = stat->predicted.mem + stat->predicted.mem / 4;
+    return mem < limits->mem ? mem : limits->mem;
+}
+
+/**
+ * Check if the run may be admitted before runs queued earlier.
+ *
+ * Should be called with admission_lock held.
+ */
+static int may_pass(const waiter *self, long long now)
+{
+    if (waiters == self)
+        return 1;
+    return config.max_wait > 0 && now - waiters->start < config.max_wait * 1000LL;
+}
+
+/**
+ * Wait until the run can start.
+ *
+ * Run is admitted if there are less than max_running admitted runs,
+ * its memory fits under max_memory with memory of admitted runs
+ * and pressure is below thresholds. Pressure is ignored if nothing is
+ * running, the host is loaded by someone else then and waiting won`t help,
+ * and after max_wait. Memory is never overcommitted, but a run bigger
+ * than max_memory is admitted when nothing else is running.
+ * Once the first queued run waited max_wait, or at once without max_wait,
+ * runs are admitted in order of arrival, so none of them starves.
+ *
+ * @param stat  its predicted memory is used and queue_time is set
+ * @return 1 if run was counted and admission_leave() must be called, 0 otherwise
+ */
+int admission_enter(const saferun_limits *limits, saferun_stat *stat)
+{
+    long long start = get_rtime(), now = start;
+    long long mem = run_memory(limits, stat);
+    int counted = 0;
+
+    pthread_mutex_lock(&admission_lock);
+    if (enabled()) {
+        metrics_queue(1);
+        waiter self;
+        self.start = start;
+        self.next = NULL;
+        waiter **tail = &waiters;
+        while (*tail)
+            tail = &(*tail)->next;
+        *tail = &self;
+
+        while (1) {
+            int waited_enough = config.max_wait > 0 && now - start >= config.max_wait * 1000LL;
+            int slot = config.max_running <= 0 || running < config.max_running;
+            int fits = config.max_memory <= 0 || !running || reserved + mem <= config.max_memory;
+            if (may_pass(&self, now) && slot && fits
+                    && (!running || waited_enough || pressure_ok(now)))
+                break;
+
+            // slots and memory are waited for without timeout, pressure is polled
+            timespec deadline;
+            long long wake = now + ADMISSION_POLL;
+            deadline.tv_sec = wake / (1000*1000);
+            deadline.tv_nsec = (wake % (1000*1000)) * 1000;
+            pthread_cond_timedwait(&admission_cond, &admission_lock, &deadline);
+            now = get_rtime();
+        }
+
+        waiter **prev = &waiters;
+        while (*prev != &self)
+            prev = &(*prev)->next;
+        *prev = self.next;
+        // the next run may be the first one now
+        pthread_cond_broadcast(&admission_cond);
+        metrics_queue(-1);
+        ++running;
+        reserved += mem;
+        counted = 1;
+    }
+    pthread_mutex_unlock(&admission_lock);
+
+    stat->queue_time = counted ? get_rtime() - start : 0;
+    if (counted)
+        metrics_observe(METRIC_QUEUE, stat->queue_time);
+    return counted;
+}
+
+/**
+ * Release the slot and memory taken by admission_enter()
+ */
+void admission_leave(const saferun_limits *limits, const saferun_stat *stat)
+{
+    pthread_mutex_lock(&admission_lock);
+    --running;
+    reserved -= run_memory(limits, stat);
+    pthread_cond_broadcast(&admission_cond);
+    pthread_mutex_unlock(&admission_lock);
+}
+
+/**
+ * Fill pressure of remote load and limit its capacity by max_running
+ *
+ * Pressure is read even if admission doesn`t use it, coordinator does.
+ */
+void admission_load(saferun_remote_load *load)
+{
+    double *values[3] = {&load->cpu_pressure, &load->memory_pressure, &load->io_pressure};
+    for (int i = 0; i < 3; ++i)
+        *values[i] = read_pressure(pressure_files[i]);
+
+    pthread_mutex_lock(&admission_lock);
+    if (config.max_running > 0 && (!load->capacity || config.max_running < load->capacity))
+        load->capacity = config.max_running;
+    pthread_mutex_unlock(&admission_lock);
+}
+
+/**
+ * Set admission control for all runs of the process.
+ *
+ * Runs over the limits wait in saferun_run() before setting up
+ * the cgroup, the wait is reported in saferun_stat.queue_time.
+ * With max_memory runs are packed by memory predicted by history,
+ * see saferun_set_history, or by their memory limit.
+ * NULL or all zero config disables admission control.
+ *
+ * @return -1 if config is invalid, 0 otherwise.
+ */
+int saferun_set_admission(const saferun_admission *cfg)
+{
+    if (cfg && (cfg->max_running < 0 || cfg->max_wait < 0 || cfg->max_memory < 0))
+        return -1;
+
+    pthread_mutex_lock(&admission_lock);
+    if (cfg)
+        config = *cfg;
+    else
+        memset(&config, 0, sizeof(config));
+    pressure_time = 0;
+    pthread_cond_broadcast(&admission_cond);
+    pthread_mutex_unlock(&admission_lock);
+    return 0;
+}
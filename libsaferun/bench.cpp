@@ -0,0 +1,133 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+#include "saferun.h"
+#include "utils.h"
+#include "log.h"
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Median of sorted array
+ */
+static double median(const double *x, int n)
+{
+    return n % 2 ? x[n / 2] : (x[n / 2 - 1] + x[n / 2]) / 2;
+}
+
+/**
+ * Fill summary of n values, values are sorted in place.
+ */
+static void summarize(double *x, int n, saferun_summary *s)
+{
+    memset(s, 0, sizeof(saferun_summary));
+    if (!n)
+        return;
+
+    qsort(x, n, sizeof(double), compare_double);
+    s->min = x[0];
+    s->median = median(x, n);
+    for (int i = 0; i < n; ++i)
+        s->mean += x[i];
+    s->mean /= n;
+    s->p95 = x[(int) ceil(0.95 * n) - 1];
+
+    double *dev = (double *) malloc(n * sizeof(double));
+    if (!dev)
+        return;
+    for (int i = 0; i < n; ++i)
+        dev[i] = fabs(x[i] - s->median);
+    qsort(dev, n, sizeof(double), compare_double);
+    s->mad = median(dev, n);
+    free(dev);
+}
+
+/**
+ * Run the task warmup+repeat times in the same cgroup and summarize measured runs.
+ *
+ * Instance is made persistent for the time of benchmark, so cgroup is
+ * created once. Benchmark stops on the first run with result other
+ * than _OK, bench->last holds its statistics then.
+ *
+ * @note For steady timings use SAFERUN_JAIL_* flags of the task jail.
+ * Spawn cost depends on isolation profile of the task, so benchmark
+ * the same task with different saferun_task.isolation to compare them.
+ *
+ * @param warmup  number of runs before measuring
+ * @param repeat  number of measured runs
+ *
+ * @return 0 if all runs were done, 1 if some run failed, -1 on error
+ */
+int saferun_bench_run(saferun_inst *inst, const saferun_task *task, int warmup, int repeat,
+                      saferun_bench *bench)
+{
+    if (!inst || !task || !bench || warmup < 0 || repeat <= 0)
+        return -1;
+
+    memset(bench, 0, sizeof(saferun_bench));
+
+    double *values = (double *) malloc(4 * repeat * sizeof(double));
+    if (!values)
+        return -1;
+    double *time = values, *rtime = values + repeat, *mem = values + 2 * repeat;
+    double *spawn = values + 3 * repeat;
+
+    int persistent = inst->persistent;
+    saferun_set_persistent(inst, 1);
+
+    int ret = 0;
+    try {
+        for (int i = 0; i < warmup + repeat; ++i) {
+            rewind_stdio(task->stdin_fd, task->stdout_fd, task->stderr_fd);
+            if (saferun_run(inst, task, &bench->last))
+                throw -1;
+            if (bench->last.result != _OK) {
+                ret = 1;
+                break;
+            }
+            if (i < warmup)
+                continue;
+
+            time[bench->runs] = bench->last.time;
+            rtime[bench->runs] = bench->last.rtime;
+            mem[bench->runs] = bench->last.mem;
+            spawn[bench->runs] = 0;
+            for (int p = SAFERUN_PHASE_CGROUP; p <= SAFERUN_PHASE_EXEC; ++p)
+                spawn[bench->runs] += bench->last.phase_time[p];
+            ++bench->runs;
+        }
+    }
+    catch (...) {
+        ret = -1;
+    }
+
+    summarize(time, bench->runs, &bench->time);
+    summarize(rtime, bench->runs, &bench->rtime);
+    summarize(mem, bench->runs, &bench->mem);
+    summarize(spawn, bench->runs, &bench->spawn);
+
+    free(values);
+    saferun_set_persistent(inst, persistent);
+    return ret;
+}
@@ -0,0 +1,635 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#include "saferun.h"
+#include "sha256.h"
+#include "utils.h"
+#include "log.h"
+
+/*
+ * Cache directory has two files:
+ *  - index, an mmap`ed hash table of fixed size entries;
+ *  - data, captured output of cached runs, only appended to.
+ * Both are guarded by flock on index, so several processes can share
+ * the cache, and by a mutex for threads of one process.
+ */
+
+#define CACHE_MAGIC   0x48435253 /* "SRCH" */
+#define CACHE_VERSION 1
+
+/* Entries checked for a key before evicting the first one */
+#define CACHE_PROBE 16
+
+/* Runs with more output are not cached */
+#define CACHE_MAX_OUTPUT (64*1024*1024)
+
+enum cache_state {
+    CACHE_EMPTY    = 0,
+    CACHE_VALID    = 1,
+    CACHE_UNSTABLE = 2  /**< verification got other result, never served again */
+};
+
+struct cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t stat_size; /**< sizeof(saferun_stat), the index is reset if it changes */
+    uint32_t slots;
+    uint32_t entries;
+    uint32_t reserved;
+    int64_t hits;
+    int64_t misses;
+    int64_t verified;
+    int64_t mismatches;
+};
+
+struct cache_entry {
+    unsigned char key[SHA256_SIZE];
+    unsigned char output_hash[SHA256_SIZE]; /**< of stdout and stderr */
+    uint32_t state;
+    uint32_t reserved;
+    uint64_t out_offset, out_length; /**< stdout in data file */
+    uint64_t err_offset, err_length; /**< stderr in data file */
+    saferun_stat stat;
+};
+
+struct saferun_cache {
+    pthread_mutex_t lock;
+    int index_fd;
+    int data_fd;
+    size_t size;          /**< of mapping */
+    cache_header *header;
+    cache_entry *entries;
+
+    double verify_rate;
+    unsigned seed;
+};
+
+/* Output file of the task and its offset before the run */
+struct cache_output {
+    int fd;      /**< -1 if not captured */
+    int read_fd; /**< same file opened for reading, task outputs are usually write-only */
+    off_t start;
+};
+
+static void lock(saferun_cache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    flock(cache->index_fd, LOCK_EX);
+}
+
+static void unlock(saferun_cache *cache)
+{
+    flock(cache->index_fd, LOCK_UN);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static void write_full(int fd, const char *p, size_t n)
+{
+    while (n) {
+        ssize_t k = write(fd, p, n);
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k <= 0) {
+            SYSERROR("can`t write cached output");
+            throw -1;
+        }
+        p += k;
+        n -= k;
+    }
+}
+
+/**
+ * Copy length bytes at offset of fd to the end of to_fd (if it`s not -1).
+ *
+ * @param ctx  if not NULL, copied bytes are hashed
+ */
+static void copy_range(int fd, off_t offset, off_t length, int to_fd, sha256_ctx *ctx)
+{
+    char buf[64*1024];
+    while (length > 0) {
+        ssize_t k = pread(fd, buf, length < (off_t) sizeof(buf) ? length : sizeof(buf), offset);
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k <= 0) {
+            SYSERROR("can`t read output");
+            throw -1;
+        }
+        if (ctx)
+            sha256_update(ctx, buf, k);
+        if (to_fd >= 0)
+            write_full(to_fd, buf, k);
+        offset += k;
+        length -= k;
+    }
+}
+
+static int is_regular(int fd)
+{
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+static int same_file(int fd1, int fd2)
+{
+    struct stat st1, st2;
+    return fstat(fd1, &st1) == 0 && fstat(fd2, &st2) == 0
+        && st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino;
+}
+
+/**
+ * Compute cache key of the task.
+ *
+ * Key covers executable content, stdin content, argv, jail and limits.
+ * Task is cacheable only if its stdin and outputs are regular files
+ * (or are not redirected), so input can be hashed and output captured.
+ *
+ * @return 0 if the task can`t be cached
+ */
+static int make_key(const saferun_task *task, unsigned char *key)
+{
+    const saferun_jail *jail = task->jail;
+    char exe[MAXPATHLEN];
+    sha256_ctx ctx;
+
+    if ((task->stdin_fd >= 0 && !is_regular(task->stdin_fd))
+            || (task->stdout_fd >= 0 && !is_regular(task->stdout_fd))
+            || (task->stderr_fd >= 0 && !is_regular(task->stderr_fd)))
+        return 0;
+    if (!find_executable(task, exe))
+        return 0;
+
+    sha256_init(&ctx);
+
+    int fd = open(exe, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    int ok = sha256_update_fd(&ctx, fd);
+    close(fd);
+    if (!ok)
+        return 0;
+
+    uint32_t has_stdin = task->stdin_fd >= 0;
+    sha256_update(&ctx, &has_stdin, sizeof(has_stdin));
+    if (has_stdin && !sha256_update_fd(&ctx, task->stdin_fd))
+        return 0;
+
+    for (char **arg = task->argv; *arg; ++arg)
+        sha256_update_str(&ctx, *arg);
+    sha256_update_str(&ctx, NULL);
+
+    sha256_update_str(&ctx, jail->hostname);
+    sha256_update_str(&ctx, jail->chroot);
+    sha256_update_str(&ctx, jail->chdir);
+    uint32_t ids[4] = {(uint32_t) jail->uid, (uint32_t) jail->gid, (uint32_t) jail->flags, (uint32_t) jail->cpu};
+    sha256_update(&ctx, ids, sizeof(ids));
+    sha256_update(&ctx, task->limits, sizeof(saferun_limits));
+    sha256_update_str(&ctx, task->qos);
+    sha256_update_str(&ctx, task->isolation);
+
+    sha256_final(&ctx, key);
+    return 1;
+}
+
+/**
+ * Find entry with key, or entry to put it to.
+ *
+ * Should be called with cache locked.
+ */
+static cache_entry *find_entry(saferun_cache *cache, const unsigned char *key, int *found)
+{
+    uint64_t h;
+    memcpy(&h, key, sizeof(h));
+    uint32_t slots = cache->header->slots;
+    cache_entry *empty = NULL;
+
+    for (uint32_t i = 0; i < CACHE_PROBE && i < slots; ++i) {
+        cache_entry *e = &cache->entries[(h + i) % slots];
+        if (e->state == CACHE_EMPTY) {
+            if (!empty)
+                empty = e;
+        } else if (!memcmp(e->key, key, SHA256_SIZE)) {
+            *found = 1;
+            return e;
+        }
+    }
+
+    *found = 0;
+    return empty ? empty : &cache->entries[h % slots];
+}
+
+/**
+ * Remember offsets of task outputs, so output of the run can be read later.
+ */
+static void start_outputs(const saferun_task *task, cache_output *out)
+{
+    out[0].fd = task->stdout_fd;
+    out[1].fd = task->stderr_fd;
+    // output written to one file twice would be duplicated on hits
+    if (out[1].fd >= 0 && out[0].fd >= 0 && same_file(out[0].fd, out[1].fd))
+        out[1].fd = -1;
+
+    for (int i = 0; i < 2; ++i) {
+        out[i].read_fd = -1;
+        if (out[i].fd >= 0 && (out[i].start = lseek(out[i].fd, 0, SEEK_CUR)) == -1)
+            out[i].fd = -1;
+    }
+}
+
+/**
+ * Open task outputs for reading, so they can be captured.
+ *
+ * @return 0 if some output can`t be opened
+ */
+static int open_outputs(cache_output *out)
+{
+    char path[64];
+    for (int i = 0; i < 2; ++i) {
+        if (out[i].fd < 0)
+            continue;
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", out[i].fd);
+        if ((out[i].read_fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+            SYSERROR("can`t open output for reading");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void close_outputs(cache_output *out)
+{
+    for (int i = 0; i < 2; ++i)
+        if (out[i].read_fd >= 0)
+            close(out[i].read_fd);
+}
+
+static off_t output_length(const cache_output *out)
+{
+    struct stat st;
+    if (out->fd < 0 || fstat(out->fd, &st) == -1 || st.st_size < out->start)
+        return 0;
+    return st.st_size - out->start;
+}
+
+/**
+ * Hash output of the run, and copy it to data file if entry is not NULL.
+ */
+static void capture_outputs(saferun_cache *cache, const cache_output *out,
+                            cache_entry *entry, unsigned char *hash)
+{
+    sha256_ctx ctx;
+    sha256_init(&ctx);
+
+    for (int i = 0; i < 2; ++i) {
+        off_t length = output_length(&out[i]);
+        if (entry) {
+            struct stat st;
+            if (fstat(cache->data_fd, &st) == -1)
+                throw -1;
+            if (i == 0) {
+                entry->out_offset = st.st_size;
+                entry->out_length = length;
+            } else {
+                entry->err_offset = st.st_size;
+                entry->err_length = length;
+            }
+        }
+        if (length)
+            copy_range(out[i].read_fd, out[i].start, length, entry ? cache->data_fd : -1, &ctx);
+        // separates stdout and stderr in the hash
+        sha256_update(&ctx, &length, sizeof(length));
+    }
+
+    sha256_final(&ctx, hash);
+}
+
+/**
+ * Write cached output of entry to task stdout and stderr.
+ */
+static void replay_outputs(saferun_cache *cache, const cache_entry *entry, const saferun_task *task)
+{
+    cache_output out[2];
+    start_outputs(task, out);
+
+    if (out[0].fd >= 0)
+        copy_range(cache->data_fd, entry->out_offset, entry->out_length, out[0].fd, NULL);
+    if (out[1].fd >= 0)
+        copy_range(cache->data_fd, entry->err_offset, entry->err_length, out[1].fd, NULL);
+}
+
+/**
+ * Open cache in directory, create it if needed.
+ *
+ * @param slots  number of entries in a new cache, ignored if cache exists
+ * @return NULL on error
+ */
+saferun_cache *saferun_cache_open(const char *dir, int slots)
+{
+    char path[MAXPATHLEN];
+    struct stat st;
+
+    if (!dir || slots <= 0)
+        return NULL;
+
+    saferun_cache *cache = (saferun_cache *) malloc(sizeof(saferun_cache));
+    if (!cache)
+        return NULL;
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->index_fd = cache->data_fd = -1;
+    cache->header = NULL;
+    cache->verify_rate = 0;
+    cache->seed = getpid();
+
+    try {
+        if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+            SYSERROR("can`t create cache dir %s", dir);
+            throw -1;
+        }
+
+        snprintf(path, sizeof(path), "%s/index", dir);
+        cache->index_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        snprintf(path, sizeof(path), "%s/data", dir);
+        cache->data_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (cache->index_fd < 0 || cache->data_fd < 0) {
+            SYSERROR("can`t open cache files in %s", dir);
+            throw -1;
+        }
+
+        flock(cache->index_fd, LOCK_EX);
+        try {
+            cache_header header;
+            if (fstat(cache->index_fd, &st) == -1)
+                throw -1;
+            if ((size_t) st.st_size < sizeof(header)
+                    || pread(cache->index_fd, &header, sizeof(header), 0) != sizeof(header)
+                    || header.magic != CACHE_MAGIC || header.version != CACHE_VERSION
+                    || header.stat_size != sizeof(saferun_stat)
+                    || (size_t) st.st_size != sizeof(header) + header.slots * sizeof(cache_entry)) {
+                if (st.st_size)
+                    WARN("cache index in %s is outdated or broken, resetting it", dir);
+                memset(&header, 0, sizeof(header));
+                header.magic = CACHE_MAGIC;
+                header.version = CACHE_VERSION;
+                header.stat_size = sizeof(saferun_stat);
+                header.slots = slots;
+                if (ftruncate(cache->index_fd, 0) == -1
+                        || ftruncate(cache->index_fd, sizeof(header) + slots * sizeof(cache_entry)) == -1
+                        || pwrite(cache->index_fd, &header, sizeof(header), 0) != sizeof(header)
+                        || ftruncate(cache->data_fd, 0) == -1) {
+                    SYSERROR("can`t create cache index in %s", dir);
+                    throw -1;
+                }
+            }
+
+            cache->size = sizeof(header) + header.slots * sizeof(cache_entry);
+            void *p = mmap(NULL, cache->size, PROT_READ | PROT_WRITE, MAP_SHARED, cache->index_fd, 0);
+            if (p == MAP_FAILED) {
+                SYSERROR("can`t map cache index");
+                throw -1;
+            }
+            cache->header = (cache_header *) p;
+            cache->entries = (cache_entry *) (cache->header + 1);
+        }
+        catch (...) {
+            flock(cache->index_fd, LOCK_UN);
+            throw;
+        }
+        flock(cache->index_fd, LOCK_UN);
+    }
+    catch (...) {
+        saferun_cache_close(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+/**
+ * Close cache, all its entries are already on disk.
+ *
+ * @return -1 if cache is NULL, 0 otherwise.
+ */
+int saferun_cache_close(saferun_cache *cache)
+{
+    if (!cache)
+        return -1;
+    if (cache->header)
+        munmap(cache->header, cache->size);
+    if (cache->index_fd >= 0)
+        close(cache->index_fd);
+    if (cache->data_fd >= 0)
+        close(cache->data_fd);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+    return 0;
+}
+
+/**
+ * Set fraction of cache hits that are run again to check the result.
+ *
+ * If rerun gets other verdict or output, the task is nondeterministic:
+ * its entry is marked so and the task is never served from cache again.
+ *
+ * @param rate  from 0 (never verify) to 1 (always run)
+ * @return -1 on bad arguments, 0 otherwise.
+ */
+int saferun_cache_set_verify(saferun_cache *cache, double rate)
+{
+    if (!cache || rate < 0 || rate > 1)
+        return -1;
+    pthread_mutex_lock(&cache->lock);
+    cache->verify_rate = rate;
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+/**
+ * Run task, or take its result from cache if the same task was run before.
+ *
+ * On hit, stat of the cached run is returned with stat->cached set,
+ * and cached output is written to task stdout and stderr.
+ * Tasks with stdin or outputs not being regular files are always run.
+ *
+ * @note Time and memory of cached runs are the ones of the first run.
+ *
+ * @return -1 on library error, 0 otherwise, as saferun_run()
+ */
+int saferun_cache_run(saferun_cache *cache, const saferun_inst *inst,
+                      const saferun_task *task, saferun_stat *stat)
+{
+    unsigned char key[SHA256_SIZE], output_hash[SHA256_SIZE];
+    cache_output out[2];
+    int found, verify = 0;
+    saferun_result cached_result = _OK;
+
+    if (!cache || !task || !task->jail || !task->limits || !task->argv || !stat)
+        return -1;
+
+    stat->cached = 0;
+    if (!make_key(task, key))
+        return saferun_run(inst, task, stat);
+
+    lock(cache);
+    cache_entry *entry = find_entry(cache, key, &found);
+    if (found && entry->state == CACHE_UNSTABLE) {
+        unlock(cache);
+        return saferun_run(inst, task, stat);
+    }
+    if (found) {
+        verify = cache->verify_rate > 0 && rand_r(&cache->seed) < cache->verify_rate * RAND_MAX;
+        if (!verify) {
+            int ret = 0;
+            try {
+                replay_outputs(cache, entry, task);
+                *stat = entry->stat;
+                stat->cached = 1;
+                ++cache->header->hits;
+            }
+            catch (...) {
+                ret = -1;
+            }
+            unlock(cache);
+            return ret;
+        }
+        memcpy(output_hash, entry->output_hash, SHA256_SIZE);
+        cached_result = (saferun_result) entry->stat.result;
+    } else {
+        ++cache->header->misses;
+    }
+    unlock(cache);
+
+    start_outputs(task, out);
+    int ret = saferun_run(inst, task, stat);
+    if (ret || output_length(&out[0]) + output_length(&out[1]) > CACHE_MAX_OUTPUT
+            || !open_outputs(out)) {
+        close_outputs(out);
+        return ret;
+    }
+
+    lock(cache);
+    try {
+        entry = find_entry(cache, key, &found);
+        if (verify) {
+            unsigned char new_hash[SHA256_SIZE];
+            capture_outputs(cache, out, NULL, new_hash);
+            ++cache->header->verified;
+            if (found && (stat->result != cached_result || memcmp(new_hash, output_hash, SHA256_SIZE))) {
+                WARN("task %s is nondeterministic, it won`t be cached", task->argv[0]);
+                ++cache->header->mismatches;
+                entry->state = CACHE_UNSTABLE;
+            }
+        } else if (!found || entry->state != CACHE_UNSTABLE) {
+            // evicted or replaced entry, its output stays in data file until clear
+            if (entry->state != CACHE_EMPTY)
+                --cache->header->entries;
+            entry->state = CACHE_EMPTY;
+            memcpy(entry->key, key, SHA256_SIZE);
+            capture_outputs(cache, out, entry, entry->output_hash);
+            entry->stat = *stat;
+            entry->state = CACHE_VALID;
+            ++cache->header->entries;
+        }
+    }
+    catch (...) {
+        // the run itself succeeded, failing to cache it is not an error
+        WARN("can`t put result of %s to cache", task->argv[0]);
+    }
+    unlock(cache);
+    close_outputs(out);
+
+    return ret;
+}
+
+/**
+ * Remove cached result of the task, e.g. after its checker is changed.
+ *
+ * @return -1 if task can`t be cached, 0 otherwise.
+ */
+int saferun_cache_invalidate(saferun_cache *cache, const saferun_task *task)
+{
+    unsigned char key[SHA256_SIZE];
+    int found;
+
+    if (!cache || !task || !task->jail || !task->limits || !task->argv)
+        return -1;
+    if (!make_key(task, key))
+        return -1;
+
+    lock(cache);
+    cache_entry *entry = find_entry(cache, key, &found);
+    if (found) {
+        entry->state = CACHE_EMPTY;
+        --cache->header->entries;
+    }
+    unlock(cache);
+    return 0;
+}
+
+/**
+ * Remove all cached results and their output.
+ *
+ * @return -1 on error, 0 otherwise.
+ */
+int saferun_cache_clear(saferun_cache *cache)
+{
+    if (!cache)
+        return -1;
+
+    lock(cache);
+    memset(cache->entries, 0, cache->header->slots * sizeof(cache_entry));
+    cache->header->entries = 0;
+    int ret = ftruncate(cache->data_fd, 0);
+    unlock(cache);
+
+    if (ret == -1) {
+        SYSERROR("can`t truncate cache data");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Get cache counters, they are kept on disk and shared by all users.
+ *
+ * @return -1 on bad arguments, 0 otherwise.
+ */
+int saferun_cache_get_info(saferun_cache *cache, saferun_cache_info *info)
+{
+    if (!cache || !info)
+        return -1;
+
+    lock(cache);
+    info->slots = cache->header->slots;
+    info->entries = cache->header->entries;
+    info->hits = cache->header->hits;
+    info->misses = cache->header->misses;
+    info->verified = cache->header->verified;
+    info->mismatches = cache->header->mismatches;
+    unlock(cache);
+    return 0;
+}
@@ -0,0 +1,276 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/wait.h>
+
+#include "saferun.h"
+#include "run.h"
+#include "cgroup.h"
+#include "calibrate.h"
+#include "sha256.h"
+#include "utils.h"
+#include "log.h"
+
+/* Reference workload: CALIBRATE_ROUNDS hashes of a buffer bigger than L2 cache */
+#define CALIBRATE_BUFFER (1024*1024)
+#define CALIBRATE_ROUNDS 16
+/* Workload is run this many times, the fastest one counts */
+#define CALIBRATE_SAMPLES 3
+/* Memory limit of the calibration cgroup, the workload needs only the buffer */
+#define CALIBRATE_MEMORY (64*1024*1024)
+
+/**
+ * Reference workload, a chain of hashes where every digest changes
+ * the buffer, so rounds can`t be skipped or reordered.
+ */
+static void workload(unsigned char *buf)
+{
+    unsigned char digest[SHA256_SIZE];
+    for (int i = 0; i < CALIBRATE_ROUNDS; ++i) {
+        sha256_ctx ctx;
+        sha256_init(&ctx);
+        sha256_update(&ctx, buf, CALIBRATE_BUFFER);
+        sha256_final(&ctx, digest);
+
+        size_t offset;
+        memcpy(&offset, digest, sizeof(offset));
+        memcpy(buf + offset % (CALIBRATE_BUFFER - SHA256_SIZE), digest, SHA256_SIZE);
+    }
+}
+
+/**
+ * Run the workload once in cgroup of sandbox.
+ *
+ * The child is forked, not exec`ed, and waits on a pipe until it`s moved
+ * to the cgroup, so cpuacct.usage counts nothing but the workload.
+ * Buffer is allocated before fork, malloc is not safe in a child of
+ * a multithreaded process.
+ *
+ * @return CPU time of the workload, in nanoseconds
+ */
+static long long sample(const saferun_inst *sandbox, const saferun_task *task, unsigned char *buf)
+{
+    int go[2];
+    long long usage = 0;
+
+    setup_cgroup(sandbox, task, 0);
+    if (pipe(go)) {
+        SYSERROR("can`t make pipe for calibration");
+        fini_cgroup(sandbox);
+        throw -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        char c;
+        close(go[1]);
+        if (read(go[0], &c, 1) != 1)
+            _exit(1);
+        workload(buf);
+        _exit(0);
+    }
+    close(go[0]);
+
+    int status = 0;
+    try {
+        if (pid < 0) {
+            SYSERROR("can`t fork calibration workload");
+            throw -1;
+        }
+        task_to_cgroup(sandbox, pid, 0);
+        if (write(go[1], "", 1) != 1) {
+            SYSERROR("can`t start calibration workload");
+            throw -1;
+        }
+        close(go[1]);
+        go[1] = -1;
+        waitpid(pid, &status, 0);
+        pid = 0;
+        if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+            ERROR("calibration workload failed with status %d", status);
+            throw -1;
+        }
+        cgroup_read_ll(sandbox->cpuacct_path, "cpuacct.usage", &usage);
+    }
+    catch (...) {
+        if (go[1] >= 0)
+            close(go[1]);
+        if (pid > 0) {
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+        }
+        fini_cgroup(sandbox);
+        throw;
+    }
+
+    fini_cgroup(sandbox);
+    return usage;
+}
+
+/**
+ * Measure speed of the host by the reference workload.
+ *
+ * Workload is run in its own cgroup "<cgname>-calib" limited like a task
+ * with "accounting" isolation, so instance cgroup and its settings are
+ * not touched. CPU time of the fastest of CALIBRATE_SAMPLES runs counts,
+ * slower ones were disturbed by other load of the host.
+ *
+ * saferun_inst.speed becomes reference time of the workload divided by
+ * its CPU time here, so it`s more than 1 on hosts faster than reference.
+ *
+ * @return -1 on error, speed is not changed then, 0 otherwise.
+ */
+int saferun_calibrate(saferun_inst *inst)
+{
+    char cgname[MAXPATHLEN];
+
+    if (!inst)
+        return -1;
+
+    int n = snprintf(cgname, sizeof(cgname), "%s-calib", inst->cgname);
+    if (n < 0 || n >= (int) sizeof(cgname)) {
+        ERROR("name of calibration cgroup of %s is too long", inst->cgname);
+        return -1;
+    }
+    saferun_inst *sandbox = saferun_init(cgname);
+    unsigned char *buf = (unsigned char *) malloc(CALIBRATE_BUFFER);
+    if (!sandbox || !buf) {
+        ERROR("can`t prepare calibration sandbox %s", cgname);
+        saferun_fini(sandbox);
+        free(buf);
+        return -1;
+    }
+    for (int i = 0; i < CALIBRATE_BUFFER; ++i)
+        buf[i] = (unsigned char) (i * 131);
+
+    saferun_limits limits;
+    memset(&limits, 0, sizeof(limits));
+    limits.mem = CALIBRATE_MEMORY;
+    saferun_task task;
+    memset(&task, 0, sizeof(task));
+    task.limits = &limits;
+
+    int ret = 0;
+    long long best = 0;
+    try {
+        for (int i = 0; i < CALIBRATE_SAMPLES; ++i) {
+            long long usage = sample(sandbox, &task, buf);
+            if (usage > 0 && (!best || usage < best))
+                best = usage;
+        }
+        if (!best) {
+            ERROR("calibration workload took no CPU time");
+            throw -1;
+        }
+        inst->speed = inst->reference * 1000000 / best;
+        inst->calibrated = get_rtime();
+        INFO("host speed is %.3f, reference workload took %.3f ms", inst->speed, best / 1e6);
+    }
+    catch (...) {
+        ret = -1;
+    }
+
+    free(buf);
+    saferun_fini(sandbox);
+    return ret;
+}
+
+/**
+ * Set how times of the instance relate to the reference host.
+ *
+ * Calibrates the instance if it was never calibrated or reference changed.
+ * Instances of a pool are calibrated again by saferun_pool_acquire() once
+ * interval passed, a single instance can call saferun_calibrate() itself.
+ *
+ * With normalize time and rtime limits are in reference milliseconds,
+ * they are divided by speed of the host before the run. Both raw and
+ * reference times are reported in saferun_stat. rtime includes waiting
+ * for I/O, which doesn`t depend on CPU speed, so it`s scaled less exactly.
+ *
+ * @param reference  CPU time of the reference workload on the reference host,
+ *                   in milliseconds, 0 is SAFERUN_REFERENCE_TIME
+ * @param interval   calibrate again after this many milliseconds, 0 never
+ * @param normalize  scale time limits to this host
+ *
+ * @return -1 on bad arguments or calibration error, 0 otherwise.
+ */
+int saferun_set_calibration(saferun_inst *inst, double reference, long interval, int normalize)
+{
+    if (!inst || reference < 0 || interval < 0)
+        return -1;
+
+    if (!reference)
+        reference = SAFERUN_REFERENCE_TIME;
+    if (reference != inst->reference)
+        inst->calibrated = 0;
+    inst->reference = reference;
+    inst->calibrate_interval = interval;
+
+    if (!inst->calibrated && saferun_calibrate(inst))
+        return -1;
+    inst->normalize = normalize;
+    return 0;
+}
+
+/**
+ * Calibrate instance again if its calibration is older than interval.
+ *
+ * Failed calibration keeps the previous speed.
+ */
+void calibrate_refresh(saferun_inst *inst)
+{
+    if (!inst->calibrated || !inst->calibrate_interval)
+        return;
+    if (get_rtime() - inst->calibrated < (long long) inst->calibrate_interval * 1000)
+        return;
+    if (saferun_calibrate(inst))
+        WARN("calibration of %s failed, speed %.3f is kept", inst->cgname, inst->speed);
+}
+
+/**
+ * Limits to run task with on this host.
+ *
+ * @param scaled  where to put scaled copy of limits
+ *
+ * @return limits themselves if the instance doesn`t normalize, scaled otherwise
+ */
+const saferun_limits *calibrate_limits(const saferun_inst *inst, const saferun_limits *limits,
+                                       saferun_limits *scaled)
+{
+    if (!inst->normalize)
+        return limits;
+
+    *scaled = *limits;
+    scaled->time = (long) (limits->time / inst->speed);
+    scaled->rtime = (long) (limits->rtime / inst->speed);
+    return scaled;
+}
+
+/**
+ * Fill reference times of the run
+ */
+void calibrate_stat(const saferun_inst *inst, saferun_stat *stat)
+{
+    stat->speed = inst->speed;
+    stat->ref_time = (long) (stat->time * inst->speed);
+    stat->ref_rtime = (long) (stat->rtime * inst->speed);
+}
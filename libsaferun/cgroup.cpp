@@ -16,41 +16,78 @@
 
 #include <mntent.h>
 #include <signal.h>
+#include <pthread.h>
 #include <sys/param.h>
 #include <string.h>
 
 #include "cgroup.h"
 #include "log.h"
 
+/* Max number of cgroup hierarchies remembered from MTAB */
+#define MAX_MOUNTS 32
+
+struct cgroup_mount {
+    char dir[MAXPATHLEN];
+    char opts[256];
+};
+
+static cgroup_mount mounts[MAX_MOUNTS];
+static int mounts_count = -1; /**< -1 if MTAB failed to be read */
+static pthread_once_t mounts_once = PTHREAD_ONCE_INIT;
+
 /**
- * Get cgroup path for group cgroup_name in specified subsystem
+ * Remember all cgroup mounts from MTAB.
  *
- * @param path where to write result
+ * Called once per process, so new instances don`t rescan MTAB.
  */
-void cgroup_get_path(const char *subsystem, const char *cgroup_name, char *path)
+static void read_mounts()
 {
     struct mntent *mntent;
-    FILE *file = NULL;
-
-    file = setmntent(MTAB, "r");
+    FILE *file = setmntent(MTAB, "r");
     if (!file) {
         SYSERROR("failed to open %s", MTAB);
-        throw -1;
+        return;
     }
 
-    while ((mntent = getmntent(file))) {
+    mounts_count = 0;
+    while ((mntent = getmntent(file)) && mounts_count < MAX_MOUNTS) {
         if (strcmp(mntent->mnt_type, "cgroup"))
             continue;
-        if (!subsystem || hasmntopt(mntent, subsystem)) {
-            snprintf(path, MAXPATHLEN, "%s/%s", mntent->mnt_dir, cgroup_name);
-            fclose(file);
+        snprintf(mounts[mounts_count].dir, MAXPATHLEN, "%s", mntent->mnt_dir);
+        snprintf(mounts[mounts_count].opts, sizeof(mounts[0].opts), "%s", mntent->mnt_opts);
+        ++mounts_count;
+    }
+
+    endmntent(file);
+}
+
+/**
+ * Get cgroup path for group cgroup_name in specified subsystem
+ *
+ * @note cgroup mounts are read from MTAB only on the first call
+ *
+ * @param path where to write result
+ */
+void cgroup_get_path(const char *subsystem, const char *cgroup_name, char *path)
+{
+    pthread_once(&mounts_once, read_mounts);
+    if (mounts_count < 0)
+        throw -1;
+
+    for (int i = 0; i < mounts_count; ++i) {
+        struct mntent mntent;
+        mntent.mnt_opts = mounts[i].opts;
+        if (!subsystem || hasmntopt(&mntent, subsystem)) {
+            if (snprintf(path, MAXPATHLEN, "%s/%s", mounts[i].dir, cgroup_name) >= MAXPATHLEN) {
+                ERROR("path of cgroup %s is too long", cgroup_name);
+                throw -1;
+            }
             DEBUG("using cgroup at '%s'", path);
             return;
         }
-    };
+    }
 
     DEBUG("Failed to find cgroup for %s\n", subsystem ? subsystem : "(NULL)");
-    fclose(file);
     throw -1;
 }
 
@@ -127,6 +164,119 @@ void cgroup_read_ll(const char *path, const char *filename, long long *x)
         throw -1;
 }
 
+/**
+ * Read number from "key value" formatted file in cgroup, like cpu.stat
+ *
+ * @param path      path to cgroup
+ * @param filename  name of a file to read
+ * @param key       name of the value
+ * @param x         where to write result
+ */
+void cgroup_read_key(const char *path, const char *filename, const char *key, long long *x)
+{
+    FILE * file = cgroup_open(path, filename, "r");
+    char name[64];
+    long long t;
+
+    while (fscanf(file, "%63s %lld", name, &t) == 2) {
+        if (!strcmp(name, key)) {
+            *x = t;
+            fclose(file);
+            return;
+        }
+    }
+
+    fclose(file);
+    ERROR("no '%s' in '%s' at '%s'", key, filename, path);
+    throw -1;
+}
+
+/**
+ * Read per-device statistics from blkio file in cgroup
+ *
+ * Lines look like "8:0 Read 4096", values are summed over all devices.
+ *
+ * @param path      path to cgroup
+ * @param filename  name of a file to read, e.g. blkio.throttle.io_service_bytes
+ * @param read      where to write sum of "Read" values
+ * @param write     where to write sum of "Write" values
+ */
+void cgroup_read_blkio(const char *path, const char *filename, long long *read, long long *write)
+{
+    FILE * file = cgroup_open(path, filename, "r");
+    char line[128], op[16];
+    long long x;
+
+    *read = *write = 0;
+    while (fgets(line, sizeof(line), file)) {
+        // "Total N" line doesn`t match, because it has no device field
+        if (sscanf(line, "%*s %15s %lld", op, &x) != 2)
+            continue;
+        if (!strcmp(op, "Read"))
+            *read += x;
+        else if (!strcmp(op, "Write"))
+            *write += x;
+    }
+
+    fclose(file);
+}
+
+/**
+ * Remove all per-device rules from blkio throttle file in cgroup
+ *
+ * Lines look like "8:0 1048576", writing zero value removes the rule.
+ *
+ * @param path      path to cgroup
+ * @param filename  name of a file, e.g. blkio.throttle.read_bps_device
+ */
+void cgroup_clear_blkio_rules(const char *path, const char *filename)
+{
+    FILE * file = cgroup_open(path, filename, "r");
+    char devs[16][32];
+    int count = 0;
+
+    while (count < 16 && fscanf(file, "%31s %*s", devs[count]) == 1)
+        ++count;
+    fclose(file);
+
+    for (int i = 0; i < count; ++i) {
+        char rule[sizeof(devs[0]) + 3];
+        snprintf(rule, sizeof(rule), "%.*s 0", (int) sizeof(devs[0]) - 1, devs[i]);
+        cgroup_write_str(path, filename, rule);
+    }
+}
+
+/**
+ * Freeze or thaw all processes in freezer cgroup
+ *
+ * @note Freezing is not immediate, @see cgroup_is_frozen
+ *
+ * @param path    path to freezer cgroup
+ * @param freeze  non-zero to freeze, zero to thaw
+ */
+void cgroup_freeze(const char *path, int freeze)
+{
+    cgroup_write_str(path, "freezer.state", freeze ? "FROZEN" : "THAWED");
+}
+
+/**
+ * Check if freezing of the cgroup is finished
+ *
+ * @param path  path to freezer cgroup
+ * @return 1 if state is FROZEN, 0 if it`s FREEZING or THAWED
+ */
+int cgroup_is_frozen(const char *path)
+{
+    FILE * file = cgroup_open(path, "freezer.state", "r");
+    char state[16];
+    int k = fscanf(file, "%15s", state);
+    fclose(file);
+
+    if (k != 1)
+        throw -1;
+    return !strcmp(state, "FROZEN");
+}
+
 /**
  * Send signal to all processes in cgroup
  *
@@ -149,3 +299,37 @@ void cgroup_kill(const char *path, int sig)
      * For example proccess can terminate.
      */
 }
+
+/**
+ * Check if some process in cgroup is running or waits for disk
+ *
+ * State of every task is read from /proc/<pid>/stat, tasks which exit
+ * while the file is read are skipped.
+ *
+ * @param path  path to cgroup
+ * @return 1 if some task is in R or D state, 0 if all of them sleep or are stopped
+ */
+int cgroup_has_runnable(const char *path)
+{
+    FILE * file = cgroup_open(path, "tasks", "r");
+    int pid;
+    int runnable = 0;
+    while (!runnable && fscanf(file, "%d", &pid) == 1) {
+        char name[32], buf[512];
+        snprintf(name, sizeof(name), "/proc/%d/stat", pid);
+        FILE *stat = fopen(name, "r");
+        if (!stat)
+            continue;
+        size_t n = fread(buf, 1, sizeof(buf) - 1, stat);
+        fclose(stat);
+        buf[n] = '\0';
+
+        // comm may contain spaces and brackets, state goes after the last ')'
+        char *p = strrchr(buf, ')');
+        if (p && p[1] == ' ' && (p[2] == 'R' || p[2] == 'D'))
+            runnable = 1;
+    }
+
+    fclose(file);
+    return runnable;
+}
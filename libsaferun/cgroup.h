@@ -27,7 +27,13 @@ FILE *cgroup_open(const char *path, const char *filename, const char *mode);
 void cgroup_write_str(const char *path, const char *filename, const char *str);
 void cgroup_write_ll(const char *path, const char *filename, const long long x);
 void cgroup_read_ll(const char *path, const char *filename, long long *x);
+void cgroup_read_key(const char *path, const char *filename, const char *key, long long *x);
+void cgroup_read_blkio(const char *path, const char *filename, long long *read, long long *write);
+void cgroup_clear_blkio_rules(const char *path, const char *filename);
 
+void cgroup_freeze(const char *path, int freeze);
+int cgroup_is_frozen(const char *path);
 void cgroup_kill(const char *path, int sig);
+int cgroup_has_runnable(const char *path);
 
 #endif /* _CGROUP_H */
@@ -0,0 +1,1067 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "saferun.h"
+#include "remote.h"
+#include "utils.h"
+#include "log.h"
+
+/* How often workers are asked for their load, in microseconds */
+#define COORD_STATUS_INTERVAL (100*1000)
+/* Worker not replying to load request for this long is lost, like a stopped or cut off one */
+#define COORD_STATUS_TIMEOUT (50*COORD_STATUS_INTERVAL)
+/* Connect taking longer than this fails, in microseconds */
+#define COORD_CONNECT_TIMEOUT (5*1000*1000)
+/* Lost worker not closing connection for this long can still run its tasks, they fail then */
+#define COORD_DRAIN_TIMEOUT (30*1000*1000)
+
+/* Delay before reconnecting to a lost worker, doubled on each failure, in microseconds */
+#define COORD_RECONNECT     (500*1000)
+#define COORD_RECONNECT_MAX (30*1000*1000)
+
+/* Tasks sent to a worker over its capacity, so it doesn`t idle while a reply goes back */
+#define COORD_PREFETCH 2
+
+/**
+ * coord_task - task submitted to coordinator.
+ *
+ * Task is kept encoded, so it can be sent again after a worker is lost
+ * or the task is stolen. After it`s done the same node holds the result.
+ */
+struct coord_task {
+    remote_header *msg; /**< encoded task, payload follows the header */
+    int fds[3];         /**< dups of stdio fds, -1 if not passed */
+    int paths;          /**< stdio is sent as paths, so the task can go to TCP worker */
+    unsigned wire_id;   /**< id of the task on its worker connection */
+    int failures;       /**< workers lost while running the task */
+    int cancelling;     /**< stealing is requested, reply is waited for */
+
+    saferun_coord_result result;
+    coord_task *next;
+};
+
+/* Stages of connecting to worker */
+enum {
+    CONNECT_SOCKET = 1, /**< connect is in progress, socket becomes writable when it`s done */
+    CONNECT_AUTH   = 2, /**< TCP handshake, worker challenges coordinator with the secret */
+};
+
+/**
+ * coord_out - message waiting to be sent to worker.
+ */
+struct coord_out {
+    char *data;       /**< header and payload */
+    size_t size;
+    size_t sent;
+    int fds[3];       /**< attached to the first byte, owned by the task */
+    int nfds;
+    coord_out *next;
+};
+
+/**
+ * coord_worker - connection to a saferun daemon.
+ *
+ * Socket is non-blocking, messages are queued and sent as far as the socket
+ * takes them, replies are collected in the buffer until complete. So a slow
+ * or unreachable worker doesn`t stall the coordinator thread.
+ */
+struct coord_worker {
+    char *address;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int unix_socket;       /**< stdio fds can be passed */
+    int sock;              /**< -1 if not connected */
+    int connecting;        /**< CONNECT_* stage, 0 when tasks can be sent */
+    long long connect_time;
+    long long drain_time;  /**< when connection of lost worker was shut down, 0 if it`s not lost */
+    long long retry_time;  /**< when to reconnect */
+    long long retry_delay;
+    long long status_time; /**< when load was requested */
+    int status_pending;
+    int foreign;           /**< runs on the worker which are not ours, by its last load */
+    coord_task *tasks;     /**< sent and not replied, the newest first */
+    coord_out *out, *out_tail; /**< messages not sent yet */
+    remote_buf *in;        /**< message being received */
+    size_t in_size;        /**< bytes of it received */
+
+    saferun_coord_worker info;
+};
+
+/**
+ * saferun_coord - coordinator dispatching tasks to several saferun daemons.
+ *
+ * Submitted tasks wait in the queue, the coordinator thread sends them
+ * to the least loaded workers, moves tasks from overloaded workers
+ * to idle ones, resends tasks of lost workers and collects results.
+ */
+struct saferun_coord {
+    coord_worker *workers;
+    int count;
+    int has_unix;  /**< some worker can get stdio fds */
+    int retries;   /**< times a task is resent after its worker is lost */
+
+    pthread_t thread;
+    int started;
+    pthread_mutex_t lock; /**< protects everything except of buf and wake */
+    pthread_cond_t cond;  /**< signalled on new result */
+    int wake[2];          /**< pipe waking the thread on new task or on stop */
+
+    coord_task *queue, *queue_tail;     /**< tasks not sent yet */
+    coord_task *results, *results_tail; /**< done tasks not taken by saferun_coord_wait */
+    int pending;                        /**< submitted tasks without taken result */
+    unsigned next_wire_id;
+    int stop;
+};
+
+static void push_back(coord_task **head, coord_task **tail, coord_task *task)
+{
+    task->next = NULL;
+    if (*tail)
+        (*tail)->next = task;
+    else
+        *head = task;
+    *tail = task;
+}
+
+static void push_front(saferun_coord *coord, coord_task *task)
+{
+    task->next = coord->queue;
+    coord->queue = task;
+    if (!coord->queue_tail)
+        coord->queue_tail = task;
+}
+
+static coord_task *pop_front(coord_task **head, coord_task **tail)
+{
+    coord_task *task = *head;
+    *head = task->next;
+    if (!*head)
+        *tail = NULL;
+    return task;
+}
+
+static void free_task(coord_task *task)
+{
+    for (int i = 0; i < 3; ++i)
+        if (task->fds[i] >= 0)
+            close(task->fds[i]);
+    free(task->msg);
+    free(task);
+}
+
+static void wake(saferun_coord *coord)
+{
+    char c = 0;
+    // pipe is non-blocking, if it`s full the thread is woken anyway
+    write(coord->wake[1], &c, 1);
+}
+
+/**
+ * Move done task to results
+ *
+ * @param stat  NULL if the task was not run
+ */
+static void finish(saferun_coord *coord, coord_task *task, int ret, const saferun_stat *stat,
+                   int worker)
+{
+    task->result.ret = ret;
+    task->result.worker = worker;
+    if (stat)
+        task->result.stat = *stat;
+
+    // stdio and message are not needed anymore, result is kept till saferun_coord_wait
+    for (int i = 0; i < 3; ++i)
+        if (task->fds[i] >= 0) {
+            close(task->fds[i]);
+            task->fds[i] = -1;
+        }
+    free(task->msg);
+    task->msg = NULL;
+
+    push_back(&coord->results, &coord->results_tail, task);
+    pthread_cond_broadcast(&coord->cond);
+}
+
+/**
+ * Drop messages not sent to worker
+ */
+static void drop_out(coord_worker *w)
+{
+    while (w->out) {
+        coord_out *out = w->out;
+        w->out = out->next;
+        free(out->data);
+        free(out);
+    }
+    w->out_tail = NULL;
+}
+
+/**
+ * Close connection to worker and drop messages not sent to it
+ */
+static void close_worker(coord_worker *w)
+{
+    close(w->sock);
+    w->sock = -1;
+    w->connecting = 0;
+    w->drain_time = 0;
+    w->in_size = 0;
+    drop_out(w);
+}
+
+/**
+ * Close connection which isn`t made yet, it`s retried with growing delay
+ */
+static void connect_fail(coord_worker *w, long long now)
+{
+    close_worker(w);
+    w->retry_time = now + w->retry_delay;
+    w->retry_delay = w->retry_delay * 2 < COORD_RECONNECT_MAX ?
+        w->retry_delay * 2 : COORD_RECONNECT_MAX;
+}
+
+/**
+ * Close connection to lost worker and queue its tasks again.
+ *
+ * Task is given up after its workers were lost more than retries times,
+ * or if the worker didn`t close the connection, the task can still run
+ * there then. Outputs passed as fds are truncated before resending,
+ * outputs sent as paths are truncated by the worker.
+ *
+ * @param closed  the worker closed the connection, so its tasks are gone
+ */
+static void worker_gone(saferun_coord *coord, coord_worker *w, int closed)
+{
+    if (closed)
+        WARN("worker %s is lost, %d tasks are resent", w->address, w->info.outstanding);
+    else
+        ERROR("worker %s is lost and doesn`t close connection, %d tasks fail",
+              w->address, w->info.outstanding);
+
+    close_worker(w);
+    w->retry_time = get_rtime() + w->retry_delay;
+    w->info.outstanding = 0;
+
+    while (w->tasks) {
+        coord_task *task = w->tasks;
+        w->tasks = task->next;
+        task->cancelling = 0;
+
+        if (!closed || ++task->failures > coord->retries) {
+            ERROR("task %u failed on %d workers", task->result.id, task->failures);
+            finish(coord, task, -1, NULL, -1);
+            continue;
+        }
+
+        try {
+            rewind_stdio(task->fds[0], task->fds[1], task->fds[2]);
+        }
+        catch (...) {
+            finish(coord, task, -1, NULL, -1);
+            continue;
+        }
+        push_front(coord, task);
+    }
+}
+
+/**
+ * Stop using lost worker and wait until it closes the connection.
+ *
+ * The daemon drops queued tasks of a closed connection and kills running
+ * ones before it closes its end. Tasks are resent only after that, so
+ * a task never runs on two workers at once, @see worker_gone.
+ */
+static void worker_fail(saferun_coord *coord, coord_worker *w)
+{
+    // not connected yet, so there are no tasks
+    if (w->connecting) {
+        connect_fail(w, get_rtime());
+        return;
+    }
+    if (w->drain_time) {
+        worker_gone(coord, w, 1);
+        return;
+    }
+
+    shutdown(w->sock, SHUT_WR);
+    drop_out(w);
+    w->drain_time = get_rtime();
+    w->in_size = 0;
+    w->status_pending = 0;
+    w->foreign = 0;
+    ++w->info.failures;
+}
+
+/**
+ * Discard what lost worker sends until it closes the connection
+ */
+static void drain_worker(saferun_coord *coord, coord_worker *w)
+{
+    char buf[4096];
+
+    while (1) {
+        ssize_t k = recv(w->sock, buf, sizeof(buf), MSG_DONTWAIT);
+        if (k > 0 || (k < 0 && errno == EINTR))
+            continue;
+        if (k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        worker_gone(coord, w, 1);
+        return;
+    }
+}
+
+/**
+ * Send queued messages to worker as far as its socket takes them
+ */
+static void flush_worker(saferun_coord *coord, coord_worker *w)
+{
+    try {
+        while (w->out) {
+            coord_out *out = w->out;
+            size_t k = remote_send_some(w->sock, out->data + out->sent, out->size - out->sent,
+                                        out->fds, out->sent ? 0 : out->nfds);
+            if (!k)
+                return;
+            out->sent += k;
+            if (out->sent < out->size)
+                return;
+
+            w->out = out->next;
+            if (!w->out)
+                w->out_tail = NULL;
+            free(out->data);
+            free(out);
+        }
+    }
+    catch (...) {
+        worker_fail(coord, w);
+    }
+}
+
+/**
+ * Queue message to worker, its payload follows the header
+ *
+ * @return 0 if there is no memory for it, the worker is failed then
+ */
+static int queue_msg(saferun_coord *coord, coord_worker *w, const remote_header *header,
+                     const int *fds, int nfds)
+{
+    size_t size = sizeof(remote_header) + header->length;
+    coord_out *out = (coord_out *)malloc(sizeof(coord_out));
+    char *data = (char *)malloc(size);
+
+    if (!out || !data) {
+        ERROR("no memory for message to worker %s", w->address);
+        free(out);
+        free(data);
+        worker_fail(coord, w);
+        return 0;
+    }
+
+    memcpy(data, header, size);
+    ((remote_header *)data)->magic = REMOTE_MAGIC;
+    out->data = data;
+    out->size = size;
+    out->sent = 0;
+    out->nfds = nfds;
+    memcpy(out->fds, fds, nfds * sizeof(int));
+    out->next = NULL;
+
+    if (w->out_tail)
+        w->out_tail->next = out;
+    else
+        w->out = out;
+    w->out_tail = out;
+    return 1;
+}
+
+/**
+ * Queue request without payload, like load request or cancel
+ */
+static int queue_empty(saferun_coord *coord, coord_worker *w, uint32_t type, unsigned id)
+{
+    remote_header header;
+    memset(&header, 0, sizeof(header));
+    header.type = type;
+    header.id = id;
+    return queue_msg(coord, w, &header, NULL, 0);
+}
+
+/**
+ * Send task to worker, the task is added to its outstanding tasks
+ */
+static void send_task(saferun_coord *coord, coord_worker *w, coord_task *task)
+{
+    int fds[3], nfds = 0;
+
+    task->wire_id = ++coord->next_wire_id;
+    task->msg->id = task->wire_id;
+    for (int i = 0; i < 3; ++i)
+        if (task->msg->fds & (1 << i))
+            fds[nfds++] = task->fds[i];
+
+    task->next = w->tasks;
+    w->tasks = task;
+    ++w->info.outstanding;
+    ++task->result.attempts;
+
+    queue_msg(coord, w, task->msg, fds, nfds);
+}
+
+static int capacity(const coord_worker *w)
+{
+    return w->info.load.capacity > 0 ? w->info.load.capacity : 1;
+}
+
+static int busy(const coord_worker *w)
+{
+    return w->info.outstanding + w->foreign;
+}
+
+/**
+ * Load of worker for choosing the least loaded one.
+ *
+ * Share of busy capacity, plus the highest pressure, so workers
+ * on hosts with contention get tasks after others.
+ */
+static double score(const coord_worker *w)
+{
+    const saferun_remote_load *load = &w->info.load;
+    double pressure = load->cpu_pressure;
+    if (load->memory_pressure > pressure)
+        pressure = load->memory_pressure;
+    if (load->io_pressure > pressure)
+        pressure = load->io_pressure;
+
+    return (double)busy(w) / capacity(w) + (pressure > 0 ? pressure / 100 : 0);
+}
+
+static int connected(const coord_worker *w)
+{
+    return w->sock >= 0 && !w->connecting && !w->drain_time;
+}
+
+static int can_run(const coord_worker *w, const coord_task *task)
+{
+    return connected(w) && (task->paths || w->unix_socket);
+}
+
+/**
+ * Send queued tasks to the least loaded workers with free capacity
+ */
+static void dispatch(saferun_coord *coord)
+{
+    while (coord->queue) {
+        coord_task *task = coord->queue;
+        coord_worker *best = NULL;
+
+        for (int i = 0; i < coord->count; ++i) {
+            coord_worker *w = &coord->workers[i];
+            if (!can_run(w, task) || busy(w) >= capacity(w) + COORD_PREFETCH)
+                continue;
+            if (!best || score(w) < score(best))
+                best = w;
+        }
+
+        if (!best)
+            return;
+
+        pop_front(&coord->queue, &coord->queue_tail);
+        send_task(coord, best, task);
+    }
+}
+
+/**
+ * Steal tasks waiting on overloaded workers for idle ones.
+ *
+ * The newest task of the most overloaded worker is cancelled, if it`s
+ * not started yet it comes back and is dispatched again. Stealing is
+ * needed only when the queue is empty, idle workers take from it otherwise.
+ */
+static void steal(saferun_coord *coord)
+{
+    if (coord->queue)
+        return;
+
+    for (int i = 0; i < coord->count; ++i) {
+        coord_worker *thief = &coord->workers[i];
+        if (!connected(thief) || busy(thief) >= capacity(thief))
+            continue;
+
+        coord_worker *victim = NULL;
+        coord_task *task = NULL;
+        int max_backlog = 0;
+
+        for (int j = 0; j < coord->count; ++j) {
+            coord_worker *w = &coord->workers[j];
+            int backlog = busy(w) - capacity(w);
+            if (w == thief || !connected(w) || backlog <= max_backlog)
+                continue;
+
+            // tasks being stolen already are a part of the backlog
+            coord_task *candidate = NULL;
+            for (coord_task *t = w->tasks; t; t = t->next) {
+                if (t->cancelling)
+                    --backlog;
+                else if (!candidate && (t->paths || thief->unix_socket))
+                    candidate = t;
+            }
+            if (candidate && backlog > max_backlog) {
+                victim = w;
+                task = candidate;
+                max_backlog = backlog;
+            }
+        }
+
+        if (!victim)
+            return;
+
+        DEBUG("stealing task %u from %s for %s", task->result.id, victim->address, thief->address);
+        if (queue_empty(coord, victim, REMOTE_CANCEL, task->wire_id))
+            task->cancelling = 1;
+    }
+}
+
+/**
+ * Handle message received from worker
+ */
+static void handle_msg(saferun_coord *coord, coord_worker *w, int index)
+{
+    remote_buf *b = w->in;
+    int ret;
+    saferun_stat stat;
+
+    b->pos = 0;
+    try {
+        if (w->connecting && b->header.type == REMOTE_AUTH && b->header.length) {
+            remote_auth_reply(b);
+            queue_msg(coord, w, &b->header, NULL, 0);
+            return;
+        }
+        if (w->connecting && b->header.type == REMOTE_AUTH) {
+            w->connecting = 0;
+            INFO("connected to worker %s", w->address);
+            return;
+        }
+        if (w->connecting) {
+            ERROR("worker %s doesn`t authenticate", w->address);
+            throw -1;
+        }
+
+        if (b->header.type == REMOTE_STATUS) {
+            remote_decode_load(b, &w->info.load);
+            int foreign = w->info.load.in_flight + w->info.load.queued - w->info.outstanding;
+            w->foreign = foreign > 0 ? foreign : 0;
+            w->status_pending = 0;
+            return;
+        }
+
+        if (b->header.type != REMOTE_REPLY) {
+            ERROR("unexpected message from worker %s", w->address);
+            throw -1;
+        }
+        remote_decode_reply(b, &ret, &stat);
+    }
+    catch (...) {
+        worker_fail(coord, w);
+        return;
+    }
+
+    coord_task **p = &w->tasks;
+    while (*p && (*p)->wire_id != b->header.id)
+        p = &(*p)->next;
+    if (!*p) {
+        WARN("reply to unknown task %u from worker %s", b->header.id, w->address);
+        return;
+    }
+
+    coord_task *task = *p;
+    *p = task->next;
+    --w->info.outstanding;
+    // this worker is fine, so next loss is retried quickly
+    w->retry_delay = COORD_RECONNECT;
+
+    if (ret == SAFERUN_REMOTE_CANCELLED) {
+        task->cancelling = 0;
+        ++w->info.stolen;
+        push_front(coord, task);
+    } else {
+        ++w->info.done;
+        finish(coord, task, ret, &stat, index);
+    }
+}
+
+/**
+ * Read what worker sent and handle complete messages.
+ *
+ * Workers never pass fds, so messages are read with plain recv.
+ */
+static void read_worker(saferun_coord *coord, coord_worker *w, int index)
+{
+    const size_t header_size = sizeof(remote_header);
+
+    while (w->sock >= 0) {
+        if (w->drain_time) {
+            drain_worker(coord, w);
+            return;
+        }
+
+        remote_buf *b = w->in;
+        size_t want = w->in_size < header_size ? header_size : header_size + b->header.length;
+
+        ssize_t k = recv(w->sock, (char *)&b->header + w->in_size, want - w->in_size, MSG_DONTWAIT);
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (k <= 0) {
+            if (k)
+                SYSERROR("can`t receive message from worker %s", w->address);
+            else
+                ERROR("worker %s closed connection", w->address);
+            worker_fail(coord, w);
+            return;
+        }
+
+        w->in_size += k;
+        if (w->in_size == header_size) {
+            try {
+                remote_check_header(&b->header);
+            }
+            catch (...) {
+                worker_fail(coord, w);
+                return;
+            }
+        }
+        if (w->in_size >= header_size && w->in_size == header_size + b->header.length) {
+            w->in_size = 0;
+            handle_msg(coord, w, index);
+        }
+    }
+}
+
+/**
+ * Finish connect to worker, when its socket is writable or on timeout.
+ *
+ * Over TCP the worker challenges coordinator first, tasks are sent
+ * after it accepts the reply, @see handle_msg.
+ */
+static void connect_done(coord_worker *w, int ready, long long now)
+{
+    if (ready && w->connecting == CONNECT_SOCKET && remote_connect_done(w->sock)) {
+        w->connecting = w->unix_socket ? 0 : CONNECT_AUTH;
+        w->status_pending = 0;
+        w->status_time = 0;
+        memset(&w->info.load, 0, sizeof(w->info.load));
+        if (!w->connecting)
+            INFO("connected to worker %s", w->address);
+        return;
+    }
+
+    if (ready)
+        DEBUG("can`t connect to worker %s: %s", w->address, strerror(errno));
+    else if (now - w->connect_time < COORD_CONNECT_TIMEOUT)
+        return;
+    else
+        DEBUG("connect to worker %s timed out", w->address);
+
+    connect_fail(w, now);
+}
+
+/**
+ * Start connecting to worker, connect is finished in coordinator loop
+ */
+static void connect_worker(coord_worker *w, long long now)
+{
+    int done = 0;
+    try {
+        w->sock = remote_connect_start(&w->addr, w->addrlen, &done);
+    }
+    catch (...) {
+        DEBUG("can`t connect to worker %s: %s", w->address, strerror(errno));
+        w->sock = -1;
+        connect_fail(w, now);
+        return;
+    }
+    w->connecting = CONNECT_SOCKET;
+    w->connect_time = now;
+    if (done)
+        connect_done(w, 1, now);
+}
+
+/**
+ * Connect to lost workers, request load of connected ones and fail
+ * ones which don`t reply to it or don`t close connection after failure.
+ */
+static void maintain_workers(saferun_coord *coord)
+{
+    long long now = get_rtime();
+
+    for (int i = 0; i < coord->count; ++i) {
+        coord_worker *w = &coord->workers[i];
+
+        if (w->sock < 0 && now >= w->retry_time)
+            connect_worker(w, now);
+        if (w->connecting)
+            connect_done(w, 0, now);
+        if (w->drain_time && now - w->drain_time >= COORD_DRAIN_TIMEOUT)
+            worker_gone(coord, w, 0);
+        if (!connected(w))
+            continue;
+
+        if (w->status_pending && now - w->status_time >= COORD_STATUS_TIMEOUT) {
+            ERROR("worker %s doesn`t reply for %lld ms", w->address, (now - w->status_time) / 1000);
+            worker_fail(coord, w);
+            continue;
+        }
+
+        if (!w->status_pending && now - w->status_time >= COORD_STATUS_INTERVAL) {
+            w->status_time = now;
+            if (queue_empty(coord, w, REMOTE_STATUS, 0))
+                w->status_pending = 1;
+        }
+    }
+}
+
+static void *coord_thread(void *arg)
+{
+    saferun_coord *coord = (saferun_coord *)arg;
+    struct pollfd *fds = (struct pollfd *)malloc((coord->count + 1) * sizeof(struct pollfd));
+    int *index = (int *)malloc(coord->count * sizeof(int));
+
+    if (!fds || !index) {
+        ERROR("coordinator is out of memory");
+        free(fds);
+        free(index);
+        return NULL;
+    }
+
+    // all sockets are non-blocking, so the lock is released only for poll
+    pthread_mutex_lock(&coord->lock);
+    while (!coord->stop) {
+        maintain_workers(coord);
+        dispatch(coord);
+        steal(coord);
+
+        int n = 1;
+        fds[0].fd = coord->wake[0];
+        fds[0].events = POLLIN;
+        for (int i = 0; i < coord->count; ++i) {
+            coord_worker *w = &coord->workers[i];
+            if (w->sock >= 0 && w->connecting != CONNECT_SOCKET)
+                flush_worker(coord, w);
+            if (w->sock < 0)
+                continue;
+            fds[n].fd = w->sock;
+            fds[n].events = w->connecting == CONNECT_SOCKET ? POLLOUT : POLLIN | (w->out ? POLLOUT : 0);
+            index[n - 1] = i;
+            ++n;
+        }
+
+        pthread_mutex_unlock(&coord->lock);
+        int k = poll(fds, n, COORD_STATUS_INTERVAL / 1000);
+        pthread_mutex_lock(&coord->lock);
+
+        if (k <= 0)
+            continue;
+
+        if (fds[0].revents) {
+            char buf[64];
+            while (read(coord->wake[0], buf, sizeof(buf)) > 0)
+                ;
+        }
+
+        long long now = get_rtime();
+        for (int i = 1; i < n; ++i) {
+            coord_worker *w = &coord->workers[index[i - 1]];
+            if (!fds[i].revents || w->sock != fds[i].fd)
+                continue;
+            if (w->connecting == CONNECT_SOCKET)
+                connect_done(w, 1, now);
+            else
+                read_worker(coord, w, index[i - 1]);
+        }
+    }
+    pthread_mutex_unlock(&coord->lock);
+
+    free(fds);
+    free(index);
+    return NULL;
+}
+
+/**
+ * Create coordinator of saferun daemons.
+ *
+ * Workers are connected and asked for their load in background.
+ * Lost workers are reconnected with growing delay. Host names of workers
+ * are resolved here once, so the coordinator thread never waits for DNS.
+ * TCP workers need the shared secret set before, @see saferun_remote_set_secret.
+ *
+ * @param workers  addresses of daemons, @see saferun_remote_connect
+ * @param retries  times a task is resent after its worker is lost
+ * @return NULL if errors, or pointer to coordinator otherwise.
+ */
+saferun_coord *saferun_coord_create(const char *const *workers, int count, int retries)
+{
+    if (!workers || count <= 0 || retries < 0)
+        return NULL;
+
+    saferun_coord *coord = (saferun_coord *)calloc(1, sizeof(saferun_coord));
+    if (!coord)
+        return NULL;
+
+    coord->count = count;
+    coord->retries = retries;
+    coord->wake[0] = coord->wake[1] = -1;
+    pthread_mutex_init(&coord->lock, NULL);
+    pthread_cond_init(&coord->cond, NULL);
+
+    coord->workers = (coord_worker *)calloc(count, sizeof(coord_worker));
+    if (!coord->workers || pipe2(coord->wake, O_CLOEXEC | O_NONBLOCK)) {
+        ERROR("can`t create coordinator");
+        saferun_coord_destroy(coord);
+        return NULL;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        coord_worker *w = &coord->workers[i];
+        w->sock = -1;
+        w->retry_delay = COORD_RECONNECT;
+        if (!workers[i] || !(w->address = strdup(workers[i]))
+                || !(w->in = (remote_buf *)malloc(sizeof(remote_buf)))) {
+            saferun_coord_destroy(coord);
+            return NULL;
+        }
+        try {
+            remote_resolve(w->address, &w->addr, &w->addrlen);
+            if (!remote_is_unix(w->address))
+                remote_need_secret();
+        }
+        catch (...) {
+            saferun_coord_destroy(coord);
+            return NULL;
+        }
+        w->unix_socket = remote_is_unix(w->address);
+        coord->has_unix |= w->unix_socket;
+    }
+
+    if (pthread_create(&coord->thread, NULL, coord_thread, coord)) {
+        ERROR("can`t start coordinator thread");
+        saferun_coord_destroy(coord);
+        return NULL;
+    }
+    coord->started = 1;
+
+    return coord;
+}
+
+/**
+ * Submit task to coordinator.
+ *
+ * Task is copied, so it can be freed after the call. If paths are given,
+ * they are sent instead of stdio fds and the task can go to any worker.
+ * Otherwise stdio fds are duplicated and passed, so the task goes only
+ * to workers on unix sockets.
+ *
+ * @param id     any number, result of this task will have it
+ * @param paths  stdin, stdout and stderr paths, @see saferun_remote_send_paths
+ * @return -1 on error, 0 otherwise.
+ */
+int saferun_coord_submit(saferun_coord *coord, unsigned id, const saferun_task *task,
+                         const char *const *paths)
+{
+    if (!coord || !task || !task->jail || !task->limits || !task->argv)
+        return -1;
+
+    if (!paths && !coord->has_unix) {
+        ERROR("stdio fds can`t be passed to TCP workers, stdio paths must be given");
+        return -1;
+    }
+
+    coord_task *t = (coord_task *)calloc(1, sizeof(coord_task));
+    remote_buf *b = (remote_buf *)malloc(sizeof(remote_buf));
+    int ret = 0;
+
+    if (!t || !b) {
+        free(t);
+        free(b);
+        return -1;
+    }
+
+    t->fds[0] = t->fds[1] = t->fds[2] = -1;
+    t->paths = paths != NULL;
+    t->result.id = id;
+    t->result.worker = -1;
+
+    try {
+        int fds[3], nfds;
+        remote_encode_task(b, 0, task, paths, fds, &nfds);
+
+        size_t size = sizeof(remote_header) + b->header.length;
+        if (!(t->msg = (remote_header *)malloc(size)))
+            throw -1;
+        memcpy(t->msg, &b->header, size);
+
+        const int stdio[3] = {task->stdin_fd, task->stdout_fd, task->stderr_fd};
+        for (int i = 0; i < 3; ++i)
+            if (!paths && stdio[i] >= 0 && (t->fds[i] = fcntl(stdio[i], F_DUPFD_CLOEXEC, 0)) < 0) {
+                SYSERROR("can`t duplicate stdio fd %d", stdio[i]);
+                throw -1;
+            }
+    }
+    catch (...) {
+        free_task(t);
+        ret = -1;
+    }
+    free(b);
+
+    if (ret)
+        return ret;
+
+    pthread_mutex_lock(&coord->lock);
+    push_back(&coord->queue, &coord->queue_tail, t);
+    ++coord->pending;
+    pthread_mutex_unlock(&coord->lock);
+
+    wake(coord);
+    return 0;
+}
+
+/**
+ * Wait for result of any submitted task.
+ *
+ * Results come in order of completion, so they can be streamed to user.
+ *
+ * @param timeout  in milliseconds, -1 to wait without timeout
+ * @return 0 if result is written, 1 on timeout, -1 on error or if
+ *         there are no submitted tasks without result.
+ */
+int saferun_coord_wait(saferun_coord *coord, saferun_coord_result *result, int timeout)
+{
+    if (!coord || !result)
+        return -1;
+
+    long long deadline = get_rtime() + timeout * 1000LL;
+    int ret;
+
+    pthread_mutex_lock(&coord->lock);
+    while (!coord->results && coord->pending) {
+        if (timeout < 0) {
+            pthread_cond_wait(&coord->cond, &coord->lock);
+            continue;
+        }
+
+        timespec ts;
+        ts.tv_sec = deadline / (1000*1000);
+        ts.tv_nsec = (deadline % (1000*1000)) * 1000;
+        if (pthread_cond_timedwait(&coord->cond, &coord->lock, &ts) == ETIMEDOUT)
+            break;
+    }
+
+    if (coord->results) {
+        coord_task *task = pop_front(&coord->results, &coord->results_tail);
+        *result = task->result;
+        free_task(task);
+        --coord->pending;
+        ret = 0;
+    } else {
+        ret = coord->pending ? 1 : -1;
+    }
+    pthread_mutex_unlock(&coord->lock);
+
+    return ret;
+}
+
+/**
+ * Get state of worker.
+ *
+ * @param index  of worker in saferun_coord_create() list
+ * @return -1 on error, 0 otherwise.
+ */
+int saferun_coord_get_worker(saferun_coord *coord, int index, saferun_coord_worker *info)
+{
+    if (!coord || !info || index < 0 || index >= coord->count)
+        return -1;
+
+    pthread_mutex_lock(&coord->lock);
+    coord_worker *w = &coord->workers[index];
+    *info = w->info;
+    info->alive = connected(w);
+    pthread_mutex_unlock(&coord->lock);
+    return 0;
+}
+
+static void free_list(coord_task *task)
+{
+    while (task) {
+        coord_task *next = task->next;
+        free_task(task);
+        task = next;
+    }
+}
+
+/**
+ * Stop coordinator and free it.
+ *
+ * Tasks without result are abandoned, workers still run tasks sent to them.
+ *
+ * @return 0
+ */
+int saferun_coord_destroy(saferun_coord *coord)
+{
+    if (!coord)
+        return 0;
+
+    if (coord->started) {
+        pthread_mutex_lock(&coord->lock);
+        coord->stop = 1;
+        pthread_mutex_unlock(&coord->lock);
+        wake(coord);
+        pthread_join(coord->thread, NULL);
+    }
+
+    for (int i = 0; coord->workers && i < coord->count; ++i) {
+        coord_worker *w = &coord->workers[i];
+        if (w->sock >= 0)
+            close_worker(w);
+        free_list(w->tasks);
+        free(w->address);
+        free(w->in);
+    }
+    free_list(coord->queue);
+    free_list(coord->results);
+
+    if (coord->wake[0] >= 0) {
+        close(coord->wake[0]);
+        close(coord->wake[1]);
+    }
+    pthread_mutex_destroy(&coord->lock);
+    pthread_cond_destroy(&coord->cond);
+    free(coord->workers);
+    free(coord);
+    return 0;
+}
@@ -0,0 +1,484 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "saferun.h"
+#include "run.h"
+#include "cgroup.h"
+#include "sync.h"
+#include "hv.h"
+#include "utils.h"
+#include "trace.h"
+#include "metrics.h"
+#include "perf.h"
+#include "freezer.h"
+#include "admission.h"
+#include "journal.h"
+#include "history.h"
+#include "calibrate.h"
+#include "profile.h"
+#include "log.h"
+
+/*
+ * Protocol of fork server program. Sockets are SOCK_SEQPACKET,
+ * so every message is one record. Numbers are in host byte order.
+ *
+ * server -> library, control socket: "SRRD" when the runtime is warmed up.
+ * library -> server, control socket: uint32 mask of attached stdio fds
+ *     (1 stdin, 2 stdout, 4 stderr), then arguments of the test, each ends
+ *     with zero. SCM_RIGHTS carries run socket, then attached stdio fds.
+ * test -> library, run socket: "SRRD" from the forked test process. Its pid
+ *     is taken from credentials of the message, so it`s right in our pid namespace.
+ * library -> test, run socket: "SRGO" when the test is in its cgroup. Test
+ *     closes run socket, redirects stdio and runs.
+ * server -> library, run socket: "SREX" and int32 wait status after the test exits.
+ */
+#define FORKSERVER_READY "SRRD"
+#define FORKSERVER_GO    "SRGO"
+#define FORKSERVER_EXIT  "SREX"
+
+/* Max size of request, mask and arguments */
+#define FORKSERVER_MAX_SIZE (64*1024)
+
+struct saferun_forkserver {
+    const saferun_inst *inst; /**< cgroup of the server */
+    pid_t pid;  /**< of the server */
+    int ctl;    /**< control socket */
+
+    saferun_jail jail; /**< jail of the server, only chroot is kept, setup_io needs it */
+    char *chroot;
+};
+
+/**
+ * State of waiting for test exit, @see wait_test
+ */
+struct forkserver_wait {
+    int sock;     /**< run socket */
+    pid_t server; /**< only exit status from the server is trusted */
+};
+
+/**
+ * Receive message with pid of the sender.
+ *
+ * SO_PASSCRED must be set on the socket, kernel adds credentials then.
+ *
+ * @param flags  MSG_DONTWAIT or 0
+ * @param pid    where to write pid of the sender, 0 if unknown
+ * @return length of message, 0 if the other end is closed, -1 if there is nothing to read
+ */
+static int recv_cred(int sock, char *buf, int size, pid_t *pid, int flags)
+{
+    char cbuf[CMSG_SPACE(sizeof(ucred))];
+    iovec iov;
+    msghdr msg;
+    int k;
+
+    iov.iov_base = buf;
+    iov.iov_len = size;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    do {
+        k = recvmsg(sock, &msg, flags | MSG_CMSG_CLOEXEC);
+    } while (k < 0 && errno == EINTR);
+    if (k < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return -1;
+        SYSERROR("can`t receive from fork server");
+        throw -1;
+    }
+
+    *pid = 0;
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_CREDENTIALS) {
+            ucred cred;
+            memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+            *pid = cred.pid;
+        }
+    }
+    return k;
+}
+
+/**
+ * Wait for message with no payload.
+ *
+ * @param what     expected message
+ * @param timeout  in milliseconds
+ * @param pid      where to write pid of the sender
+ */
+static void wait_message(int sock, const char *what, long timeout, pid_t *pid)
+{
+    pollfd p;
+    char buf[8];
+    int k;
+
+    p.fd = sock;
+    p.events = POLLIN;
+    do {
+        k = poll(&p, 1, timeout);
+    } while (k < 0 && errno == EINTR);
+    if (k <= 0) {
+        ERROR("no %s from fork server in %ld ms", what, timeout);
+        throw -1;
+    }
+
+    if (recv_cred(sock, buf, sizeof(buf), pid, 0) != 4 || memcmp(buf, what, 4)) {
+        ERROR("fork server sent something else than %s", what);
+        throw -1;
+    }
+}
+
+/**
+ * Send test to fork server.
+ *
+ * @param run_sock  socket the test and the server talk to us on
+ */
+static void send_request(saferun_forkserver *server, const saferun_task *task, int run_sock)
+{
+    char buf[FORKSERVER_MAX_SIZE];
+    char cbuf[CMSG_SPACE(4 * sizeof(int))];
+    int fds[4], nfds = 0;
+    uint32_t mask = 0;
+    size_t len = sizeof(mask);
+
+    fds[nfds++] = run_sock;
+    if (task->stdin_fd >= 0) {
+        mask |= 1;
+        fds[nfds++] = task->stdin_fd;
+    }
+    if (task->stdout_fd >= 0) {
+        mask |= 2;
+        fds[nfds++] = task->stdout_fd;
+    }
+    if (task->stderr_fd >= 0) {
+        mask |= 4;
+        fds[nfds++] = task->stderr_fd;
+    }
+    memcpy(buf, &mask, sizeof(mask));
+
+    for (char **arg = task->argv; *arg; ++arg) {
+        size_t n = strlen(*arg) + 1;
+        if (len + n > sizeof(buf)) {
+            ERROR("arguments of %s are too long for fork server", task->argv[0]);
+            throw -1;
+        }
+        memcpy(buf + len, *arg, n);
+        len += n;
+    }
+
+    iovec iov;
+    msghdr msg;
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+    if (sendmsg(server->ctl, &msg, MSG_NOSIGNAL) != (ssize_t) len) {
+        SYSERROR("can`t send test to fork server");
+        throw -1;
+    }
+}
+
+/**
+ * Check if the test exited, @see hv_wait
+ *
+ * Test is a child of the server, so its status comes from the server.
+ * Messages from anyone else on run socket are dropped.
+ */
+static pid_t wait_test(pid_t pid, int *status, void *data)
+{
+    forkserver_wait *w = (forkserver_wait *) data;
+    char buf[16];
+    pid_t sender;
+    int32_t t;
+
+    while (1) {
+        int k = recv_cred(w->sock, buf, sizeof(buf), &sender, MSG_DONTWAIT);
+        if (k < 0)
+            return 0;
+        if (k == 0) {
+            ERROR("fork server exited while running the test");
+            return -1;
+        }
+        if (sender != w->server || k != 8 || memcmp(buf, FORKSERVER_EXIT, 4))
+            continue;
+
+        memcpy(&t, buf + 4, sizeof(t));
+        *status = t;
+        return pid;
+    }
+}
+
+/**
+ * Make SOCK_SEQPACKET socket pair, credentials are passed to the first socket.
+ */
+static void make_socketpair(int sv[2])
+{
+    int on = 1;
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv)) {
+        SYSERROR("failed to create fork server socketpair");
+        throw -1;
+    }
+    if (setsockopt(sv[0], SOL_SOCKET, SO_PASSCRED, &on, sizeof(on))) {
+        SYSERROR("can`t pass credentials on fork server socket");
+        throw -1;
+    }
+}
+
+static void close_fd(int *fd)
+{
+    if (*fd >= 0)
+        close(*fd);
+    *fd = -1;
+}
+
+/**
+ * Start fork server, the language runtime tests are forked from.
+ *
+ * The program is run in the task jail and in cgroup of inst, it gets
+ * control socket as SAFERUN_FORKSERVER_FD and tells when it`s ready,
+ * see protocol in forkserver.cpp and saferun-forkserver.py for reference.
+ * Startup time and memory of the runtime are counted in its own cgroup,
+ * so they don`t go to tests.
+ *
+ * Only memory limit of the task is applied to the server, rtime limit is
+ * the time it has to get ready. inst must not be used for anything else
+ * until saferun_forkserver_stop().
+ *
+ * @note Tests share the server process, so use one server per submission.
+ *
+ * @return NULL if errors, or pointer to server otherwise.
+ */
+saferun_forkserver *saferun_forkserver_start(const saferun_inst *inst, const saferun_task *task)
+{
+    int ctl[2], sv[2];
+    int isolation;
+    pid_t pid = 0, sender;
+    saferun_stat stat; // only durations of phases are written, they are not reported
+
+    if (!inst || !task || !task->jail || !task->limits || !task->argv)
+        return NULL;
+
+    saferun_forkserver *server = (saferun_forkserver *)calloc(1, sizeof(saferun_forkserver));
+    if (!server)
+        return NULL;
+
+    ctl[0] = ctl[1] = -1;
+    sv[0] = sv[1] = 0;
+    try {
+        if (task->jail->chroot && !(server->chroot = strdup(task->jail->chroot)))
+            throw -1;
+
+        isolation = isolation_flags(task);
+        make_socketpair(ctl);
+        setup_cgroup(inst, task, isolation);
+        sync_init(sv);
+        spawn_task(inst, task, isolation, ctl[1], sv, &pid, &stat);
+        close_fd(&ctl[1]);
+        sync_free(sv);
+
+        wait_message(ctl[0], FORKSERVER_READY, task->limits->rtime, &sender);
+        if (sender != pid) {
+            ERROR("fork server ready message is sent by %d, not by server", sender);
+            throw -1;
+        }
+    }
+    catch (...) {
+        if (pid > 0) {
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+        }
+        try {
+            kill_cgroup(inst);
+            fini_cgroup(inst);
+        } catch(...) {}
+        sync_free(sv);
+        close_fd(&ctl[0]);
+        close_fd(&ctl[1]);
+        free(server->chroot);
+        free(server);
+        return NULL;
+    }
+
+    server->inst = inst;
+    server->pid = pid;
+    server->ctl = ctl[0];
+    server->jail = *task->jail;
+    server->jail.hostname = server->jail.chdir = NULL;
+    server->jail.chroot = server->chroot;
+    return server;
+}
+
+/**
+ * Run test forked from fork server.
+ *
+ * Test process is moved to fresh cgroup of inst before it runs, so its time
+ * and memory are counted from zero and limited like with saferun_run().
+ * Memory shared with the server is charged to the server until it`s written.
+ *
+ * Can be called from several threads at once with different instances.
+ *
+ * @param task  argv is passed to the server, for saferun-forkserver.py it`s
+ *              the script and its arguments. Jail of the task is ignored,
+ *              the test runs in jail of the server. Isolation of the task
+ *              selects only cgroups, namespaces are the ones of the server.
+ *
+ * @return -1 if there were library errors or the server is dead, 0 otherwise.
+ */
+int saferun_forkserver_run(saferun_forkserver *server, const saferun_inst *inst,
+                           const saferun_task *task, saferun_stat *stat)
+{
+    int run[2];
+    int ret = 0;
+    int admitted = 0;
+    int recorded = 0;
+    int isolation = 0;
+    unsigned char key[HISTORY_KEY];
+    long long base_time = 0, base_mem = 0;
+    pid_t pid = 0, sender;
+    saferun_limits scaled;
+    const saferun_limits *limits;
+    perf_counters perf_data, *perf = NULL;
+    profiler *prof = NULL;
+
+    if (!server || !inst || !task || !task->limits || !task->argv || !stat)
+        return -1;
+
+    saferun_task t = *task;
+    t.jail = &server->jail;
+    run[0] = run[1] = -1;
+
+    memset(stat->phase_time, 0, sizeof(stat->phase_time));
+    stat->cached = 0;
+    metrics_run_start();
+    recorded = history_predict(&t, stat, key);
+    admitted = admission_enter(t.limits, stat);
+    limits = calibrate_limits(inst, t.limits, &scaled);
+
+    try {
+        trace_begin(stat, SAFERUN_PHASE_CGROUP, pid);
+        isolation = isolation_flags(&t);
+        base_mem = setup_cgroup(inst, &t, isolation);
+        perf = setup_perf(inst, t.limits, &perf_data);
+        prof = setup_profile(inst, &t);
+        make_socketpair(run);
+        trace_end(stat, SAFERUN_PHASE_CGROUP, pid);
+
+        trace_begin(stat, SAFERUN_PHASE_CLONE, pid);
+        send_request(server, &t, run[1]);
+        close_fd(&run[1]);
+        wait_message(run[0], FORKSERVER_READY, limits->rtime, &sender);
+        if (sender <= 0 || sender == server->pid) {
+            ERROR("test ready message is sent by %d, not by test", sender);
+            throw -1;
+        }
+        pid = sender;
+        trace_end(stat, SAFERUN_PHASE_CLONE, pid);
+
+        trace_begin(stat, SAFERUN_PHASE_SYNC, pid);
+        task_to_cgroup(inst, pid, isolation);
+        cgroup_read_ll(inst->cpuacct_path, "cpuacct.usage", &base_time);
+        stat->start_time = get_rtime();
+        if (send(run[0], FORKSERVER_GO, 4, MSG_NOSIGNAL) != 4) {
+            SYSERROR("can`t start test of fork server");
+            throw -1;
+        }
+        trace_end(stat, SAFERUN_PHASE_SYNC, pid);
+
+        forkserver_wait wait;
+        wait.sock = run[0];
+        wait.server = server->pid;
+        trace_begin(stat, SAFERUN_PHASE_MONITOR, pid);
+        hypervisor(inst, pid, limits, isolation, perf, prof, base_time, base_mem, wait_test, &wait, stat);
+        trace_end(stat, SAFERUN_PHASE_MONITOR, pid);
+    }
+    catch (...) {
+        metrics_error(trace_current_phase());
+        if (pid > 0) kill(pid, SIGKILL);
+        try {
+            kill_cgroup(inst);
+        } catch(...) {}
+        ret = -1;
+    }
+
+    trace_begin(stat, SAFERUN_PHASE_TEARDOWN, pid);
+    try {
+        if (perf)
+            perf_close(perf);
+        if (prof)
+            fini_profile(prof, &t);
+        close_fd(&run[0]);
+        close_fd(&run[1]);
+        fini_cgroup(inst);
+    } catch(...) {}
+    trace_end(stat, SAFERUN_PHASE_TEARDOWN, pid);
+
+    calibrate_stat(inst, stat);
+    if (admitted)
+        admission_leave(t.limits, stat);
+    metrics_run_finish(stat, ret);
+    journal_append(&t, stat, ret);
+    if (recorded)
+        history_update(key, stat, ret);
+    return ret;
+}
+
+/**
+ * Stop fork server and remove its cgroup, unless it`s persistent.
+ *
+ * Runtime can`t be trusted to exit, so it`s killed.
+ *
+ * @return -1 if server is NULL, 0 otherwise.
+ */
+int saferun_forkserver_stop(saferun_forkserver *server)
+{
+    if (!server)
+        return -1;
+
+    close_fd(&server->ctl);
+    kill(server->pid, SIGKILL);
+    while (waitpid(server->pid, NULL, 0) < 0 && errno == EINTR)
+        ;
+    try {
+        kill_cgroup(server->inst);
+        fini_cgroup(server->inst);
+    } catch(...) {}
+
+    free(server->chroot);
+    free(server);
+    return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "saferun.h"
+#include "cgroup.h"
+#include "freezer.h"
+#include "utils.h"
+#include "log.h"
+
+/* How long to wait for the cgroup to become FROZEN */
+#define FREEZE_TRIES 1000
+#define FREEZE_DELAY (1000*1000) //in nanosec
+
+/* Guards paused_total and paused_since of all instances, they change rarely */
+static pthread_mutex_t pause_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Freeze cgroup and wait until all its processes are stopped.
+ *
+ * @return 1 if cgroup is frozen, 0 if it`s still freezing after FREEZE_TRIES
+ */
+static int freeze(const char *path)
+{
+    timespec delay;
+    delay.tv_sec = 0;
+    delay.tv_nsec = FREEZE_DELAY;
+
+    cgroup_freeze(path, 1);
+    for (int i = 0; i < FREEZE_TRIES; ++i) {
+        if (cgroup_is_frozen(path))
+            return 1;
+        nanosleep(&delay, NULL);
+    }
+    return 0;
+}
+
+/**
+ * Kill all processes of the task.
+ *
+ * With freezer cgroup the processes are frozen first, so none of them
+ * can fork while the tasks file is read, then they are killed and thawed
+ * to let SIGKILL be delivered. Without freezer the tasks file is just
+ * read and signalled, which may miss processes forked meanwhile.
+ */
+void kill_cgroup(const saferun_inst *inst)
+{
+    if (inst->freezer_path[0]) {
+        try {
+            if (!freeze(inst->freezer_path))
+                WARN("cgroup '%s' is not frozen in time, killing anyway", inst->cgname);
+            cgroup_kill(inst->freezer_path, SIGKILL);
+            cgroup_freeze(inst->freezer_path, 0);
+            return;
+        }
+        catch (...) {
+            try {
+                cgroup_freeze(inst->freezer_path, 0);
+            } catch (...) {}
+        }
+    }
+
+    cgroup_kill(inst->cpuacct_path, SIGKILL);
+    cgroup_kill(inst->memory_path, SIGKILL);
+}
+
+/**
+ * Total time the instance spent paused, including the current pause.
+ *
+ * Hypervisor reads it at start and on every check, the difference is
+ * excluded from real time of the run.
+ *
+ * @return time in microseconds
+ */
+long long paused_time(const saferun_inst *inst)
+{
+    pthread_mutex_lock(&pause_lock);
+    long long t = inst->paused_total;
+    if (inst->paused_since)
+        t += get_rtime() - inst->paused_since;
+    pthread_mutex_unlock(&pause_lock);
+    return t;
+}
+
+/**
+ * Pause the task running in the instance by freezing its cgroup.
+ *
+ * Time while the task is paused is not counted as real time.
+ * Every call should be followed by saferun_resume(), frozen task can`t
+ * finish and saferun_run() waits for it. Can be called from any thread.
+ *
+ * @return -1 if freezer cgroup is not mounted or cgroup can`t be frozen,
+ *         0 otherwise.
+ */
+int saferun_pause(saferun_inst *inst)
+{
+    if (!inst || !inst->freezer_path[0])
+        return -1;
+
+    try {
+        if (!freeze(inst->freezer_path))
+            WARN("cgroup '%s' is still freezing", inst->cgname);
+    }
+    catch (...) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&pause_lock);
+    if (!inst->paused_since)
+        inst->paused_since = get_rtime();
+    pthread_mutex_unlock(&pause_lock);
+    return 0;
+}
+
+/**
+ * Resume the task paused by saferun_pause().
+ *
+ * @return -1 if freezer cgroup is not mounted or cgroup can`t be thawed,
+ *         0 otherwise.
+ */
+int saferun_resume(saferun_inst *inst)
+{
+    if (!inst || !inst->freezer_path[0])
+        return -1;
+
+    pthread_mutex_lock(&pause_lock);
+    int ret = 0;
+    if (inst->paused_since) {
+        inst->paused_total += get_rtime() - inst->paused_since;
+        inst->paused_since = 0;
+    }
+    try {
+        cgroup_freeze(inst->freezer_path, 0);
+    }
+    catch (...) {
+        ret = -1;
+    }
+    pthread_mutex_unlock(&pause_lock);
+    return ret;
+}
@@ -0,0 +1,434 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#include "saferun.h"
+#include "history.h"
+#include "sha256.h"
+#include "utils.h"
+#include "log.h"
+
+/*
+ * History file is an mmap`ed hash table of fixed size entries, one per
+ * executable and argv, guarded like the cache index: by flock for other
+ * processes and by a mutex for threads of one process.
+ */
+
+#define HISTORY_MAGIC   0x54485253 /* "SRHT" */
+#define HISTORY_VERSION 1
+
+/* Entries checked for a key before evicting the least recently updated one */
+#define HISTORY_PROBE 16
+
+/* Weight of the last run in moving averages */
+#define HISTORY_ALPHA 0.25
+
+/* Executables whose content hash is remembered, keyed by inode and mtime */
+#define HISTORY_MEMO 64
+
+struct history_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t entries;
+    int64_t updates; /**< clock of entry updates, used for eviction */
+};
+
+struct history_entry {
+    unsigned char key[HISTORY_KEY];
+    uint32_t runs;   /**< 0 if the entry is empty */
+    uint32_t reserved;
+    int64_t updated; /**< header updates at the last update of the entry */
+    double time;     /**< moving averages, in milliseconds and bytes */
+    double rtime;
+    double mem;
+};
+
+/**
+ * Content hash of an executable, valid while its inode is not changed.
+ */
+struct exe_digest {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    unsigned char digest[SHA256_SIZE];
+};
+
+struct saferun_history {
+    pthread_mutex_t lock;
+    int fd;
+    size_t size;            /**< of mapping */
+    history_header *header;
+    history_entry *entries;
+
+    exe_digest memo[HISTORY_MEMO];
+    int memo_count;
+    int memo_next;          /**< replaced next when memo is full */
+};
+
+static saferun_history *current; /**< history of runs, @see saferun_set_history */
+static pthread_rwlock_t current_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void lock(saferun_history *history)
+{
+    pthread_mutex_lock(&history->lock);
+    flock(history->fd, LOCK_EX);
+}
+
+static void unlock(saferun_history *history)
+{
+    flock(history->fd, LOCK_UN);
+    pthread_mutex_unlock(&history->lock);
+}
+
+static int same_inode(const exe_digest *d, const struct stat *st)
+{
+    return d->dev == st->st_dev && d->ino == st->st_ino && d->size == st->st_size
+        && d->mtime.tv_sec == st->st_mtim.tv_sec && d->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/**
+ * Hash content of the executable, or take the hash of the same inode.
+ *
+ * Submissions are run on many tests, so an executable is hashed once
+ * instead of on every run.
+ *
+ * @return 0 if the file can`t be read
+ */
+static int hash_executable(saferun_history *history, int fd, unsigned char *digest)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        return 0;
+
+    pthread_mutex_lock(&history->lock);
+    for (int i = 0; i < history->memo_count; ++i)
+        if (same_inode(&history->memo[i], &st)) {
+            memcpy(digest, history->memo[i].digest, SHA256_SIZE);
+            pthread_mutex_unlock(&history->lock);
+            return 1;
+        }
+    pthread_mutex_unlock(&history->lock);
+
+    // big executables are hashed without blocking other runs
+    sha256_ctx ctx;
+    sha256_init(&ctx);
+    if (!sha256_update_fd(&ctx, fd))
+        return 0;
+    sha256_final(&ctx, digest);
+
+    pthread_mutex_lock(&history->lock);
+    exe_digest *d;
+    if (history->memo_count < HISTORY_MEMO) {
+        d = &history->memo[history->memo_count++];
+    } else {
+        d = &history->memo[history->memo_next];
+        history->memo_next = (history->memo_next + 1) % HISTORY_MEMO;
+    }
+    d->dev = st.st_dev;
+    d->ino = st.st_ino;
+    d->size = st.st_size;
+    d->mtime = st.st_mtim;
+    memcpy(d->digest, digest, SHA256_SIZE);
+    pthread_mutex_unlock(&history->lock);
+    return 1;
+}
+
+/**
+ * Compute history key of the task: hash of executable content and argv.
+ *
+ * Interpreted programs differ by argv, content of scripts is not hashed.
+ *
+ * @return 0 if the executable is not found
+ */
+static int make_key(saferun_history *history, const saferun_task *task, unsigned char *key)
+{
+    char exe[MAXPATHLEN];
+    unsigned char digest[SHA256_SIZE];
+
+    if (!find_executable(task, exe))
+        return 0;
+
+    int fd = open(exe, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    int ok = hash_executable(history, fd, digest);
+    close(fd);
+    if (!ok)
+        return 0;
+
+    sha256_ctx ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, digest, SHA256_SIZE);
+    for (char **arg = task->argv; *arg; ++arg)
+        sha256_update_str(&ctx, *arg);
+    sha256_update_str(&ctx, NULL);
+    sha256_final(&ctx, digest);
+
+    memcpy(key, digest, HISTORY_KEY);
+    return 1;
+}
+
+/**
+ * Find entry with key, or entry to put it to.
+ *
+ * Should be called with history locked.
+ */
+static history_entry *find_entry(saferun_history *history, const unsigned char *key, int *found)
+{
+    uint64_t h;
+    memcpy(&h, key, sizeof(h));
+    uint32_t slots = history->header->slots;
+    history_entry *victim = NULL;
+
+    for (uint32_t i = 0; i < HISTORY_PROBE && i < slots; ++i) {
+        history_entry *e = &history->entries[(h + i) % slots];
+        if (e->runs && !memcmp(e->key, key, HISTORY_KEY)) {
+            *found = 1;
+            return e;
+        }
+        if (!victim || (victim->runs && (!e->runs || e->updated < victim->updated)))
+            victim = e;
+    }
+
+    *found = 0;
+    return victim;
+}
+
+static void fill_prediction(const history_entry *e, saferun_prediction *prediction)
+{
+    prediction->runs = e->runs;
+    prediction->time = (long) e->time;
+    prediction->rtime = (long) e->rtime;
+    prediction->mem = (long long) e->mem;
+}
+
+/**
+ * Open history file, create it if needed.
+ *
+ * @param slots  number of entries in a new history, ignored if it exists
+ * @return NULL on error
+ */
+saferun_history *saferun_history_open(const char *path, int slots)
+{
+    struct stat st;
+
+    if (!path || slots <= 0)
+        return NULL;
+
+    saferun_history *history = (saferun_history *) calloc(1, sizeof(saferun_history));
+    if (!history)
+        return NULL;
+    pthread_mutex_init(&history->lock, NULL);
+    history->fd = -1;
+
+    try {
+        history->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (history->fd < 0) {
+            SYSERROR("can`t open history %s", path);
+            throw -1;
+        }
+
+        flock(history->fd, LOCK_EX);
+        try {
+            history_header header;
+            if (fstat(history->fd, &st) == -1)
+                throw -1;
+            if ((size_t) st.st_size < sizeof(header)
+                    || pread(history->fd, &header, sizeof(header), 0) != sizeof(header)
+                    || header.magic != HISTORY_MAGIC || header.version != HISTORY_VERSION
+                    || (size_t) st.st_size != sizeof(header) + header.slots * sizeof(history_entry)) {
+                if (st.st_size)
+                    WARN("history %s is outdated or broken, resetting it", path);
+                memset(&header, 0, sizeof(header));
+                header.magic = HISTORY_MAGIC;
+                header.version = HISTORY_VERSION;
+                header.slots = slots;
+                if (ftruncate(history->fd, 0) == -1
+                        || ftruncate(history->fd, sizeof(header) + slots * sizeof(history_entry)) == -1
+                        || pwrite(history->fd, &header, sizeof(header), 0) != sizeof(header)) {
+                    SYSERROR("can`t create history %s", path);
+                    throw -1;
+                }
+            }
+
+            history->size = sizeof(header) + header.slots * sizeof(history_entry);
+            void *p = mmap(NULL, history->size, PROT_READ | PROT_WRITE, MAP_SHARED, history->fd, 0);
+            if (p == MAP_FAILED) {
+                SYSERROR("can`t map history");
+                throw -1;
+            }
+            history->header = (history_header *) p;
+            history->entries = (history_entry *) (history->header + 1);
+        }
+        catch (...) {
+            flock(history->fd, LOCK_UN);
+            throw;
+        }
+        flock(history->fd, LOCK_UN);
+    }
+    catch (...) {
+        saferun_history_close(history);
+        return NULL;
+    }
+
+    return history;
+}
+
+/**
+ * Close history, all its entries are already on disk.
+ *
+ * Call saferun_set_history(NULL) first if it`s the history of runs.
+ *
+ * @return -1 if history is NULL, 0 otherwise.
+ */
+int saferun_history_close(saferun_history *history)
+{
+    if (!history)
+        return -1;
+    if (history->header)
+        munmap(history->header, history->size);
+    if (history->fd >= 0)
+        close(history->fd);
+    pthread_mutex_destroy(&history->lock);
+    free(history);
+    return 0;
+}
+
+/**
+ * Predict resource usage of the task from history of its previous runs.
+ *
+ * Runs are matched by content of the executable and argv, so a rejudged
+ * submission is known while a recompiled one is new.
+ *
+ * @param prediction  runs is 0 if the task was not run before
+ * @return -1 on bad arguments, 0 otherwise.
+ */
+int saferun_history_predict(saferun_history *history, const saferun_task *task,
+                            saferun_prediction *prediction)
+{
+    unsigned char key[HISTORY_KEY];
+
+    if (!history || !task || !task->jail || !task->argv || !prediction)
+        return -1;
+
+    memset(prediction, 0, sizeof(saferun_prediction));
+    if (!make_key(history, task, key))
+        return 0;
+
+    int found;
+    lock(history);
+    history_entry *e = find_entry(history, key, &found);
+    if (found)
+        fill_prediction(e, prediction);
+    unlock(history);
+    return 0;
+}
+
+/**
+ * Set history for all runs of the process.
+ *
+ * Every saferun_run() fills saferun_stat.predicted from it and updates it
+ * with time, rtime and memory of the finished run. NULL disables history.
+ *
+ * @return 0
+ */
+int saferun_set_history(saferun_history *history)
+{
+    pthread_rwlock_wrlock(&current_lock);
+    current = history;
+    pthread_rwlock_unlock(&current_lock);
+    return 0;
+}
+
+/**
+ * Fill stat->predicted from history set by saferun_set_history()
+ *
+ * @param key  where to write key of the task for history_update()
+ * @return 1 if the run should be recorded, 0 if there is no history
+ *         or the executable is not found
+ */
+int history_predict(const saferun_task *task, saferun_stat *stat, unsigned char *key)
+{
+    memset(&stat->predicted, 0, sizeof(saferun_prediction));
+
+    pthread_rwlock_rdlock(&current_lock);
+    saferun_history *history = current;
+    int keyed = history && make_key(history, task, key);
+    if (keyed) {
+        int found;
+        lock(history);
+        history_entry *e = find_entry(history, key, &found);
+        if (found)
+            fill_prediction(e, &stat->predicted);
+        unlock(history);
+    }
+    pthread_rwlock_unlock(&current_lock);
+    return keyed;
+}
+
+/**
+ * Add finished run to history set by saferun_set_history()
+ *
+ * Skipped runs and library errors tell nothing about the task and are
+ * not recorded.
+ */
+void history_update(const unsigned char *key, const saferun_stat *stat, int ret)
+{
+    if (ret || stat->result == _SK)
+        return;
+
+    pthread_rwlock_rdlock(&current_lock);
+    saferun_history *history = current;
+    if (!history) {
+        pthread_rwlock_unlock(&current_lock);
+        return;
+    }
+
+    int found;
+    lock(history);
+    history_entry *e = find_entry(history, key, &found);
+    if (!found) {
+        if (!e->runs)
+            ++history->header->entries;
+        memset(e, 0, sizeof(history_entry));
+        memcpy(e->key, key, HISTORY_KEY);
+        e->time = stat->time;
+        e->rtime = stat->rtime;
+        e->mem = stat->mem;
+    } else {
+        e->time += HISTORY_ALPHA * (stat->time - e->time);
+        e->rtime += HISTORY_ALPHA * (stat->rtime - e->rtime);
+        e->mem += HISTORY_ALPHA * (stat->mem - e->mem);
+    }
+    if (e->runs < UINT32_MAX)
+        ++e->runs;
+    e->updated = ++history->header->updates;
+    unlock(history);
+    pthread_rwlock_unlock(&current_lock);
+}
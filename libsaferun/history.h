@@ -0,0 +1,28 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _HISTORY_H
+#define _HISTORY_H
+
+#include "saferun.h"
+
+/* Bytes of sha256 kept as history key */
+#define HISTORY_KEY 16
+
+int history_predict(const saferun_task *task, saferun_stat *stat, unsigned char *key);
+void history_update(const unsigned char *key, const saferun_stat *stat, int ret);
+
+#endif /*_HISTORY_H */
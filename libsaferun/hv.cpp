@@ -17,100 +17,395 @@
 #include <sys/wait.h>
 #include <signal.h>
 #include <time.h>
+#include <pthread.h>
+#include <string.h>
 
 #include "saferun.h"
 #include "cgroup.h"
 #include "utils.h"
+#include "metrics.h"
+#include "perf.h"
+#include "freezer.h"
+#include "profile.h"
+#include "hv.h"
 #include "log.h"
 
+
+/* Built-in checkers, the run always has time and rtime limits */
+#define BUILTIN_CHECKERS 7
+
+/* Samples of CPU usage kept for the idleness check */
+#define IDLE_SAMPLES 32
+/* Task is idle if it used less than 1/IDLE_CPU_SHARE of a core in the window */
+#define IDLE_CPU_SHARE 100
+
+/**
+ * CPU usage of the task at some moment of its real time.
+ */
+struct idle_sample {
+    long rtime;       /**< in milliseconds */
+    long long usage;  /**< in nanoseconds */
+};
+
+/**
+ * State of hypervisor of one run, shared by counters and built-in checkers.
+ */
+struct hv_state {
+    const saferun_inst *inst;
+    perf_counters *perf;  /**< NULL if not used */
+    int blkio;            /**< task is in blkio cgroup */
+    long long base_time;  /**< cpuacct.usage at exec of the program, in nanoseconds */
+    long long base_mem;   /**< memory left charged by previous runs of persistent cgroup */
+    long long base_paused;    /**< paused_time() at start */
+    long long base_periods;   /**< nr_throttled of cpu.stat at start */
+    long long base_throttled; /**< throttled_time of cpu.stat at start, in nanoseconds */
+    long long failcnt;    /**< max of memory.failcnt and memory.memsw.failcnt */
+    long long usage;      /**< cpuacct.usage since exec, in nanoseconds */
+
+    idle_sample idle[IDLE_SAMPLES]; /**< ring of samples, oldest one is at window start */
+    int idle_first;
+    int idle_count;
+};
+
+static saferun_checker checkers[SAFERUN_CHECKER_MAX];
+static int checkers_count = 0;
+static pthread_mutex_t checkers_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /**
- * Checks process exit status.
+ * Reads CPU bandwidth throttling statistics via cgroup cpu subsystem files.
  *
- * Sets stat->result to _RE if Runtime Error occured.
+ * Counters can`t be reset, so persistent cgroup keeps values of previous runs.
+ * That`s why hypervisor reads them at start and at finish.
  *
- * @param status  process exit status
- * @param stat    statistics to update
+ * @param inst     library instance
+ * @param periods  where to write number of throttled periods
+ * @param time     where to write throttled time, in nanoseconds
  */
-void check_exit_status(const int status, saferun_stat * stat)
+void read_cpu_stat(const saferun_inst * inst, long long *periods, long long *time)
 {
-    stat->status = status;
-    if (stat->result != _OK)
+    *periods = *time = 0;
+    if (!inst->cpu_path[0])
         return;
 
-    if (WIFSIGNALED(status) ||
-            (WIFEXITED(status) && WEXITSTATUS(status)))
-        stat->result = _RE;
-    else
-        stat->result = _OK;
+    cgroup_read_key(inst->cpu_path, "cpu.stat", "nr_throttled", periods);
+    cgroup_read_key(inst->cpu_path, "cpu.stat", "throttled_time", time);
 }
 
 /**
- * Checks user+system execution time of the process via cgroup subsystem files.
+ * Reads counters of the task to statistics.
  *
- * Sets stat->result to _TL if time limit exceeded.
+ * Counters of subsystems which are not mounted, or not used by isolation
+ * of the task, are left as they are.
  *
- * @param inst    library instance
- * @param limits  limits to check
- * @param stat    statistics to update
+ * @note On cgroup v1 buffered writes are mostly accounted to the kernel
+ * flusher threads, so io_write counts direct and synchronous writes,
+ * @see check_io
+ *
+ * @param hv        hypervisor state
+ * @param counters  SAFERUN_COUNTER_* flags of counters to read
+ * @param stat      statistics to update
  */
-void check_time(const saferun_inst * inst, const saferun_limits * limits, saferun_stat * stat)
+static void read_counters(hv_state *hv, int counters, saferun_stat *stat)
 {
+    const saferun_inst *inst = hv->inst;
     long long t;
-    cgroup_read_ll(inst->cpuacct_path, "cpuacct.usage", &t);
-    stat->time = t / (1000*1000); //Converting from nano- to milli- seconds
-    if (stat->result == _OK && stat->time > limits->time)
-        stat->result = _TL;
+
+    if (counters & SAFERUN_COUNTER_TIME) {
+        cgroup_read_ll(inst->cpuacct_path, "cpuacct.usage", &t);
+        hv->usage = t - hv->base_time;
+        stat->time = hv->usage / (1000*1000); //Converting from nano- to milli- seconds
+    }
+
+    if (counters & SAFERUN_COUNTER_RTIME) {
+        long long paused = paused_time(inst) - hv->base_paused;
+        stat->paused_time = paused / 1000;
+        stat->rtime = (get_rtime() - stat->start_time - paused) / 1000;
+    }
+
+    if (counters & SAFERUN_COUNTER_MEMORY) {
+        cgroup_read_ll(inst->memory_path, "memory.memsw.max_usage_in_bytes", &(stat->mem));
+        stat->mem = stat->mem > hv->base_mem ? stat->mem - hv->base_mem : 0;
+        cgroup_read_ll(inst->memory_path, "memory.failcnt", &(hv->failcnt));
+        cgroup_read_ll(inst->memory_path, "memory.memsw.failcnt", &t);
+        if (t > hv->failcnt)
+            hv->failcnt = t;
+    }
+
+    if ((counters & SAFERUN_COUNTER_IO) && hv->blkio) {
+        cgroup_read_blkio(inst->blkio_path, "blkio.throttle.io_service_bytes",
+                          &(stat->io_read), &(stat->io_write));
+        cgroup_read_blkio(inst->blkio_path, "blkio.throttle.io_serviced",
+                          &(stat->io_read_ops), &(stat->io_write_ops));
+    }
+
+    if ((counters & SAFERUN_COUNTER_PERF) && hv->perf)
+        perf_read(hv->perf, stat);
+
+    if ((counters & SAFERUN_COUNTER_THROTTLE) && inst->cpu_path[0]) {
+        long long periods, throttled;
+        read_cpu_stat(inst, &periods, &throttled);
+        stat->throttled_periods = periods - hv->base_periods;
+        stat->throttled_time = (throttled - hv->base_throttled) / (1000*1000); //Converting from nano- to milli- seconds
+    }
+}
+
+/**
+ * Checks user+system execution time of the process.
+ *
+ * Returns _TL if time limit exceeded.
+ */
+static saferun_result check_time(const saferun_limits *limits, const saferun_stat *stat,
+                                 int, void *)
+{
+    return stat->time > limits->time ? _TL : _OK;
 }
 
 /**
  * Checks real execution time of the process.
  *
- * Sets stat->result to _TL if real time limit exceeded.
+ * Returns _TL if real time limit exceeded.
+ * Time while the task was paused is not counted.
+ */
+static saferun_result check_rtime(const saferun_limits *limits, const saferun_stat *stat,
+                                  int, void *)
+{
+    return stat->rtime > limits->rtime ? _TL : _OK;
+}
+
+/**
+ * Checks disk writes of the process.
  *
- * @param limits  limits to check
- * @param stat    statistics to update
+ * Returns _OL if too much was written to disk, or a file grew over
+ * io_write. Buffered writes are missed by blkio on cgroup v1, so size of
+ * every file is also limited by RLIMIT_FSIZE: writes beyond it fail and
+ * raise SIGXFSZ, which is ignored by init of a pid namespace.
  */
-void check_rtime(const saferun_limits * limits, saferun_stat * stat)
+static saferun_result check_io(const saferun_limits *limits, const saferun_stat *stat,
+                               int finished, void *data)
 {
-    stat->rtime = (get_rtime() - stat->start_time) / 1000;
-    if (stat->result == _OK && stat->rtime > limits->rtime)
-        stat->result = _TL;
+    hv_state *hv = (hv_state *) data;
+    if (finished && WIFSIGNALED(stat->status) && WTERMSIG(stat->status) == SIGXFSZ)
+        return _OL;
+    return hv->blkio && stat->io_write > limits->io_write ? _OL : _OK;
 }
 
 /**
- * Checks memory usage for process via cgroup subsystem files.
+ * Checks instructions retired by the process.
  *
- * Sets stat->result to _ML if memory limit exceeded.
+ * Returns _TL if instructions limit exceeded.
+ * Unlike cpuacct.usage, instruction count doesn`t depend on CPU frequency
+ * and on neighbours, so the verdict is the same on every run.
+ */
+static saferun_result check_instructions(const saferun_limits *limits, const saferun_stat *stat,
+                                         int, void *)
+{
+    return stat->instructions > limits->instructions ? _TL : _OK;
+}
+
+/**
+ * Checks that the running process makes CPU progress.
  *
- * @param inst    library instance
- * @param limits  limits to check
- * @param status  process exit status
- * @param stat    statistics to update
+ * Returns _IL if the task used less than 1/IDLE_CPU_SHARE of a core during
+ * the last limits->idle milliseconds of real time, and none of its
+ * processes is runnable or waits for disk. So a task blocked on stdin or
+ * sleeping is ended early, while one starved by neighbours or by its CPU
+ * quota is not. Samples are taken at most IDLE_SAMPLES - 2 times per
+ * window, so the ring always covers the window.
  */
-void check_memory(const saferun_inst * inst, const saferun_limits * limits, int status, saferun_stat * stat)
+static saferun_result check_idle(const saferun_limits *limits, const saferun_stat *stat,
+                                 int finished, void *data)
 {
-    long long failcnt, t;
-    cgroup_read_ll(inst->memory_path, "memory.memsw.max_usage_in_bytes", &(stat->mem));
-    cgroup_read_ll(inst->memory_path, "memory.failcnt", &failcnt);
-    cgroup_read_ll(inst->memory_path, "memory.memsw.failcnt", &t);
-    if (t > failcnt)
-        failcnt = t;
+    hv_state *hv = (hv_state *) data;
+    if (finished)
+        return _OK;
+
+    long window = limits->idle;
+    idle_sample *ring = hv->idle;
+    int last = (hv->idle_first + hv->idle_count - 1) % IDLE_SAMPLES;
+    if (!hv->idle_count || stat->rtime - ring[last].rtime >= window / (IDLE_SAMPLES - 2)) {
+        if (hv->idle_count == IDLE_SAMPLES) {
+            hv->idle_first = (hv->idle_first + 1) % IDLE_SAMPLES;
+            --hv->idle_count;
+        }
+        last = (hv->idle_first + hv->idle_count) % IDLE_SAMPLES;
+        ring[last].rtime = stat->rtime;
+        ring[last].usage = hv->usage;
+        ++hv->idle_count;
+    }
+
+    // keep the newest sample taken at or before start of the window
+    while (hv->idle_count > 1 &&
+            ring[(hv->idle_first + 1) % IDLE_SAMPLES].rtime <= stat->rtime - window) {
+        hv->idle_first = (hv->idle_first + 1) % IDLE_SAMPLES;
+        --hv->idle_count;
+    }
 
-    if (stat->result == _OK && failcnt > 0)
-        if (WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL)
-            stat->result = _ML;
+    const idle_sample *start = &ring[hv->idle_first];
+    if (stat->rtime - start->rtime < window)
+        return _OK;
+    if ((hv->usage - start->usage) * IDLE_CPU_SHARE >= window * 1000000LL)
+        return _OK;
+    return cgroup_has_runnable(hv->inst->cpuacct_path) ? _OK : _IL;
+}
+
+/**
+ * Checks memory usage of the finished process.
+ *
+ * Returns _ML if the process was killed by OOM killer of the cgroup.
+ */
+static saferun_result check_memory(const saferun_limits *, const saferun_stat *stat,
+                                   int finished, void *data)
+{
+    hv_state *hv = (hv_state *) data;
+    if (finished && hv->failcnt > 0)
+        if (WIFSIGNALED(stat->status) && WTERMSIG(stat->status) == SIGKILL)
+            return _ML;
+    return _OK;
+}
+
+/**
+ * Checks exit status of the finished process.
+ *
+ * Returns _RE if Runtime Error occured.
+ */
+static saferun_result check_exit_status(const saferun_limits *, const saferun_stat *stat,
+                                        int finished, void *)
+{
+    if (finished && (WIFSIGNALED(stat->status) ||
+            (WIFEXITED(stat->status) && WEXITSTATUS(stat->status))))
+        return _RE;
+    return _OK;
+}
+
+static const saferun_checker builtin_time = { "time", SAFERUN_COUNTER_TIME, check_time, NULL };
+static const saferun_checker builtin_rtime = { "rtime", SAFERUN_COUNTER_RTIME, check_rtime, NULL };
+static const saferun_checker builtin_io = { "io", SAFERUN_COUNTER_IO, check_io, NULL };
+static const saferun_checker builtin_instructions = { "instructions", SAFERUN_COUNTER_PERF, check_instructions, NULL };
+static const saferun_checker builtin_idle = { "idle", SAFERUN_COUNTER_TIME | SAFERUN_COUNTER_RTIME, check_idle, NULL };
+static const saferun_checker builtin_memory = { "memory", SAFERUN_COUNTER_MEMORY, check_memory, NULL };
+static const saferun_checker builtin_exit_status = { "exit_status", 0, check_exit_status, NULL };
+
+/**
+ * Append checker to list of checkers of the run.
+ *
+ * @param data  passed to check instead of checker data, if not NULL
+ */
+static void add_checker(saferun_checker *list, int *count, const saferun_checker *checker, void *data)
+{
+    list[*count] = *checker;
+    if (data)
+        list[*count].data = data;
+    ++*count;
+}
+
+/**
+ * Select checkers run on every tick for the limits of the run.
+ *
+ * Checks of limits which are not set are skipped, registered checkers go
+ * after built-in ones. Memory and exit status are only checked after exit,
+ * so they are not selected.
+ *
+ * @param list      where to write checkers, BUILTIN_CHECKERS + SAFERUN_CHECKER_MAX long
+ * @param counters  where to write union of counters needed by the checkers
+ * @return number of checkers
+ */
+static int select_checkers(hv_state *hv, const saferun_limits *limits,
+                           saferun_checker *list, int *counters)
+{
+    int count = 0;
+
+    add_checker(list, &count, &builtin_time, hv);
+    add_checker(list, &count, &builtin_rtime, hv);
+    if (limits->io_write)
+        add_checker(list, &count, &builtin_io, hv);
+    if (limits->instructions && hv->perf && hv->perf->hw)
+        add_checker(list, &count, &builtin_instructions, hv);
+    if (limits->idle > 0)
+        add_checker(list, &count, &builtin_idle, hv);
+
+    pthread_mutex_lock(&checkers_lock);
+    for (int i = 0; i < checkers_count; ++i)
+        add_checker(list, &count, &checkers[i], NULL);
+    pthread_mutex_unlock(&checkers_lock);
+
+    *counters = 0;
+    for (int i = 0; i < count; ++i)
+        *counters |= list[i].counters;
+    return count;
+}
+
+/**
+ * Run checkers until the first one which fails.
+ *
+ * Sets stat->result to result of the failed checker.
+ */
+static void run_checkers(const saferun_checker *list, int count, const saferun_limits *limits,
+                         int finished, saferun_stat *stat)
+{
+    for (int i = 0; i < count && stat->result == _OK; ++i) {
+        saferun_result result = list[i].check(limits, stat, finished, list[i].data);
+        if (result != _OK) {
+            DEBUG("checker %s failed with result %d", list[i].name, result);
+            stat->result = result;
+        }
+    }
+}
+
+/**
+ * Add limit check to hypervisor of every run of the process.
+ *
+ * Checker is copied. Checkers can`t be removed, so its data must be valid
+ * till the end of the process. They are run after built-in ones, in order
+ * of registration, and may be called from several threads at once.
+ *
+ * @return -1 if there are too many checkers or check is NULL, 0 otherwise.
+ */
+int saferun_register_checker(const saferun_checker *checker)
+{
+    if (!checker || !checker->check)
+        return -1;
+
+    pthread_mutex_lock(&checkers_lock);
+    if (checkers_count == SAFERUN_CHECKER_MAX) {
+        pthread_mutex_unlock(&checkers_lock);
+        return -1;
+    }
+    checkers[checkers_count] = *checker;
+    checkers[checkers_count].name[sizeof(checker->name) - 1] = '\0';
+    ++checkers_count;
+    pthread_mutex_unlock(&checkers_lock);
+    return 0;
+}
+
+/**
+ * Wait for child process of the library.
+ */
+pid_t hv_waitpid(pid_t pid, int *status, void *)
+{
+    return waitpid(pid, status, WNOHANG);
 }
 
 /**
  * Run hypervisor for process.
  *
- * Hypervisor will check execution time and memory usage.
- * It runs some checks every SAFERUN_HV_DELAY.
- * Some checks are run after process finishes.
+ * Hypervisor runs checkers of limits set for the task and registered ones
+ * every SAFERUN_HV_DELAY, reading only counters they need.
+ * After process finishes all counters are read and all checkers are run,
+ * together with checks of memory and exit status.
+ * Violating task is killed with all its processes by kill_cgroup().
+ * Processes left by the task after it exited are killed by fini_cgroup(),
+ * so stats are returned before that.
+ * Samples of profiler are drained on every check, so its buffers stay small.
  *
+ * @param isolation  SAFERUN_ISOLATE_* flags of the task
+ * @param base_mem   memory charged before the task, @see setup_cgroup
+ * @param waiter     tells if the task exited, task of fork server is not
+ *                   a child of the library, @see hv_waitpid
+ * @param wait_data  passed to waiter
  */
-void hypervisor(const saferun_inst *inst, pid_t pid, const saferun_limits * limits,
-                saferun_stat * stat)
+void hypervisor(const saferun_inst *inst, pid_t pid, const saferun_limits * limits, int isolation,
+                perf_counters *perf, profiler *prof, long long base_time, long long base_mem,
+                hv_wait waiter, void *wait_data, saferun_stat * stat)
 {
     // Setting up delay for hypervisor
     timespec delay;
@@ -118,33 +413,88 @@ void hypervisor(const saferun_inst *inst, pid_t pid, const saferun_limits * limi
     delay.tv_nsec = SAFERUN_HV_DELAY;
     
     stat->result = _OK;
+    stat->io_read = stat->io_write = 0;
+    stat->io_read_ops = stat->io_write_ops = 0;
+    stat->throttled_periods = stat->throttled_time = 0;
+    stat->instructions = stat->cycles = stat->task_clock = 0;
+
+    hv_state hv;
+    hv.inst = inst;
+    hv.perf = perf;
+    hv.blkio = inst->blkio_path[0] && (isolation & SAFERUN_ISOLATE_BLKIO);
+    hv.base_time = base_time;
+    hv.base_mem = base_mem;
+    hv.base_paused = paused_time(inst);
+    hv.failcnt = 0;
+    hv.usage = 0;
+    hv.idle_first = hv.idle_count = 0;
+    read_cpu_stat(inst, &hv.base_periods, &hv.base_throttled);
+
+    saferun_checker list[BUILTIN_CHECKERS + SAFERUN_CHECKER_MAX];
+    int counters;
+    int ticking = select_checkers(&hv, limits, list, &counters);
+    int count = ticking;
+    add_checker(list, &count, &builtin_memory, &hv);
+    add_checker(list, &count, &builtin_exit_status, &hv);
 
     int status;
+    int detected = 0;
+    long long last_poll = get_rtime();
     while (1) {
-        int w = waitpid(pid, &status, WNOHANG);
+        int w = waiter(pid, &status, wait_data);
         if (w == -1) {
             DEBUG("Can`t wait for pid");
             throw -1;
         }
-        check_time(inst, limits, stat);
-        check_rtime(limits, stat);
+        long long now = get_rtime();
+        if (prof)
+            profile_drain(prof);
         if (w == pid) {
-            check_memory(inst, limits, status, stat);
-            check_exit_status(status, stat);
+            if (!detected)
+                metrics_observe(METRIC_DETECTION, now - last_poll);
+            stat->status = status;
+            read_counters(&hv, SAFERUN_COUNTER_ALL, stat);
+            run_checkers(list, count, limits, 1, stat);
             break;
         }
+
+        read_counters(&hv, counters, stat);
+        run_checkers(list, ticking, limits, 0, stat);
+        // given up by another thread, @see saferun_cancel
+        if (stat->result == _OK && inst->cancelled)
+            stat->result = _SK;
         
         if (stat->result != _OK) {
+            if (!detected)
+                metrics_observe(METRIC_DETECTION, now - last_poll);
+            detected = 1;
             kill(pid, SIGKILL);
-            cgroup_kill(inst->cpuacct_path, SIGKILL);
+            kill_cgroup(inst);
             // One more iteration, so our process
             // wouldn`t become a zombie
             continue;
         }
         
+        last_poll = now;
         nanosleep(&delay, NULL);
     }
-
-    cgroup_kill(inst->cpuacct_path, SIGKILL);
 }
 
+/**
+ * Give up the run of the instance from another thread.
+ *
+ * Hypervisor kills the task on its next check and reports it as _SK,
+ * a task which is still starting is killed as soon as it`s watched.
+ * The mark stays after the run, so the caller clears it before
+ * the instance is run again.
+ *
+ * @param cancelled  1 to give up the run, 0 to clear the mark
+ * @return -1 if inst is NULL, 0 otherwise
+ */
+int saferun_cancel(saferun_inst *inst, int cancelled)
+{
+    if (!inst)
+        return -1;
+    inst->cancelled = cancelled;
+    return 0;
+}
@@ -18,8 +18,19 @@
 #define _HYPERVISOR_H
 
 #include "saferun.h"
+#include "perf.h"
+#include "profile.h"
 
-void hypervisor(const saferun_inst *inst, pid_t pid, const saferun_limits * limits,
-                saferun_stat * stat);
+/**
+ * Check if the task exited without blocking, like waitpid(pid, status, WNOHANG).
+ *
+ * @return pid if the task exited, 0 if it`s running, -1 on error
+ */
+typedef pid_t (*hv_wait)(pid_t pid, int *status, void *data);
+
+pid_t hv_waitpid(pid_t pid, int *status, void *data);
+void hypervisor(const saferun_inst *inst, pid_t pid, const saferun_limits * limits, int isolation,
+                perf_counters *perf, profiler *prof, long long base_time, long long base_mem,
+                hv_wait waiter, void *wait_data, saferun_stat * stat);
 
 #endif /*_HYPERVISOR_H */
@@ -0,0 +1,756 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "saferun.h"
+#include "journal.h"
+#include "utils.h"
+#include "log.h"
+
+/*
+ * Journal directory has segment files named by their numbers, and a lock
+ * file held by the writer. Segment is a header page and an array of
+ * fixed size records. Segment is allocated in full when created, so
+ * writing a record is a copy to mapped memory, and disk full shows up
+ * on rotation instead of SIGBUS.
+ *
+ * Mapped pages belong to page cache, so records survive a crash of the
+ * writer process. Use saferun_journal_sync() to survive a crash of the host.
+ *
+ * Records are written in parallel, so a record without commit can be
+ * still in progress. It`s torn only if its segment is sealed, which is
+ * done when its last record is written after rotation, or if the writer
+ * is gone: the lock file isn`t locked, or the next writer sealed segments
+ * left by a crashed one.
+ */
+
+#define JOURNAL_MAGIC  0x4a4a5253 /* "SRJJ" */
+#define JOURNAL_HEADER 4096       /* records start at this offset */
+
+/* Smallest segment, smaller sizes are rounded up to it */
+#define JOURNAL_MIN_SEGMENT (JOURNAL_HEADER + 16 * sizeof(saferun_journal_record))
+
+struct journal_header {
+    uint32_t magic;
+    uint32_t record_size;  /**< sizeof(saferun_journal_record) of the writer */
+    uint64_t number;       /**< of the segment, the file is named by it */
+    uint64_t first_seq;    /**< seq of the first record */
+    uint32_t capacity;     /**< records in the segment */
+    uint32_t used;         /**< records taken by writer, some can be torn */
+    uint32_t sealed;       /**< used when all of them were written, 0 before */
+};
+
+struct journal_segment {
+    int fd;
+    char *map;
+    size_t size;
+    journal_header *header;
+    saferun_journal_record *records;
+    int writers; /**< records being written */
+    int retired; /**< segment is full, unmapped after the last writer */
+};
+
+/**
+ * saferun_journal - append-only journal of runs.
+ *
+ * Slots are taken under the mutex, records are written without it.
+ */
+struct saferun_journal {
+    char dir[MAXPATHLEN];
+    int lock_fd;          /**< locked, so there is one writer per journal, @see writer_alive */
+    long long segment_size;
+    int keep;             /**< segments kept, 0 to keep all */
+
+    pthread_mutex_t lock; /**< protects the segment and its header */
+    journal_segment *segment;
+    uint64_t next_seq;
+};
+
+struct saferun_journal_reader {
+    char dir[MAXPATHLEN];
+    unsigned long long from; /**< records before it are skipped */
+    uint64_t number;         /**< of the open segment */
+    journal_segment *segment;
+    uint32_t pos;            /**< next record in the segment */
+    long long skipped;       /**< torn records */
+};
+
+static pthread_rwlock_t current_lock = PTHREAD_RWLOCK_INITIALIZER;
+static saferun_journal *current; /**< journal of runs, @see saferun_set_journal */
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init()
+{
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k)
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+/**
+ * CRC-32 as in zlib, so records can be checked by other tools
+ */
+static uint32_t crc32(const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    uint32_t c = 0xffffffff;
+
+    pthread_once(&crc_once, crc_init);
+    while (len--)
+        c = crc_table[(c ^ *p++) & 0xff] ^ (c >> 8);
+    return c ^ 0xffffffff;
+}
+
+static int record_ok(const saferun_journal_record *rec)
+{
+    return rec->commit == SAFERUN_JOURNAL_COMMIT
+        && rec->crc == crc32(rec, offsetof(saferun_journal_record, crc));
+}
+
+/**
+ * Make path of segment file, MAXPATHLEN long
+ *
+ * @param tmp  add .tmp suffix of a segment being created
+ */
+static void segment_path(const char *dir, uint64_t number, int tmp, char *path)
+{
+    int n = snprintf(path, MAXPATHLEN, "%s/%016llx.srj%s", dir, (unsigned long long)number,
+                     tmp ? ".tmp" : "");
+    if (n < 0 || n >= MAXPATHLEN) {
+        ERROR("path of journal %s is too long", dir);
+        throw -1;
+    }
+}
+
+/**
+ * Parse number of segment from file name
+ *
+ * @return 0 if it`s not a segment file
+ */
+static int segment_number(const char *name, uint64_t *number)
+{
+    char tail[8];
+    unsigned long long x;
+
+    if (strlen(name) != 20 || sscanf(name, "%16llx%7s", &x, tail) != 2 || strcmp(tail, ".srj"))
+        return 0;
+    *number = x;
+    return 1;
+}
+
+/**
+ * Find the first segment with number bigger than after
+ *
+ * @return 0 if there is none
+ */
+static int next_segment(const char *dir, uint64_t after, uint64_t *number)
+{
+    DIR *d = opendir(dir);
+    struct dirent *e;
+    uint64_t x;
+    int found = 0;
+
+    if (!d) {
+        SYSERROR("can`t open journal %s", dir);
+        throw -1;
+    }
+
+    while ((e = readdir(d)))
+        if (segment_number(e->d_name, &x) && x > after && (!found || x < *number)) {
+            *number = x;
+            found = 1;
+        }
+
+    closedir(d);
+    return found;
+}
+
+static void segment_free(journal_segment *seg)
+{
+    if (!seg)
+        return;
+    if (seg->map)
+        munmap(seg->map, seg->size);
+    if (seg->fd >= 0)
+        close(seg->fd);
+    free(seg);
+}
+
+/**
+ * Mark all records of segment as final, should be called when no record
+ * is being written to it
+ */
+static void segment_seal(journal_segment *seg)
+{
+    // records must be seen before the seal
+    __sync_synchronize();
+    ((volatile journal_header *)seg->header)->sealed = seg->header->used;
+}
+
+/**
+ * Lock journal for writing, or check if it`s locked.
+ *
+ * Open file description locks are used, readers can test them without
+ * taking them, and they are released when the writer dies.
+ *
+ * @param type  F_WRLCK to lock, F_UNLCK to test
+ * @return 1 if the lock is taken or the journal is locked by a writer
+ */
+static int lock_journal(int fd, int type)
+{
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+
+    if (type == F_WRLCK)
+        return fcntl(fd, F_OFD_SETLK, &fl) == 0;
+    return fcntl(fd, F_OFD_GETLK, &fl) == 0 && fl.l_type != F_UNLCK;
+}
+
+/**
+ * Check if a writer holds the journal
+ */
+static int writer_alive(const char *dir)
+{
+    char path[MAXPATHLEN];
+    snprintf(path, MAXPATHLEN, "%s/lock", dir);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    int alive = lock_journal(fd, F_UNLCK);
+    close(fd);
+    return alive;
+}
+
+/**
+ * Seal segments left by a writer which crashed, should be called by
+ * the writer holding the lock
+ */
+static void seal_left(const char *dir)
+{
+    char path[MAXPATHLEN];
+    journal_header header;
+    uint64_t number = 0;
+
+    while (next_segment(dir, number, &number)) {
+        segment_path(dir, number, 0, path);
+        int fd = open(path, O_RDWR | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        if (pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header)
+                && header.magic == JOURNAL_MAGIC && !header.sealed) {
+            header.sealed = header.used;
+            if (pwrite(fd, &header.sealed, sizeof(header.sealed), offsetof(journal_header, sealed))
+                    != (ssize_t)sizeof(header.sealed))
+                SYSWARN("can`t seal journal segment %s", path);
+        }
+        close(fd);
+    }
+}
+
+/**
+ * Map segment file
+ *
+ * @param writable  map for writing, the file is created with .tmp suffix then,
+ *                  so readers don`t see it before its header is written
+ */
+static journal_segment *segment_map(const char *dir, uint64_t number, int writable, size_t size)
+{
+    char path[MAXPATHLEN];
+    struct stat st;
+
+    journal_segment *seg = (journal_segment *)calloc(1, sizeof(journal_segment));
+    if (!seg)
+        throw -1;
+    seg->fd = -1;
+
+    try {
+        segment_path(dir, number, writable, path);
+        seg->fd = writable ? open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)
+                           : open(path, O_RDONLY | O_CLOEXEC);
+        if (seg->fd < 0) {
+            SYSERROR("can`t open journal segment %s", path);
+            throw -1;
+        }
+
+        if (writable) {
+            int err = posix_fallocate(seg->fd, 0, size);
+            if (err) {
+                errno = err;
+                SYSERROR("can`t allocate journal segment %s", path);
+                unlink(path);
+                throw -1;
+            }
+        } else {
+            if (fstat(seg->fd, &st) == -1 || st.st_size < JOURNAL_HEADER) {
+                ERROR("journal segment %s is truncated", path);
+                throw -1;
+            }
+            size = st.st_size;
+        }
+
+        seg->size = size;
+        seg->map = (char *)mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                                MAP_SHARED, seg->fd, 0);
+        if (seg->map == MAP_FAILED) {
+            seg->map = NULL;
+            SYSERROR("can`t map journal segment %s", path);
+            throw -1;
+        }
+        seg->header = (journal_header *)seg->map;
+        seg->records = (saferun_journal_record *)(seg->map + JOURNAL_HEADER);
+
+        if (!writable && (seg->header->magic != JOURNAL_MAGIC
+                || seg->header->record_size != sizeof(saferun_journal_record)
+                || JOURNAL_HEADER + (size_t)seg->header->capacity * sizeof(saferun_journal_record) > size)) {
+            ERROR("bad journal segment %s", path);
+            throw -1;
+        }
+    }
+    catch (...) {
+        segment_free(seg);
+        throw;
+    }
+
+    return seg;
+}
+
+/**
+ * Remove the oldest segments, so only keep of them are left
+ */
+static void remove_old(saferun_journal *journal, uint64_t newest)
+{
+    char path[MAXPATHLEN];
+    uint64_t number = 0;
+
+    if (!journal->keep || newest < (uint64_t)journal->keep)
+        return;
+
+    // segments are numbered without gaps, except of removed ones
+    while (next_segment(journal->dir, number, &number) && number <= newest - journal->keep) {
+        segment_path(journal->dir, number, 0, path);
+        if (unlink(path) == -1)
+            SYSWARN("can`t remove journal segment %s", path);
+    }
+}
+
+/**
+ * Start new segment after the current one.
+ *
+ * Should be called with journal lock held. Full segment is unmapped
+ * when the last record being written to it is done.
+ */
+static void rotate(saferun_journal *journal, uint64_t number)
+{
+    size_t size = journal->segment_size;
+    journal_segment *seg = segment_map(journal->dir, number, 1, size);
+
+    seg->header->magic = JOURNAL_MAGIC;
+    seg->header->record_size = sizeof(saferun_journal_record);
+    seg->header->number = number;
+    seg->header->first_seq = journal->next_seq;
+    seg->header->capacity = (size - JOURNAL_HEADER) / sizeof(saferun_journal_record);
+    seg->header->used = 0;
+
+    char tmp[MAXPATHLEN], path[MAXPATHLEN];
+    segment_path(journal->dir, number, 1, tmp);
+    segment_path(journal->dir, number, 0, path);
+    if (rename(tmp, path) == -1) {
+        SYSERROR("can`t rename journal segment %s", tmp);
+        unlink(tmp);
+        segment_free(seg);
+        throw -1;
+    }
+
+    journal_segment *old = journal->segment;
+    journal->segment = seg;
+    if (old) {
+        old->retired = 1;
+        if (!old->writers) {
+            segment_seal(old);
+            segment_free(old);
+        }
+    }
+
+    remove_old(journal, number);
+}
+
+/**
+ * Open journal for writing, new segment is started.
+ *
+ * Only one process can write a journal, others fail to open it.
+ *
+ * @param dir           directory of journal, created if needed
+ * @param segment_size  size of segment file in bytes
+ * @param keep          segments to keep, older ones are removed, 0 to keep all
+ * @return NULL if errors, or pointer to journal otherwise.
+ */
+saferun_journal *saferun_journal_open(const char *dir, long long segment_size, int keep)
+{
+    char path[MAXPATHLEN];
+
+    if (!dir || segment_size <= 0 || keep < 0)
+        return NULL;
+
+    saferun_journal *journal = (saferun_journal *)calloc(1, sizeof(saferun_journal));
+    if (!journal)
+        return NULL;
+
+    snprintf(journal->dir, MAXPATHLEN, "%s", dir);
+    journal->lock_fd = -1;
+    journal->keep = keep;
+    journal->next_seq = 1;
+    pthread_mutex_init(&journal->lock, NULL);
+
+    // whole pages, so segments are mapped without a tail
+    long page = sysconf(_SC_PAGESIZE);
+    if (segment_size < (long long)JOURNAL_MIN_SEGMENT)
+        segment_size = JOURNAL_MIN_SEGMENT;
+    journal->segment_size = (segment_size + page - 1) / page * page;
+
+    try {
+        if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+            SYSERROR("can`t create journal %s", dir);
+            throw -1;
+        }
+
+        snprintf(path, MAXPATHLEN, "%s/lock", dir);
+        journal->lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (journal->lock_fd < 0 || !lock_journal(journal->lock_fd, F_WRLCK)) {
+            SYSERROR("can`t lock journal %s, is it written by other process?", dir);
+            throw -1;
+        }
+        seal_left(dir);
+
+        // continue numbering after the last segment, it`s not appended to
+        uint64_t last = 0, number = 0;
+        while (next_segment(dir, number, &number))
+            last = number;
+        if (last) {
+            journal_segment *seg = segment_map(dir, last, 0, 0);
+            journal->next_seq = seg->header->first_seq + seg->header->used;
+            segment_free(seg);
+        }
+
+        rotate(journal, last + 1);
+    }
+    catch (...) {
+        saferun_journal_close(journal);
+        return NULL;
+    }
+
+    return journal;
+}
+
+/**
+ * Write all records to disk, so they survive a crash of the host.
+ *
+ * @return -1 on error, 0 otherwise.
+ */
+int saferun_journal_sync(saferun_journal *journal)
+{
+    if (!journal)
+        return -1;
+
+    pthread_mutex_lock(&journal->lock);
+    journal_segment *seg = journal->segment;
+    int ret = msync(seg->map, seg->size, MS_SYNC);
+    pthread_mutex_unlock(&journal->lock);
+
+    if (ret)
+        SYSERROR("can`t sync journal %s", journal->dir);
+    return ret ? -1 : 0;
+}
+
+/**
+ * Close journal, it`s unset first if it`s used for runs.
+ *
+ * @return 0
+ */
+int saferun_journal_close(saferun_journal *journal)
+{
+    if (!journal)
+        return 0;
+
+    pthread_rwlock_wrlock(&current_lock);
+    if (current == journal)
+        current = NULL;
+    pthread_rwlock_unlock(&current_lock);
+
+    // runs using the journal are done, it`s unset
+    if (journal->segment)
+        segment_seal(journal->segment);
+    segment_free(journal->segment);
+    if (journal->lock_fd >= 0)
+        close(journal->lock_fd);
+    pthread_mutex_destroy(&journal->lock);
+    free(journal);
+    return 0;
+}
+
+/**
+ * Set journal for all runs of the process.
+ *
+ * Every saferun_run() appends a record with argv, limits, return
+ * value and statistics of the run. NULL disables journaling.
+ *
+ * @return 0
+ */
+int saferun_set_journal(saferun_journal *journal)
+{
+    pthread_rwlock_wrlock(&current_lock);
+    current = journal;
+    pthread_rwlock_unlock(&current_lock);
+    return 0;
+}
+
+/**
+ * Take slot for a record, rotating the segment if it`s full
+ */
+static journal_segment *reserve(saferun_journal *journal, uint32_t *slot, uint64_t *seq)
+{
+    pthread_mutex_lock(&journal->lock);
+    try {
+        journal_segment *seg = journal->segment;
+        if (seg->header->used == seg->header->capacity)
+            rotate(journal, seg->header->number + 1);
+    }
+    catch (...) {
+        pthread_mutex_unlock(&journal->lock);
+        throw;
+    }
+
+    journal_segment *seg = journal->segment;
+    *slot = seg->header->used++;
+    *seq = journal->next_seq++;
+    ++seg->writers;
+    pthread_mutex_unlock(&journal->lock);
+
+    return seg;
+}
+
+static void release(saferun_journal *journal, journal_segment *seg)
+{
+    pthread_mutex_lock(&journal->lock);
+    if (!--seg->writers && seg->retired) {
+        segment_seal(seg);
+        segment_free(seg);
+    }
+    pthread_mutex_unlock(&journal->lock);
+}
+
+static void fill_record(saferun_journal_record *rec, const saferun_task *task,
+                        const saferun_stat *stat, int ret)
+{
+    memset(rec, 0, sizeof(saferun_journal_record));
+    rec->time = get_rtime();
+    rec->ret = ret;
+    rec->uid = task->jail->uid;
+    rec->gid = task->jail->gid;
+    rec->limits = *task->limits;
+    rec->stat = *stat;
+
+    for (char **arg = task->argv; arg && *arg; ++arg) {
+        ++rec->argc;
+        size_t len = strlen(*arg) + 1;
+        if (rec->argv_len + len > SAFERUN_JOURNAL_ARGV)
+            continue;
+        memcpy(rec->argv + rec->argv_len, *arg, len);
+        rec->argv_len += len;
+    }
+}
+
+/**
+ * Append record of finished run to the journal set by saferun_set_journal()
+ *
+ * Errors are only logged, journal doesn`t fail the run.
+ */
+void journal_append(const saferun_task *task, const saferun_stat *stat, int ret)
+{
+    saferun_journal_record rec;
+
+    pthread_rwlock_rdlock(&current_lock);
+    saferun_journal *journal = current;
+    if (!journal) {
+        pthread_rwlock_unlock(&current_lock);
+        return;
+    }
+
+    try {
+        uint32_t slot;
+        uint64_t seq;
+        fill_record(&rec, task, stat, ret);
+        journal_segment *seg = reserve(journal, &slot, &seq);
+
+        rec.seq = seq;
+        rec.crc = crc32(&rec, offsetof(saferun_journal_record, crc));
+
+        saferun_journal_record *dst = &seg->records[slot];
+        memcpy(dst, &rec, sizeof(rec));
+        // commit must not be seen before the rest of the record
+        __sync_synchronize();
+        ((volatile saferun_journal_record *)dst)->commit = SAFERUN_JOURNAL_COMMIT;
+
+        release(journal, seg);
+    }
+    catch (...) {
+        ERROR("run is not written to journal %s", journal->dir);
+    }
+    pthread_rwlock_unlock(&current_lock);
+}
+
+/**
+ * Open reader of journal.
+ *
+ * The journal can be written meanwhile, records appended later are
+ * read by later saferun_journal_next() calls.
+ *
+ * @param from  seq of the first record to read, 0 to read all
+ * @return NULL if errors, or pointer to reader otherwise.
+ */
+saferun_journal_reader *saferun_journal_reader_open(const char *dir, unsigned long long from)
+{
+    if (!dir)
+        return NULL;
+
+    saferun_journal_reader *reader = (saferun_journal_reader *)calloc(1, sizeof(saferun_journal_reader));
+    if (!reader)
+        return NULL;
+
+    snprintf(reader->dir, MAXPATHLEN, "%s", dir);
+    reader->from = from;
+
+    DIR *d = opendir(dir);
+    if (!d) {
+        SYSERROR("can`t open journal %s", dir);
+        free(reader);
+        return NULL;
+    }
+    closedir(d);
+
+    return reader;
+}
+
+/**
+ * Read next complete record.
+ *
+ * Records with wrong crc, or without commit in sealed segments or after
+ * the writer is gone, are skipped, @see saferun_journal_skipped.
+ * Reading stops at a record being written.
+ *
+ * @return 0 if record is read, 1 if there are no more records now, -1 on error
+ */
+int saferun_journal_next(saferun_journal_reader *reader, saferun_journal_record *record)
+{
+    if (!reader || !record)
+        return -1;
+
+    try {
+        while (1) {
+            journal_segment *seg = reader->segment;
+            uint64_t number;
+
+            if (seg) {
+                uint32_t used = ((volatile journal_header *)seg->header)->used;
+                if (used > seg->header->capacity)
+                    used = seg->header->capacity;
+
+                // segments before from are skipped as a whole
+                if (reader->from > seg->header->first_seq + used && reader->pos < used)
+                    reader->pos = used;
+
+                while (reader->pos < used) {
+                    const saferun_journal_record *rec = &seg->records[reader->pos];
+                    // record without commit can be still written by a slow run
+                    // even if the writer moved to the next segment
+                    if (((volatile saferun_journal_record *)rec)->commit != SAFERUN_JOURNAL_COMMIT
+                            && !((volatile journal_header *)seg->header)->sealed
+                            && writer_alive(reader->dir))
+                        return 1;
+                    __sync_synchronize();
+
+                    ++reader->pos;
+                    if (!record_ok(rec)) {
+                        ++reader->skipped;
+                        continue;
+                    }
+                    if (rec->seq < reader->from)
+                        continue;
+                    *record = *rec;
+                    return 0;
+                }
+            }
+
+            // the segment is done only if the writer moved to the next one,
+            // it could append more records before that
+            if (!next_segment(reader->dir, reader->number, &number))
+                return 1;
+            if (seg && ((volatile journal_header *)seg->header)->used > reader->pos)
+                continue;
+
+            segment_free(reader->segment);
+            reader->segment = NULL;
+            reader->segment = segment_map(reader->dir, number, 0, 0);
+            reader->number = number;
+            reader->pos = 0;
+        }
+    }
+    catch (...) {
+        return -1;
+    }
+}
+
+/**
+ * Get number of torn records skipped by reader
+ */
+long long saferun_journal_skipped(saferun_journal_reader *reader)
+{
+    return reader ? reader->skipped : 0;
+}
+
+/**
+ * Close reader of journal.
+ *
+ * @return 0
+ */
+int saferun_journal_reader_close(saferun_journal_reader *reader)
+{
+    if (!reader)
+        return 0;
+
+    segment_free(reader->segment);
+    free(reader);
+    return 0;
+}
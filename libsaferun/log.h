@@ -22,7 +22,7 @@
 
 #include "log_priorities.h"
 
-#if !NDEBUG || USE_PROFILING 
+#if !NDEBUG
 #define DEFAULT_LOG_PRIORITY SAFERUN_LOG_TRACE;
 #else
 #define DEFAULT_LOG_PRIORITY SAFERUN_LOG_INFO;
@@ -0,0 +1,271 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+#include "log.h"
+
+/*
+ * All metrics are process-wide and updated with atomic builtins,
+ * so runs in different threads never wait for each other here.
+ */
+
+#define RESULT_COUNT 9
+#define BUCKET_COUNT 14
+
+static const char *result_names[RESULT_COUNT] = {
+    "OK", "RE", "TL", "ML", "SV", "OL", "WA", "SK", "IL"
+};
+
+/* Upper bounds of histogram buckets, in microseconds */
+static const long long bucket_bounds[BUCKET_COUNT] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000
+};
+
+struct histogram {
+    const char *name;
+    const char *help;
+    long long buckets[BUCKET_COUNT + 1]; /**< last one is +Inf */
+    long long sum;                       /**< in microseconds */
+};
+
+static long long runs[RESULT_COUNT];
+static long long errors[SAFERUN_PHASE_COUNT];
+static long long in_flight;
+static long long pool_size;
+static long long pool_in_use;
+static long long queued;
+
+static histogram histograms[METRIC_HISTOGRAM_COUNT] = {
+    { "saferun_spawn_seconds",     "Time from saferun_run() call to exec of the task.", {0}, 0 },
+    { "saferun_teardown_seconds",  "Time of cleanup after the task is reaped.", {0}, 0 },
+    { "saferun_detection_seconds", "Upper bound of delay between task exit or limit violation and its detection.", {0}, 0 },
+    { "saferun_queue_seconds",     "Wait for admission before the run.", {0}, 0 },
+};
+
+static long long load(long long *x)
+{
+    return __sync_fetch_and_add(x, 0);
+}
+
+/**
+ * Count the run as in-flight
+ */
+void metrics_run_start()
+{
+    __sync_fetch_and_add(&in_flight, 1);
+}
+
+/**
+ * Account finished run
+ *
+ * @param ret  value returned by saferun_run
+ */
+void metrics_run_finish(const saferun_stat *stat, int ret)
+{
+    __sync_fetch_and_sub(&in_flight, 1);
+
+    if (!ret) {
+        if (stat->result >= 0 && stat->result < RESULT_COUNT)
+            __sync_fetch_and_add(&runs[stat->result], 1);
+
+        long long spawn = 0;
+        for (int i = SAFERUN_PHASE_CGROUP; i <= SAFERUN_PHASE_EXEC; ++i)
+            spawn += stat->phase_time[i];
+        metrics_observe(METRIC_SPAWN, spawn);
+    }
+
+    metrics_observe(METRIC_TEARDOWN, stat->phase_time[SAFERUN_PHASE_TEARDOWN]);
+}
+
+/**
+ * Count library error that happened in phase
+ */
+void metrics_error(saferun_phase phase)
+{
+    if (phase >= 0 && phase < SAFERUN_PHASE_COUNT)
+        __sync_fetch_and_add(&errors[phase], 1);
+}
+
+/**
+ * Change pool gauges by given deltas
+ */
+void metrics_pool(int size, int in_use)
+{
+    __sync_fetch_and_add(&pool_size, size);
+    __sync_fetch_and_add(&pool_in_use, in_use);
+}
+
+/**
+ * Change number of runs waiting for admission by delta
+ */
+void metrics_queue(int queued_delta)
+{
+    __sync_fetch_and_add(&queued, queued_delta);
+}
+
+/**
+ * Fill gauges of remote load, capacity is number of pool instances
+ */
+void metrics_load(saferun_remote_load *remote)
+{
+    remote->in_flight = load(&in_flight);
+    remote->queued = load(&queued);
+    remote->capacity = load(&pool_size);
+}
+
+/**
+ * Add observation to histogram
+ */
+void metrics_observe(metric_histogram h, long long usec)
+{
+    int i = 0;
+    while (i < BUCKET_COUNT && usec > bucket_bounds[i])
+        ++i;
+
+    __sync_fetch_and_add(&histograms[h].buckets[i], 1);
+    __sync_fetch_and_add(&histograms[h].sum, usec);
+}
+
+static int dump_histogram(int fd, histogram *h)
+{
+    long long count = 0;
+
+    if (dprintf(fd, "# HELP %s %s\n# TYPE %s histogram\n", h->name, h->help, h->name) < 0)
+        return -1;
+
+    for (int i = 0; i <= BUCKET_COUNT; ++i) {
+        count += load(&h->buckets[i]);
+        int k = (i < BUCKET_COUNT)
+            ? dprintf(fd, "%s_bucket{le=\"%g\"} %lld\n", h->name, bucket_bounds[i] / 1e6, count)
+            : dprintf(fd, "%s_bucket{le=\"+Inf\"} %lld\n", h->name, count);
+        if (k < 0)
+            return -1;
+    }
+
+    if (dprintf(fd, "%s_sum %g\n%s_count %lld\n", h->name, load(&h->sum) / 1e6, h->name, count) < 0)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * Write all library metrics to fd in Prometheus text exposition format.
+ *
+ * @return -1 on write error, 0 otherwise.
+ */
+int saferun_metrics_dump(int fd)
+{
+    int ret = 0;
+
+    ret |= dprintf(fd, "# HELP saferun_runs_total Finished runs by result.\n"
+                       "# TYPE saferun_runs_total counter\n");
+    for (int i = 0; i < RESULT_COUNT; ++i)
+        ret |= dprintf(fd, "saferun_runs_total{result=\"%s\"} %lld\n", result_names[i], load(&runs[i]));
+
+    ret |= dprintf(fd, "# HELP saferun_errors_total Library errors by phase of the run.\n"
+                       "# TYPE saferun_errors_total counter\n");
+    for (int i = 0; i < SAFERUN_PHASE_COUNT; ++i)
+        ret |= dprintf(fd, "saferun_errors_total{phase=\"%s\"} %lld\n",
+                       saferun_phase_name((saferun_phase)i), load(&errors[i]));
+
+    ret |= dprintf(fd, "# HELP saferun_in_flight Runs in progress.\n"
+                       "# TYPE saferun_in_flight gauge\n"
+                       "saferun_in_flight %lld\n", load(&in_flight));
+
+    ret |= dprintf(fd, "# HELP saferun_queued Runs waiting for admission.\n"
+                       "# TYPE saferun_queued gauge\n"
+                       "saferun_queued %lld\n", load(&queued));
+
+    ret |= dprintf(fd, "# HELP saferun_pool_instances Instances in all pools.\n"
+                       "# TYPE saferun_pool_instances gauge\n"
+                       "saferun_pool_instances %lld\n"
+                       "# HELP saferun_pool_in_use Instances of pools taken by runs.\n"
+                       "# TYPE saferun_pool_in_use gauge\n"
+                       "saferun_pool_in_use %lld\n", load(&pool_size), load(&pool_in_use));
+
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; ++i)
+        ret |= dump_histogram(fd, &histograms[i]);
+
+    if (ret < 0) {
+        SYSERROR("can`t write metrics");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Write metrics to unix socket if path is a socket, or to a file otherwise.
+ *
+ * File is replaced atomically, so a scraper never sees it half-written.
+ *
+ * @return -1 on error, 0 otherwise.
+ */
+int saferun_metrics_write(const char *path)
+{
+    struct stat st;
+    char tmp[MAXPATHLEN];
+    int fd, ret;
+
+    if (!path)
+        return -1;
+
+    if (!stat(path, &st) && S_ISSOCK(st.st_mode)) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+            SYSERROR("can`t connect to %s", path);
+            if (fd >= 0)
+                close(fd);
+            return -1;
+        }
+        ret = saferun_metrics_dump(fd);
+        close(fd);
+        return ret;
+    }
+
+    snprintf(tmp, MAXPATHLEN, "%s.tmp", path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        SYSERROR("can`t open %s", tmp);
+        return -1;
+    }
+
+    ret = saferun_metrics_dump(fd);
+    close(fd);
+
+    if (!ret && rename(tmp, path)) {
+        SYSERROR("can`t rename %s to %s", tmp, path);
+        ret = -1;
+    }
+    if (ret)
+        unlink(tmp);
+
+    return ret;
+}
@@ -0,0 +1,39 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include "saferun.h"
+
+/* Histograms, @see metrics_observe */
+enum metric_histogram {
+    METRIC_SPAWN     = 0, /**< from saferun_run() call to successful exec */
+    METRIC_TEARDOWN  = 1, /**< teardown phase of the run */
+    METRIC_DETECTION = 2, /**< from task exit or limit violation until hypervisor notices it */
+    METRIC_QUEUE     = 3, /**< wait for admission, @see saferun_set_admission */
+    METRIC_HISTOGRAM_COUNT
+};
+
+void metrics_run_start();
+void metrics_run_finish(const saferun_stat *stat, int ret);
+void metrics_error(saferun_phase phase);
+void metrics_observe(metric_histogram h, long long usec);
+void metrics_pool(int size, int in_use);
+void metrics_queue(int queued_delta);
+void metrics_load(saferun_remote_load *remote);
+
+#endif /*_METRICS_H*/
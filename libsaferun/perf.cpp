@@ -0,0 +1,162 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perf.h"
+#include "log.h"
+
+static int perf_event_open(perf_event_attr *attr, int pid, int cpu, unsigned long flags)
+{
+    return syscall(__NR_perf_event_open, attr, pid, cpu, -1, flags);
+}
+
+static void close_counter(perf_counters *pc, int counter)
+{
+    for (int cpu = 0; cpu < pc->ncpus; ++cpu)
+        if (pc->fds[counter][cpu] >= 0) {
+            close(pc->fds[counter][cpu]);
+            pc->fds[counter][cpu] = -1;
+        }
+}
+
+/**
+ * Open counter of one event on all CPUs
+ *
+ * The task can run on any online CPU, so a counter missing on one of
+ * them would count only a part of it. Offline CPUs are skipped.
+ *
+ * @return 0 if the counter can`t be opened on some online CPU, errno is
+ *         set and the counter is closed then, 1 otherwise
+ */
+static int open_counter(perf_counters *pc, int counter, int cgroup_fd, __u32 type, __u64 config)
+{
+    perf_event_attr attr;
+    int opened = 0, failed = 0;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    // only the task itself is counted, kernel work depends on the host too much
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    for (int cpu = 0; cpu < pc->ncpus && !failed; ++cpu) {
+        pc->fds[counter][cpu] = perf_event_open(&attr, cgroup_fd, cpu,
+                                                PERF_FLAG_PID_CGROUP | PERF_FLAG_FD_CLOEXEC);
+        if (pc->fds[counter][cpu] >= 0)
+            ++opened;
+        else if (errno != ENODEV)
+            failed = errno;
+    }
+    if (!failed && pc->ncpus < sysconf(_SC_NPROCESSORS_CONF))
+        failed = ERANGE;
+
+    if (!failed && opened)
+        return 1;
+    if (opened)
+        WARN("perf counter %d can`t be opened on every CPU, it`s not used: %s",
+             counter, strerror(failed));
+    close_counter(pc, counter);
+    errno = failed ? failed : ENODEV;
+    return 0;
+}
+
+/**
+ * Attach counters to cgroup.
+ *
+ * Counts instructions and cycles, if hardware PMU is not available on
+ * every CPU (for example in virtual machine), then only task-clock is counted.
+ *
+ * @param cgroup_path  path to cgroup in perf_event subsystem
+ */
+void perf_open(perf_counters *pc, const char *cgroup_path)
+{
+    for (int i = 0; i < PERF_COUNTER_COUNT; ++i)
+        for (int cpu = 0; cpu < PERF_MAX_CPUS; ++cpu)
+            pc->fds[i][cpu] = -1;
+
+    pc->ncpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (pc->ncpus > PERF_MAX_CPUS)
+        pc->ncpus = PERF_MAX_CPUS;
+
+    int cgroup_fd = open(cgroup_path, O_RDONLY | O_CLOEXEC);
+    if (cgroup_fd < 0) {
+        SYSERROR("can`t open %s", cgroup_path);
+        throw -1;
+    }
+
+    pc->hw = open_counter(pc, PERF_INSTRUCTIONS, cgroup_fd, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS)
+          && open_counter(pc, PERF_CYCLES, cgroup_fd, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    if (!pc->hw) {
+        DEBUG("hardware counters are not available: %s", strerror(errno));
+        close_counter(pc, PERF_INSTRUCTIONS);
+    }
+
+    int sw = open_counter(pc, PERF_TASK_CLOCK, cgroup_fd, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK);
+    close(cgroup_fd);
+
+    if (!pc->hw && !sw) {
+        SYSERROR("can`t open perf counters");
+        perf_close(pc);
+        throw -1;
+    }
+}
+
+/**
+ * Sum counter over all CPUs
+ *
+ * Counter value is scaled if it was multiplexed with other events.
+ */
+static long long read_counter(perf_counters *pc, int counter)
+{
+    long long sum = 0;
+    __u64 v[3]; // value, time enabled, time running
+
+    for (int cpu = 0; cpu < pc->ncpus; ++cpu) {
+        int fd = pc->fds[counter][cpu];
+        if (fd < 0 || read(fd, v, sizeof(v)) != sizeof(v) || !v[2])
+            continue;
+        sum += (v[1] == v[2]) ? v[0] : (long long)((double)v[0] * v[1] / v[2]);
+    }
+
+    return sum;
+}
+
+/**
+ * Read counters to stat
+ */
+void perf_read(perf_counters *pc, saferun_stat *stat)
+{
+    if (pc->hw) {
+        stat->instructions = read_counter(pc, PERF_INSTRUCTIONS);
+        stat->cycles = read_counter(pc, PERF_CYCLES);
+    }
+    stat->task_clock = read_counter(pc, PERF_TASK_CLOCK);
+}
+
+void perf_close(perf_counters *pc)
+{
+    for (int i = 0; i < PERF_COUNTER_COUNT; ++i)
+        close_counter(pc, i);
+}
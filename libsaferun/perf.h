@@ -0,0 +1,49 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _PERF_H
+#define _PERF_H
+
+#include "saferun.h"
+
+/* Max number of CPUs counters are opened on */
+#define PERF_MAX_CPUS 256
+
+/* Counted events */
+enum perf_counter {
+    PERF_INSTRUCTIONS = 0,
+    PERF_CYCLES       = 1,
+    PERF_TASK_CLOCK   = 2,
+    PERF_COUNTER_COUNT
+};
+
+/**
+ * perf_counters - counters attached to task cgroup.
+ *
+ * Cgroup counters are per-CPU only, so there is one fd per CPU
+ * for each event. fd is -1 if it couldn`t be opened.
+ */
+struct perf_counters {
+    int ncpus;
+    int hw; /**< non zero if hardware counters are available */
+    int fds[PERF_COUNTER_COUNT][PERF_MAX_CPUS];
+};
+
+void perf_open(perf_counters *pc, const char *cgroup_path);
+void perf_read(perf_counters *pc, saferun_stat *stat);
+void perf_close(perf_counters *pc);
+
+#endif /*_PERF_H*/
@@ -0,0 +1,72 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <string.h>
+
+#include "saferun.h"
+#include "log.h"
+
+/**
+ * Run steps one by one in the same jail, like compile and then tests.
+ *
+ * All steps share the jail, so files written by a step to its chroot
+ * or working directory are seen by the next ones. Cgroup is created
+ * once for the whole pipeline and only reset between steps, each step
+ * still gets its own limits and statistics.
+ * Pipeline stops on the first step with result other than _OK.
+ *
+ * @param steps  steps to run, in order
+ * @param count  number of steps
+ * @param stats  array of count statistics, one per step
+ *
+ * @return number of steps run, the last of them failed if its result is
+ *         not _OK; -1 on library error.
+ */
+int saferun_pipeline_run(saferun_inst *inst, saferun_jail *jail,
+                         const saferun_step *steps, int count, saferun_stat *stats)
+{
+    if (!inst || !jail || !steps || count <= 0 || !stats)
+        return -1;
+
+    int persistent = inst->persistent;
+    saferun_set_persistent(inst, 1);
+
+    int done = 0;
+    while (done < count) {
+        const saferun_step *step = &steps[done];
+        saferun_task task;
+        memset(&task, 0, sizeof(task));
+        task.jail = jail;
+        task.limits = step->limits;
+        task.argv = step->argv;
+        task.stdin_fd = step->stdin_fd;
+        task.stdout_fd = step->stdout_fd;
+        task.stderr_fd = step->stderr_fd;
+        task.qos = step->qos;
+        task.isolation = step->isolation;
+
+        if (!task.limits || !task.argv || saferun_run(inst, &task, &stats[done])) {
+            ERROR("step %d of pipeline failed", done);
+            done = -1;
+            break;
+        }
+        if (stats[done++].result != _OK)
+            break;
+    }
+
+    saferun_set_persistent(inst, persistent);
+    return done;
+}
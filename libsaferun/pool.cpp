@@ -0,0 +1,190 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/param.h>
+
+#include "saferun.h"
+#include "metrics.h"
+#include "calibrate.h"
+#include "log.h"
+
+/**
+ * saferun_pool - set of persistent instances for concurrent runs.
+ *
+ * Free instances are kept in a stack, so the most recently used
+ * (and the most warm) one is taken first.
+ */
+struct saferun_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+
+    int size;
+    int free_count;
+    saferun_inst **insts; /**< all instances */
+    saferun_inst **free;  /**< stack of free instances */
+};
+
+/**
+ * Create pool of persistent instances.
+ *
+ * Instance cgroups are named "<prefix>-<number>".
+ *
+ * @return NULL if errors, or pointer to pool otherwise.
+ */
+saferun_pool *saferun_pool_create(const char *prefix, int size)
+{
+    char cgname[MAXPATHLEN];
+
+    if (!prefix || size <= 0)
+        return NULL;
+
+    saferun_pool *pool = (saferun_pool *)calloc(1, sizeof(saferun_pool));
+    if (!pool)
+        return NULL;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    pool->insts = (saferun_inst **)calloc(size, sizeof(saferun_inst *));
+    pool->free = (saferun_inst **)calloc(size, sizeof(saferun_inst *));
+    if (!pool->insts || !pool->free) {
+        saferun_pool_destroy(pool);
+        return NULL;
+    }
+
+    for (int i = 0; i < size; ++i) {
+        snprintf(cgname, MAXPATHLEN, "%s-%d", prefix, i);
+        saferun_inst *inst = saferun_init(cgname);
+        if (!inst) {
+            ERROR("can`t create instance %s for pool", cgname);
+            saferun_pool_destroy(pool);
+            return NULL;
+        }
+        saferun_set_persistent(inst, 1);
+        pool->insts[pool->size++] = inst;
+        pool->free[pool->free_count++] = inst;
+        metrics_pool(1, 0);
+    }
+
+    return pool;
+}
+
+/**
+ * Take free instance from pool, waits if there is none.
+ *
+ * Instance is calibrated again here if its calibration is older than
+ * interval, @see saferun_pool_set_calibration
+ */
+saferun_inst *saferun_pool_acquire(saferun_pool *pool)
+{
+    if (!pool)
+        return NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->free_count)
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    saferun_inst *inst = pool->free[--pool->free_count];
+    pthread_mutex_unlock(&pool->lock);
+
+    calibrate_refresh(inst);
+    metrics_pool(0, 1);
+    return inst;
+}
+
+/**
+ * Return instance taken by saferun_pool_acquire() back to pool.
+ */
+void saferun_pool_release(saferun_pool *pool, saferun_inst *inst)
+{
+    if (!pool || !inst)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->free[pool->free_count++] = inst;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    metrics_pool(0, -1);
+}
+
+/**
+ * Set CPU QoS class on all instances of pool.
+ *
+ * @see saferun_set_qos
+ */
+int saferun_pool_set_qos(saferun_pool *pool, const char *name, long cpu_shares, long cpu_quota)
+{
+    if (!pool)
+        return -1;
+
+    for (int i = 0; i < pool->size; ++i)
+        if (saferun_set_qos(pool->insts[i], name, cpu_shares, cpu_quota))
+            return -1;
+    return 0;
+}
+
+/**
+ * Set calibration of all instances of pool.
+ *
+ * Host is calibrated once, other instances take its speed, then each
+ * instance is calibrated again on its own as interval passes.
+ *
+ * @note All instances must be released.
+ * @see saferun_set_calibration
+ */
+int saferun_pool_set_calibration(saferun_pool *pool, double reference, long interval, int normalize)
+{
+    if (!pool)
+        return -1;
+
+    if (saferun_set_calibration(pool->insts[0], reference, interval, normalize))
+        return -1;
+    for (int i = 1; i < pool->size; ++i) {
+        saferun_inst *inst = pool->insts[i];
+        inst->speed = pool->insts[0]->speed;
+        inst->reference = pool->insts[0]->reference;
+        inst->calibrated = pool->insts[0]->calibrated;
+        inst->calibrate_interval = interval;
+        inst->normalize = normalize;
+    }
+    return 0;
+}
+
+/**
+ * Destroy pool and all its instances.
+ *
+ * @note All instances must be released.
+ */
+int saferun_pool_destroy(saferun_pool *pool)
+{
+    if (!pool)
+        return -1;
+
+    for (int i = 0; i < pool->size; ++i)
+        saferun_fini(pool->insts[i]);
+    metrics_pool(-pool->size, 0);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+
+    free(pool->insts);
+    free(pool->free);
+    free(pool);
+    return 0;
+}
@@ -0,0 +1,387 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "profile.h"
+#include "log.h"
+
+/*
+ * Samples are taken by CPU clock on every CPU for the task cgroup,
+ * so they work for any process of the task, in any namespace.
+ * Kernel reports host pids, so memory maps are read from host /proc.
+ * Symbols are read through /proc/<pid>/map_files while the process is
+ * alive, so they come from the mapped files themselves. Paths in maps are
+ * chosen by the task and can lead to any file of the host by the end
+ * of the run, they are used only as names.
+ */
+
+static int perf_event_open(perf_event_attr *attr, int pid, int cpu, unsigned long flags)
+{
+    return syscall(__NR_perf_event_open, attr, pid, cpu, -1, flags);
+}
+
+/**
+ * Attach sampling counters to cgroup.
+ *
+ * @param cgroup_path  path to cgroup in perf_event subsystem
+ * @param freq         samples per second, clamped to PROFILE_MAX_FREQ
+ */
+void profile_open(profiler *prof, const char *cgroup_path, int freq)
+{
+    perf_event_attr attr;
+    int opened = 0;
+
+    memset(prof, 0, sizeof(profiler));
+    for (int cpu = 0; cpu < PERF_MAX_CPUS; ++cpu)
+        prof->fds[cpu] = -1;
+
+    prof->ncpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (prof->ncpus > PERF_MAX_CPUS)
+        prof->ncpus = PERF_MAX_CPUS;
+    prof->ring_size = (1 + PROFILE_RING_PAGES) * sysconf(_SC_PAGESIZE);
+
+    prof->stacks = (profile_stack *) calloc(PROFILE_MAX_STACKS, sizeof(profile_stack));
+    if (!prof->stacks)
+        throw -1;
+
+    int cgroup_fd = open(cgroup_path, O_RDONLY | O_CLOEXEC);
+    if (cgroup_fd < 0) {
+        SYSERROR("can`t open %s", cgroup_path);
+        profile_close(prof);
+        throw -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    // CPU clock works without hardware PMU, e.g. in virtual machines
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = PERF_COUNT_SW_CPU_CLOCK;
+    attr.freq = 1;
+    attr.sample_freq = freq > PROFILE_MAX_FREQ ? PROFILE_MAX_FREQ : freq;
+    attr.sample_type = PERF_SAMPLE_TID | PERF_SAMPLE_CALLCHAIN;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.exclude_callchain_kernel = 1;
+    attr.sample_max_stack = PROFILE_MAX_DEPTH;
+    attr.wakeup_events = 0;
+
+    for (int cpu = 0; cpu < prof->ncpus; ++cpu) {
+        int fd = perf_event_open(&attr, cgroup_fd, cpu, PERF_FLAG_PID_CGROUP | PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0)
+            continue;
+        void *ring = mmap(NULL, prof->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (ring == MAP_FAILED) {
+            close(fd);
+            continue;
+        }
+        prof->fds[cpu] = fd;
+        prof->rings[cpu] = ring;
+        ++opened;
+    }
+    close(cgroup_fd);
+
+    if (!opened) {
+        SYSERROR("can`t open sampling counters");
+        profile_close(prof);
+        throw -1;
+    }
+}
+
+/**
+ * Load symbols of the file mapped at start-end in the process
+ */
+static void load_module(profile_module *mod, pid_t pid, unsigned long long start,
+                        unsigned long long end)
+{
+    char path[96];
+
+    snprintf(path, sizeof(path), "/proc/%d/map_files/%llx-%llx", pid, start, end);
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    elf_symbols_load(fd, &mod->syms);
+    close(fd);
+}
+
+/**
+ * Read memory maps and name of process, load symbols of new modules
+ *
+ * @return NULL if the process is gone or too many processes
+ */
+static profile_proc *load_proc(profiler *prof, pid_t pid)
+{
+    char path[64], line[MAXPATHLEN + 128];
+
+    if (prof->nprocs == PROFILE_MAX_PROCS)
+        return NULL;
+
+    snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return NULL;
+
+    profile_proc *proc = &prof->procs[prof->nprocs];
+    memset(proc, 0, sizeof(profile_proc));
+    proc->pid = pid;
+
+    int capacity = 0;
+    while (fgets(line, sizeof(line), file)) {
+        unsigned long long start, end, offset;
+        char perms[8], name[MAXPATHLEN];
+        name[0] = '\0';
+        if (sscanf(line, "%llx-%llx %7s %llx %*s %*s %4095s", &start, &end, perms, &offset, name) < 4
+                || perms[2] != 'x' || name[0] != '/')
+            continue;
+
+        int module = 0;
+        while (module < prof->nmodules && strcmp(prof->modules[module].path, name))
+            ++module;
+        if (module == prof->nmodules) {
+            if (module == PROFILE_MAX_MODULES)
+                continue;
+            prof->modules[module].path = strdup(name);
+            load_module(&prof->modules[module], pid, start, end);
+            ++prof->nmodules;
+        }
+
+        if (proc->nmaps == capacity) {
+            capacity = capacity ? capacity * 2 : 32;
+            profile_map *maps = (profile_map *) realloc(proc->maps, capacity * sizeof(profile_map));
+            if (!maps)
+                break;
+            proc->maps = maps;
+        }
+        profile_map *m = &proc->maps[proc->nmaps++];
+        m->start = start;
+        m->end = end;
+        m->offset = offset;
+        m->module = module;
+    }
+    fclose(file);
+
+    snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+    file = fopen(path, "r");
+    if (file) {
+        if (fgets(proc->comm, sizeof(proc->comm), file))
+            proc->comm[strcspn(proc->comm, "\n")] = '\0';
+        fclose(file);
+    }
+    if (!proc->comm[0])
+        snprintf(proc->comm, sizeof(proc->comm), "%d", pid);
+
+    ++prof->nprocs;
+    return proc;
+}
+
+static profile_proc *find_proc(profiler *prof, pid_t pid)
+{
+    for (int i = 0; i < prof->nprocs; ++i)
+        if (prof->procs[i].pid == pid)
+            return &prof->procs[i];
+    return NULL;
+}
+
+/**
+ * Count one sample in the stacks table
+ */
+static void add_sample(profiler *prof, pid_t pid, const uint64_t *ips, uint64_t nr)
+{
+    uint64_t frames[PROFILE_MAX_DEPTH];
+    int depth = 0;
+
+    for (uint64_t i = 0; i < nr && depth < PROFILE_MAX_DEPTH; ++i)
+        if (ips[i] < PERF_CONTEXT_MAX) // skip context markers
+            frames[depth++] = ips[i];
+    if (!depth)
+        return;
+
+    // maps are read while the process is alive, it can be gone at write
+    if (!find_proc(prof, pid))
+        load_proc(prof, pid);
+
+    uint64_t h = pid;
+    for (int i = 0; i < depth; ++i)
+        h = (h ^ frames[i]) * 0x100000001b3ULL;
+
+    for (int i = 0; i < PROFILE_MAX_STACKS; ++i) {
+        profile_stack *s = &prof->stacks[(h + i) % PROFILE_MAX_STACKS];
+        if (!s->count) {
+            s->pid = pid;
+            s->depth = depth;
+            memcpy(s->ips, frames, depth * sizeof(uint64_t));
+            s->count = 1;
+            return;
+        }
+        if (s->pid == pid && s->depth == depth && !memcmp(s->ips, frames, depth * sizeof(uint64_t))) {
+            ++s->count;
+            return;
+        }
+        // table is full enough, new stacks aren`t worth longer probing
+        if (i == 64)
+            break;
+    }
+    ++prof->other;
+}
+
+/**
+ * Read all samples from ring buffer of one CPU
+ */
+static void drain_ring(profiler *prof, void *ring)
+{
+    perf_event_mmap_page *meta = (perf_event_mmap_page *) ring;
+    char *data = (char *) ring + sysconf(_SC_PAGESIZE);
+    uint64_t data_size = prof->ring_size - sysconf(_SC_PAGESIZE);
+    char record[sizeof(perf_event_header) + 16 + 8 * (PROFILE_MAX_DEPTH + 8)];
+
+    uint64_t head = meta->data_head;
+    __sync_synchronize();
+    uint64_t tail = meta->data_tail;
+
+    while (tail + sizeof(perf_event_header) <= head) {
+        perf_event_header header;
+        for (size_t i = 0; i < sizeof(header); ++i)
+            ((char *) &header)[i] = data[(tail + i) % data_size];
+        if (!header.size)
+            break;
+
+        if (header.size <= sizeof(record)) {
+            for (size_t i = 0; i < header.size; ++i)
+                record[i] = data[(tail + i) % data_size];
+
+            if (header.type == PERF_RECORD_SAMPLE) {
+                // u32 pid, u32 tid, u64 nr, u64 ips[nr]
+                uint32_t pid;
+                uint64_t nr;
+                memcpy(&pid, record + sizeof(header), sizeof(pid));
+                memcpy(&nr, record + sizeof(header) + 8, sizeof(nr));
+                if (sizeof(header) + 16 + nr * 8 <= header.size)
+                    add_sample(prof, pid, (const uint64_t *) (record + sizeof(header) + 16), nr);
+            } else if (header.type == PERF_RECORD_LOST) {
+                uint64_t lost;
+                memcpy(&lost, record + sizeof(header) + 8, sizeof(lost));
+                prof->lost += lost;
+            }
+        }
+        tail += header.size;
+    }
+
+    __sync_synchronize();
+    meta->data_tail = tail;
+}
+
+/**
+ * Move samples from ring buffers to stacks table.
+ *
+ * Called by hypervisor on every check, so buffers don`t overflow.
+ */
+void profile_drain(profiler *prof)
+{
+    for (int cpu = 0; cpu < prof->ncpus; ++cpu)
+        if (prof->rings[cpu])
+            drain_ring(prof, prof->rings[cpu]);
+}
+
+/**
+ * Write one frame as function+offset, or module+offset if there are no symbols
+ */
+static int write_frame(profiler *prof, FILE *out, const profile_proc *proc, uint64_t ip)
+{
+    for (int i = 0; proc && i < proc->nmaps; ++i) {
+        const profile_map *m = &proc->maps[i];
+        if (ip < m->start || ip >= m->end)
+            continue;
+
+        const profile_module *mod = &prof->modules[m->module];
+        uint64_t offset = ip - m->start + m->offset, sym_offset;
+        const char *name = elf_symbols_lookup(&mod->syms, offset, &sym_offset);
+        const char *base = strrchr(mod->path, '/');
+        base = base ? base + 1 : mod->path;
+        if (name)
+            return fprintf(out, "%s", name);
+        return fprintf(out, "%s+0x%llx", base, (unsigned long long) offset);
+    }
+    return fprintf(out, "0x%llx", (unsigned long long) ip);
+}
+
+/**
+ * Write collected stacks in folded format: "comm;outer;...;leaf count".
+ *
+ * The output can be passed to flamegraph.pl or speedscope as is.
+ */
+void profile_write(profiler *prof, int fd)
+{
+    int dup_fd = dup(fd);
+    FILE *out = dup_fd >= 0 ? fdopen(dup_fd, "w") : NULL;
+    if (!out) {
+        SYSERROR("can`t write profile");
+        if (dup_fd >= 0)
+            close(dup_fd);
+        throw -1;
+    }
+
+    for (int i = 0; i < PROFILE_MAX_STACKS; ++i) {
+        const profile_stack *s = &prof->stacks[i];
+        if (!s->count)
+            continue;
+        const profile_proc *proc = find_proc(prof, s->pid);
+        fprintf(out, "%s", proc ? proc->comm : "[unknown]");
+        for (int j = s->depth - 1; j >= 0; --j) {
+            fputc(';', out);
+            write_frame(prof, out, proc, s->ips[j]);
+        }
+        fprintf(out, " %llu\n", (unsigned long long) s->count);
+    }
+    if (prof->other)
+        fprintf(out, "[other] %llu\n", (unsigned long long) prof->other);
+    if (prof->lost)
+        fprintf(out, "[lost] %llu\n", (unsigned long long) prof->lost);
+
+    if (fclose(out)) {
+        SYSERROR("can`t write profile");
+        throw -1;
+    }
+}
+
+void profile_close(profiler *prof)
+{
+    for (int cpu = 0; cpu < prof->ncpus; ++cpu) {
+        if (prof->rings[cpu])
+            munmap(prof->rings[cpu], prof->ring_size);
+        if (prof->fds[cpu] >= 0)
+            close(prof->fds[cpu]);
+        prof->rings[cpu] = NULL;
+        prof->fds[cpu] = -1;
+    }
+    for (int i = 0; i < prof->nprocs; ++i)
+        free(prof->procs[i].maps);
+    for (int i = 0; i < prof->nmodules; ++i) {
+        elf_symbols_free(&prof->modules[i].syms);
+        free(prof->modules[i].path);
+    }
+    prof->nprocs = prof->nmodules = 0;
+    free(prof->stacks);
+    prof->stacks = NULL;
+}
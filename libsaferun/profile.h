@@ -0,0 +1,83 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _PROFILE_H
+#define _PROFILE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "saferun.h"
+#include "perf.h"
+#include "symbols.h"
+
+/* Sampling profiler limits, they bound its memory and time overhead */
+#define PROFILE_MAX_FREQ    4999  /**< samples per second per CPU */
+#define PROFILE_MAX_DEPTH   64    /**< frames recorded per sample */
+#define PROFILE_MAX_STACKS  4096  /**< distinct stacks, others are counted as [other] */
+#define PROFILE_MAX_PROCS   64    /**< processes, whose memory maps are remembered */
+#define PROFILE_MAX_MODULES 128   /**< executables and libraries, whose symbols are loaded */
+#define PROFILE_RING_PAGES  16    /**< data pages of ring buffer per CPU, power of 2 */
+
+struct profile_stack {
+    uint64_t count;     /**< zero if the slot is empty */
+    pid_t pid;
+    int depth;
+    uint64_t ips[PROFILE_MAX_DEPTH]; /**< leaf first */
+};
+
+struct profile_map {
+    uint64_t start, end, offset;
+    int module;
+};
+
+struct profile_proc {
+    pid_t pid;
+    char comm[16];
+    int nmaps;
+    profile_map *maps;
+};
+
+struct profile_module {
+    char *path;       /**< as in memory maps, only a name */
+    elf_symbols syms; /**< loaded when the module is first seen */
+};
+
+/**
+ * Sampling profiler attached to task cgroup.
+ */
+struct profiler {
+    int ncpus;
+    int fds[PERF_MAX_CPUS];
+    void *rings[PERF_MAX_CPUS];
+    size_t ring_size;
+
+    profile_stack *stacks;   /**< hash table of PROFILE_MAX_STACKS */
+    uint64_t other;          /**< samples, that didn`t fit to stacks */
+    uint64_t lost;           /**< samples lost by kernel, ring buffer was full */
+
+    int nprocs;
+    profile_proc procs[PROFILE_MAX_PROCS];
+    int nmodules;
+    profile_module modules[PROFILE_MAX_MODULES];
+};
+
+void profile_open(profiler *prof, const char *cgroup_path, int freq);
+void profile_drain(profiler *prof);
+void profile_write(profiler *prof, int fd);
+void profile_close(profiler *prof);
+
+#endif /*_PROFILE_H */
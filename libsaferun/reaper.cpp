@@ -0,0 +1,346 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/param.h>
+
+#include "saferun.h"
+#include "cgroup.h"
+#include "reaper.h"
+#include "utils.h"
+#include "log.h"
+
+/* Max dead cgroups waiting for removal, runs wait for a free slot beyond it */
+#define REAPER_QUEUE 64
+/* rmdir fails until killed processes exit, so it`s tried again */
+#define REAPER_TRIES 100
+#define REAPER_DELAY (10*1000*1000) //in nanosec
+/* Max dead cgroups collected by one saferun_init() */
+#define REAPER_COLLECT 256
+
+/* Fields of saferun_inst holding cgroup paths, empty ones are not mounted */
+static const size_t path_fields[] = {
+    offsetof(saferun_inst, cpuacct_path),
+    offsetof(saferun_inst, devices_path),
+    offsetof(saferun_inst, memory_path),
+    offsetof(saferun_inst, blkio_path),
+    offsetof(saferun_inst, cpu_path),
+    offsetof(saferun_inst, perf_event_path),
+    offsetof(saferun_inst, freezer_path),
+};
+#define PATH_FIELDS ((int) (sizeof(path_fields) / sizeof(path_fields[0])))
+#define PATH(inst, i) ((char *) (inst) + path_fields[i])
+
+/*
+ * Dead cgroups are kept as copies of their instance with paths of the
+ * renamed cgroups, so the instance can make new ones at once.
+ */
+static saferun_inst *queue[REAPER_QUEUE];
+static int queue_first = 0;
+static int queue_count = 0;
+static saferun_inst *current = NULL; /**< being removed by reaper thread */
+static unsigned seq = 0;
+static int started = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER; /**< wakes reaper thread */
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;   /**< wakes runs waiting for a slot and drains */
+
+/**
+ * Kill processes of dead cgroup and remove it.
+ *
+ * Processes forked while tasks files are read are killed on the next try.
+ * Frozen processes can`t die, so freezer cgroup is thawed.
+ */
+static void reap(saferun_inst *dead)
+{
+    timespec delay;
+    delay.tv_sec = 0;
+    delay.tv_nsec = REAPER_DELAY;
+
+    for (int i = 0; i < PATH_FIELDS; ++i)
+        if (PATH(dead, i)[0] && access(PATH(dead, i), F_OK))
+            PATH(dead, i)[0] = '\0';
+
+    for (int t = 0; t < REAPER_TRIES; ++t) {
+        int left = 0;
+        for (int i = 0; i < PATH_FIELDS; ++i) {
+            const char *path = PATH(dead, i);
+            if (!path[0])
+                continue;
+            try {
+                cgroup_kill(path, SIGKILL);
+                if (path == dead->freezer_path)
+                    cgroup_freeze(path, 0);
+            } catch (...) {}
+        }
+        for (int i = 0; i < PATH_FIELDS; ++i) {
+            const char *path = PATH(dead, i);
+            if (path[0] && rmdir(path) && errno != ENOENT)
+                ++left;
+        }
+        if (!left)
+            return;
+        nanosleep(&delay, NULL);
+    }
+    WARN("cgroup of %s is not removed, saferun_init() of it will try again", dead->cgname);
+}
+
+static void *reaper(void *)
+{
+    pthread_mutex_lock(&lock);
+    while (1) {
+        while (!queue_count)
+            pthread_cond_wait(&queued, &lock);
+        current = queue[queue_first];
+        queue_first = (queue_first + 1) % REAPER_QUEUE;
+        --queue_count;
+        pthread_cond_broadcast(&done);
+        pthread_mutex_unlock(&lock);
+
+        reap(current);
+
+        free(current);
+
+        pthread_mutex_lock(&lock);
+        current = NULL;
+        pthread_cond_broadcast(&done);
+    }
+    return NULL;
+}
+
+/**
+ * Start reaper thread, if it`s not running.
+ *
+ * Should be called with lock held. Signals are blocked in the thread,
+ * so they are delivered to threads of the application.
+ *
+ * @return 0 if reaper can`t be started
+ */
+static int start_reaper()
+{
+    if (started)
+        return 1;
+
+    pthread_t thread;
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    started = !pthread_create(&thread, NULL, reaper, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (!started) {
+        ERROR("can`t start reaper thread, cgroups are removed at once");
+        return 0;
+    }
+    pthread_detach(thread);
+    return 1;
+}
+
+/**
+ * Hand dead cgroup to reaper, waits while the queue is full.
+ *
+ * Without reaper thread cgroup is removed right here.
+ */
+static void enqueue(saferun_inst *dead)
+{
+    pthread_mutex_lock(&lock);
+    if (!start_reaper()) {
+        pthread_mutex_unlock(&lock);
+        reap(dead);
+        free(dead);
+        return;
+    }
+    if (queue_count == REAPER_QUEUE)
+        DEBUG("reaper is behind, %s waits for it", dead->cgname);
+    while (queue_count == REAPER_QUEUE)
+        pthread_cond_wait(&done, &lock);
+    queue[(queue_first + queue_count++) % REAPER_QUEUE] = dead;
+    pthread_cond_signal(&queued);
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Remove cgroup of the instance in background.
+ *
+ * Processes of the task are killed by the caller, reaper kills again
+ * ones missed by it. Cgroup is renamed to "<cgname>.dead.<pid>.<seq>"
+ * in every subsystem, which is quick, and the next run of the instance
+ * makes a new one.
+ * Page cache of a big memory cgroup is uncharged on rmdir, which can
+ * take hundreds of milliseconds, so the run returns before it.
+ * If cgroup can`t be renamed, it`s removed at once.
+ */
+void reaper_defer(const saferun_inst *inst)
+{
+    saferun_inst *dead = (saferun_inst *) malloc(sizeof(saferun_inst));
+    if (!dead) {
+        ERROR("no memory for dead cgroup of %s", inst->cgname);
+        throw -1;
+    }
+    *dead = *inst;
+
+    pthread_mutex_lock(&lock);
+    unsigned n = seq++;
+    pthread_mutex_unlock(&lock);
+
+    int renamed = 0, failed = 0;
+    for (int i = 0; i < PATH_FIELDS; ++i) {
+        const char *from = PATH(inst, i);
+        if (!from[0])
+            continue;
+
+        // subsystems mounted together share the directory
+        int j = 0;
+        while (j < i && strcmp(from, PATH(inst, j)))
+            ++j;
+        if (j < i) {
+            strcpy(PATH(dead, i), PATH(dead, j));
+            continue;
+        }
+
+        snprintf(PATH(dead, i), MAXPATHLEN, "%s.dead.%d.%u", from, getpid(), n);
+        if (!rename(from, PATH(dead, i))) {
+            renamed = 1;
+        } else if (errno == ENOENT) {
+            PATH(dead, i)[0] = '\0';
+        } else {
+            SYSWARN("can`t rename cgroup %s, removing it at once", from);
+            strcpy(PATH(dead, i), from);
+            failed = 1;
+        }
+    }
+
+    if (failed) {
+        reap(dead);
+        free(dead);
+    } else if (renamed) {
+        enqueue(dead);
+    } else {
+        free(dead);
+    }
+}
+
+/**
+ * Wait until reaper removed all dead cgroups of the instance.
+ *
+ * Processes left by tasks are killed by then.
+ */
+void reaper_drain(const saferun_inst *inst)
+{
+    pthread_mutex_lock(&lock);
+    while (1) {
+        int pending = current && !strcmp(current->cgname, inst->cgname);
+        for (int k = 0; k < queue_count && !pending; ++k)
+            pending = !strcmp(queue[(queue_first + k) % REAPER_QUEUE]->cgname, inst->cgname);
+        if (!pending)
+            break;
+        pthread_cond_wait(&done, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Collect names of dead cgroups of the instance in directory of one
+ * subsystem, whose process is gone.
+ *
+ * @return new count of names
+ */
+static int collect_dir(const char *path, char (*names)[NAME_MAX + 1], int count)
+{
+    char dir[MAXPATHLEN], prefix[NAME_MAX + 8];
+
+    const char *base = strrchr(path, '/');
+    if (!base)
+        return count;
+    snprintf(dir, sizeof(dir), "%.*s", (int) (base - path), path);
+    snprintf(prefix, sizeof(prefix), "%s.dead.", base + 1);
+    size_t len = strlen(prefix);
+
+    DIR *d = opendir(dir);
+    if (!d)
+        return count;
+    dirent *entry;
+    while ((entry = readdir(d)) && count < REAPER_COLLECT) {
+        int pid;
+        if (strncmp(entry->d_name, prefix, len) || sscanf(entry->d_name + len, "%d.", &pid) != 1)
+            continue;
+        if (!kill(pid, 0) || errno != ESRCH)
+            continue;
+
+        int known = 0;
+        for (int k = 0; k < count && !known; ++k)
+            known = !strcmp(names[k], entry->d_name);
+        if (!known)
+            snprintf(names[count++], NAME_MAX + 1, "%s", entry->d_name);
+    }
+    closedir(d);
+    return count;
+}
+
+/**
+ * Remove cgroups left by a supervisor which crashed.
+ *
+ * Cgroup of the instance itself is left if it crashed during a run or
+ * had a persistent instance, its processes could be counted in the next
+ * run. Dead cgroups are left if it crashed before reaper removed them.
+ * Names of cgroups are unique per instance, so cgroups of live instances
+ * of other processes are not touched. Both are removed by reaper.
+ */
+void reaper_collect(const saferun_inst *inst)
+{
+    int left = 0;
+    for (int i = 0; i < PATH_FIELDS; ++i)
+        if (PATH(inst, i)[0] && !access(PATH(inst, i), F_OK))
+            left = 1;
+    if (left) {
+        WARN("cgroup %s is left by previous supervisor, removing it", inst->cgname);
+        try {
+            reaper_defer(inst);
+        } catch (...) {}
+    }
+
+    char (*names)[NAME_MAX + 1] = (char (*)[NAME_MAX + 1]) malloc(REAPER_COLLECT * (NAME_MAX + 1));
+    if (!names)
+        return;
+    int count = 0;
+    for (int i = 0; i < PATH_FIELDS; ++i)
+        if (PATH(inst, i)[0])
+            count = collect_dir(PATH(inst, i), names, count);
+
+    for (int k = 0; k < count; ++k) {
+        saferun_inst *dead = (saferun_inst *) malloc(sizeof(saferun_inst));
+        if (!dead)
+            break;
+        *dead = *inst;
+        for (int i = 0; i < PATH_FIELDS; ++i) {
+            char *path = PATH(dead, i);
+            char *base = strrchr(path, '/');
+            if (path[0] && base)
+                snprintf(base + 1, MAXPATHLEN - (base + 1 - path), "%s", names[k]);
+        }
+        DEBUG("removing dead cgroup %s", names[k]);
+        enqueue(dead);
+    }
+    free(names);
+}
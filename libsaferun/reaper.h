@@ -0,0 +1,26 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _REAPER_H
+#define _REAPER_H
+
+#include "saferun.h"
+
+void reaper_defer(const saferun_inst *inst);
+void reaper_drain(const saferun_inst *inst);
+void reaper_collect(const saferun_inst *inst);
+
+#endif /*_REAPER_H */
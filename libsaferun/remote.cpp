@@ -0,0 +1,1522 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "remote.h"
+#include "sha256.h"
+#include "metrics.h"
+#include "admission.h"
+#include "log.h"
+
+/* Prefix of TCP addresses, like "tcp:host:port", other addresses are unix socket paths */
+#define TCP_PREFIX "tcp:"
+/* Peer not finishing TCP handshake in this time is dropped, in seconds */
+#define AUTH_TIMEOUT 10
+
+/*
+ * Key of TCP connections, digest of the shared secret file.
+ * Peers over TCP have no credentials, so both ends prove they know it.
+ */
+static unsigned char secret_key[SHA256_SIZE];
+static int secret_set = 0;
+static pthread_mutex_t secret_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void put(remote_buf *b, const void *p, size_t n)
+{
+    if (b->header.length + n > REMOTE_MAX_SIZE) {
+        ERROR("remote message is too long");
+        throw -1;
+    }
+    memcpy(b->data + b->header.length, p, n);
+    b->header.length += n;
+}
+
+static void put_u32(remote_buf *b, uint32_t x)
+{
+    put(b, &x, sizeof(x));
+}
+
+/* Strings are sent with terminating zero, so they can be used right in buffer */
+static void put_str(remote_buf *b, const char *s)
+{
+    put_u32(b, s ? strlen(s) + 1 : 0);
+    if (s)
+        put(b, s, strlen(s) + 1);
+}
+
+static void get(remote_buf *b, void *p, size_t n)
+{
+    if (b->pos + n > b->header.length) {
+        ERROR("remote message is truncated");
+        throw -1;
+    }
+    memcpy(p, b->data + b->pos, n);
+    b->pos += n;
+}
+
+static uint32_t get_u32(remote_buf *b)
+{
+    uint32_t x;
+    get(b, &x, sizeof(x));
+    return x;
+}
+
+static char *get_str(remote_buf *b)
+{
+    uint32_t len = get_u32(b);
+    if (!len)
+        return NULL;
+
+    char *s = b->data + b->pos;
+    if (b->pos + len > b->header.length || s[len - 1]) {
+        ERROR("bad string in remote message");
+        throw -1;
+    }
+    b->pos += len;
+    return s;
+}
+
+static void write_full(int sock, const char *p, size_t n)
+{
+    while (n) {
+        ssize_t k = send(sock, p, n, MSG_NOSIGNAL);
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k <= 0) {
+            SYSERROR("can`t send remote message");
+            throw -1;
+        }
+        p += k;
+        n -= k;
+    }
+}
+
+/**
+ * Read exactly n bytes
+ *
+ * @return 0 if connection is closed before first byte, 1 otherwise
+ */
+static int read_full(int sock, char *p, size_t n)
+{
+    size_t done = 0;
+    while (done < n) {
+        ssize_t k = recv(sock, p + done, n - done, 0);
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k == 0 && done == 0)
+            return 0;
+        if (k <= 0) {
+            SYSERROR("can`t receive remote message");
+            throw -1;
+        }
+        done += k;
+    }
+    return 1;
+}
+
+/**
+ * Send message, its payload follows the header, with fds attached
+ */
+void remote_send_msg(int sock, remote_header *msg_header, const int *fds, int nfds)
+{
+    char cbuf[CMSG_SPACE(3 * sizeof(int))];
+    struct msghdr msg;
+    struct iovec iov;
+    size_t total = sizeof(remote_header) + msg_header->length;
+
+    msg_header->magic = REMOTE_MAGIC;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = msg_header;
+    iov.iov_len = total;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (nfds) {
+        int domain;
+        socklen_t len = sizeof(domain);
+        if (getsockopt(sock, SOL_SOCKET, SO_DOMAIN, &domain, &len) || domain != AF_UNIX) {
+            ERROR("stdio fds can`t be passed over TCP, stdio paths must be sent");
+            throw -1;
+        }
+
+        msg.msg_control = cbuf;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+
+    ssize_t k;
+    do {
+        k = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (k < 0 && errno == EINTR);
+
+    if (k <= 0) {
+        SYSERROR("can`t send remote message");
+        throw -1;
+    }
+
+    // fds went with the first byte, the rest is plain data
+    write_full(sock, (const char *)msg_header + k, total - k);
+}
+
+/**
+ * Check header of received message before its payload is read
+ */
+void remote_check_header(const remote_header *header)
+{
+    if (header->magic != REMOTE_MAGIC || header->length > REMOTE_MAX_SIZE) {
+        ERROR("bad remote message");
+        throw -1;
+    }
+}
+
+/**
+ * Send as much of message as socket takes without blocking.
+ *
+ * fds are attached to the first byte, so they must be given only
+ * with the beginning of message.
+ *
+ * @return number of bytes sent, 0 if socket buffer is full
+ */
+size_t remote_send_some(int sock, const char *p, size_t n, const int *fds, int nfds)
+{
+    char cbuf[CMSG_SPACE(3 * sizeof(int))];
+    struct msghdr msg;
+    struct iovec iov;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void *)p;
+    iov.iov_len = n;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (nfds) {
+        msg.msg_control = cbuf;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+
+    ssize_t k;
+    do {
+        k = sendmsg(sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while (k < 0 && errno == EINTR);
+
+    if (k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    if (k <= 0) {
+        SYSERROR("can`t send remote message");
+        throw -1;
+    }
+    return k;
+}
+
+/**
+ * Receive message to b, attached fds are written to fds
+ *
+ * @return 0 if connection is closed, 1 otherwise
+ */
+int remote_recv_msg(int sock, remote_buf *b, int *fds, int *nfds)
+{
+    char cbuf[CMSG_SPACE(3 * sizeof(int))];
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t k;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &b->header;
+    iov.iov_len = sizeof(remote_header);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    do {
+        k = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (k < 0 && errno == EINTR);
+
+    if (k == 0)
+        return 0;
+    if (k < 0) {
+        SYSERROR("can`t receive remote message");
+        throw -1;
+    }
+
+    *nfds = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds + *nfds, CMSG_DATA(cmsg), n * sizeof(int));
+        *nfds += n;
+    }
+
+    try {
+        if (msg.msg_flags & MSG_CTRUNC) {
+            ERROR("too many fds in remote message");
+            throw -1;
+        }
+
+        if (k < (ssize_t)sizeof(remote_header)
+                && !read_full(sock, (char *)&b->header + k, sizeof(remote_header) - k)) {
+            ERROR("remote message is truncated");
+            throw -1;
+        }
+
+        remote_check_header(&b->header);
+
+        if (b->header.length && !read_full(sock, b->data, b->header.length)) {
+            ERROR("remote message is truncated");
+            throw -1;
+        }
+    }
+    catch (...) {
+        for (int i = 0; i < *nfds; ++i)
+            close(fds[i]);
+        *nfds = 0;
+        throw;
+    }
+
+    b->pos = 0;
+    return 1;
+}
+
+/**
+ * Check if address is a path to unix socket, not a TCP address
+ */
+int remote_is_unix(const char *address)
+{
+    return strncmp(address, TCP_PREFIX, strlen(TCP_PREFIX)) != 0;
+}
+
+/**
+ * Fill sockaddr for unix socket at path
+ */
+static void unix_address(const char *path, struct sockaddr_un *addr)
+{
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        ERROR("bad socket path");
+        throw -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+}
+
+/**
+ * Resolve "tcp:host:port" address.
+ *
+ * IPv6 host is written in brackets, like "tcp:[::1]:7000".
+ * Empty host means loopback, all addresses must be asked for explicitly,
+ * like "tcp:0.0.0.0:7000".
+ *
+ * @return list to be freed with freeaddrinfo()
+ */
+static struct addrinfo *tcp_address(const char *address)
+{
+    const char *host = address + strlen(TCP_PREFIX);
+    const char *port = strrchr(host, ':');
+    char name[256];
+
+    if (!port || port - host >= (long)sizeof(name)) {
+        ERROR("bad TCP address %s", address);
+        throw -1;
+    }
+    snprintf(name, sizeof(name), "%.*s", (int)(port - host), host);
+    ++port;
+
+    char *h = name;
+    size_t len = strlen(name);
+    if (len >= 2 && name[0] == '[' && name[len - 1] == ']') {
+        name[len - 1] = '\0';
+        ++h;
+    }
+
+    struct addrinfo hints, *list;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int err = getaddrinfo(*h ? h : NULL, port, &hints, &list);
+    if (err) {
+        ERROR("can`t resolve %s: %s", address, gai_strerror(err));
+        throw -1;
+    }
+    return list;
+}
+
+/**
+ * Check if socket address is the wildcard one, binding to it listens on all interfaces
+ */
+static int is_wildcard(const struct sockaddr *addr)
+{
+    if (addr->sa_family == AF_INET)
+        return ((const struct sockaddr_in *)addr)->sin_addr.s_addr == htonl(INADDR_ANY);
+    if (addr->sa_family == AF_INET6)
+        return IN6_IS_ADDR_UNSPECIFIED(&((const struct sockaddr_in6 *)addr)->sin6_addr);
+    return 0;
+}
+
+/**
+ * Connect or bind and listen TCP socket, tries all resolved addresses.
+ *
+ * Nagle is disabled, messages are small and replies are waited for.
+ * Accepted sockets inherit it from listening one.
+ *
+ * @param flags  SAFERUN_LISTEN_* flags, if passive
+ */
+static int tcp_socket(const char *address, int passive, int flags)
+{
+    struct addrinfo *list = tcp_address(address);
+    int sock = -1, one = 1;
+
+    for (struct addrinfo *ai = list; ai; ai = ai->ai_next)
+        if (passive && is_wildcard(ai->ai_addr) && !(flags & SAFERUN_LISTEN_ANY)) {
+            ERROR("%s listens on all interfaces, SAFERUN_LISTEN_ANY is needed for it", address);
+            freeaddrinfo(list);
+            throw -1;
+        }
+
+    for (struct addrinfo *ai = list; ai && sock < 0; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock < 0)
+            continue;
+
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        int err;
+        if (passive) {
+            setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            err = bind(sock, ai->ai_addr, ai->ai_addrlen) || listen(sock, 64);
+        } else {
+            err = connect(sock, ai->ai_addr, ai->ai_addrlen);
+        }
+
+        if (err) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    freeaddrinfo(list);
+
+    if (sock < 0) {
+        SYSERROR("can`t %s %s", passive ? "listen on" : "connect to", address);
+        throw -1;
+    }
+    return sock;
+}
+
+/**
+ * Read shared secret of TCP connections from file.
+ *
+ * Daemon and its clients must use the same file. Anyone who knows the
+ * secret can run tasks as any user but root, so the file must not be
+ * readable by group or others.
+ *
+ * @return -1 on error, 0 otherwise.
+ */
+int saferun_remote_set_secret(const char *path)
+{
+    struct stat st;
+    sha256_ctx ctx;
+    unsigned char key[SHA256_SIZE];
+
+    if (!path)
+        return -1;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        SYSERROR("can`t open secret %s", path);
+        return -1;
+    }
+
+    int ok = !fstat(fd, &st);
+    if (ok && (st.st_mode & (S_IRWXG | S_IRWXO))) {
+        ERROR("secret %s is accessible by group or others", path);
+        ok = 0;
+    } else if (ok && !st.st_size) {
+        ERROR("secret %s is empty", path);
+        ok = 0;
+    }
+    sha256_init(&ctx);
+    if (ok && !sha256_update_fd(&ctx, fd)) {
+        SYSERROR("can`t read secret %s", path);
+        ok = 0;
+    }
+    close(fd);
+    if (!ok)
+        return -1;
+
+    sha256_final(&ctx, key);
+    pthread_mutex_lock(&secret_lock);
+    memcpy(secret_key, key, sizeof(key));
+    secret_set = 1;
+    pthread_mutex_unlock(&secret_lock);
+    return 0;
+}
+
+/**
+ * Get key of TCP connections
+ */
+static void get_key(unsigned char key[SHA256_SIZE])
+{
+    pthread_mutex_lock(&secret_lock);
+    int ok = secret_set;
+    memcpy(key, secret_key, SHA256_SIZE);
+    pthread_mutex_unlock(&secret_lock);
+
+    if (!ok) {
+        ERROR("TCP connections need shared secret, @see saferun_remote_set_secret");
+        throw -1;
+    }
+}
+
+/**
+ * Check that TCP connections can be made, the secret is set
+ */
+void remote_need_secret()
+{
+    unsigned char key[SHA256_SIZE];
+    get_key(key);
+}
+
+/**
+ * Turn received challenge into reply with its HMAC, in place
+ */
+void remote_auth_reply(remote_buf *b)
+{
+    unsigned char key[SHA256_SIZE], mac[SHA256_SIZE];
+
+    if (b->header.type != REMOTE_AUTH || b->header.length != REMOTE_NONCE_SIZE) {
+        ERROR("bad challenge from saferun daemon");
+        throw -1;
+    }
+    get_key(key);
+    hmac_sha256(key, b->data, REMOTE_NONCE_SIZE, mac);
+
+    memset(&b->header, 0, sizeof(b->header));
+    b->header.type = REMOTE_AUTH;
+    b->header.length = sizeof(mac);
+    memcpy(b->data, mac, sizeof(mac));
+}
+
+/**
+ * Limit time of blocking receive on socket, 0 for no limit
+ */
+static void set_recv_timeout(int sock, int seconds)
+{
+    struct timeval tv;
+    tv.tv_sec = seconds;
+    tv.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+/**
+ * Receive one message of handshake, fds are never expected
+ */
+static void recv_auth(int sock, remote_buf *b)
+{
+    int fds[3], nfds = 0;
+
+    if (!remote_recv_msg(sock, b, fds, &nfds) || nfds || b->header.type != REMOTE_AUTH) {
+        for (int i = 0; i < nfds; ++i)
+            close(fds[i]);
+        ERROR("TCP handshake failed");
+        throw -1;
+    }
+}
+
+/**
+ * Prove to saferun daemon that this end knows the secret
+ */
+static void auth_client(int sock, remote_buf *b)
+{
+    set_recv_timeout(sock, AUTH_TIMEOUT);
+    recv_auth(sock, b);
+    remote_auth_reply(b);
+    remote_send_msg(sock, &b->header, NULL, 0);
+
+    recv_auth(sock, b);
+    if (b->header.length) {
+        ERROR("TCP handshake failed");
+        throw -1;
+    }
+    set_recv_timeout(sock, 0);
+}
+
+/**
+ * Challenge client of saferun daemon with random nonce, it must reply
+ * with its HMAC. Challenge is new every time, so replies can`t be replayed.
+ */
+static void auth_server(int sock, remote_buf *b)
+{
+    unsigned char key[SHA256_SIZE], nonce[REMOTE_NONCE_SIZE], mac[SHA256_SIZE];
+
+    get_key(key);
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || read(fd, nonce, sizeof(nonce)) != (ssize_t)sizeof(nonce)) {
+        SYSERROR("can`t make challenge");
+        if (fd >= 0)
+            close(fd);
+        throw -1;
+    }
+    close(fd);
+
+    memset(&b->header, 0, sizeof(b->header));
+    b->header.type = REMOTE_AUTH;
+    b->header.length = sizeof(nonce);
+    memcpy(b->data, nonce, sizeof(nonce));
+    remote_send_msg(sock, &b->header, NULL, 0);
+
+    set_recv_timeout(sock, AUTH_TIMEOUT);
+    recv_auth(sock, b);
+    hmac_sha256(key, nonce, sizeof(nonce), mac);
+
+    // compared in constant time, so the HMAC can`t be guessed byte by byte
+    unsigned char diff = b->header.length != sizeof(mac);
+    for (size_t i = 0; i < sizeof(mac) && !diff; ++i)
+        diff |= b->data[i] ^ mac[i];
+    if (diff) {
+        ERROR("TCP client doesn`t know the secret");
+        throw -1;
+    }
+    set_recv_timeout(sock, 0);
+
+    memset(&b->header, 0, sizeof(b->header));
+    b->header.type = REMOTE_AUTH;
+    remote_send_msg(sock, &b->header, NULL, 0);
+}
+
+/**
+ * Resolve address of saferun daemon, the first resolved one is taken for TCP.
+ */
+void remote_resolve(const char *address, struct sockaddr_storage *addr, socklen_t *len)
+{
+    memset(addr, 0, sizeof(*addr));
+    if (remote_is_unix(address)) {
+        unix_address(address, (struct sockaddr_un *)addr);
+        *len = sizeof(struct sockaddr_un);
+        return;
+    }
+
+    struct addrinfo *list = tcp_address(address);
+    memcpy(addr, list->ai_addr, list->ai_addrlen);
+    *len = list->ai_addrlen;
+    freeaddrinfo(list);
+}
+
+/**
+ * Start connecting to saferun daemon without blocking.
+ *
+ * @param done  where to write 1 if connection is made at once, 0 if it`s
+ *              in progress, socket becomes writable then, @see remote_connect_done
+ * @return non-blocking socket
+ */
+int remote_connect_start(const struct sockaddr_storage *addr, socklen_t len, int *done)
+{
+    int one = 1;
+    int sock = socket(addr->ss_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (sock < 0) {
+        SYSERROR("can`t create socket");
+        throw -1;
+    }
+    if (addr->ss_family != AF_UNIX)
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    *done = !connect(sock, (const struct sockaddr *)addr, len);
+    if (!*done && errno != EINPROGRESS && errno != EINTR) {
+        close(sock);
+        throw -1;
+    }
+    return sock;
+}
+
+/**
+ * Check result of connect started by remote_connect_start()
+ *
+ * @return 1 if connected, 0 if connect failed
+ */
+int remote_connect_done(int sock)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len))
+        return 0;
+    errno = err;
+    return !err;
+}
+
+/**
+ * Connect to saferun daemon.
+ *
+ * Over TCP the daemon challenges this end to prove it knows the shared
+ * secret, @see saferun_remote_set_secret.
+ *
+ * @param address  path to unix socket, or "tcp:host:port"
+ * @return socket, or -1 on error.
+ */
+int saferun_remote_connect(const char *address)
+{
+    struct sockaddr_un addr;
+    remote_buf *b = NULL;
+    int sock = -1;
+
+    if (!address)
+        return -1;
+
+    try {
+        if (!remote_is_unix(address)) {
+            remote_need_secret();
+            sock = tcp_socket(address, 0, 0);
+            if (!(b = (remote_buf *)malloc(sizeof(remote_buf)))) {
+                ERROR("no memory for TCP handshake");
+                throw -1;
+            }
+            auth_client(sock, b);
+            free(b);
+            return sock;
+        }
+
+        unix_address(address, &addr);
+        sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+            SYSERROR("can`t connect to %s", address);
+            throw -1;
+        }
+    }
+    catch (...) {
+        if (sock >= 0)
+            close(sock);
+        free(b);
+        return -1;
+    }
+
+    return sock;
+}
+
+/**
+ * Create listening socket for saferun daemon.
+ *
+ * Stale socket file at address is removed. TCP socket needs the shared
+ * secret, clients are challenged with it by saferun_remote_get_peer().
+ *
+ * @param address  path to unix socket, or "tcp:host:port" with empty host
+ *                 for loopback
+ * @param flags    SAFERUN_LISTEN_ANY to allow listening on all interfaces
+ * @return socket, or -1 on error.
+ */
+int saferun_remote_listen(const char *address, int flags)
+{
+    struct sockaddr_un addr;
+    int sock = -1;
+
+    if (!address)
+        return -1;
+
+    try {
+        if (!remote_is_unix(address)) {
+            remote_need_secret();
+            return tcp_socket(address, 1, flags);
+        }
+
+        unix_address(address, &addr);
+        unlink(address);
+        sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(sock, 64)) {
+            SYSERROR("can`t listen on %s", address);
+            throw -1;
+        }
+    }
+    catch (...) {
+        if (sock >= 0)
+            close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/**
+ * Encode task to b.
+ *
+ * If paths is not NULL, then stdio paths are sent instead of fds,
+ * NULL path means /dev/null. Otherwise fds to be attached are written to fds.
+ */
+void remote_encode_task(remote_buf *b, unsigned id, const saferun_task *task,
+                        const char *const *paths, int *fds, int *nfds)
+{
+    const int stdio[3] = {task->stdin_fd, task->stdout_fd, task->stderr_fd};
+    uint32_t argc = 0;
+
+    memset(&b->header, 0, sizeof(b->header));
+    b->header.type = REMOTE_TASK;
+    b->header.id = id;
+
+    // REMOTE_STDIN, REMOTE_STDOUT and REMOTE_STDERR are bits in stdio order
+    *nfds = 0;
+    for (int i = 0; i < 3; ++i)
+        if (!paths && stdio[i] >= 0) {
+            fds[(*nfds)++] = stdio[i];
+            b->header.fds |= 1 << i;
+        }
+
+    put(b, task->limits, sizeof(saferun_limits));
+    put_u32(b, task->jail->uid);
+    put_u32(b, task->jail->gid);
+    put_u32(b, task->jail->flags);
+    put_u32(b, task->jail->cpu);
+    put_str(b, task->jail->hostname);
+    put_str(b, task->jail->chroot);
+    put_str(b, task->jail->chdir);
+    put_str(b, task->qos);
+    put_str(b, task->isolation);
+
+    while (task->argv[argc])
+        ++argc;
+    put_u32(b, argc);
+    for (uint32_t i = 0; i < argc; ++i)
+        put_str(b, task->argv[i]);
+
+    for (int i = 0; i < 3; ++i)
+        put_str(b, paths ? paths[i] : NULL);
+}
+
+static int send_task(int sock, unsigned id, const saferun_task *task, const char *const *paths)
+{
+    if (!task || !task->jail || !task->limits || !task->argv)
+        return -1;
+
+    remote_buf *b = (remote_buf *)malloc(sizeof(remote_buf));
+    int fds[3], nfds = 0, ret = 0;
+
+    if (!b)
+        return -1;
+
+    try {
+        remote_encode_task(b, id, task, paths, fds, &nfds);
+        remote_send_msg(sock, &b->header, fds, nfds);
+    }
+    catch (...) {
+        ret = -1;
+    }
+
+    free(b);
+    return ret;
+}
+
+/**
+ * Send task to saferun daemon.
+ *
+ * stdin_fd, stdout_fd and stderr_fd of the task are passed to daemon,
+ * so the task uses them as if it was run locally. Works only over unix
+ * socket, @see saferun_remote_send_paths for TCP.
+ *
+ * @param id  any number, reply to this task will have it
+ * @return -1 on error, 0 otherwise.
+ */
+int saferun_remote_send(int sock, unsigned id, const saferun_task *task)
+{
+    return send_task(sock, id, task, NULL);
+}
+
+/**
+ * Send task to saferun daemon, with paths of stdio files instead of fds.
+ *
+ * Daemon opens the files itself, so they must be on storage shared
+ * with daemon host, inside of daemon io root. Stdio fds of the task are ignored.
+ *
+ * @param paths  stdin, stdout and stderr paths, NULL path means /dev/null
+ * @return -1 on error, 0 otherwise.
+ */
+int saferun_remote_send_paths(int sock, unsigned id, const saferun_task *task,
+                              const char *const *paths)
+{
+    if (!paths)
+        return -1;
+    return send_task(sock, id, task, paths);
+}
+
+/**
+ * Switch file system ids and groups of this thread to the task user.
+ *
+ * Raw system calls change only the calling thread, glibc wrappers would
+ * change all threads of the daemon. Only fs-related capabilities are
+ * dropped with fsuid, so the daemon can switch back.
+ *
+ * @param saved  where to write groups of the thread, @see restore_ids
+ * @return number of saved groups, -1 on failure
+ */
+static int switch_ids(uid_t uid, gid_t gid, gid_t **saved)
+{
+    int n = getgroups(0, NULL);
+    *saved = (gid_t *) malloc((n > 0 ? n : 1) * sizeof(gid_t));
+    if (n < 0 || !*saved || getgroups(n, *saved) != n) {
+        free(*saved);
+        return -1;
+    }
+
+    const gid_t groups[] = {gid};
+    if (syscall(SYS_setgroups, 1, groups) == -1) {
+        free(*saved);
+        return -1;
+    }
+    syscall(SYS_setfsgid, gid);
+    syscall(SYS_setfsuid, uid);
+    return n;
+}
+
+/**
+ * Switch file system ids and groups of this thread back to the daemon
+ */
+static void restore_ids(gid_t *saved, int n)
+{
+    syscall(SYS_setfsuid, geteuid());
+    syscall(SYS_setfsgid, getegid());
+    if (syscall(SYS_setgroups, n, saved) == -1)
+        SYSERROR("can`t restore groups of thread");
+    free(saved);
+}
+
+/**
+ * Open file by path relative to the directory, the path can`t leave it.
+ *
+ * Every directory on the way is opened separately without following
+ * symlinks, so a component swapped for a symlink isn`t followed either.
+ * The file must be regular, O_NONBLOCK keeps a FIFO from blocking.
+ *
+ * @return -1 with errno set on failure
+ */
+static int open_beneath(int root_fd, const char *rel, int write)
+{
+    char buf[PATH_MAX], *save = NULL;
+    struct stat st;
+
+    if (snprintf(buf, sizeof(buf), "%s", rel) >= (int) sizeof(buf)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    int dir_fd = dup(root_fd);
+    char *name = strtok_r(buf, "/", &save);
+    while (dir_fd >= 0 && name) {
+        char *next = strtok_r(NULL, "/", &save);
+        if (!strcmp(name, "..")) {
+            close(dir_fd);
+            errno = EPERM;
+            return -1;
+        }
+        if (!next)
+            break;
+        if (strcmp(name, ".")) {
+            int fd = openat(dir_fd, name, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            close(dir_fd);
+            dir_fd = fd;
+        }
+        name = next;
+    }
+    if (dir_fd < 0)
+        return -1;
+    if (!name || !strcmp(name, ".")) {
+        close(dir_fd);
+        errno = EISDIR;
+        return -1;
+    }
+
+    int flags = O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC | (write ? O_WRONLY | O_CREAT : O_RDONLY);
+    int fd = openat(dir_fd, name, flags, 0644);
+    close(dir_fd);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || fcntl(fd, F_SETFL, 0) == -1) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Open stdio file sent by path, it must be inside of io_root.
+ *
+ * Paths come from the network and files are opened by the daemon,
+ * so the path is walked from io_root with file system ids of the user
+ * the task runs as: the kernel checks its access to every directory
+ * and to the file, new outputs belong to it.
+ */
+static int open_path(const char *path, int write, const char *io_root, uid_t uid, gid_t gid)
+{
+    char root[PATH_MAX];
+
+    if (!io_root) {
+        ERROR("stdio paths are not accepted without io root");
+        throw -1;
+    }
+
+    if (!realpath(io_root, root)) {
+        SYSERROR("can`t resolve io root %s", io_root);
+        throw -1;
+    }
+
+    size_t n = strcmp(root, "/") ? strlen(root) : 0;
+    if (path[0] != '/' || strncmp(path, root, n) || path[n] != '/') {
+        ERROR("%s is outside of %s", path, io_root);
+        throw -1;
+    }
+
+    int root_fd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) {
+        SYSERROR("can`t open %s", root);
+        throw -1;
+    }
+
+    gid_t *saved;
+    int nsaved = switch_ids(uid, gid, &saved);
+    if (nsaved < 0) {
+        SYSERROR("can`t switch to user %d to open %s", (int) uid, path);
+        close(root_fd);
+        throw -1;
+    }
+    int fd = open_beneath(root_fd, path + n + 1, write);
+    int err = errno;
+    restore_ids(saved, nsaved);
+    close(root_fd);
+
+    if (fd < 0) {
+        errno = err;
+        SYSERROR("user %d can`t %s %s", (int) uid, write ? "write" : "read", path);
+        throw -1;
+    }
+
+    if (write && ftruncate(fd, 0)) {
+        SYSERROR("can`t truncate %s", path);
+        close(fd);
+        throw -1;
+    }
+    return fd;
+}
+
+/**
+ * Take next passed fd, open sent path, or open /dev/null if neither was sent
+ *
+ * @param i  0 for stdin, 1 for stdout, 2 for stderr
+ */
+static int take_fd(int i, uint32_t mask, const int *fds, int *pos,
+                   const char *path, const char *io_root, const saferun_jail *jail)
+{
+    if (mask & (1 << i))
+        return fds[(*pos)++];
+
+    if (path)
+        return open_path(path, i != 0, io_root, jail->uid, jail->gid);
+
+    int fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        SYSERROR("can`t open /dev/null");
+        throw -1;
+    }
+    return fd;
+}
+
+/**
+ * Receive task sent by saferun_remote_send().
+ *
+ * If some of stdio fds was not passed, then /dev/null is used.
+ * Tasks with stdio paths are not accepted, neither are other requests.
+ * Tasks are checked with the default policy: no chroot, full isolation,
+ * peer must be root or the user of this process to run as other users.
+ *
+ * @param id  where to write id of the task
+ * @return NULL if connection is closed or on error,
+ *         task to be freed with saferun_remote_free() otherwise.
+ */
+saferun_task *saferun_remote_recv(int sock, unsigned *id)
+{
+    saferun_remote_policy policy;
+    saferun_remote_peer peer;
+    int type;
+
+    memset(&policy, 0, sizeof(policy));
+    if (saferun_remote_get_peer(sock, &peer)) {
+        ERROR("can`t check peer of remote task");
+        return NULL;
+    }
+
+    saferun_task *task = saferun_remote_recv_request(sock, id, &type, &policy, &peer);
+    if (!task && type)
+        ERROR("unexpected remote request");
+    return task;
+}
+
+/**
+ * Check peer of the connection by its credentials.
+ *
+ * Credentials are taken by the kernel when the peer connects, so they
+ * can`t be forged. Root and the user of this process are trusted.
+ *
+ * TCP peer has no credentials, it`s challenged to prove it knows
+ * the shared secret instead and is trusted then. The handshake blocks
+ * for up to a few seconds, so it should be done by the thread
+ * of the connection, not by the accepting one.
+ *
+ * @return -1 if the peer can`t be checked or fails the handshake,
+ *         0 otherwise.
+ */
+int saferun_remote_get_peer(int sock, saferun_remote_peer *peer)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    int domain;
+    socklen_t domain_len = sizeof(domain);
+
+    if (!peer)
+        return -1;
+    memset(peer, 0, sizeof(saferun_remote_peer));
+    peer->uid = (uid_t) -1;
+    peer->gid = (gid_t) -1;
+
+    if (getsockopt(sock, SOL_SOCKET, SO_DOMAIN, &domain, &domain_len))
+        return -1;
+
+    if (domain != AF_UNIX) {
+        remote_buf *b = (remote_buf *)malloc(sizeof(remote_buf));
+        int ret = 0;
+        if (!b)
+            return -1;
+        try {
+            auth_server(sock, b);
+            peer->trusted = 1;
+        }
+        catch (...) {
+            ret = -1;
+        }
+        free(b);
+        return ret;
+    }
+
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) || len != sizeof(cred))
+        return -1;
+
+    peer->uid = cred.uid;
+    peer->gid = cred.gid;
+    peer->trusted = !cred.uid || cred.uid == geteuid();
+    return 0;
+}
+
+/**
+ * Check if dir is one of allowed ones, both are resolved.
+ */
+static int allowed_dir(const char *dir, const char *const *allowed)
+{
+    char path[PATH_MAX], other[PATH_MAX];
+
+    if (!realpath(dir, path))
+        return 0;
+    for (; allowed && *allowed; ++allowed)
+        if (realpath(*allowed, other) && !strcmp(path, other))
+            return 1;
+    return 0;
+}
+
+/**
+ * Make task sent by peer obey the policy, or refuse it.
+ *
+ * User of the policy replaces one asked by client. Otherwise trusted
+ * peers choose any user but root, others run tasks only as themselves.
+ * Chroot is compared after resolving symlinks, so a link to "/" can`t
+ * pass for an allowed dir.
+ */
+static void check_task(remote_task *rt, const saferun_remote_policy *policy,
+                       const saferun_remote_peer *peer)
+{
+    saferun_jail *jail = &rt->jail;
+    const char *isolation = rt->task.isolation;
+
+    if (policy->uid) {
+        jail->uid = policy->uid;
+        jail->gid = policy->gid;
+    } else if (!peer->trusted && (jail->uid != peer->uid || jail->gid != peer->gid)) {
+        ERROR("user %d can run tasks only as itself", (int) peer->uid);
+        throw -1;
+    }
+
+    if (!jail->uid || !jail->gid) {
+        ERROR("remote tasks can`t run as root");
+        throw -1;
+    }
+
+    if (jail->chroot && !allowed_dir(jail->chroot, policy->chroots)) {
+        ERROR("chroot to %s is not allowed", jail->chroot);
+        throw -1;
+    }
+
+    if (!isolation || !strcmp(isolation, "full"))
+        return;
+    int allowed = 0;
+    for (const char *const *name = policy->isolations; name && *name && !allowed; ++name)
+        allowed = !strcmp(isolation, *name);
+    if (!allowed || !strcmp(isolation, "accounting")) {
+        ERROR("isolation %s is not allowed for remote tasks", isolation);
+        throw -1;
+    }
+}
+
+/**
+ * Receive request to saferun daemon: task, status request or cancel.
+ *
+ * Task must obey the policy, @see saferun_remote_policy. Stdio files
+ * of the task sent by saferun_remote_send_paths() are opened here, paths
+ * outside of io root are refused. Files that weren`t sent are /dev/null.
+ *
+ * @param id      where to write id of the task
+ * @param type    where to write SAFERUN_REMOTE_* type of the request,
+ *                it`s zero if connection is closed or is broken
+ * @param policy  what tasks are accepted
+ * @param peer    who sent the task, @see saferun_remote_get_peer
+ * @return task to be freed with saferun_remote_free(), NULL if it`s not a task
+ *         or if the task can`t be used, the task should be replied with -1 then.
+ */
+saferun_task *saferun_remote_recv_request(int sock, unsigned *id, int *type,
+                                          const saferun_remote_policy *policy,
+                                          const saferun_remote_peer *peer)
+{
+    remote_task *rt = (remote_task *)malloc(sizeof(remote_task));
+    int fds[3], nfds = 0, pos = 0;
+
+    *type = 0;
+    if (!rt || !policy || !peer) {
+        free(rt);
+        return NULL;
+    }
+
+    saferun_task *task = &rt->task;
+    memset(task, 0, sizeof(saferun_task));
+    task->stdin_fd = task->stdout_fd = task->stderr_fd = -1;
+
+    try {
+        if (!remote_recv_msg(sock, &rt->buf, fds, &nfds)) {
+            free(rt);
+            return NULL;
+        }
+
+        remote_buf *b = &rt->buf;
+        if (nfds != __builtin_popcount(b->header.fds)) {
+            ERROR("unexpected remote message");
+            throw -1;
+        }
+        *id = b->header.id;
+
+        if ((b->header.type == REMOTE_STATUS || b->header.type == REMOTE_CANCEL) && !nfds) {
+            *type = b->header.type;
+            free(rt);
+            return NULL;
+        }
+
+        if (b->header.type != REMOTE_TASK) {
+            ERROR("unexpected remote message");
+            throw -1;
+        }
+
+        get(b, &rt->limits, sizeof(saferun_limits));
+        rt->jail.uid = get_u32(b);
+        rt->jail.gid = get_u32(b);
+        rt->jail.flags = get_u32(b);
+        rt->jail.cpu = get_u32(b);
+        rt->jail.hostname = get_str(b);
+        rt->jail.chroot = get_str(b);
+        rt->jail.chdir = get_str(b);
+        task->qos = get_str(b);
+        task->isolation = get_str(b);
+
+        uint32_t argc = get_u32(b);
+        if (!argc || argc > REMOTE_MAX_ARGS) {
+            ERROR("bad argc in remote message");
+            throw -1;
+        }
+        for (uint32_t i = 0; i < argc; ++i)
+            if (!(rt->argv[i] = get_str(b)))
+                throw -1;
+        rt->argv[argc] = NULL;
+
+        const char *paths[3];
+        for (int i = 0; i < 3; ++i)
+            paths[i] = get_str(b);
+
+        // the message is read completely, so the connection can be used further
+        *type = SAFERUN_REMOTE_TASK;
+        check_task(rt, policy, peer);
+
+        task->stdin_fd  = take_fd(0, b->header.fds, fds, &pos, paths[0], policy->io_root, &rt->jail);
+        task->stdout_fd = take_fd(1, b->header.fds, fds, &pos, paths[1], policy->io_root, &rt->jail);
+        task->stderr_fd = take_fd(2, b->header.fds, fds, &pos, paths[2], policy->io_root, &rt->jail);
+
+        task->jail = &rt->jail;
+        task->limits = &rt->limits;
+        task->argv = rt->argv;
+    }
+    catch (...) {
+        for (int i = pos; i < nfds; ++i)
+            close(fds[i]);
+        saferun_remote_free(task);
+        return NULL;
+    }
+
+    return task;
+}
+
+/**
+ * Free task returned by saferun_remote_recv(), its fds are closed.
+ */
+void saferun_remote_free(saferun_task *task)
+{
+    if (!task)
+        return;
+
+    if (task->stdin_fd >= 0)
+        close(task->stdin_fd);
+    if (task->stdout_fd >= 0)
+        close(task->stdout_fd);
+    if (task->stderr_fd >= 0)
+        close(task->stderr_fd);
+    free(task);
+}
+
+/**
+ * Send message without payload and fds
+ */
+static int send_empty(int sock, uint32_t type, unsigned id)
+{
+    remote_header header;
+
+    memset(&header, 0, sizeof(header));
+    header.type = type;
+    header.id = id;
+
+    try {
+        remote_send_msg(sock, &header, NULL, 0);
+    }
+    catch (...) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Send result of task to client.
+ *
+ * @param ret   value returned by saferun_run, or SAFERUN_REMOTE_CANCELLED
+ * @param stat  NULL if the task wasn`t run
+ * @return -1 on error, 0 otherwise.
+ */
+int saferun_remote_reply(int sock, unsigned id, int ret, const saferun_stat *stat)
+{
+    remote_buf *b = (remote_buf *)malloc(sizeof(remote_buf));
+    saferun_stat empty;
+    int res = 0;
+
+    if (!b)
+        return -1;
+
+    if (!stat) {
+        memset(&empty, 0, sizeof(empty));
+        stat = &empty;
+    }
+
+    try {
+        memset(&b->header, 0, sizeof(b->header));
+        b->header.type = REMOTE_REPLY;
+        b->header.id = id;
+        put_u32(b, ret);
+        put(b, stat, sizeof(saferun_stat));
+        remote_send_msg(sock, &b->header, NULL, 0);
+    }
+    catch (...) {
+        res = -1;
+    }
+
+    free(b);
+    return res;
+}
+
+void remote_decode_reply(remote_buf *b, int *ret, saferun_stat *stat)
+{
+    *ret = (int)get_u32(b);
+    get(b, stat, sizeof(saferun_stat));
+}
+
+/**
+ * Receive result of task sent by saferun_remote_reply().
+ *
+ * @param id    where to write id of the task
+ * @param ret   where to write value returned by saferun_run
+ * @return -1 on error or if connection is closed, 0 otherwise.
+ */
+int saferun_remote_recv_reply(int sock, unsigned *id, int *ret, saferun_stat *stat)
+{
+    remote_buf *b = (remote_buf *)malloc(sizeof(remote_buf));
+    int fds[3], nfds = 0, res = 0;
+
+    if (!b)
+        return -1;
+
+    try {
+        if (!remote_recv_msg(sock, b, fds, &nfds))
+            throw -1;
+
+        for (int i = 0; i < nfds; ++i)
+            close(fds[i]);
+
+        if (b->header.type != REMOTE_REPLY) {
+            ERROR("unexpected remote message");
+            throw -1;
+        }
+
+        *id = b->header.id;
+        remote_decode_reply(b, ret, stat);
+    }
+    catch (...) {
+        res = -1;
+    }
+
+    free(b);
+    return res;
+}
+
+/**
+ * Run task by saferun daemon and wait for result.
+ *
+ * @param address  path to unix socket of daemon
+ * @return -1 if there were some library errors, locally or in daemon.
+ *         Returns 0 otherwise.
+ *
+ * @see saferun_run
+ */
+int saferun_remote_run(const char *address, const saferun_task *task, saferun_stat *stat)
+{
+    unsigned id;
+    int ret = -1;
+
+    if (!task || !stat)
+        return -1;
+
+    int sock = saferun_remote_connect(address);
+    if (sock < 0)
+        return -1;
+
+    if (saferun_remote_send(sock, 0, task) || saferun_remote_recv_reply(sock, &id, &ret, stat))
+        ret = -1;
+
+    close(sock);
+    return ret;
+}
+
+/**
+ * Request load of saferun daemon, or reply to the request.
+ *
+ * Reply comes as a message of REMOTE_STATUS type with the same id,
+ * @see saferun_coord_create which uses it.
+ *
+ * @param load  NULL to request, load to reply otherwise
+ * @return -1 on error, 0 otherwise.
+ */
+int saferun_remote_status(int sock, unsigned id, const saferun_remote_load *load)
+{
+    if (!load)
+        return send_empty(sock, REMOTE_STATUS, id);
+
+    remote_buf *b = (remote_buf *)malloc(sizeof(remote_buf));
+    int res = 0;
+
+    if (!b)
+        return -1;
+
+    try {
+        memset(&b->header, 0, sizeof(b->header));
+        b->header.type = REMOTE_STATUS;
+        b->header.id = id;
+        put_u32(b, load->in_flight);
+        put_u32(b, load->queued);
+        put_u32(b, load->capacity);
+        put(b, &load->cpu_pressure, sizeof(double));
+        put(b, &load->memory_pressure, sizeof(double));
+        put(b, &load->io_pressure, sizeof(double));
+        remote_send_msg(sock, &b->header, NULL, 0);
+    }
+    catch (...) {
+        res = -1;
+    }
+
+    free(b);
+    return res;
+}
+
+void remote_decode_load(remote_buf *b, saferun_remote_load *load)
+{
+    load->in_flight = get_u32(b);
+    load->queued = get_u32(b);
+    load->capacity = get_u32(b);
+    get(b, &load->cpu_pressure, sizeof(double));
+    get(b, &load->memory_pressure, sizeof(double));
+    get(b, &load->io_pressure, sizeof(double));
+}
+
+/**
+ * Ask saferun daemon to cancel the task if it`s not started yet.
+ *
+ * Cancelled task is replied with SAFERUN_REMOTE_CANCELLED, otherwise
+ * it`s run and replied as usual.
+ *
+ * @return -1 on error, 0 otherwise.
+ */
+int saferun_remote_cancel(int sock, unsigned id)
+{
+    return send_empty(sock, REMOTE_CANCEL, id);
+}
+
+/**
+ * Get load of this process to reply status request.
+ *
+ * Daemon should add tasks waiting in its own queue to load->queued.
+ */
+void saferun_remote_get_load(saferun_remote_load *load)
+{
+    memset(load, 0, sizeof(saferun_remote_load));
+    metrics_load(load);
+    admission_load(load);
+}
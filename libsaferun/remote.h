@@ -0,0 +1,99 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _REMOTE_H
+#define _REMOTE_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "saferun.h"
+
+#define REMOTE_MAGIC    0x344e5253 /* "SRN4" */
+#define REMOTE_MAX_SIZE (64*1024)  /* max payload size */
+#define REMOTE_MAX_ARGS 1024
+
+/* Types of messages */
+enum remote_type {
+    REMOTE_TASK   = SAFERUN_REMOTE_TASK,   /**< task description, stdio fds are passed with
+                                                SCM_RIGHTS or stdio paths are in the payload */
+    REMOTE_REPLY  = 2,                     /**< return value of saferun_run and saferun_stat */
+    REMOTE_STATUS = SAFERUN_REMOTE_STATUS, /**< load request, empty, or reply with load */
+    REMOTE_CANCEL = SAFERUN_REMOTE_CANCEL, /**< cancel the task with this id if it isn`t started */
+    REMOTE_AUTH   = 5,                     /**< TCP handshake: challenge, its HMAC, empty accept */
+};
+
+/* Bytes of challenge and of its HMAC in REMOTE_AUTH messages */
+#define REMOTE_NONCE_SIZE 32
+
+/* Bits of remote_header.fds */
+enum {
+    REMOTE_STDIN  = 1,
+    REMOTE_STDOUT = 2,
+    REMOTE_STDERR = 4,
+};
+
+/**
+ * remote_header - header of every message.
+ *
+ * Messages are sent over stream sockets, so header tells where
+ * the message ends. Numbers are in host byte order, so over TCP both ends
+ * must be of the same architecture, magic doesn`t match otherwise.
+ */
+struct remote_header {
+    uint32_t magic;
+    uint32_t type;   /**< @see remote_type */
+    uint32_t id;     /**< chosen by client, reply has the id of its task */
+    uint32_t length; /**< of payload following the header */
+    uint32_t fds;    /**< which stdio fds are attached to the message */
+};
+
+/**
+ * remote_buf - message being encoded or decoded.
+ */
+struct remote_buf {
+    remote_header header;
+    char data[REMOTE_MAX_SIZE];
+    uint32_t pos; /**< read position in data */
+};
+
+/**
+ * remote_task - decoded task, all pointers point inside of it.
+ */
+struct remote_task {
+    saferun_task task; /**< must be first, saferun_remote_free() relies on it */
+    saferun_jail jail;
+    saferun_limits limits;
+    char *argv[REMOTE_MAX_ARGS + 1];
+    remote_buf buf;
+};
+
+void remote_encode_task(remote_buf *b, unsigned id, const saferun_task *task,
+                        const char *const *paths, int *fds, int *nfds);
+void remote_send_msg(int sock, remote_header *msg, const int *fds, int nfds);
+int remote_recv_msg(int sock, remote_buf *b, int *fds, int *nfds);
+void remote_check_header(const remote_header *header);
+size_t remote_send_some(int sock, const char *p, size_t n, const int *fds, int nfds);
+void remote_resolve(const char *address, struct sockaddr_storage *addr, socklen_t *len);
+int remote_connect_start(const struct sockaddr_storage *addr, socklen_t len, int *done);
+int remote_connect_done(int sock);
+void remote_need_secret();
+void remote_auth_reply(remote_buf *b);
+void remote_decode_reply(remote_buf *b, int *ret, saferun_stat *stat);
+void remote_decode_load(remote_buf *b, saferun_remote_load *load);
+int remote_is_unix(const char *address);
+
+#endif /*_REMOTE_H*/
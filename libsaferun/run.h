@@ -0,0 +1,34 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _RUN_H
+#define _RUN_H
+
+#include "saferun.h"
+#include "perf.h"
+#include "profile.h"
+
+int isolation_flags(const saferun_task *task);
+long long setup_cgroup(const saferun_inst *inst, const saferun_task *task, int isolation);
+void fini_cgroup(const saferun_inst *inst);
+void task_to_cgroup(const saferun_inst *inst, pid_t pid, int isolation);
+perf_counters *setup_perf(const saferun_inst *inst, const saferun_limits *limits, perf_counters *perf);
+profiler *setup_profile(const saferun_inst *inst, const saferun_task *task);
+void fini_profile(profiler *prof, const saferun_task *task);
+long long spawn_task(const saferun_inst *inst, const saferun_task *task, int isolation, int ctl_fd,
+                     int sv[2], pid_t *pid, saferun_stat *stat);
+
+#endif /*_RUN_H */
@@ -28,116 +28,688 @@
 #include <signal.h>
 #include <time.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #include "saferun.h"
+#include "run.h"
 #include "cgroup.h"
 #include "sync.h"
 #include "hv.h"
 #include "utils.h"
-#include "profiling.h"
+#include "trace.h"
+#include "metrics.h"
+#include "perf.h"
+#include "freezer.h"
+#include "admission.h"
+#include "journal.h"
+#include "history.h"
+#include "calibrate.h"
+#include "reaper.h"
+#include "warm.h"
+#include "profile.h"
 #include "log.h"
 
 const int SYNC_MAGIC_1 = 17; /**< Just some number for syncing parent process and child */
 const int SYNC_MAGIC_2 = 27; /**< Just some other number */
+const int SYNC_MAGIC_3 = 37; /**< Child is about to exec, its CPU time since wake follows */
 const int SYNC_MAGIC_FAIL = 136; /**< Another number, indicating that something has gone wrong */
 
+/* Memory left charged to persistent cgroup over 1/N of the new limit is freed before the run */
+#define RESET_FORCE_EMPTY 4
+
+/* Environment of tasks run with SAFERUN_JAIL_CLEAN_ENV */
+static char *clean_env[] = {
+    (char *) "PATH=/usr/local/bin:/usr/bin:/bin",
+    (char *) "HOME=/",
+    (char *) "LANG=C",
+    (char *) "LC_ALL=C",
+    NULL
+};
+
+/* Steps of jail setup in the child, the failed one is reported to the parent */
+enum jail_step {
+    JAIL_STDIO,
+    JAIL_FDS,
+    JAIL_CTL,
+    JAIL_HOSTNAME,
+    JAIL_CHROOT,
+    JAIL_CHDIR,
+    JAIL_UIDGID,
+    JAIL_ASLR,
+    JAIL_CPU,
+    JAIL_FSIZE,
+    JAIL_CAPS,
+    JAIL_EXEC,
+    JAIL_STEPS
+};
+
+static const char *const jail_steps[JAIL_STEPS] = {
+    "redirect stdio",
+    "close inherited fds",
+    "pass control socket",
+    "set hostname",
+    "chroot",
+    "chdir",
+    "set uid and gid",
+    "disable ASLR",
+    "pin to CPU",
+    "limit file size",
+    "drop capabilities",
+    "exec",
+};
+
 struct clone_data {
     const saferun_task *task;
-    int fd; /**< fd for syncing with parent process*/
+    int isolation; /**< SAFERUN_ISOLATE_* flags of the task */
+    int fd;     /**< fd for syncing with parent process*/
+    int ctl_fd; /**< passed to the program as SAFERUN_FORKSERVER_FD, -1 if none */
+};
+
+/**
+ * Named set of SAFERUN_ISOLATE_* flags, @see saferun_set_isolation
+ */
+struct isolation_profile {
+    char name[32];
+    int flags;
+};
+
+/* Built-in profiles go first and can`t be changed */
+#define BUILTIN_ISOLATIONS 2
+
+static isolation_profile isolations[SAFERUN_ISOLATION_MAX] = {
+    { "full", SAFERUN_ISOLATE_FULL },
+    { "accounting", 0 },
 };
+static int isolations_count = BUILTIN_ISOLATIONS;
+static pthread_mutex_t isolations_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Find isolation profile by name
+ *
+ * Should be called with isolations locked.
+ *
+ * @return index of the profile, -1 if there is no such profile
+ */
+static int find_isolation(const char *name)
+{
+    for (int i = 0; i < isolations_count; ++i)
+        if (!strcmp(isolations[i].name, name))
+            return i;
+    return -1;
+}
+
+/**
+ * Get SAFERUN_ISOLATE_* flags of the task isolation profile
+ *
+ * Throws if the profile is unknown.
+ */
+int isolation_flags(const saferun_task *task)
+{
+    if (!task->isolation)
+        return SAFERUN_ISOLATE_FULL;
+
+    pthread_mutex_lock(&isolations_lock);
+    int i = find_isolation(task->isolation);
+    int flags = i >= 0 ? isolations[i].flags : 0;
+    pthread_mutex_unlock(&isolations_lock);
+
+    if (i < 0) {
+        ERROR("unknown isolation profile '%s'", task->isolation);
+        throw -1;
+    }
+    return flags;
+}
+
+/**
+ * Write one blkio throttle rule if limit is set
+ */
+void throttle_io(const saferun_inst *inst, const char *filename, const char *dev, long long limit)
+{
+    char rule[64];
+    if (!limit)
+        return;
+    snprintf(rule, sizeof(rule), "%s %lld", dev, limit);
+    cgroup_write_str(inst->blkio_path, filename, rule);
+}
+
+/**
+ * Setups disk I/O throttling on the device holding the jail root.
+ */
+void setup_io(const saferun_inst *inst, const saferun_task *task, int isolation)
+{
+    const saferun_limits *limits = task->limits;
+    char dev[32];
+
+    if (!limits->io_read_bps && !limits->io_write_bps
+            && !limits->io_read_iops && !limits->io_write_iops)
+        return;
+
+    if (!inst->blkio_path[0]) {
+        ERROR("I/O limits are set, but blkio cgroup is not mounted");
+        throw -1;
+    }
+    if (!(isolation & SAFERUN_ISOLATE_BLKIO)) {
+        ERROR("I/O limits are set, but isolation profile '%s' has no blkio", task->isolation);
+        throw -1;
+    }
+
+    get_block_device(task->jail->chroot ? task->jail->chroot : "/", dev, sizeof(dev));
+
+    throttle_io(inst, "blkio.throttle.read_bps_device",   dev, limits->io_read_bps);
+    throttle_io(inst, "blkio.throttle.write_bps_device",  dev, limits->io_write_bps);
+    throttle_io(inst, "blkio.throttle.read_iops_device",  dev, limits->io_read_iops);
+    throttle_io(inst, "blkio.throttle.write_iops_device", dev, limits->io_write_iops);
+}
+
+/**
+ * Find QoS class by name
+ *
+ * @return NULL if there is no such class
+ */
+const saferun_qos *find_qos(const saferun_inst *inst, const char *name)
+{
+    for (int i = 0; i < inst->qos_count; ++i)
+        if (!strcmp(inst->qos[i].name, name))
+            return &inst->qos[i];
+    return NULL;
+}
+
+/**
+ * Setups CPU weight and bandwidth from task QoS class and limits.
+ *
+ * Fresh cgroup has default weight and no bandwidth limit,
+ * so nothing is written if task doesn`t ask for it.
+ */
+void setup_cpu(const saferun_inst *inst, const saferun_task *task)
+{
+    const saferun_qos *qos = NULL;
+    long quota = task->limits->cpu_quota;
+
+    if (task->qos) {
+        qos = find_qos(inst, task->qos);
+        if (!qos) {
+            ERROR("unknown QoS class '%s'", task->qos);
+            throw -1;
+        }
+        if (!quota)
+            quota = qos->cpu_quota;
+    }
+
+    if (!qos && !quota) {
+        // Persistent cgroup can keep settings of the previous run
+        if (inst->persistent && inst->cpu_path[0]) {
+            cgroup_write_ll(inst->cpu_path, "cpu.shares", 1024);
+            cgroup_write_ll(inst->cpu_path, "cpu.cfs_quota_us", -1);
+        }
+        return;
+    }
+
+    if (!inst->cpu_path[0]) {
+        ERROR("CPU QoS is set, but cpu cgroup is not mounted");
+        throw -1;
+    }
+    if (quota && quota < SAFERUN_CPU_QUOTA_MIN) {
+        ERROR("CPU quota %ld is below the minimum of %d", quota, SAFERUN_CPU_QUOTA_MIN);
+        throw -1;
+    }
+
+    if ((qos && qos->cpu_shares) || inst->persistent)
+        cgroup_write_ll(inst->cpu_path, "cpu.shares", qos && qos->cpu_shares ? qos->cpu_shares : 1024);
+    if (quota) {
+        cgroup_write_ll(inst->cpu_path, "cpu.cfs_period_us", SAFERUN_CPU_PERIOD);
+        cgroup_write_ll(inst->cpu_path, "cpu.cfs_quota_us", (long long)quota * SAFERUN_CPU_PERIOD / 1000);
+    } else if (inst->persistent) {
+        cgroup_write_ll(inst->cpu_path, "cpu.cfs_quota_us", -1);
+    }
+}
+
+/**
+ * Check if cpu subsystem is mounted separately from cpuacct
+ */
+int cpu_is_separate(const saferun_inst *inst)
+{
+    return inst->cpu_path[0] && strcmp(inst->cpu_path, inst->cpuacct_path);
+}
+
+/**
+ * Setups memory limit
+ *
+ * memory.memsw.limit_in_bytes can`t be less than memory.limit_in_bytes,
+ * so if persistent cgroup had less limit before, memsw goes first.
+ */
+void setup_memory(const saferun_inst *inst, const saferun_limits *limits)
+{
+    long long old = 0;
+    if (inst->persistent)
+        cgroup_read_ll(inst->memory_path, "memory.memsw.limit_in_bytes", &old);
+
+    if (old && old < limits->mem) {
+        cgroup_write_ll(inst->memory_path, "memory.memsw.limit_in_bytes", limits->mem);
+        cgroup_write_ll(inst->memory_path, "memory.limit_in_bytes", limits->mem);
+    } else {
+        cgroup_write_ll(inst->memory_path, "memory.limit_in_bytes", limits->mem);
+        cgroup_write_ll(inst->memory_path, "memory.memsw.limit_in_bytes", limits->mem);
+    }
+}
+
+/**
+ * Resets counters of persistent cgroup left from the previous run.
+ *
+ * Page cache of the previous run stays charged to the cgroup. It`s
+ * reclaimed when the task needs memory, and max usage is reset to usage,
+ * so it`s subtracted from peak of the run, @see setup_cgroup.
+ * memory.force_empty would free it, but it takes up to 0.5 seconds on
+ * a big cgroup, so it`s used only if the leftover takes much of the new
+ * limit, or more than it, which couldn`t be set then.
+ */
+void reset_cgroup(const saferun_inst *inst, const saferun_limits *limits, int isolation)
+{
+    long long usage = 0;
+
+    cgroup_write_ll(inst->cpuacct_path, "cpuacct.usage", 0);
+
+    cgroup_read_ll(inst->memory_path, "memory.memsw.usage_in_bytes", &usage);
+    if (usage > limits->mem / RESET_FORCE_EMPTY)
+        cgroup_write_ll(inst->memory_path, "memory.force_empty", 0);
+    cgroup_write_ll(inst->memory_path, "memory.max_usage_in_bytes", 0);
+    cgroup_write_ll(inst->memory_path, "memory.memsw.max_usage_in_bytes", 0);
+    cgroup_write_ll(inst->memory_path, "memory.failcnt", 0);
+    cgroup_write_ll(inst->memory_path, "memory.memsw.failcnt", 0);
+
+    if (inst->blkio_path[0] && (isolation & SAFERUN_ISOLATE_BLKIO)) {
+        cgroup_write_ll(inst->blkio_path, "blkio.reset_stats", 1);
+        cgroup_clear_blkio_rules(inst->blkio_path, "blkio.throttle.read_bps_device");
+        cgroup_clear_blkio_rules(inst->blkio_path, "blkio.throttle.write_bps_device");
+        cgroup_clear_blkio_rules(inst->blkio_path, "blkio.throttle.read_iops_device");
+        cgroup_clear_blkio_rules(inst->blkio_path, "blkio.throttle.write_iops_device");
+    }
+}
 
 /**
  * Setups cgroup
  *
  * Makes directories, writes parameters to files in cgroups.
+ * Persistent cgroup is reused, so only its counters are reset.
+ * devices and blkio cgroups are used only if isolation has them,
+ * the rest are needed for limits and statistics.
+ *
+ * @param isolation  SAFERUN_ISOLATE_* flags of the task
+ * @return memory charged to the cgroup before the task, in bytes,
+ *         hypervisor subtracts it from peak usage
  *
  * @todo
  * Find out what memory.move_chare_at_immigrate really means.
  */
-void setup_cgroup(const saferun_inst *inst, const saferun_limits *limits)
+long long setup_cgroup(const saferun_inst *inst, const saferun_task *task, int isolation)
 {
+    long long base_mem = 0;
+
     mkdir(inst->cpuacct_path, 0777);
-    mkdir(inst->devices_path, 0777);
+    if (isolation & SAFERUN_ISOLATE_DEVICES)
+        mkdir(inst->devices_path, 0777);
     mkdir(inst->memory_path, 0777);
+    if (inst->blkio_path[0] && (isolation & SAFERUN_ISOLATE_BLKIO))
+        mkdir(inst->blkio_path, 0777);
+    if (cpu_is_separate(inst))
+        mkdir(inst->cpu_path, 0777);
+    if (inst->perf_event_path[0])
+        mkdir(inst->perf_event_path, 0777);
+    if (inst->freezer_path[0])
+        mkdir(inst->freezer_path, 0777);
+
+    if (inst->persistent) {
+        reset_cgroup(inst, task->limits, isolation);
+        cgroup_read_ll(inst->memory_path, "memory.memsw.max_usage_in_bytes", &base_mem);
+    }
 
-    cgroup_write_str(inst->devices_path, "devices.deny", "a");
-    cgroup_write_ll(inst->memory_path, "memory.limit_in_bytes", limits->mem);
-    cgroup_write_ll(inst->memory_path, "memory.memsw.limit_in_bytes", limits->mem);
+    if (isolation & SAFERUN_ISOLATE_DEVICES)
+        cgroup_write_str(inst->devices_path, "devices.deny", "a");
+    setup_memory(inst, task->limits);
+    setup_io(inst, task, isolation);
+    setup_cpu(inst, task);
 
     //Not sure about this, see kernel-doc/cgroups/memory.txt
 //    cgroup_write_ll(inst->memory_path, "memory.move_charge_at_immigrate", 3);
+    return base_mem;
 }
 
 /**
  * Removes cgroup via rmdir
  */
-void fini_cgroup(const saferun_inst *inst)
+void remove_cgroup(const saferun_inst *inst)
 {
-    PROFILING_START();
-
     // memory.force_empty takes 0.5 seconds, too long and not really needed
     //cgroup_write_ll(inst->memory_path, "memory.force_empty", 0);
-    PROFILING_CHECKPOINT();
     rmdir(inst->cpuacct_path);
     rmdir(inst->memory_path);
     rmdir(inst->devices_path);
+    if (inst->blkio_path[0])
+        rmdir(inst->blkio_path);
+    if (cpu_is_separate(inst))
+        rmdir(inst->cpu_path);
+    if (inst->perf_event_path[0])
+        rmdir(inst->perf_event_path);
+    if (inst->freezer_path[0])
+        rmdir(inst->freezer_path);
+}
 
-    PROFILING_CHECKPOINT();
+/**
+ * Finishes cgroup after the run.
+ *
+ * Processes left by the task are killed at once, so none of them
+ * outlives the run. Persistent cgroup is reused by the next run, other
+ * cgroups are removed by reaper in background, @see reaper_defer
+ */
+void fini_cgroup(const saferun_inst *inst)
+{
+    if (inst->persistent) {
+        kill_cgroup(inst);
+        return;
+    }
+    // reaper kills processes it finds again, the cgroup is removed anyway
+    try {
+        kill_cgroup(inst);
+    } catch (...) {}
+    reaper_defer(inst);
 }
 
 /**
- * Adds task to cgroups.
+ * Adds task to cgroups set up for its isolation.
  */
-void task_to_cgroup(const saferun_inst *inst, pid_t pid)
+void task_to_cgroup(const saferun_inst *inst, pid_t pid, int isolation)
 {
     cgroup_write_ll(inst->memory_path, "tasks", pid);
-    cgroup_write_ll(inst->devices_path, "tasks", pid);
+    if (isolation & SAFERUN_ISOLATE_DEVICES)
+        cgroup_write_ll(inst->devices_path, "tasks", pid);
     cgroup_write_ll(inst->cpuacct_path, "tasks", pid);
+    if (inst->blkio_path[0] && (isolation & SAFERUN_ISOLATE_BLKIO))
+        cgroup_write_ll(inst->blkio_path, "tasks", pid);
+    if (cpu_is_separate(inst))
+        cgroup_write_ll(inst->cpu_path, "tasks", pid);
+    if (inst->perf_event_path[0])
+        cgroup_write_ll(inst->perf_event_path, "tasks", pid);
+    if (inst->freezer_path[0])
+        cgroup_write_ll(inst->freezer_path, "tasks", pid);
 }
 
-int do_start(void *_data)
+/**
+ * Attach perf counters to task cgroup, if they are needed.
+ *
+ * @return NULL if counters are not needed.
+ */
+perf_counters *setup_perf(const saferun_inst *inst, const saferun_limits *limits, perf_counters *perf)
+{
+    if (!inst->perf && !limits->instructions)
+        return NULL;
+
+    if (!inst->perf_event_path[0]) {
+        ERROR("perf counters are needed, but perf_event cgroup is not mounted");
+        throw -1;
+    }
+
+    perf_open(perf, inst->perf_event_path);
+    if (!perf->hw && limits->instructions)
+        WARN("no hardware counters, instructions limit is ignored");
+
+    return perf;
+}
+
+/**
+ * Attach sampling profiler to task cgroup, if it`s requested.
+ *
+ * @return NULL if profiler is not needed.
+ */
+profiler *setup_profile(const saferun_inst *inst, const saferun_task *task)
+{
+    if (!task->profile_freq)
+        return NULL;
+
+    if (!inst->perf_event_path[0]) {
+        ERROR("profiling is requested, but perf_event cgroup is not mounted");
+        throw -1;
+    }
+
+    profiler *prof = (profiler *)malloc(sizeof(profiler));
+    if (!prof)
+        throw -1;
+    try {
+        profile_open(prof, inst->perf_event_path, task->profile_freq);
+    }
+    catch (...) {
+        free(prof);
+        throw;
+    }
+    return prof;
+}
+
+/**
+ * Write profile of the run and detach profiler
+ */
+void fini_profile(profiler *prof, const saferun_task *task)
+{
+    try {
+        profile_drain(prof);
+        profile_write(prof, task->profile_fd);
+    }
+    catch (...) {
+        WARN("profile of %s is not written", task->argv[0]);
+    }
+    profile_close(prof);
+    free(prof);
+}
+
+/**
+ * Report the failed step and errno to the parent, which logs them.
+ *
+ * Magic and the report are written at once, so the parent reads
+ * the whole report after the magic.
+ */
+static void child_fail(int fd, int step)
+{
+    int msg[3] = {SYNC_MAGIC_FAIL, step, errno};
+    if (write(fd, msg, sizeof(msg)) != sizeof(msg))
+        return; // the parent sees the child exit anyway
+}
+
+/**
+ * Log the failure reported by child_fail(), its magic is already read.
+ */
+static void child_failed(int fd, const saferun_task *task)
+{
+    int msg[2];
+    if (read(fd, msg, sizeof(msg)) != sizeof(msg) || msg[0] < 0 || msg[0] >= JAIL_STEPS) {
+        ERROR("jail setup of %s failed", task->argv[0]);
+        return;
+    }
+    ERROR("%s: can`t %s: %s", task->argv[0], jail_steps[msg[0]], strerror(msg[1]));
+}
+
+/**
+ * Set up the jail in the child.
+ *
+ * @param step  where to write the failed step
+ * @return -1 on failure, errno is set
+ */
+static int setup_jail(clone_data *data, int *step)
 {
-    clone_data *data = (clone_data *) _data;
     const saferun_task *task = data->task;
     const saferun_jail *jail = task->jail;
 
-    try {
-        redirect_fd(task->stdin_fd, 0);
-        redirect_fd(task->stdout_fd, 1);
-        redirect_fd(task->stderr_fd, 2);
-        
-        //set close-on-exec flag to all fds, except 0, 1, 2
-        setup_inherited_fds();
-        
-        setup_hostname(jail->hostname);
-        setup_chroot(jail->chroot);
-        setup_chdir(jail->chdir);
-        setup_uidgid(jail->uid, jail->gid);
+    // the program would inherit signals blocked in the calling thread
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+
+    *step = JAIL_STDIO;
+    if (redirect_fd(task->stdin_fd, 0) || redirect_fd(task->stdout_fd, 1) ||
+        redirect_fd(task->stderr_fd, 2))
+        return -1;
+
+    //set close-on-exec flag to all fds, except 0, 1, 2
+    *step = JAIL_FDS;
+    if ((data->isolation & SAFERUN_ISOLATE_FDS) && setup_inherited_fds())
+        return -1;
 
-        setup_drop_caps();
+    *step = JAIL_CTL;
+    if (data->ctl_fd >= 0) {
+        // sync socket can take the place of control socket
+        if (data->fd == SAFERUN_FORKSERVER_FD)
+            data->fd = fcntl(data->fd, F_DUPFD_CLOEXEC, SAFERUN_FORKSERVER_FD + 1);
+        if (data->fd < 0 || dup2(data->ctl_fd, SAFERUN_FORKSERVER_FD) == -1)
+            return -1;
     }
-    catch(...) {
-        sync_wake(data->fd, SYNC_MAGIC_FAIL);
+
+    *step = JAIL_HOSTNAME;
+    if (setup_hostname(jail->hostname))
+        return -1;
+    *step = JAIL_CHROOT;
+    if (setup_chroot(jail->chroot))
+        return -1;
+    *step = JAIL_CHDIR;
+    if (setup_chdir(jail->chdir))
+        return -1;
+    *step = JAIL_UIDGID;
+    if (setup_uidgid(jail->uid, jail->gid))
+        return -1;
+
+    *step = JAIL_ASLR;
+    if ((jail->flags & SAFERUN_JAIL_NO_ASLR) && setup_no_aslr())
+        return -1;
+    *step = JAIL_CPU;
+    if ((jail->flags & SAFERUN_JAIL_PIN_CPU) && setup_cpu_affinity(jail->cpu))
+        return -1;
+    *step = JAIL_FSIZE;
+    if (task->limits->io_write && setup_file_size(task->limits->io_write))
+        return -1;
+
+    *step = JAIL_CAPS;
+    if ((data->isolation & SAFERUN_ISOLATE_CAPS) && setup_drop_caps())
+        return -1;
+    return 0;
+}
+
+/**
+ * Body of the cloned child, it doesn`t log or throw, @see saferun_clone
+ */
+int do_start(void *_data)
+{
+    clone_data *data = (clone_data *) _data;
+    const saferun_task *task = data->task;
+    int step;
+
+    if (setup_jail(data, &step)) {
+        // sync socket stays in place of control socket if it can`t be moved
+        child_fail(data->fd < 0 ? SAFERUN_FORKSERVER_FD : data->fd, step);
         return -1;
     }
     
-    try {
-        sync_wake(data->fd, SYNC_MAGIC_1);
-        sync_wait(data->fd);
-    }
-    catch(...) {
+    // cgroup usage is taken by parent before waking the child, so CPU
+    // time the child spends until exec is measured and subtracted
+    timespec blocked, woken;
+    if (sync_child_wake(data->fd, SYNC_MAGIC_1))
+        return -1;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &blocked);
+    if (sync_child_wait(data->fd) || sync_child_wake(data->fd, SYNC_MAGIC_3))
+        return -1;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &woken);
+    if (sync_child_wake(data->fd, (woken.tv_sec - blocked.tv_sec) * 1000000 +
+                                  (woken.tv_nsec - blocked.tv_nsec) / 1000))
         return -1;
-    }
 
-    execvp(task->argv[0], task->argv);
+    if (task->jail->flags & SAFERUN_JAIL_CLEAN_ENV)
+        execvpe(task->argv[0], task->argv, clean_env);
+    else
+        execvp(task->argv[0], task->argv);
     
     //This code runs, so an error occured
-    ERROR("Can`t exec %s: %s", task->argv[0], strerror(errno));
-    sync_wake(data->fd, SYNC_MAGIC_FAIL);
+    child_fail(data->fd, JAIL_EXEC);
 
     return 0;
 }
 
+/**
+ * Clones the task process in jail, adds it to cgroup and waits for its exec.
+ *
+ * Only namespaces of the task isolation are made, a new network namespace
+ * is the most expensive of them.
+ *
+ * @param isolation  SAFERUN_ISOLATE_* flags of the task
+ * @param ctl_fd  passed to the program as SAFERUN_FORKSERVER_FD, -1 if none
+ * @param sv      sockets made by sync_init(), sv[1] is closed after clone
+ * @param pid     where to write pid of the task as soon as it`s cloned
+ * @param stat    where to write durations of phases and start time
+ * @return cpuacct.usage of the cgroup at exec of the program, in nanoseconds.
+ *         The child reports CPU time it spent since it was woken, so CPU
+ *         time of the program before the parent gets here is counted.
+ */
+long long spawn_task(const saferun_inst *inst, const saferun_task *task, int isolation, int ctl_fd,
+                     int sv[2], pid_t *pid, saferun_stat *stat)
+{
+    long long base_time = 0;
+    int clone_flags = 0;
+    int sync_res;
+
+    if (isolation & SAFERUN_ISOLATE_UTS)
+        clone_flags |= CLONE_NEWUTS;
+    if (isolation & SAFERUN_ISOLATE_PID)
+        clone_flags |= CLONE_NEWPID;
+    if (isolation & SAFERUN_ISOLATE_IPC)
+        clone_flags |= CLONE_NEWIPC;
+    if (isolation & SAFERUN_ISOLATE_NET)
+        clone_flags |= CLONE_NEWNET;
+
+    // without UTS namespace hostname of the host would be changed
+    if (task->jail->hostname && !(isolation & SAFERUN_ISOLATE_UTS)) {
+        ERROR("hostname is set, but isolation profile '%s' has no UTS namespace", task->isolation);
+        throw -1;
+    }
+
+    clone_data data;
+    data.task = task;
+    data.isolation = isolation;
+    data.fd = sv[1];
+    data.ctl_fd = ctl_fd;
+
+    trace_begin(stat, SAFERUN_PHASE_CLONE, *pid);
+    *pid = saferun_clone(do_start, &data, clone_flags);
+    //closing second socket as not needed in this thread
+    close(sv[1]);
+    sv[1] = 0;
+    trace_end(stat, SAFERUN_PHASE_CLONE, *pid);
+
+    trace_begin(stat, SAFERUN_PHASE_JAIL, *pid);
+    sync_res = sync_wait(sv[0]);
+    if (sync_res != SYNC_MAGIC_1) {
+        if (sync_res == SYNC_MAGIC_FAIL)
+            child_failed(sv[0], task);
+        throw -1;
+    }
+    trace_end(stat, SAFERUN_PHASE_JAIL, *pid);
+
+    trace_begin(stat, SAFERUN_PHASE_SYNC, *pid);
+    task_to_cgroup(inst, *pid, isolation);
+    // the child is blocked, so the program can`t run before these are taken
+    cgroup_read_ll(inst->cpuacct_path, "cpuacct.usage", &base_time);
+    stat->start_time = get_rtime();
+    sync_wake(sv[0], SYNC_MAGIC_2);
+    trace_end(stat, SAFERUN_PHASE_SYNC, *pid);
+
+    trace_begin(stat, SAFERUN_PHASE_EXEC, *pid);
+    if (sync_wait(sv[0]) != SYNC_MAGIC_3)
+        throw -1;
+    base_time += sync_wait(sv[0]) * 1000LL;
+    sync_res = sync_wait(sv[0]);
+    if (sync_res == SYNC_MAGIC_FAIL) {
+        // if other end is closed, sync_wait
+        // will just read nothing and return -1
+        child_failed(sv[0], task);
+        throw -1;
+    }
+    trace_end(stat, SAFERUN_PHASE_EXEC, *pid);
+    return base_time;
+}
+
 /**
  * Runs task in secured environment limiting task`s resources.
  *
@@ -153,68 +725,74 @@ int do_start(void *_data)
  */
 int saferun_run(const saferun_inst *inst, const saferun_task *task, saferun_stat *stat)
 {
-    PROFILING_START();
-    const int clone_flags = CLONE_NEWUTS | CLONE_NEWPID | CLONE_NEWIPC | CLONE_NEWNET;
     int sv[2];
     int ret = 0;
-    int sync_res = -1;
-    pid_t pid;
+    int admitted = 0;
+    int recorded = 0;
+    int isolation = 0;
+    unsigned char key[HISTORY_KEY];
+    long long base_time = 0, base_mem = 0;
+    pid_t pid = 0;
+    saferun_limits scaled;
+    const saferun_limits *limits;
+    perf_counters perf_data, *perf = NULL;
+    profiler *prof = NULL;
 
     sv[0] = sv[1] = 0;
 
     if (!inst || !task || !task->jail || !task->limits || !stat)
         return -1;
 
-    clone_data data;
-    data.task = task;
+    memset(stat->phase_time, 0, sizeof(stat->phase_time));
+    stat->cached = 0;
+    metrics_run_start();
+    recorded = history_predict(task, stat, key);
+    admitted = admission_enter(task->limits, stat);
+    limits = calibrate_limits(inst, task->limits, &scaled);
 
     try {
-        setup_cgroup(inst, task->limits);
+        trace_begin(stat, SAFERUN_PHASE_CGROUP, pid);
+        isolation = isolation_flags(task);
+        base_mem = setup_cgroup(inst, task, isolation);
+        perf = setup_perf(inst, task->limits, &perf_data);
+        prof = setup_profile(inst, task);
         sync_init(sv);
-        data.fd = sv[1];
-        
-        pid = saferun_clone(do_start, &data, clone_flags);
-        //closing second socket as not needed in this thread
-        close(sv[1]);
-        sv[1] = 0;
-
-        sync_res = sync_wait(sv[0]);
-        if (sync_res != SYNC_MAGIC_1)
-            throw -1;
-
-        task_to_cgroup(inst, pid);
-        stat->start_time = get_rtime();
+        trace_end(stat, SAFERUN_PHASE_CGROUP, pid);
 
-        sync_wake(sv[0], SYNC_MAGIC_2);
-
-        sync_res = sync_wait(sv[0]);
-        if (sync_res == SYNC_MAGIC_FAIL) {
-            // if other end is closed, sync_wait
-            // will just read nothing and return -1
-            DEBUG("Caught error on exec");
-            throw -1;
-        }
-        
-        hypervisor(inst, pid, task->limits, stat);
+        // CPU time of jail setup is not counted as time of the program
+        base_time = spawn_task(inst, task, isolation, -1, sv, &pid, stat);
         
+        trace_begin(stat, SAFERUN_PHASE_MONITOR, pid);
+        hypervisor(inst, pid, limits, isolation, perf, prof, base_time, base_mem, hv_waitpid, NULL, stat);
+        trace_end(stat, SAFERUN_PHASE_MONITOR, pid);
     }
     catch (...) {
+        metrics_error(trace_current_phase());
         if (pid > 0) kill(pid, SIGKILL);
         try {
-            cgroup_kill(inst->cpuacct_path, SIGKILL);
-            cgroup_kill(inst->memory_path, SIGKILL);
+            kill_cgroup(inst);
         } catch(...) {}
         ret = -1;
     }
     
-    PROFILING_CHECKPOINT();
-    
+    trace_begin(stat, SAFERUN_PHASE_TEARDOWN, pid);
     try {
+        if (perf)
+            perf_close(perf);
+        if (prof)
+            fini_profile(prof, task);
         sync_free(sv);
         fini_cgroup(inst);
     } catch(...) {}
-
-    PROFILING_CHECKPOINT();
+    trace_end(stat, SAFERUN_PHASE_TEARDOWN, pid);
+
+    calibrate_stat(inst, stat);
+    if (admitted)
+        admission_leave(task->limits, stat);
+    metrics_run_finish(stat, ret);
+    journal_append(task, stat, ret);
+    if (recorded)
+        history_update(key, stat, ret);
     return ret;
 }
 
@@ -226,6 +804,8 @@ int saferun_run(const saferun_inst *inst, const saferun_task *task, saferun_stat
  * @return NULL if errors, or pointer to saferun_inst otherwise.
  *
  * @note It`s a good idea to call saferun_set_logging() first.
+ * Cgroups left with this name by a crashed process are removed,
+ * so the name must not be used by other live instances.
  */
 saferun_inst* saferun_init(const char *cgroup_name)
 {
@@ -242,27 +822,182 @@ saferun_inst* saferun_init(const char *cgroup_name)
         cgroup_get_path("devices", inst->cgname, inst->devices_path);
     }
     catch (...) {
-        delete inst;
-        inst = NULL;
+        free(inst);
+        return NULL;
+    }
+
+    // blkio and cpu are optional, only I/O limits and CPU QoS need them
+    try {
+        cgroup_get_path("blkio", inst->cgname, inst->blkio_path);
+    }
+    catch (...) {
+        inst->blkio_path[0] = '\0';
+    }
+
+    try {
+        cgroup_get_path("cpu", inst->cgname, inst->cpu_path);
+    }
+    catch (...) {
+        inst->cpu_path[0] = '\0';
+    }
+
+    try {
+        cgroup_get_path("perf_event", inst->cgname, inst->perf_event_path);
+    }
+    catch (...) {
+        inst->perf_event_path[0] = '\0';
+    }
+
+    try {
+        cgroup_get_path("freezer", inst->cgname, inst->freezer_path);
+    }
+    catch (...) {
+        inst->freezer_path[0] = '\0';
     }
 
+    inst->qos_count = 0;
+    inst->persistent = 0;
+    inst->perf = 0;
+    inst->paused_total = inst->paused_since = 0;
+    inst->cancelled = 0;
+    inst->warm = NULL;
+
+    inst->speed = 1;
+    inst->reference = SAFERUN_REFERENCE_TIME;
+    inst->calibrate_interval = 0;
+    inst->calibrated = 0;
+    inst->normalize = 0;
+
+    reaper_collect(inst);
+
     return inst;
 }
 
 /**
  * Finilize the library
  *
- * @note This function just frees memory.
- * @return always 0.
+ * @note This function waits until cgroups of finished runs are removed
+ * by reaper, frees memory and removes persistent cgroup.
+ * @return -1 if inst is NULL, 0 otherwise.
  */
 int saferun_fini(saferun_inst *inst)
 {
     if (!inst)
         return -1;
+    reaper_drain(inst);
+    if (inst->persistent)
+        remove_cgroup(inst);
+    warm_free(inst->warm);
     free(inst);
     return 0;
 }
 
+/**
+ * Keep cgroup of the instance between runs.
+ *
+ * Saves mkdir and rmdir of cgroup on every run, counters are reset
+ * before each run instead. Cgroup is removed by saferun_fini().
+ *
+ * @return -1 if inst is NULL, 0 otherwise.
+ */
+int saferun_set_persistent(saferun_inst *inst, int persistent)
+{
+    if (!inst)
+        return -1;
+    if (inst->persistent && !persistent)
+        remove_cgroup(inst);
+    inst->persistent = persistent;
+    return 0;
+}
+
+/**
+ * Count instructions, cycles and task-clock of every run.
+ *
+ * Counters are attached to task cgroup with perf_event_open(2), so they
+ * need mounted perf_event cgroup. They are also used without this flag
+ * if saferun_limits.instructions is set.
+ *
+ * @return -1 if inst is NULL, 0 otherwise.
+ */
+int saferun_set_perf(saferun_inst *inst, int enabled)
+{
+    if (!inst)
+        return -1;
+    inst->perf = enabled;
+    return 0;
+}
+
+/**
+ * Add CPU QoS class to instance or change an existing one.
+ *
+ * Tasks select a class by name with saferun_task.qos.
+ * Their own saferun_limits.cpu_quota overrides the class quota.
+ *
+ * @param name        class name, like "contest" or "rejudge"
+ * @param cpu_shares  relative CPU weight, 1024 is default
+ * @param cpu_quota   CPU bandwidth in thousandths of a core, 0 means unlimited
+ *
+ * @return -1 if there are too many classes or cpu_quota is below
+ *         SAFERUN_CPU_QUOTA_MIN, 0 otherwise.
+ */
+int saferun_set_qos(saferun_inst *inst, const char *name, long cpu_shares, long cpu_quota)
+{
+    if (!inst || !name || strlen(name) >= sizeof(inst->qos[0].name))
+        return -1;
+    if (cpu_quota && cpu_quota < SAFERUN_CPU_QUOTA_MIN) {
+        ERROR("CPU quota %ld is below the minimum of %d", cpu_quota, SAFERUN_CPU_QUOTA_MIN);
+        return -1;
+    }
+
+    saferun_qos *qos = (saferun_qos *)find_qos(inst, name);
+    if (!qos) {
+        if (inst->qos_count == SAFERUN_QOS_MAX)
+            return -1;
+        qos = &inst->qos[inst->qos_count++];
+        strcpy(qos->name, name);
+    }
+
+    qos->cpu_shares = cpu_shares;
+    qos->cpu_quota = cpu_quota;
+    return 0;
+}
+
+/**
+ * Add isolation profile or change an existing one.
+ *
+ * Tasks select a profile by name with saferun_task.isolation, NULL is
+ * "full". Built-in profiles are "full" with all SAFERUN_ISOLATE_* flags
+ * and "accounting" without any, where the task is only measured and
+ * limited by memory, cpuacct and cpu cgroups. Use reduced profiles only
+ * for trusted programs like compilers and checkers, they spawn faster.
+ * Profiles are shared by all instances of the process.
+ *
+ * @param name   profile name, like "compiler"
+ * @param flags  SAFERUN_ISOLATE_* flags
+ *
+ * @return -1 if there are too many profiles, flags are unknown or name is
+ *         of a built-in profile, 0 otherwise.
+ */
+int saferun_set_isolation(const char *name, int flags)
+{
+    if (!name || strlen(name) >= sizeof(isolations[0].name) || (flags & ~SAFERUN_ISOLATE_FULL))
+        return -1;
+
+    int ret = 0;
+    pthread_mutex_lock(&isolations_lock);
+    int i = find_isolation(name);
+    if (i < 0 && isolations_count < SAFERUN_ISOLATION_MAX) {
+        i = isolations_count++;
+        strcpy(isolations[i].name, name);
+    }
+    if (i >= BUILTIN_ISOLATIONS)
+        isolations[i].flags = flags;
+    else
+        ret = -1;
+    pthread_mutex_unlock(&isolations_lock);
+    return ret;
+}
+
 /**
  * Set logging fd and logging priority.
  *
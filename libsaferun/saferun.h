@@ -31,7 +31,52 @@ extern "C" {
 #include "log_priorities.h"
 
 /* Saferun hypervisor delay */
-const int SAFERUN_HV_DELAY = 40*1000*1000; //in nanosec
+static const int SAFERUN_HV_DELAY = 40*1000*1000; //in nanosec
+
+/* Period of CPU bandwidth control */
+static const int SAFERUN_CPU_PERIOD = 100*1000; //in microsec
+
+/* Min CPU bandwidth in thousandths of a core, the kernel rejects quota below 1 ms */
+static const int SAFERUN_CPU_QUOTA_MIN = 1000*1000 / SAFERUN_CPU_PERIOD;
+
+/* Max number of QoS classes per instance */
+#define SAFERUN_QOS_MAX 8
+
+/**
+ * saferun_qos - CPU QoS class, tasks choose it by name.
+ *
+ * @see saferun_set_qos
+ */
+typedef struct saferun_qos {
+    char name[32];
+    long cpu_shares; /**< relative CPU weight, as in cpu.shares, 0 means default (1024) */
+    long cpu_quota;  /**< CPU bandwidth in thousandths of a core, 0 means unlimited */
+} saferun_qos;
+
+/* Max number of isolation profiles, built-in ones included */
+#define SAFERUN_ISOLATION_MAX 16
+
+/* Parts of isolation, flags of saferun_set_isolation */
+#define SAFERUN_ISOLATE_UTS     1   /**< new UTS namespace, needed for saferun_jail.hostname */
+#define SAFERUN_ISOLATE_PID     2   /**< new PID namespace */
+#define SAFERUN_ISOLATE_IPC     4   /**< new IPC namespace */
+#define SAFERUN_ISOLATE_NET     8   /**< new network namespace, without network */
+#define SAFERUN_ISOLATE_DEVICES 16  /**< devices cgroup denying all devices */
+#define SAFERUN_ISOLATE_BLKIO   32  /**< blkio cgroup, needed for io_* limits and statistics */
+#define SAFERUN_ISOLATE_CAPS    64  /**< drop all capabilities */
+#define SAFERUN_ISOLATE_FDS     128 /**< close inherited fds other than stdio on exec */
+#define SAFERUN_ISOLATE_FULL    255 /**< all of them, built-in "full" profile */
+
+/* CPU time of the reference workload on the reference host by default, in ms,
+   @see saferun_set_calibration */
+#define SAFERUN_REFERENCE_TIME 100
+
+/**
+ * saferun_warm - files kept in page cache for an instance.
+ *
+ * Members are private, @see saferun_warm_add
+ */
+typedef struct saferun_warm saferun_warm;
 
 /**
  * saferun_inst - information for use in library internals.
@@ -45,8 +90,121 @@ typedef struct saferun_inst {
     char cpuacct_path[MAXPATHLEN];
     char devices_path[MAXPATHLEN];
     char memory_path[MAXPATHLEN];
+    char blkio_path[MAXPATHLEN];   /**< empty if blkio subsystem is not mounted */
+    char cpu_path[MAXPATHLEN];     /**< empty if cpu subsystem is not mounted */
+    char perf_event_path[MAXPATHLEN]; /**< empty if perf_event subsystem is not mounted */
+    char freezer_path[MAXPATHLEN]; /**< empty if freezer subsystem is not mounted */
+
+    saferun_qos qos[SAFERUN_QOS_MAX];
+    int qos_count;
+
+    int persistent; /**< keep cgroup between runs, @see saferun_set_persistent */
+    int perf;       /**< count instructions and cycles, @see saferun_set_perf */
+
+    long long paused_total; /**< time spent paused, in microseconds, @see saferun_pause */
+    long long paused_since; /**< start of the current pause, zero if not paused */
+    volatile int cancelled; /**< the run is given up by another thread, @see saferun_cancel */
+
+    saferun_warm *warm; /**< NULL if nothing is warmed */
+
+    /* @see saferun_set_calibration */
+    double speed;            /**< reference milliseconds per millisecond of CPU time here, 1 if not calibrated */
+    double reference;        /**< CPU time of the reference workload on the reference host, in ms */
+    long calibrate_interval; /**< calibrate again after this many milliseconds, 0 never */
+    long long calibrated;    /**< time of the last calibration, in microseconds since epoch, 0 if never */
+    int normalize;           /**< time limits are in reference milliseconds */
 } saferun_inst;
 
+/**
+ * saferun_pool - set of persistent instances for concurrent runs.
+ *
+ * Members are private, @see saferun_pool_create
+ */
+typedef struct saferun_pool saferun_pool;
+
+/**
+ * saferun_cache - on-disk cache of run results.
+ *
+ * Members are private, @see saferun_cache_open
+ */
+typedef struct saferun_cache saferun_cache;
+
+/**
+ * saferun_history - on-disk history of resource usage per executable.
+ *
+ * Members are private, @see saferun_history_open
+ */
+typedef struct saferun_history saferun_history;
+
+/**
+ * saferun_cache_info - cache counters.
+ *
+ * @see saferun_cache_get_info
+ */
+typedef struct saferun_cache_info {
+    int slots;              /**< max entries */
+    int entries;            /**< cached results */
+    long long hits;         /**< results returned from cache */
+    long long misses;       /**< tasks not found in cache and run */
+    long long verified;     /**< hits run again to verify the result */
+    long long mismatches;   /**< verified hits with other result, @see saferun_cache_set_verify */
+} saferun_cache_info;
+
+/**
+ * saferun_remote_load - load of saferun daemon, reported on status request.
+ *
+ * @see saferun_remote_get_load
+ */
+typedef struct saferun_remote_load {
+    int in_flight; /**< runs in progress */
+    int queued;    /**< runs waiting for admission or for a free instance */
+    int capacity;  /**< max concurrent runs */
+
+    double cpu_pressure;    /**< PSI "some avg10" in percent, -1 if unknown */
+    double memory_pressure; /**< PSI "some avg10" in percent, -1 if unknown */
+    double io_pressure;     /**< PSI "some avg10" in percent, -1 if unknown */
+} saferun_remote_load;
+
+/**
+ * saferun_remote_policy - what saferun daemon accepts from its clients.
+ *
+ * Clients describe their tasks completely, so the daemon restricts
+ * everything that would let a task out of the jail. Tasks never run as root.
+ *
+ * @see saferun_remote_recv_request
+ */
+typedef struct saferun_remote_policy {
+    const char *io_root;           /**< dir with stdio files sent as paths, NULL to refuse paths */
+    uid_t uid;                     /**< if not zero, run every task as this UID, whatever client asks */
+    gid_t gid;                     /**< GID to run every task with, if uid is set */
+    const char *const *chroots;    /**< dirs tasks may chroot to, NULL terminated, NULL for none */
+    const char *const *isolations; /**< profiles tasks may use besides "full", NULL terminated,
+                                        "accounting" is never accepted */
+} saferun_remote_policy;
+
+/**
+ * saferun_remote_peer - client on the other end of daemon connection.
+ *
+ * @see saferun_remote_get_peer
+ */
+typedef struct saferun_remote_peer {
+    int trusted; /**< root or user of the daemon, or TCP client knowing the shared secret,
+                      may run tasks as any user but root */
+    uid_t uid;   /**< untrusted peer may run tasks only as its own UID and GID */
+    gid_t gid;
+} saferun_remote_peer;
+
+/* Types of requests to saferun daemon, @see saferun_remote_recv_request */
+#define SAFERUN_REMOTE_TASK   1 /**< task to run */
+#define SAFERUN_REMOTE_STATUS 3 /**< request of load, @see saferun_remote_status */
+#define SAFERUN_REMOTE_CANCEL 4 /**< cancel of a task which is not started yet */
+
+/* Reply value for a cancelled task, instead of saferun_run return value */
+#define SAFERUN_REMOTE_CANCELLED 2
+
+/* Flags of saferun_remote_listen */
+#define SAFERUN_LISTEN_ANY 1 /**< allow TCP address listening on all interfaces, like 0.0.0.0 */
+
 /**
  * saferun_jail - jail parameters for running the task.
  *
@@ -63,17 +221,68 @@ typedef struct saferun_jail {
     
     uid_t uid; /**< if not zero, then run as this UID */
     gid_t gid; /**< if not zero, left only this group */
+
+    int flags; /**< SAFERUN_JAIL_* flags, mostly for reducing timing variance */
+    int cpu;   /**< CPU to pin the task to, if SAFERUN_JAIL_PIN_CPU is set */
 } saferun_jail;
 
+/* saferun_jail flags */
+#define SAFERUN_JAIL_NO_ASLR   1 /**< disable address space randomization, @see personality(2) */
+#define SAFERUN_JAIL_CLEAN_ENV 2 /**< run with fixed environment instead of inherited one */
+#define SAFERUN_JAIL_PIN_CPU   4 /**< pin the task to saferun_jail.cpu */
+
+/**
+ * saferun_admission - admission control of runs, shared by the whole process.
+ *
+ * Pressure thresholds are compared with "some avg10" of /proc/pressure files,
+ * the percent of time some tasks of the host were stalled on the resource.
+ * Zero in any member means it`s not checked.
+ *
+ * @see saferun_set_admission
+ */
+typedef struct saferun_admission {
+    int max_running;        /**< max runs in progress */
+    double cpu_pressure;    /**< max CPU pressure, in percent */
+    double memory_pressure; /**< max memory pressure, in percent */
+    double io_pressure;     /**< max I/O pressure, in percent */
+    long max_wait;          /**< start run after this wait even under pressure, later runs
+                                 pass it only until then, in milliseconds */
+    long long max_memory;   /**< max sum of predicted memory of runs in progress, in bytes,
+                                 @see saferun_set_history */
+} saferun_admission;
+
 /**
  * saferun_limits - limits, that will affect the jail.
  *
  * Memory is limited by cgroup.memory subsystem, there maybe some special effects because of that.
+ *
+ * Disk I/O is limited by cgroup.blkio subsystem on the block device holding
+ * the jail root (chroot dir, or "/" if there is no chroot).
+ * Zero in any io_* member means no limit.
  */
 typedef struct saferun_limits {
     long rtime;    /**< real time, in milliseconds */
     long time;     /**< user+system time, in milliseconds */
     long long mem; /**< in bytes */
+
+    long long io_read_bps;   /**< disk read bandwidth, in bytes per second */
+    long long io_write_bps;  /**< disk write bandwidth, in bytes per second */
+    long long io_read_iops;  /**< disk read operations per second */
+    long long io_write_iops; /**< disk write operations per second */
+    long long io_write;      /**< total bytes written to disk, task is killed on excess.
+                                  Buffered writes are not counted on cgroup v1, so size
+                                  of every file written by the task, stdout too, is
+                                  limited by it as well */
+
+    long cpu_quota; /**< CPU bandwidth in thousandths of a core (1000 is one core),
+                         at least SAFERUN_CPU_QUOTA_MIN, 0 means use the one of
+                         task QoS class */
+
+    long long instructions; /**< user space instructions retired, 0 means no limit,
+                                 exceeding it is _TL. Ignored without hardware counters */
+
+    long idle; /**< real time without CPU progress, in milliseconds, exceeding it is _IL.
+                    0 means no limit */
 } saferun_limits;
 
 /**
@@ -84,9 +293,43 @@ typedef enum saferun_result {
     _RE = 1, /**< Runtime error */
     _TL = 2, /**< Time limit exceeded */
     _ML = 3, /**< Memory limit exceeded */
-    _SV = 4  /**< Security Violation, never returned */
+    _SV = 4, /**< Security Violation, never returned */
+    _OL = 5, /**< Output limit exceeded, too much written to disk */
+    _WA = 6, /**< Wrong answer, output differs from expected, @see saferun_run_tests */
+    _SK = 7, /**< Skipped or cancelled after another test failed, @see saferun_run_tests */
+    _IL = 8  /**< Idleness limit exceeded, task was blocked or sleeping, @see saferun_limits.idle */
 } saferun_result;
 
+/**
+ * saferun_phase - phases of running a task.
+ *
+ * @see saferun_stat.phase_time and saferun_trace_dump
+ */
+typedef enum saferun_phase {
+    SAFERUN_PHASE_CGROUP   = 0, /**< cgroup setup */
+    SAFERUN_PHASE_CLONE    = 1, /**< clone of the task process */
+    SAFERUN_PHASE_JAIL     = 2, /**< jail setup in child: chroot, uid, caps */
+    SAFERUN_PHASE_SYNC     = 3, /**< adding the task to cgroup and waking it up */
+    SAFERUN_PHASE_EXEC     = 4, /**< exec of the program */
+    SAFERUN_PHASE_MONITOR  = 5, /**< hypervisor, until the task is reaped */
+    SAFERUN_PHASE_TEARDOWN = 6, /**< freeing sync sockets and removing cgroup */
+    SAFERUN_PHASE_COUNT    = 7
+} saferun_phase;
+
+/**
+ * saferun_prediction - resource usage expected from history of the same task.
+ *
+ * Values are moving averages over previous runs.
+ *
+ * @see saferun_history_predict
+ */
+typedef struct saferun_prediction {
+    int runs;      /**< runs the prediction is based on, 0 if the task is new */
+    long time;     /**< user+system time, in milliseconds */
+    long rtime;    /**< real time, in milliseconds */
+    long long mem; /**< peak memory, in bytes */
+} saferun_prediction;
+
 /**
  * saferun_stat - task running statistics.
  *
@@ -95,16 +338,71 @@ typedef enum saferun_result {
  * @todo add more details of rtime measuring
  */
 typedef struct saferun_stat {
-    long rtime;           /**< in milliseconds, not very precision */
-    long time;            /**< in milliseconds */
+    long rtime;           /**< in milliseconds, not very precision, excludes paused_time */
+    long time;            /**< in milliseconds, counted since exec of the program */
     long long mem;        /**< in bytes*/
     long long start_time; /**< in microseconds, since epoch */
+    long long queue_time; /**< wait for admission before the run, in microseconds */
+
+    long long io_read;      /**< bytes read from disk */
+    long long io_write;     /**< bytes written to disk */
+    long long io_read_ops;  /**< disk read operations */
+    long long io_write_ops; /**< disk write operations */
+
+    long long throttled_periods; /**< CPU bandwidth periods the task was throttled in */
+    long throttled_time;         /**< time the task was throttled, in milliseconds */
+
+    long paused_time; /**< time the task was paused by saferun_pause, in milliseconds */
+
+    long ref_time;  /**< time in reference milliseconds, @see saferun_set_calibration */
+    long ref_rtime; /**< rtime in reference milliseconds */
+    double speed;   /**< speed of the host times were converted with, 1 if not calibrated */
+
+    long long phase_time[SAFERUN_PHASE_COUNT]; /**< duration of each phase, in microseconds */
+
+    /* perf counters, zero if not counted, @see saferun_set_perf */
+    long long instructions; /**< user space instructions retired */
+    long long cycles;       /**< user space CPU cycles */
+    long long task_clock;   /**< CPU time by software clock, in nanoseconds */
 
     int status; /**< status code, returned by waitpid function, @see waitpid(2) for details */
+    int cached; /**< 1 if result was taken from cache, @see saferun_cache_run */
+
+    saferun_prediction predicted; /**< made before the run, @see saferun_set_history */
 
     saferun_result result; /**< @see saferun_result */
 } saferun_stat;
 
+/* Counters hypervisor reads for checkers, @see saferun_checker */
+#define SAFERUN_COUNTER_TIME     1  /**< stat.time, from cpuacct.usage */
+#define SAFERUN_COUNTER_RTIME    2  /**< stat.rtime and stat.paused_time */
+#define SAFERUN_COUNTER_MEMORY   4  /**< stat.mem, from memory.memsw.max_usage_in_bytes */
+#define SAFERUN_COUNTER_IO       8  /**< stat.io_*, zero if blkio cgroup is not mounted */
+#define SAFERUN_COUNTER_PERF     16 /**< stat.instructions, cycles and task_clock, zero if not counted */
+#define SAFERUN_COUNTER_THROTTLE 32 /**< stat.throttled_*, zero if cpu cgroup is not mounted */
+#define SAFERUN_COUNTER_ALL      63
+
+/* Max number of checkers registered by saferun_register_checker */
+#define SAFERUN_CHECKER_MAX 16
+
+/**
+ * saferun_checker - limit check run by hypervisor.
+ *
+ * Every tick hypervisor reads counters needed by any of the checkers once,
+ * then calls the checkers with the statistics. After the task exits all
+ * counters are read, stat.status is set and checkers are called with
+ * finished set. Check returns _OK, or the result to kill the task with.
+ *
+ * @see saferun_register_checker
+ */
+typedef struct saferun_checker {
+    char name[32];
+    int counters; /**< SAFERUN_COUNTER_* flags */
+    saferun_result (*check)(const saferun_limits *limits, const saferun_stat *stat,
+                            int finished, void *data);
+    void *data;   /**< passed to check */
+} saferun_checker;
+
 /**
  * saferun_task - structure describing a task.
  * 
@@ -121,16 +419,269 @@ typedef struct saferun_task {
     int stdin_fd;  
     int stdout_fd;
     int stderr_fd;
+
+    const char *qos; /**< name of QoS class, NULL for default CPU weight */
+    const char *isolation; /**< name of isolation profile, NULL for full isolation,
+                                @see saferun_set_isolation */
+
+    int profile_freq; /**< if not zero, sample stacks of the program this many times a second */
+    int profile_fd;   /**< where to write sampled stacks in folded format, used with profile_freq */
 } saferun_task;
 
+/**
+ * saferun_summary - statistics of one value over benchmark runs.
+ */
+typedef struct saferun_summary {
+    double min;
+    double median;
+    double mean;
+    double mad; /**< median absolute deviation from median */
+    double p95; /**< 95th percentile, nearest rank */
+} saferun_summary;
+
+/**
+ * saferun_bench - results of repeated runs of one task.
+ *
+ * @see saferun_bench_run
+ */
+typedef struct saferun_bench {
+    int runs; /**< measured runs completed */
+
+    saferun_summary time;  /**< in milliseconds */
+    saferun_summary rtime; /**< in milliseconds */
+    saferun_summary mem;   /**< in bytes */
+    saferun_summary spawn; /**< cgroup setup, clone, jail, sync and exec, in microseconds */
+
+    saferun_stat last; /**< statistics of the last run, failed one if result is not _OK */
+} saferun_bench;
+
+/**
+ * saferun_test - one test of saferun_run_tests.
+ *
+ * Tests run in parallel, so they must not share fds.
+ */
+typedef struct saferun_test {
+    int stdin_fd;    /**< input of the test, rewound before run, -1 if none */
+    int expected_fd; /**< expected output, -1 if output is not checked */
+    int stdout_fd;   /**< where output goes, truncated before run, -1 for a temporary
+                          file if output is checked, or stdout of the task otherwise */
+} saferun_test;
+
+/* saferun_run_tests flags */
+#define SAFERUN_TESTS_STOP   1 /**< stop on the first failed test, tests in flight are killed */
+#define SAFERUN_TESTS_TOKENS 2 /**< compare whitespace separated tokens of output, not bytes */
+
+/**
+ * saferun_step - step of a pipeline, like saferun_task without jail.
+ *
+ * @see saferun_pipeline_run
+ */
+typedef struct saferun_step {
+    saferun_limits *limits; /**< @see saferun_limits */
+
+    char **argv;   /**< argv for passing to execv */
+    int stdin_fd;
+    int stdout_fd;
+    int stderr_fd;
+
+    const char *qos; /**< name of QoS class, NULL for default CPU weight */
+    const char *isolation; /**< name of isolation profile, NULL for full isolation */
+} saferun_step;
+
+/**
+ * saferun_journal - append-only journal of runs.
+ *
+ * Members are private, @see saferun_journal_open
+ */
+typedef struct saferun_journal saferun_journal;
+
+/**
+ * saferun_journal_reader - iterator over records of a journal.
+ *
+ * Members are private, @see saferun_journal_reader_open
+ */
+typedef struct saferun_journal_reader saferun_journal_reader;
+
+/* Bytes of argv kept in a journal record */
+#define SAFERUN_JOURNAL_ARGV 1024
+
+/* Value of saferun_journal_record.commit of a complete record, "SRJC" */
+#define SAFERUN_JOURNAL_COMMIT 0x434a5253
+
+/**
+ * saferun_journal_record - record of one run in journal.
+ *
+ * Records have fixed size, commit is written the last, so a record
+ * torn by a crash has no commit or wrong crc and is skipped by readers.
+ */
+typedef struct saferun_journal_record {
+    unsigned long long seq; /**< number of the record in the journal, from 1 */
+    long long time;         /**< when the run finished, in microseconds since epoch */
+    int ret;                /**< returned by saferun_run */
+    int argc;               /**< of the task, argv has less arguments if it`s cut */
+    int argv_len;           /**< bytes of argv used */
+    uid_t uid;
+    gid_t gid;
+
+    saferun_limits limits;
+    saferun_stat stat;
+
+    char argv[SAFERUN_JOURNAL_ARGV]; /**< arguments, each one ends with zero */
+
+    unsigned int crc;    /**< CRC-32 of the record before this field */
+    unsigned int commit; /**< SAFERUN_JOURNAL_COMMIT if the record is complete */
+} saferun_journal_record;
+
+/**
+ * saferun_forkserver - language runtime started once in jail, tests are forked from it.
+ *
+ * Members are private, @see saferun_forkserver_start
+ */
+typedef struct saferun_forkserver saferun_forkserver;
+
+/* Fork server program gets its control socket as this fd */
+#define SAFERUN_FORKSERVER_FD 3
+
+/**
+ * saferun_coord - coordinator dispatching tasks to several saferun daemons.
+ *
+ * Members are private, @see saferun_coord_create
+ */
+typedef struct saferun_coord saferun_coord;
+
+/**
+ * saferun_coord_result - result of a task run by coordinator.
+ *
+ * @see saferun_coord_wait
+ */
+typedef struct saferun_coord_result {
+    unsigned id;  /**< given to saferun_coord_submit */
+    int ret;      /**< returned by saferun_run on worker, -1 if the task failed on all tries */
+    int worker;   /**< index of worker which ran the task, -1 if none */
+    int attempts; /**< times the task was sent to workers, including stolen and failed */
+
+    saferun_stat stat;
+} saferun_coord_result;
+
+/**
+ * saferun_coord_worker - state of a worker of coordinator.
+ *
+ * @see saferun_coord_get_worker
+ */
+typedef struct saferun_coord_worker {
+    int alive;       /**< connected */
+    int outstanding; /**< tasks sent and not replied */
+
+    long long done;     /**< tasks run */
+    long long stolen;   /**< tasks taken back from its queue for other workers */
+    long long failures; /**< times connection was lost */
+
+    saferun_remote_load load; /**< last reported load */
+} saferun_coord_worker;
+
 int saferun_run(const saferun_inst *inst, const saferun_task *task, saferun_stat *stat);
+int saferun_pipeline_run(saferun_inst *inst, saferun_jail *jail,
+                         const saferun_step *steps, int count, saferun_stat *stats);
+int saferun_bench_run(saferun_inst *inst, const saferun_task *task, int warmup, int repeat,
+                      saferun_bench *bench);
+int saferun_run_tests(saferun_pool *pool, const saferun_task *task, const saferun_test *tests,
+                      int count, int concurrency, int flags, saferun_stat *stats);
+
+saferun_forkserver *saferun_forkserver_start(const saferun_inst *inst, const saferun_task *task);
+int saferun_forkserver_run(saferun_forkserver *server, const saferun_inst *inst,
+                           const saferun_task *task, saferun_stat *stat);
+int saferun_forkserver_stop(saferun_forkserver *server);
 
 saferun_inst *saferun_init(const char *cgroup_name);
 
 int saferun_fini(saferun_inst *inst);
 
+int saferun_set_qos(saferun_inst *inst, const char *name, long cpu_shares, long cpu_quota);
+int saferun_set_persistent(saferun_inst *inst, int persistent);
+int saferun_set_perf(saferun_inst *inst, int enabled);
+int saferun_calibrate(saferun_inst *inst);
+int saferun_set_calibration(saferun_inst *inst, double reference, long interval, int normalize);
+
+int saferun_warm_add(saferun_inst *inst, const char *path, int lock);
+int saferun_warm_start(saferun_inst *inst, int interval);
+int saferun_warm_residency(saferun_inst *inst, long long *resident, long long *total);
+
+int saferun_pause(saferun_inst *inst);
+int saferun_resume(saferun_inst *inst);
+int saferun_cancel(saferun_inst *inst, int cancelled);
+
+int saferun_register_checker(const saferun_checker *checker);
+int saferun_set_isolation(const char *name, int flags);
+
+saferun_pool *saferun_pool_create(const char *prefix, int size);
+saferun_inst *saferun_pool_acquire(saferun_pool *pool);
+void saferun_pool_release(saferun_pool *pool, saferun_inst *inst);
+int saferun_pool_set_qos(saferun_pool *pool, const char *name, long cpu_shares, long cpu_quota);
+int saferun_pool_set_calibration(saferun_pool *pool, double reference, long interval, int normalize);
+int saferun_pool_destroy(saferun_pool *pool);
+
+saferun_cache *saferun_cache_open(const char *dir, int slots);
+int saferun_cache_close(saferun_cache *cache);
+int saferun_cache_set_verify(saferun_cache *cache, double rate);
+int saferun_cache_run(saferun_cache *cache, const saferun_inst *inst,
+                      const saferun_task *task, saferun_stat *stat);
+int saferun_cache_invalidate(saferun_cache *cache, const saferun_task *task);
+int saferun_cache_clear(saferun_cache *cache);
+int saferun_cache_get_info(saferun_cache *cache, saferun_cache_info *info);
+
+int saferun_remote_connect(const char *address);
+int saferun_remote_listen(const char *address, int flags);
+int saferun_remote_set_secret(const char *path);
+int saferun_remote_send(int sock, unsigned id, const saferun_task *task);
+int saferun_remote_send_paths(int sock, unsigned id, const saferun_task *task,
+                              const char *const *paths);
+saferun_task *saferun_remote_recv(int sock, unsigned *id);
+saferun_task *saferun_remote_recv_request(int sock, unsigned *id, int *type,
+                                          const saferun_remote_policy *policy,
+                                          const saferun_remote_peer *peer);
+int saferun_remote_get_peer(int sock, saferun_remote_peer *peer);
+void saferun_remote_free(saferun_task *task);
+int saferun_remote_reply(int sock, unsigned id, int ret, const saferun_stat *stat);
+int saferun_remote_recv_reply(int sock, unsigned *id, int *ret, saferun_stat *stat);
+int saferun_remote_run(const char *address, const saferun_task *task, saferun_stat *stat);
+int saferun_remote_status(int sock, unsigned id, const saferun_remote_load *load);
+int saferun_remote_cancel(int sock, unsigned id);
+void saferun_remote_get_load(saferun_remote_load *load);
+
+saferun_coord *saferun_coord_create(const char *const *workers, int count, int retries);
+int saferun_coord_submit(saferun_coord *coord, unsigned id, const saferun_task *task,
+                         const char *const *paths);
+int saferun_coord_wait(saferun_coord *coord, saferun_coord_result *result, int timeout);
+int saferun_coord_get_worker(saferun_coord *coord, int index, saferun_coord_worker *info);
+int saferun_coord_destroy(saferun_coord *coord);
+
 void saferun_set_logging(int fd, int priority);
 
+int saferun_set_admission(const saferun_admission *config);
+
+saferun_journal *saferun_journal_open(const char *dir, long long segment_size, int keep);
+int saferun_journal_sync(saferun_journal *journal);
+int saferun_journal_close(saferun_journal *journal);
+int saferun_set_journal(saferun_journal *journal);
+
+saferun_history *saferun_history_open(const char *path, int slots);
+int saferun_history_close(saferun_history *history);
+int saferun_history_predict(saferun_history *history, const saferun_task *task,
+                            saferun_prediction *prediction);
+int saferun_set_history(saferun_history *history);
+
+saferun_journal_reader *saferun_journal_reader_open(const char *dir, unsigned long long from);
+int saferun_journal_next(saferun_journal_reader *reader, saferun_journal_record *record);
+long long saferun_journal_skipped(saferun_journal_reader *reader);
+int saferun_journal_reader_close(saferun_journal_reader *reader);
+
+void saferun_set_tracing(int enabled);
+int saferun_trace_dump(int fd);
+const char *saferun_phase_name(saferun_phase phase);
+
+int saferun_metrics_dump(int fd);
+int saferun_metrics_write(const char *path);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -0,0 +1,177 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "sha256.h"
+
+/*
+ * SHA-256 as in FIPS 180-4, used for keys of the result cache
+ * and for authentication of TCP connections.
+ */
+
+static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t ror(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+static void transform(sha256_ctx *ctx, const unsigned char *block)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i)
+        w[i] = (uint32_t) block[4*i] << 24 | (uint32_t) block[4*i + 1] << 16
+             | (uint32_t) block[4*i + 2] << 8 | block[4*i + 3];
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = ror(w[i-15], 7) ^ ror(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = ror(w[i-2], 17) ^ ror(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+    for (int i = 0; i < 64; ++i) {
+        uint32_t t1 = h + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+        uint32_t t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+void sha256_init(sha256_ctx *ctx)
+{
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, init, sizeof(init));
+    ctx->length = 0;
+    ctx->buf_len = 0;
+}
+
+void sha256_update(sha256_ctx *ctx, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    ctx->length += len;
+
+    while (len) {
+        size_t n = 64 - ctx->buf_len;
+        if (n > len)
+            n = len;
+        memcpy(ctx->buf + ctx->buf_len, p, n);
+        ctx->buf_len += n;
+        p += n;
+        len -= n;
+        if (ctx->buf_len == 64) {
+            transform(ctx, ctx->buf);
+            ctx->buf_len = 0;
+        }
+    }
+}
+
+void sha256_final(sha256_ctx *ctx, unsigned char digest[SHA256_SIZE])
+{
+    uint64_t bits = ctx->length * 8;
+    unsigned char pad[72];
+    size_t pad_len = (ctx->buf_len < 56 ? 56 : 120) - ctx->buf_len;
+
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (int i = 0; i < 8; ++i)
+        pad[pad_len + i] = bits >> (56 - 8*i);
+    sha256_update(ctx, pad, pad_len + 8);
+
+    for (int i = 0; i < 8; ++i) {
+        digest[4*i]     = ctx->state[i] >> 24;
+        digest[4*i + 1] = ctx->state[i] >> 16;
+        digest[4*i + 2] = ctx->state[i] >> 8;
+        digest[4*i + 3] = ctx->state[i];
+    }
+}
+
+/**
+ * Hash string with its length, so "ab","c" differs from "a","bc".
+ * NULL is hashed too and differs from "".
+ */
+void sha256_update_str(sha256_ctx *ctx, const char *s)
+{
+    uint32_t len = s ? strlen(s) : UINT32_MAX;
+    sha256_update(ctx, &len, sizeof(len));
+    if (s)
+        sha256_update(ctx, s, len);
+}
+
+/**
+ * Hash whole content of file, from its start.
+ *
+ * @return 0 on read error
+ */
+int sha256_update_fd(sha256_ctx *ctx, int fd)
+{
+    char buf[64*1024];
+    off_t offset = 0;
+    while (1) {
+        ssize_t k = pread(fd, buf, sizeof(buf), offset);
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k < 0)
+            return 0;
+        if (!k)
+            return 1;
+        sha256_update(ctx, buf, k);
+        offset += k;
+    }
+}
+
+/**
+ * HMAC-SHA-256 as in RFC 2104, with a key of one digest
+ */
+void hmac_sha256(const unsigned char key[SHA256_SIZE], const void *data, size_t len,
+                 unsigned char mac[SHA256_SIZE])
+{
+    unsigned char pad[64], inner[SHA256_SIZE];
+    sha256_ctx ctx;
+
+    memset(pad, 0x36, sizeof(pad));
+    for (int i = 0; i < SHA256_SIZE; ++i)
+        pad[i] ^= key[i];
+    sha256_init(&ctx);
+    sha256_update(&ctx, pad, sizeof(pad));
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, inner);
+
+    memset(pad, 0x5c, sizeof(pad));
+    for (int i = 0; i < SHA256_SIZE; ++i)
+        pad[i] ^= key[i];
+    sha256_init(&ctx);
+    sha256_update(&ctx, pad, sizeof(pad));
+    sha256_update(&ctx, inner, sizeof(inner));
+    sha256_final(&ctx, mac);
+}
@@ -0,0 +1,40 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _SHA256_H
+#define _SHA256_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHA256_SIZE 32
+
+struct sha256_ctx {
+    uint32_t state[8];
+    uint64_t length;      /**< bytes hashed so far */
+    unsigned char buf[64];
+    size_t buf_len;
+};
+
+void sha256_init(sha256_ctx *ctx);
+void sha256_update(sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final(sha256_ctx *ctx, unsigned char digest[SHA256_SIZE]);
+void sha256_update_str(sha256_ctx *ctx, const char *s);
+int sha256_update_fd(sha256_ctx *ctx, int fd);
+void hmac_sha256(const unsigned char key[SHA256_SIZE], const void *data, size_t len,
+                 unsigned char mac[SHA256_SIZE]);
+
+#endif /*_SHA256_H */
@@ -0,0 +1,168 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <elf.h>
+#include <link.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "symbols.h"
+#include "log.h"
+
+static int compare_symbols(const void *a, const void *b)
+{
+    const elf_symbol *x = (const elf_symbol *) a, *y = (const elf_symbol *) b;
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+/**
+ * Collect function symbols of one symbol table section
+ *
+ * Names point to es->names, the copy of string table.
+ */
+static void load_table(const char *image, const ElfW(Shdr) *sh, const ElfW(Shdr) *strtab,
+                       elf_symbols *es)
+{
+    const ElfW(Sym) *syms = (const ElfW(Sym) *) (image + sh->sh_offset);
+    size_t n = sh->sh_size / sizeof(ElfW(Sym));
+
+    memcpy(es->names, image + strtab->sh_offset, strtab->sh_size);
+    es->names[strtab->sh_size] = '\0';
+
+    for (size_t i = 0; i < n; ++i) {
+        if (ELF64_ST_TYPE(syms[i].st_info) != STT_FUNC || !syms[i].st_value
+                || syms[i].st_name >= strtab->sh_size)
+            continue;
+        elf_symbol *s = &es->syms[es->count++];
+        s->addr = syms[i].st_value;
+        s->size = syms[i].st_size;
+        s->name = es->names + syms[i].st_name;
+    }
+}
+
+/**
+ * Check that count entries of entsize bytes at off lie within the file,
+ * written so that it can`t overflow.
+ */
+static int in_file(uint64_t off, uint64_t count, uint64_t entsize, size_t size)
+{
+    return off <= size && count <= (size - off) / entsize;
+}
+
+/**
+ * Load function symbols of ELF file.
+ *
+ * Uses .symtab if the file is not stripped, .dynsym otherwise.
+ * The file can come from a sandboxed program, so nothing in it is trusted.
+ *
+ * @param fd  opened file, it`s not closed
+ * @return 0 if file is not a regular native ELF or has no symbols
+ */
+int elf_symbols_load(int fd, elf_symbols *es)
+{
+    struct stat st;
+    memset(es, 0, sizeof(elf_symbols));
+
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || (size_t) st.st_size < sizeof(ElfW(Ehdr)))
+        return 0;
+    size_t size = st.st_size;
+    const char *image = (const char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED)
+        return 0;
+
+    const ElfW(Ehdr) *eh = (const ElfW(Ehdr) *) image;
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG) || eh->e_ident[EI_CLASS] != ELFCLASS64
+            || !in_file(eh->e_shoff, eh->e_shnum, sizeof(ElfW(Shdr)), size)
+            || !in_file(eh->e_phoff, eh->e_phnum, sizeof(ElfW(Phdr)), size)) {
+        munmap((void *) image, size);
+        return 0;
+    }
+
+    const ElfW(Phdr) *ph = (const ElfW(Phdr) *) (image + eh->e_phoff);
+    for (int i = 0; i < eh->e_phnum && es->nsegments < ELF_MAX_SEGMENTS; ++i)
+        if (ph[i].p_type == PT_LOAD) {
+            elf_segment *seg = &es->segments[es->nsegments++];
+            seg->offset = ph[i].p_offset;
+            seg->vaddr = ph[i].p_vaddr;
+            seg->size = ph[i].p_filesz;
+        }
+
+    const ElfW(Shdr) *sh = (const ElfW(Shdr) *) (image + eh->e_shoff);
+    const ElfW(Shdr) *table = NULL;
+    for (int i = 0; i < eh->e_shnum; ++i)
+        if (sh[i].sh_type == SHT_SYMTAB || (sh[i].sh_type == SHT_DYNSYM && !table))
+            table = &sh[i];
+
+    const ElfW(Shdr) *strtab = table && table->sh_link < eh->e_shnum ? &sh[table->sh_link] : NULL;
+    if (strtab && table->sh_entsize == sizeof(ElfW(Sym))
+            && in_file(table->sh_offset, table->sh_size / sizeof(ElfW(Sym)), sizeof(ElfW(Sym)), size)
+            && in_file(strtab->sh_offset, strtab->sh_size, 1, size)) {
+        es->syms = (elf_symbol *) malloc(table->sh_size / sizeof(ElfW(Sym)) * sizeof(elf_symbol));
+        es->names = (char *) malloc(strtab->sh_size + 1);
+        if (es->syms && es->names)
+            load_table(image, table, strtab, es);
+        qsort(es->syms, es->count, sizeof(elf_symbol), compare_symbols);
+    }
+
+    munmap((void *) image, size);
+    return es->count > 0;
+}
+
+void elf_symbols_free(elf_symbols *es)
+{
+    free(es->syms);
+    free(es->names);
+    memset(es, 0, sizeof(elf_symbols));
+}
+
+/**
+ * Find function containing file offset.
+ *
+ * @param sym_offset  where to write offset from start of the function
+ * @return name of function, NULL if not found
+ */
+const char *elf_symbols_lookup(const elf_symbols *es, uint64_t offset, uint64_t *sym_offset)
+{
+    uint64_t addr = offset;
+    for (int i = 0; i < es->nsegments; ++i)
+        if (offset >= es->segments[i].offset && offset < es->segments[i].offset + es->segments[i].size) {
+            addr = offset - es->segments[i].offset + es->segments[i].vaddr;
+            break;
+        }
+
+    // last symbol with address <= addr
+    int lo = 0, hi = es->count - 1, found = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (es->syms[mid].addr <= addr) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    if (found < 0)
+        return NULL;
+
+    const elf_symbol *s = &es->syms[found];
+    if (s->size && addr >= s->addr + s->size)
+        return NULL;
+    *sym_offset = addr - s->addr;
+    return s->name;
+}
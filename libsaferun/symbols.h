@@ -0,0 +1,52 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _SYMBOLS_H
+#define _SYMBOLS_H
+
+#include <stdint.h>
+
+struct elf_symbol {
+    uint64_t addr;
+    uint64_t size;
+    const char *name;
+};
+
+struct elf_segment {
+    uint64_t offset; /**< in file */
+    uint64_t vaddr;
+    uint64_t size;
+};
+
+#define ELF_MAX_SEGMENTS 16
+
+/**
+ * Function symbols of an ELF file, sorted by address.
+ */
+struct elf_symbols {
+    int count;
+    elf_symbol *syms;
+    char *names;
+
+    int nsegments;
+    elf_segment segments[ELF_MAX_SEGMENTS]; /**< PT_LOAD, to turn file offsets into addresses */
+};
+
+int elf_symbols_load(int fd, elf_symbols *es);
+void elf_symbols_free(elf_symbols *es);
+const char *elf_symbols_lookup(const elf_symbols *es, uint64_t offset, uint64_t *sym_offset);
+
+#endif /*_SYMBOLS_H */
@@ -47,8 +47,12 @@ void sync_free(int sv[2])
 int sync_wait(int fd)
 {
     int sync = -1;
+    ssize_t k;
 
-    if (read(fd, &sync, sizeof(sync)) < 0) {
+    do {
+        k = read(fd, &sync, sizeof(sync));
+    } while (k < 0 && errno == EINTR);
+    if (k < 0) {
         ERROR("sync wait failure : %s", strerror(errno));
         throw -1;
     }
@@ -59,9 +63,44 @@ int sync_wait(int fd)
 void sync_wake(int fd, int sequence)
 {
     int sync = sequence;
+    ssize_t k;
 
-    if (write(fd, &sync, sizeof(sync)) < 0) {
+    do {
+        k = write(fd, &sync, sizeof(sync));
+    } while (k < 0 && errno == EINTR);
+    if (k < 0) {
         ERROR("sync wake failure : %s", strerror(errno));
         throw -1;
     }
 }
+
+/**
+ * sync_wait() for the cloned child, @see saferun_clone
+ *
+ * @return -1 on failure, nothing is logged
+ */
+int sync_child_wait(int fd)
+{
+    int sync;
+    ssize_t k;
+
+    do {
+        k = read(fd, &sync, sizeof(sync));
+    } while (k < 0 && errno == EINTR);
+    return k == sizeof(sync) ? 0 : -1;
+}
+
+/**
+ * sync_wake() for the cloned child, @see saferun_clone
+ *
+ * @return -1 on failure, nothing is logged
+ */
+int sync_child_wake(int fd, int sequence)
+{
+    ssize_t k;
+
+    do {
+        k = write(fd, &sequence, sizeof(sequence));
+    } while (k < 0 && errno == EINTR);
+    return k == sizeof(sequence) ? 0 : -1;
+}
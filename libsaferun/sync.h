@@ -22,5 +22,7 @@ void sync_free(int sv[2]);
 
 int  sync_wait(int fd);
 void sync_wake(int fd, int sequence);
+int  sync_child_wait(int fd);
+int  sync_child_wake(int fd, int sequence);
 
 #endif /*_SYNC_H*/
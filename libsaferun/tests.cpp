@@ -0,0 +1,361 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "saferun.h"
+#include "utils.h"
+#include "log.h"
+
+/* States of tests of saferun_run_tests */
+enum test_state {
+    TEST_WAITING   = 0,
+    TEST_RUNNING   = 1,
+    TEST_DONE      = 2,
+    TEST_CANCELLED = 3, /**< was running when another test failed */
+};
+
+/**
+ * tests_run - tests shared by worker threads of saferun_run_tests.
+ */
+struct tests_run {
+    pthread_mutex_t lock;
+
+    saferun_pool *pool;
+    const saferun_task *task;
+    const saferun_test *tests;
+    saferun_stat *stats;
+    int count;
+    int flags;
+
+    int next;     /**< first test not taken by a worker */
+    int stopped;  /**< a test failed with SAFERUN_TESTS_STOP, or library error occured */
+    int error;    /**< library error in some test */
+    int failed;   /**< tests with result other than _OK */
+
+    test_state *state;       /**< of each test */
+    saferun_inst **running;  /**< instance of each running test */
+};
+
+/**
+ * Buffered reader of file from its start, file offset is not changed.
+ */
+struct test_reader {
+    int fd;
+    off_t pos;
+    int len, i;
+    char buf[4096];
+};
+
+static void reader_init(test_reader *r, int fd)
+{
+    r->fd = fd;
+    r->pos = 0;
+    r->len = r->i = 0;
+}
+
+/**
+ * @return next byte, -1 at the end of file
+ */
+static int next_char(test_reader *r)
+{
+    if (r->i == r->len) {
+        do {
+            r->len = pread(r->fd, r->buf, sizeof(r->buf), r->pos);
+        } while (r->len < 0 && errno == EINTR);
+        if (r->len < 0) {
+            SYSERROR("can`t read output of test");
+            throw -1;
+        }
+        r->pos += r->len;
+        r->i = 0;
+        if (!r->len)
+            return -1;
+    }
+    return (unsigned char) r->buf[r->i++];
+}
+
+static int skip_space(test_reader *r, int c)
+{
+    while (c != -1 && isspace(c))
+        c = next_char(r);
+    return c;
+}
+
+static int bytes_match(test_reader *out, test_reader *expected)
+{
+    while (1) {
+        int a = next_char(out), b = next_char(expected);
+        if (a != b)
+            return 0;
+        if (a == -1)
+            return 1;
+    }
+}
+
+static int tokens_match(test_reader *out, test_reader *expected)
+{
+    int a = next_char(out), b = next_char(expected);
+    while (1) {
+        a = skip_space(out, a);
+        b = skip_space(expected, b);
+        if (a == -1 || b == -1)
+            return a == b;
+
+        while (a != -1 && b != -1 && !isspace(a) && !isspace(b)) {
+            if (a != b)
+                return 0;
+            a = next_char(out);
+            b = next_char(expected);
+        }
+        // one token ended before the other
+        if ((a == -1 || isspace(a)) != (b == -1 || isspace(b)))
+            return 0;
+    }
+}
+
+/**
+ * Compare output of the test with expected one.
+ *
+ * Output is opened again, because it`s usually write-only.
+ */
+static int output_matches(int out_fd, int expected_fd, int tokens)
+{
+    char path[64];
+    test_reader *out = NULL, *expected = NULL;
+    int read_fd = -1, match = 0;
+
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", out_fd);
+    try {
+        if ((read_fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+            SYSERROR("can`t open output of test for reading");
+            throw -1;
+        }
+        out = (test_reader *)malloc(sizeof(test_reader));
+        expected = (test_reader *)malloc(sizeof(test_reader));
+        if (!out || !expected)
+            throw -1;
+        reader_init(out, read_fd);
+        reader_init(expected, expected_fd);
+        match = tokens ? tokens_match(out, expected) : bytes_match(out, expected);
+    }
+    catch (...) {
+        free(out);
+        free(expected);
+        if (read_fd >= 0)
+            close(read_fd);
+        throw;
+    }
+
+    free(out);
+    free(expected);
+    close(read_fd);
+    return match;
+}
+
+/**
+ * Run one test and check its output.
+ *
+ * @return 0 if the test was run, -1 on library error
+ */
+static int run_test(tests_run *run, saferun_inst *inst, int i)
+{
+    const saferun_test *test = &run->tests[i];
+    saferun_stat *stat = &run->stats[i];
+    saferun_task task = *run->task;
+    FILE *tmp = NULL;
+    int ret = 0;
+
+    task.stdin_fd = test->stdin_fd;
+    task.stdout_fd = test->stdout_fd >= 0 ? test->stdout_fd : run->task->stdout_fd;
+    try {
+        if (test->expected_fd >= 0 && test->stdout_fd < 0) {
+            if (!(tmp = tmpfile())) {
+                SYSERROR("can`t create file for output of test %d", i);
+                throw -1;
+            }
+            task.stdout_fd = fileno(tmp);
+        }
+        // stdout of the task is shared by tests, so it`s not truncated
+        rewind_stdio(task.stdin_fd, test->stdout_fd, -1);
+
+        if (saferun_run(inst, &task, stat))
+            throw -1;
+        if (stat->result == _OK && test->expected_fd >= 0
+                && !output_matches(task.stdout_fd, test->expected_fd, run->flags & SAFERUN_TESTS_TOKENS))
+            stat->result = _WA;
+    }
+    catch (...) {
+        ERROR("test %d of %s failed", i, task.argv[0]);
+        ret = -1;
+    }
+
+    if (tmp)
+        fclose(tmp);
+    return ret;
+}
+
+/**
+ * Stop the tests, running ones are killed and reported as _SK.
+ *
+ * Called with run->lock held, so instances of running tests are not
+ * released to the pool meanwhile. Instances are only marked cancelled,
+ * hypervisor of each test kills it on its next check. Killing the cgroup
+ * here would miss a test which is still starting, its process joins
+ * the cgroup later.
+ */
+static void stop_tests(tests_run *run)
+{
+    run->stopped = 1;
+    for (int i = 0; i < run->count; ++i) {
+        if (run->state[i] != TEST_RUNNING)
+            continue;
+        run->state[i] = TEST_CANCELLED;
+        run->running[i]->cancelled = 1;
+    }
+}
+
+static void *tests_worker(void *arg)
+{
+    tests_run *run = (tests_run *) arg;
+
+    while (1) {
+        pthread_mutex_lock(&run->lock);
+        int i = run->next;
+        if (run->stopped || i == run->count) {
+            pthread_mutex_unlock(&run->lock);
+            break;
+        }
+        ++run->next;
+        pthread_mutex_unlock(&run->lock);
+
+        saferun_inst *inst = saferun_pool_acquire(run->pool);
+
+        pthread_mutex_lock(&run->lock);
+        if (run->stopped) {
+            pthread_mutex_unlock(&run->lock);
+            saferun_pool_release(run->pool, inst);
+            break;
+        }
+        run->state[i] = TEST_RUNNING;
+        run->running[i] = inst;
+        inst->cancelled = 0;
+        pthread_mutex_unlock(&run->lock);
+
+        int ret = run_test(run, inst, i);
+
+        pthread_mutex_lock(&run->lock);
+        run->running[i] = NULL;
+        // instance goes back to the pool, its next run must not be cancelled
+        inst->cancelled = 0;
+        if (run->state[i] == TEST_RUNNING) {
+            run->state[i] = TEST_DONE;
+            if (ret) {
+                run->error = 1;
+                stop_tests(run);
+            } else if (run->stats[i].result != _OK) {
+                ++run->failed;
+                if (run->flags & SAFERUN_TESTS_STOP)
+                    stop_tests(run);
+            }
+        }
+        pthread_mutex_unlock(&run->lock);
+
+        saferun_pool_release(run->pool, inst);
+    }
+
+    return NULL;
+}
+
+/**
+ * Run a program on many tests in parallel, like judging a submission.
+ *
+ * Tests run on persistent instances of pool, so cgroups are not created
+ * for every test. Each test gets the task with its stdin and stdout. If
+ * expected output is given, the output is compared with it and _WA is
+ * set when the run was _OK but the output differs.
+ *
+ * With SAFERUN_TESTS_STOP the first failed test stops the others: tests
+ * in flight are killed and all tests not finished get _SK.
+ *
+ * @param task         template of tests, its stdio is replaced by the ones of tests
+ * @param count        number of tests
+ * @param concurrency  max tests run at once, also limited by size of pool
+ * @param flags        SAFERUN_TESTS_* flags
+ * @param stats        array of count statistics, one per test
+ *
+ * @return 0 if all tests passed, 1 if some failed, -1 on library error
+ */
+int saferun_run_tests(saferun_pool *pool, const saferun_task *task, const saferun_test *tests,
+                      int count, int concurrency, int flags, saferun_stat *stats)
+{
+    if (!pool || !task || !tests || count <= 0 || concurrency <= 0 || !stats)
+        return -1;
+
+    if (concurrency > count)
+        concurrency = count;
+
+    tests_run run;
+    memset(&run, 0, sizeof(run));
+    pthread_mutex_init(&run.lock, NULL);
+    run.pool = pool;
+    run.task = task;
+    run.tests = tests;
+    run.stats = stats;
+    run.count = count;
+    run.flags = flags;
+    run.state = (test_state *)calloc(count, sizeof(test_state));
+    run.running = (saferun_inst **)calloc(count, sizeof(saferun_inst *));
+    pthread_t *threads = (pthread_t *)calloc(concurrency, sizeof(pthread_t));
+
+    int started = 0;
+    if (run.state && run.running && threads) {
+        // the calling thread is one of the workers
+        for (; started < concurrency - 1; ++started)
+            if (pthread_create(&threads[started], NULL, tests_worker, &run))
+                break;
+        tests_worker(&run);
+        for (int i = 0; i < started; ++i)
+            pthread_join(threads[i], NULL);
+
+        for (int i = 0; i < count; ++i) {
+            if (run.state[i] == TEST_WAITING) {
+                memset(&stats[i], 0, sizeof(saferun_stat));
+                stats[i].result = _SK;
+            } else if (run.state[i] == TEST_CANCELLED) {
+                stats[i].result = _SK;
+            }
+        }
+    } else {
+        run.error = 1;
+    }
+
+    free(threads);
+    free(run.running);
+    free(run.state);
+    pthread_mutex_destroy(&run.lock);
+
+    if (run.error)
+        return -1;
+    return run.failed ? 1 : 0;
+}
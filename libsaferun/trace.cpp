@@ -0,0 +1,237 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+#include "utils.h"
+#include "log.h"
+
+struct trace_event {
+    long long ts; /**< in microseconds, since epoch */
+    pid_t pid;    /**< pid of the task */
+    short phase;  /**< @see saferun_phase */
+    char type;    /**< 'B' for begin, 'E' for end, as in Chrome trace format */
+};
+
+static const char *phase_names[SAFERUN_PHASE_COUNT] = {
+    "cgroup", "clone", "jail", "sync", "exec", "monitor", "teardown"
+};
+
+/*
+ * Events of every thread are kept in its own buffer, so threads don`t
+ * contend while recording. Buffers are linked in a global list to be
+ * dumped from any thread, buffers of exited threads are freed by the
+ * next dump.
+ */
+struct trace_buffer {
+    trace_event events[TRACE_BUF_SIZE];
+    int len;
+    int dropped;
+    int exited;          /**< thread is gone, free buffer after dump */
+    pid_t tid;
+    pthread_mutex_t lock; /**< taken by the thread while recording and by dump */
+    trace_buffer *next;
+};
+
+/*
+ * Phase durations are always measured, events are recorded only if
+ * tracing is enabled.
+ */
+static int trace_enabled = 0;
+static trace_buffer *buffers = NULL;
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t buffer_key;
+static pthread_once_t buffer_once = PTHREAD_ONCE_INIT;
+static __thread trace_buffer *trace_buf = NULL;
+static __thread long long phase_start[SAFERUN_PHASE_COUNT];
+static __thread saferun_phase current_phase = SAFERUN_PHASE_CGROUP;
+
+static void buffer_exit(void *data)
+{
+    trace_buffer *buf = (trace_buffer *) data;
+    pthread_mutex_lock(&buf->lock);
+    buf->exited = 1;
+    pthread_mutex_unlock(&buf->lock);
+}
+
+static void buffer_key_init()
+{
+    pthread_key_create(&buffer_key, buffer_exit);
+}
+
+/**
+ * Get buffer of the calling thread, registering it on first use
+ *
+ * @return NULL if there is no memory for it
+ */
+static trace_buffer *own_buffer()
+{
+    if (trace_buf)
+        return trace_buf;
+
+    trace_buffer *buf = (trace_buffer *) calloc(1, sizeof(trace_buffer));
+    if (!buf)
+        return NULL;
+    buf->tid = syscall(SYS_gettid);
+    pthread_mutex_init(&buf->lock, NULL);
+
+    pthread_once(&buffer_once, buffer_key_init);
+    pthread_setspecific(buffer_key, buf);
+
+    pthread_mutex_lock(&buffers_lock);
+    buf->next = buffers;
+    buffers = buf;
+    pthread_mutex_unlock(&buffers_lock);
+
+    trace_buf = buf;
+    return buf;
+}
+
+static void trace_record(saferun_phase phase, char type, long long ts, pid_t pid)
+{
+    trace_buffer *buf = own_buffer();
+    if (!buf)
+        return;
+
+    pthread_mutex_lock(&buf->lock);
+    if (buf->len == TRACE_BUF_SIZE) {
+        ++buf->dropped;
+    } else {
+        trace_event *e = &buf->events[buf->len++];
+        e->ts = ts;
+        e->pid = pid;
+        e->phase = phase;
+        e->type = type;
+    }
+    pthread_mutex_unlock(&buf->lock);
+}
+
+/**
+ * Mark beginning of the phase
+ *
+ * @param pid  pid of the task, or 0 if it`s not known yet
+ */
+void trace_begin(saferun_stat *stat, saferun_phase phase, pid_t pid)
+{
+    long long now = get_rtime();
+    current_phase = phase;
+    phase_start[phase] = now;
+    stat->phase_time[phase] = 0;
+
+    if (trace_enabled)
+        trace_record(phase, 'B', now, pid);
+}
+
+/**
+ * Mark end of the phase and save its duration to stat
+ */
+void trace_end(saferun_stat *stat, saferun_phase phase, pid_t pid)
+{
+    long long now = get_rtime();
+    stat->phase_time[phase] = now - phase_start[phase];
+
+    if (trace_enabled)
+        trace_record(phase, 'E', now, pid);
+}
+
+/**
+ * Get the last phase started by this thread
+ */
+saferun_phase trace_current_phase()
+{
+    return current_phase;
+}
+
+/**
+ * Enable or disable recording of trace events.
+ *
+ * Durations of phases are reported in saferun_stat regardless of this.
+ */
+void saferun_set_tracing(int enabled)
+{
+    trace_enabled = enabled;
+}
+
+/**
+ * Get name of the phase, as used in trace output.
+ */
+const char *saferun_phase_name(saferun_phase phase)
+{
+    if (phase < 0 || phase >= SAFERUN_PHASE_COUNT)
+        return "unknown";
+    return phase_names[phase];
+}
+
+/**
+ * Write trace events of all threads in Chrome trace JSON format
+ * and clear their buffers.
+ *
+ * Every event keeps tid of the thread which ran the task, so runs of
+ * worker threads are shown on their own tracks.
+ * Output can be loaded to chrome://tracing or https://ui.perfetto.dev
+ *
+ * @return -1 on write error, 0 otherwise.
+ */
+int saferun_trace_dump(int fd)
+{
+    pid_t pid = getpid();
+    int ret = 0, count = 0, dropped = 0;
+
+    if (dprintf(fd, "{\"traceEvents\":[") < 0)
+        ret = -1;
+
+    pthread_mutex_lock(&buffers_lock);
+    trace_buffer **link = &buffers;
+    while (*link) {
+        trace_buffer *buf = *link;
+        pthread_mutex_lock(&buf->lock);
+        for (int i = 0; i < buf->len && !ret; ++i) {
+            const trace_event *e = &buf->events[i];
+            if (dprintf(fd, "%s\n{\"name\":\"%s\",\"cat\":\"saferun\",\"ph\":\"%c\","
+                            "\"ts\":%lld,\"pid\":%d,\"tid\":%d,\"args\":{\"task\":%d}}",
+                        count++ ? "," : "", phase_names[e->phase], e->type,
+                        e->ts, pid, buf->tid, e->pid) < 0)
+                ret = -1;
+        }
+        dropped += buf->dropped;
+        buf->len = buf->dropped = 0;
+        int exited = buf->exited;
+        pthread_mutex_unlock(&buf->lock);
+
+        if (exited) {
+            *link = buf->next;
+            pthread_mutex_destroy(&buf->lock);
+            free(buf);
+        } else {
+            link = &buf->next;
+        }
+    }
+    pthread_mutex_unlock(&buffers_lock);
+
+    if (!ret && dprintf(fd, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped\":%d}}\n",
+                        dropped) < 0)
+        ret = -1;
+
+    if (ret)
+        SYSERROR("can`t write trace");
+
+    return ret;
+}
@@ -0,0 +1,29 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include "saferun.h"
+
+/* Max number of events kept per thread until saferun_trace_dump() */
+#define TRACE_BUF_SIZE 2048
+
+void trace_begin(saferun_stat *stat, saferun_phase phase, pid_t pid);
+void trace_end(saferun_stat *stat, saferun_phase phase, pid_t pid);
+saferun_phase trace_current_phase();
+
+#endif /*_TRACE_H*/
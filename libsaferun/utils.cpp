@@ -20,17 +20,32 @@
 #include <errno.h>
 
 #include <sys/types.h>
-#include <sys/capability.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/param.h>
+#include <sys/personality.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/capability.h>
 #include <signal.h>
-#include <dirent.h>
 #include <fcntl.h>
 #include <sched.h>
 #include <grp.h>
+#include <stdio.h>
 
 #include "log.h"
 #include "utils.h"
 
+/* Entry of a directory read by getdents64, glibc doesn`t declare it */
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
 /**
  * Return real time in usecs
  */
@@ -41,8 +56,54 @@ long long get_rtime()
     return TV_TO_USEC(t);
 }
 
+/**
+ * Find block device holding dir, as "major:minor" string.
+ *
+ * blkio throttling doesn`t work on partitions, so if dir is
+ * on a partition, then the whole disk is returned.
+ */
+void get_block_device(const char *dir, char *dev, size_t size)
+{
+    struct stat st;
+    char path[MAXPATHLEN];
+
+    if (stat(dir, &st) == -1) {
+        SYSERROR("can`t stat %s", dir);
+        throw -1;
+    }
+
+    if (!major(st.st_dev)) {
+        ERROR("%s is not on a block device", dir);
+        throw -1;
+    }
+
+    snprintf(dev, size, "%u:%u", major(st.st_dev), minor(st.st_dev));
+    snprintf(path, MAXPATHLEN, "/sys/dev/block/%s/partition", dev);
+    if (access(path, F_OK))
+        return;
+
+    snprintf(path, MAXPATHLEN, "/sys/dev/block/%s/../dev", dev);
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        SYSERROR("failed to open %s", path);
+        throw -1;
+    }
+    int k = fscanf(file, "%31s", dev);
+    fclose(file);
+
+    if (k != 1) {
+        ERROR("can`t read disk of partition %s", dev);
+        throw -1;
+    }
+}
+
 /**
  * Wrapper for system clone function.
+ *
+ * The child is a copy of the calling thread only, locks of malloc and stdio
+ * held by other threads at that moment stay locked in it forever. So fn
+ * may call only async-signal-safe functions, setup_* functions below are
+ * such: they don`t log or throw, but return -1 and leave errno set.
  */
 pid_t saferun_clone(int (*fn)(void *), void *arg, int flags)
 {
@@ -67,151 +128,223 @@ pid_t saferun_clone(int (*fn)(void *), void *arg, int flags)
 /**
  * Set close-on-exec flag to all fd`s except 0, 1, 2
  * (stdin, stdout, stderr)
+ *
+ * opendir() would malloc, so /proc/self/fd is read with getdents64.
  */
-void setup_inherited_fds()
+int setup_inherited_fds()
 {
-    struct dirent dirent, *direntp;
-    int fd, fddir;
-    DIR *dir;
-
-    dir = opendir("/proc/self/fd");
-    if (!dir) {
-        SYSWARN("failed to open dir /proc/self/fd/");
-        WARN("can`t check for inherited fds");
-        return; //Not a critical error
-    }
+    char buf[4096];
+    long n;
 
-    fddir = dirfd(dir);
+    int dir = open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir == -1)
+        return -1;
 
-    while (!readdir_r(dir, &dirent, &direntp)) {
-        char procpath[64];
-        char path[PATH_MAX];
+    while ((n = syscall(SYS_getdents64, dir, buf, sizeof(buf))) > 0) {
+        for (long pos = 0; pos < n; ) {
+            const linux_dirent64 *entry = (const linux_dirent64 *) (buf + pos);
+            pos += entry->d_reclen;
 
-        if (!direntp)
-            break;
+            // names are numbers, except "." and ".."
+            const char *c = entry->d_name;
+            int fd = 0;
+            while (*c >= '0' && *c <= '9')
+                fd = fd * 10 + *c++ - '0';
+            if (*c || c == entry->d_name)
+                continue;
 
-        if (!strcmp(direntp->d_name, "."))
-            continue;
-
-        if (!strcmp(direntp->d_name, ".."))
-            continue;
-
-        fd = atoi(direntp->d_name);
-
-        if (fd == 0 || fd == 1 || fd == 2
-                || fd == fddir)
-            continue;
+            if (fd == 0 || fd == 1 || fd == 2
+                    || fd == dir)
+                continue;
 
-        /* found inherited fd, setting FD_CLOEXEC */
-        if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
-            SYSERROR("can`t close-on-exec on fd %d", fd);
-            throw -1;
+            /* found inherited fd, setting FD_CLOEXEC */
+            if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+                n = -1;
+                break;
+            }
         }
+        if (n < 0)
+            break;
     }
 
-    if (closedir(dir)) {
-        SYSERROR("failed to close directory");
-        throw -1;
-    }
+    int err = errno;
+    close(dir);
+    errno = err;
+    return n < 0 ? -1 : 0;
 }
 
-void redirect_fd(int fd, int to_fd)
+int redirect_fd(int fd, int to_fd)
 {
     if (fd == to_fd || fd < 0)
-        return;
-
-    if (close(to_fd) < 0) {
-        SYSERROR("Can`t close old fd: %d", fd);
-        throw -1;
-    }
+        return 0;
 
-    if (dup2(fd, to_fd) == -1) {
-        SYSERROR("can`t redirect fd %d to %d", fd, to_fd);
-        throw -1;
-    }
+    return dup2(fd, to_fd) == -1 ? -1 : 0;
 }
 
 /**
  * Drop all capabilities.
+ *
+ * capset is called directly, cap_init() of libcap would malloc.
  */
-void setup_drop_caps()
+int setup_drop_caps()
 {
-    cap_t empty;
-    empty = cap_init();
-    if (!empty) {
-            SYSERROR("cap_init() failed");
-            throw -1;
-    }
-
-    if ( capsetp(0, empty) ) {
-            SYSERROR("capsetp() failed");
-            throw -1;
-    }
-    
-    if ( cap_free(empty) ) {
-            SYSERROR("cap_free() failed");
-            throw -1;
-    }
+    __user_cap_header_struct header;
+    __user_cap_data_struct data[_LINUX_CAPABILITY_U32S_3];
 
-    DEBUG("capabilities has been dropped");
+    header.version = _LINUX_CAPABILITY_VERSION_3;
+    header.pid = 0;
+    memset(data, 0, sizeof(data));
+    return syscall(SYS_capset, &header, data);
 }
 
 /**
  * Change hostname
  */
-void setup_hostname(const char *name)
+int setup_hostname(const char *name)
 {
-    if (!name) return;
-    if (sethostname(name, strlen(name)) == -1) {
-        SYSERROR("can`t set hostname");
-        throw -1;
-    }
+    if (!name) return 0;
+    return sethostname(name, strlen(name));
 }
 
 /**
  * Change root directory
  */
-void setup_chroot(const char *dir)
+int setup_chroot(const char *dir)
 {
-    if (!dir) return;
-    if (chroot(dir) == -1) {
-        SYSERROR("can`t chroot");
-        throw -1;
-    }
+    if (!dir) return 0;
+    return chroot(dir);
 }
 
 /**
  * Change current directory
  */
-void setup_chdir(const char *dir)
+int setup_chdir(const char *dir)
 {
-    if (!dir) return;
-    if (chdir(dir) == -1) {
-        SYSERROR("can`t chdir");
-        throw -1;
-    }
+    if (!dir) return 0;
+    return chdir(dir);
 }
 
 /**
  * Change uid and gid.
  *
+ * glibc wrappers would wait for other threads of the parent to change
+ * their ids too, they don`t exist in the child, so system calls are
+ * made directly.
+ *
  * @note This function drops all groups except gid
  */
-void setup_uidgid(uid_t uid, gid_t gid)
+int setup_uidgid(uid_t uid, gid_t gid)
 {
     // First setting gid, because if we set uid first,
     // we wouldn`t have rights for seting gid
-    int ret1, ret2, ret3;
     const gid_t gid_list[] = {gid};
     if (gid > 0) {
-        ret1 = setgroups(1, gid_list);
-        ret2 = setgid(gid);
+        if (syscall(SYS_setgroups, 1, gid_list) == -1 || syscall(SYS_setgid, gid) == -1)
+            return -1;
     }
-    if (uid > 0) ret3 = setuid(uid);
-    if (ret1 == -1 || ret2 == -1 || ret3 == -1) {
-        ERROR("can`t set uid and gid");
-        throw -1;
+    if (uid > 0 && syscall(SYS_setuid, uid) == -1)
+        return -1;
+    return 0;
+}
+
+/**
+ * Disable address space randomization for the exec`ed program.
+ *
+ * Personality is inherited over exec, so setting it in child is enough.
+ */
+int setup_no_aslr()
+{
+    int persona = personality(0xffffffff);
+    if (persona == -1 || personality(persona | ADDR_NO_RANDOMIZE) == -1)
+        return -1;
+    return 0;
+}
+
+/**
+ * Pin the current process to one CPU
+ */
+int setup_cpu_affinity(int cpu)
+{
+    cpu_set_t set;
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set);
+}
+
+/**
+ * Limit size of files written by the current process.
+ *
+ * Hard limit is set too, so the exec`ed program can`t raise it.
+ * Writing beyond it raises SIGXFSZ.
+ */
+int setup_file_size(long long size)
+{
+    rlimit limit;
+    limit.rlim_cur = limit.rlim_max = size;
+    return setrlimit(RLIMIT_FSIZE, &limit);
+}
+
+/**
+ * Find executable of the task as it would be found by execvp in the jail.
+ *
+ * @param path  where to write path of the executable, MAXPATHLEN long
+ * @return 0 if not found
+ */
+int find_executable(const saferun_task *task, char *path)
+{
+    const char *name = task->argv[0];
+    const char *root = task->jail->chroot ? task->jail->chroot : "";
+
+    if (strchr(name, '/')) {
+        if (name[0] == '/')
+            snprintf(path, MAXPATHLEN, "%s%s", root, name);
+        else if (task->jail->chdir)
+            snprintf(path, MAXPATHLEN, "%s%s/%s", root, task->jail->chdir, name);
+        else
+            snprintf(path, MAXPATHLEN, "%s", name);
+        return access(path, X_OK) == 0;
+    }
+
+    // execvp searches PATH of the calling process, not of the new environment
+    const char *env = getenv("PATH");
+    char dirs[MAXPATHLEN];
+    snprintf(dirs, sizeof(dirs), "%s", env ? env : "/bin:/usr/bin");
+
+    char *save, *dir;
+    for (dir = strtok_r(dirs, ":", &save); dir; dir = strtok_r(NULL, ":", &save)) {
+        snprintf(path, MAXPATHLEN, "%s%s/%s", root, dir, name);
+        if (access(path, X_OK) == 0)
+            return 1;
     }
+    return 0;
 }
 
+/**
+ * Prepare stdio of a task for the next run, fds can be -1.
+ *
+ * Stdin is rewound, so every run reads the same input.
+ * Regular output files are truncated, so they keep only the last run output.
+ */
+void rewind_stdio(int stdin_fd, int stdout_fd, int stderr_fd)
+{
+    struct stat st;
+
+    if (stdin_fd >= 0 && lseek(stdin_fd, 0, SEEK_SET) == -1 && errno != ESPIPE) {
+        SYSERROR("can`t rewind stdin");
+        throw -1;
+    }
 
+    const int out[] = {stdout_fd, stderr_fd};
+    for (int i = 0; i < 2; ++i) {
+        if (out[i] < 0 || fstat(out[i], &st) == -1 || !S_ISREG(st.st_mode))
+            continue;
+        if (ftruncate(out[i], 0) == -1 || lseek(out[i], 0, SEEK_SET) == -1) {
+            SYSERROR("can`t truncate output");
+            throw -1;
+        }
+    }
+}
@@ -20,18 +20,26 @@
 #include <sys/types.h>
 #include <sched.h>
 
+#include "saferun.h"
+
 #define TV_TO_USEC(t) ((t).tv_usec + (long long)((t).tv_sec)*1000*1000)
 
 long long get_rtime();
+void get_block_device(const char *dir, char *dev, size_t size);
 
 pid_t saferun_clone(int (*fn)(void *), void *arg, int flags);
 
-void redirect_fd(int fd, int to_fd);
-void setup_inherited_fds();
-void setup_drop_caps();
-void setup_hostname(const char *name);
-void setup_chroot(const char *dir);
-void setup_chdir(const char *dir);
-void setup_uidgid(uid_t uid, gid_t gid);
+int redirect_fd(int fd, int to_fd);
+int setup_inherited_fds();
+int setup_drop_caps();
+int setup_hostname(const char *name);
+int setup_chroot(const char *dir);
+int setup_chdir(const char *dir);
+int setup_uidgid(uid_t uid, gid_t gid);
+int setup_no_aslr();
+int setup_cpu_affinity(int cpu);
+int setup_file_size(long long size);
+void rewind_stdio(int stdin_fd, int stdout_fd, int stderr_fd);
+int find_executable(const saferun_task *task, char *path);
 
 #endif /*_UTILS_H */
@@ -0,0 +1,323 @@
+/*
+ *  Copyright 2012 Alexander Ankudinov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "saferun.h"
+#include "warm.h"
+#include "log.h"
+
+/* Max files warmed for one instance, directories can be huge */
+#define WARM_MAX_FILES 65536
+
+struct warm_file {
+    char *path;
+    void *map;   /**< whole file mapped, for mincore and re-warming */
+    size_t size;
+    int locked;
+};
+
+/**
+ * saferun_warm - files of an instance kept in page cache.
+ */
+struct saferun_warm {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;  /**< wakes background thread to stop */
+
+    warm_file *files;
+    int count;
+    int capacity;
+
+    pthread_t thread;
+    int running;
+    int stop;
+    int interval;          /**< of re-warming, in milliseconds */
+};
+
+static saferun_warm *warm_create()
+{
+    saferun_warm *warm = (saferun_warm *) calloc(1, sizeof(saferun_warm));
+    if (!warm)
+        return NULL;
+    pthread_mutex_init(&warm->lock, NULL);
+    pthread_cond_init(&warm->cond, NULL);
+    return warm;
+}
+
+/**
+ * Read file to page cache, map it and lock if needed.
+ *
+ * Should be called with warm->lock held.
+ */
+static void add_file(saferun_warm *warm, const char *path, int lock)
+{
+    struct stat st;
+
+    if (warm->count == WARM_MAX_FILES) {
+        ERROR("too many files to warm, %s is skipped", path);
+        throw -1;
+    }
+    if (warm->count == warm->capacity) {
+        int capacity = warm->capacity ? warm->capacity * 2 : 64;
+        warm_file *files = (warm_file *) realloc(warm->files, capacity * sizeof(warm_file));
+        if (!files)
+            throw -1;
+        warm->files = files;
+        warm->capacity = capacity;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) == -1) {
+        SYSERROR("can`t open %s for warming", path);
+        if (fd >= 0)
+            close(fd);
+        throw -1;
+    }
+    if (!st.st_size) {
+        close(fd);
+        return;
+    }
+
+    // readahead(2) returns when pages are read, so the file is warm after this call
+    readahead(fd, 0, st.st_size);
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        SYSERROR("can`t map %s for warming", path);
+        throw -1;
+    }
+
+    warm_file *f = &warm->files[warm->count];
+    f->path = strdup(path);
+    f->map = map;
+    f->size = st.st_size;
+    f->locked = lock && mlock(map, st.st_size) == 0;
+    if (lock && !f->locked)
+        SYSWARN("can`t lock %s in memory", path);
+    ++warm->count;
+}
+
+/**
+ * Add file or all regular files under directory, symlinks are skipped.
+ */
+static void add_path(saferun_warm *warm, const char *path, int lock)
+{
+    struct stat st;
+    if (lstat(path, &st) == -1) {
+        SYSERROR("can`t stat %s", path);
+        throw -1;
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        add_file(warm, path, lock);
+        return;
+    }
+    if (!S_ISDIR(st.st_mode))
+        return;
+
+    DIR *dir = opendir(path);
+    if (!dir) {
+        SYSERROR("can`t open dir %s", path);
+        throw -1;
+    }
+    try {
+        dirent *ent;
+        char sub[MAXPATHLEN];
+        while ((ent = readdir(dir))) {
+            if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+                continue;
+            snprintf(sub, sizeof(sub), "%s/%s", path, ent->d_name);
+            add_path(warm, sub, lock);
+        }
+    }
+    catch (...) {
+        closedir(dir);
+        throw;
+    }
+    closedir(dir);
+}
+
+/**
+ * Count resident pages of file with mincore(2)
+ */
+static size_t resident_pages(const warm_file *f, size_t *total)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    size_t pages = (f->size + page - 1) / page;
+    size_t resident = 0;
+
+    *total = pages;
+    unsigned char *vec = (unsigned char *) malloc(pages);
+    if (!vec)
+        return 0;
+    if (mincore(f->map, f->size, vec) == 0)
+        for (size_t i = 0; i < pages; ++i)
+            resident += vec[i] & 1;
+    free(vec);
+    return resident;
+}
+
+/**
+ * Background thread, reads evicted pages of files again.
+ */
+static void *rewarm(void *arg)
+{
+    saferun_warm *warm = (saferun_warm *) arg;
+
+    pthread_mutex_lock(&warm->lock);
+    while (!warm->stop) {
+        timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += warm->interval / 1000;
+        deadline.tv_nsec += (warm->interval % 1000) * 1000 * 1000;
+        if (deadline.tv_nsec >= 1000*1000*1000) {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000*1000*1000;
+        }
+        if (pthread_cond_timedwait(&warm->cond, &warm->lock, &deadline) != ETIMEDOUT)
+            continue;
+
+        for (int i = 0; i < warm->count; ++i) {
+            size_t total;
+            warm_file *f = &warm->files[i];
+            if (!f->locked && resident_pages(f, &total) < total) {
+                DEBUG("re-warming %s", f->path);
+                madvise(f->map, f->size, MADV_WILLNEED);
+            }
+        }
+    }
+    pthread_mutex_unlock(&warm->lock);
+    return NULL;
+}
+
+/**
+ * Stop background thread and release all files
+ */
+void warm_free(saferun_warm *warm)
+{
+    if (!warm)
+        return;
+
+    pthread_mutex_lock(&warm->lock);
+    warm->stop = 1;
+    pthread_cond_broadcast(&warm->cond);
+    pthread_mutex_unlock(&warm->lock);
+    if (warm->running)
+        pthread_join(warm->thread, NULL);
+
+    for (int i = 0; i < warm->count; ++i) {
+        munmap(warm->files[i].map, warm->files[i].size);
+        free(warm->files[i].path);
+    }
+    free(warm->files);
+    pthread_mutex_destroy(&warm->lock);
+    pthread_cond_destroy(&warm->cond);
+    free(warm);
+}
+
+/**
+ * Read file, or all files under directory, to page cache.
+ *
+ * Files stay mapped until saferun_fini(), so their residency can be checked
+ * and they can be re-warmed. Useful for jail images, shared libraries and
+ * the toolchain, so the first run on a cold node doesn`t fault them in
+ * from disk inside the measured time.
+ *
+ * @param lock  also mlock(2) files, so they are never evicted
+ * @return -1 on error, files added before the error stay warm; 0 otherwise.
+ */
+int saferun_warm_add(saferun_inst *inst, const char *path, int lock)
+{
+    if (!inst || !path)
+        return -1;
+    if (!inst->warm && !(inst->warm = warm_create()))
+        return -1;
+
+    int ret = 0;
+    pthread_mutex_lock(&inst->warm->lock);
+    try {
+        add_path(inst->warm, path, lock);
+    }
+    catch (...) {
+        ret = -1;
+    }
+    pthread_mutex_unlock(&inst->warm->lock);
+    return ret;
+}
+
+/**
+ * Start background thread, that reads evicted pages of warm files again.
+ *
+ * @param interval  how often to check residency, in milliseconds
+ * @return -1 on error or if thread is already running, 0 otherwise.
+ */
+int saferun_warm_start(saferun_inst *inst, int interval)
+{
+    if (!inst || interval <= 0)
+        return -1;
+    if (!inst->warm && !(inst->warm = warm_create()))
+        return -1;
+
+    saferun_warm *warm = inst->warm;
+    if (warm->running)
+        return -1;
+
+    warm->interval = interval;
+    if (pthread_create(&warm->thread, NULL, rewarm, warm)) {
+        ERROR("can`t start re-warming thread");
+        return -1;
+    }
+    warm->running = 1;
+    return 0;
+}
+
+/**
+ * Check how much of warm files is in page cache, with mincore(2).
+ *
+ * @param resident  where to write size of resident pages, in bytes
+ * @param total     where to write size of all pages, in bytes
+ * @return -1 on bad arguments, 0 otherwise.
+ */
+int saferun_warm_residency(saferun_inst *inst, long long *resident, long long *total)
+{
+    if (!inst || !resident || !total)
+        return -1;
+
+    *resident = *total = 0;
+    if (!inst->warm)
+        return 0;
+
+    long page = sysconf(_SC_PAGESIZE);
+    pthread_mutex_lock(&inst->warm->lock);
+    for (int i = 0; i < inst->warm->count; ++i) {
+        size_t pages;
+        *resident += (long long) resident_pages(&inst->warm->files[i], &pages) * page;
+        *total += (long long) pages * page;
+    }
+    pthread_mutex_unlock(&inst->warm->lock);
+    return 0;
+}
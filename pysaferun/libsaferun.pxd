@@ -31,8 +31,19 @@ cdef extern from "stdio.h":
 
 cdef extern from "saferun.h":
     struct saferun_inst:
+        double speed
+
+    struct saferun_cache:
         pass
 
+    struct saferun_cache_info:
+        int slots
+        int entries
+        long long hits
+        long long misses
+        long long verified
+        long long mismatches
+
     struct saferun_jail:
         char *hostname
         char *chroot
@@ -41,25 +52,100 @@ cdef extern from "saferun.h":
         uid_t uid
         gid_t gid
 
+        int flags
+        int cpu
+
+    enum:
+        SAFERUN_JAIL_NO_ASLR
+        SAFERUN_JAIL_CLEAN_ENV
+        SAFERUN_JAIL_PIN_CPU
+
+    enum:
+        SAFERUN_ISOLATE_UTS
+        SAFERUN_ISOLATE_PID
+        SAFERUN_ISOLATE_IPC
+        SAFERUN_ISOLATE_NET
+        SAFERUN_ISOLATE_DEVICES
+        SAFERUN_ISOLATE_BLKIO
+        SAFERUN_ISOLATE_CAPS
+        SAFERUN_ISOLATE_FDS
+        SAFERUN_ISOLATE_FULL
+
+    struct saferun_admission:
+        int max_running
+        double cpu_pressure
+        double memory_pressure
+        double io_pressure
+        long max_wait
+        long long max_memory
+
     struct saferun_limits:
         long rtime
         long time
         long long mem
 
+        long long io_read_bps
+        long long io_write_bps
+        long long io_read_iops
+        long long io_write_iops
+        long long io_write
+
+        long cpu_quota
+
+        long long instructions
+
+        long idle
+
     enum saferun_result:
         _OK = 0
         _RE = 1
         _TL = 2
         _ML = 3
         _SV = 4
+        _OL = 5
+        _WA = 6
+        _SK = 7
+        _IL = 8
+
+    enum:
+        SAFERUN_PHASE_COUNT
+
+    struct saferun_prediction:
+        int runs
+        long time
+        long rtime
+        long long mem
 
     struct saferun_stat:
         long rtime
         long time
         long long mem
         long long start_time
+        long long queue_time
+
+        long long io_read
+        long long io_write
+        long long io_read_ops
+        long long io_write_ops
+
+        long long throttled_periods
+        long throttled_time
+
+        long paused_time
+
+        long ref_time
+        long ref_rtime
+        double speed
+
+        long long phase_time[SAFERUN_PHASE_COUNT]
+
+        long long instructions
+        long long cycles
+        long long task_clock
 
         int status
+        int cached
+        saferun_prediction predicted
 
         saferun_result result
 
@@ -72,13 +158,130 @@ cdef extern from "saferun.h":
         int stdout_fd
         int stderr_fd
 
-    int saferun_run(saferun_inst *inst, saferun_task *task, saferun_stat *stat)
+        char *qos
+        char *isolation
+
+        int profile_freq
+        int profile_fd
+
+    struct saferun_summary:
+        double min
+        double median
+        double mean
+        double mad
+        double p95
+
+    struct saferun_bench:
+        int runs
+
+        saferun_summary time
+        saferun_summary rtime
+        saferun_summary mem
+        saferun_summary spawn
+
+        saferun_stat last
+
+    struct saferun_step:
+        saferun_limits *limits
+
+        char **argv
+        int stdin_fd
+        int stdout_fd
+        int stderr_fd
+
+        char *qos
+        char *isolation
+
+    int saferun_run(saferun_inst *inst, saferun_task *task, saferun_stat *stat) nogil
+    int saferun_pipeline_run(saferun_inst *inst, saferun_jail *jail,
+                             saferun_step *steps, int count, saferun_stat *stats) nogil
+    int saferun_bench_run(saferun_inst *inst, saferun_task *task, int warmup, int repeat,
+                          saferun_bench *bench)
 
     saferun_inst* saferun_init(char *cgroup_name)
     int saferun_fini(saferun_inst *inst)
 
+    int saferun_set_qos(saferun_inst *inst, char *name, long cpu_shares, long cpu_quota)
+    int saferun_set_persistent(saferun_inst *inst, int persistent)
+    int saferun_set_perf(saferun_inst *inst, int enabled)
+    int saferun_calibrate(saferun_inst *inst)
+    int saferun_set_calibration(saferun_inst *inst, double reference, long interval, int normalize)
+
+    int saferun_warm_add(saferun_inst *inst, char *path, int lock)
+    int saferun_warm_start(saferun_inst *inst, int interval)
+    int saferun_warm_residency(saferun_inst *inst, long long *resident, long long *total)
+
+    int saferun_pause(saferun_inst *inst)
+    int saferun_resume(saferun_inst *inst)
+
+    int saferun_set_isolation(char *name, int flags)
+
+    saferun_cache *saferun_cache_open(char *dir, int slots)
+    int saferun_cache_close(saferun_cache *cache)
+    int saferun_cache_set_verify(saferun_cache *cache, double rate)
+    int saferun_cache_run(saferun_cache *cache, saferun_inst *inst,
+                          saferun_task *task, saferun_stat *stat) nogil
+    int saferun_cache_invalidate(saferun_cache *cache, saferun_task *task)
+    int saferun_cache_clear(saferun_cache *cache)
+    int saferun_cache_get_info(saferun_cache *cache, saferun_cache_info *info)
+
+    struct saferun_forkserver:
+        pass
+
+    saferun_forkserver *saferun_forkserver_start(saferun_inst *inst, saferun_task *task)
+    int saferun_forkserver_run(saferun_forkserver *server, saferun_inst *inst,
+                               saferun_task *task, saferun_stat *stat) nogil
+    int saferun_forkserver_stop(saferun_forkserver *server)
+
+    struct saferun_journal:
+        pass
+
+    struct saferun_journal_reader:
+        pass
+
+    struct saferun_journal_record:
+        unsigned long long seq
+        long long time
+        int ret
+        int argc
+        int argv_len
+        uid_t uid
+        gid_t gid
+        saferun_limits limits
+        saferun_stat stat
+        char argv[1024]
+
+    saferun_journal *saferun_journal_open(char *dir, long long segment_size, int keep)
+    int saferun_journal_sync(saferun_journal *journal)
+    int saferun_journal_close(saferun_journal *journal)
+    int saferun_set_journal(saferun_journal *journal)
+
+    struct saferun_history:
+        pass
+
+    saferun_history *saferun_history_open(char *path, int slots)
+    int saferun_history_close(saferun_history *history)
+    int saferun_history_predict(saferun_history *history, saferun_task *task,
+                                saferun_prediction *prediction)
+    int saferun_set_history(saferun_history *history)
+
+    saferun_journal_reader *saferun_journal_reader_open(char *dir, unsigned long long start)
+    int saferun_journal_next(saferun_journal_reader *reader, saferun_journal_record *record)
+    long long saferun_journal_skipped(saferun_journal_reader *reader)
+    int saferun_journal_reader_close(saferun_journal_reader *reader)
+
+    int saferun_remote_run(char *address, saferun_task *task, saferun_stat *stat)
+
     void saferun_set_logging(int fd, int priority)
 
+    int saferun_set_admission(saferun_admission *config)
+
+    void saferun_set_tracing(int enabled)
+    int saferun_trace_dump(int fd)
+
+    int saferun_metrics_dump(int fd)
+    int saferun_metrics_write(char *path)
+
 cdef inline int get_fd(file f):
     if f is not None:
         return fileno(PyFile_AsFile(f))
@@ -46,6 +46,7 @@ __version__ = '0.1'
 cimport libsaferun
 from libsaferun cimport *
 from libc cimport stdlib
+from libc cimport string
 import sys
 
 LOG_TRACE = 0
@@ -59,6 +60,98 @@ RE = 1
 TL = 2
 ML = 3
 SV = 4
+OL = 5
+WA = 6
+SK = 7
+IL = 8
+
+ISOLATE_UTS     = SAFERUN_ISOLATE_UTS
+ISOLATE_PID     = SAFERUN_ISOLATE_PID
+ISOLATE_IPC     = SAFERUN_ISOLATE_IPC
+ISOLATE_NET     = SAFERUN_ISOLATE_NET
+ISOLATE_DEVICES = SAFERUN_ISOLATE_DEVICES
+ISOLATE_BLKIO   = SAFERUN_ISOLATE_BLKIO
+ISOLATE_CAPS    = SAFERUN_ISOLATE_CAPS
+ISOLATE_FDS     = SAFERUN_ISOLATE_FDS
+ISOLATE_FULL    = SAFERUN_ISOLATE_FULL
+
+def set_isolation(name, flags):
+    """Add isolation profile of ISOLATE_* flags, or change an existing one.
+
+    Tasks choose it by name, built-in ones are "full" and "accounting".
+    Reduced profiles spawn faster, use them only for trusted programs.
+    """
+    if saferun_set_isolation(name, flags) != 0:
+        raise ValueError("can't set isolation profile %s" % name)
+
+def set_admission(max_running=0, cpu_pressure=0, memory_pressure=0, io_pressure=0, max_wait=0,
+                  max_memory=0):
+    """Delay runs of the whole process when the host is saturated.
+
+    max_running -- max runs in progress
+    *_pressure  -- max "some avg10" of /proc/pressure files, in percent
+    max_wait    -- start run after this wait anyway, in milliseconds
+    max_memory  -- max sum of memory predicted for runs in progress, in bytes,
+                   see set_history(), not overridden by max_wait
+    Zero means not checked, wait is reported as queue_time of the stat.
+    """
+    cdef saferun_admission config
+    config.max_running, config.max_wait = max_running, max_wait
+    config.max_memory = max_memory
+    config.cpu_pressure, config.memory_pressure, config.io_pressure = cpu_pressure, memory_pressure, io_pressure
+    if saferun_set_admission(&config) != 0:
+        raise ValueError("bad admission config")
+
+def set_tracing(enabled):
+    """Enable or disable recording of trace events of runs."""
+    saferun_set_tracing(1 if enabled else 0)
+
+def trace_dump(f):
+    """Write trace events of all threads to file f in Chrome trace JSON format."""
+    f.flush()
+    if saferun_trace_dump(get_fd(f)) != 0:
+        raise IOError("can't write trace")
+
+def metrics_dump(f):
+    """Write library metrics to file f in Prometheus text format."""
+    f.flush()
+    if saferun_metrics_dump(get_fd(f)) != 0:
+        raise IOError("can't write metrics")
+
+def metrics_write(path):
+    """Write library metrics to unix socket if path is a socket, or to a file otherwise."""
+    if saferun_metrics_write(path) != 0:
+        raise IOError("can't write metrics to %s" % path)
+
+cdef saferun_journal *journal = NULL
+
+def set_journal(dir=None, segment_size=64*1024*1024, keep=0):
+    """Append a record of every run of the process to journal in dir.
+
+    segment_size -- bytes of one segment file of the journal
+    keep         -- remove older segments than the last keep, zero keeps all
+    None dir closes the journal.
+    """
+    global journal
+    cdef saferun_journal *j = NULL
+    if dir is not None:
+        j = saferun_journal_open(dir, segment_size, keep)
+        if j == NULL:
+            raise IOError("can't open journal in %s" % dir)
+        saferun_set_journal(j)
+    saferun_journal_close(journal)
+    journal = j
+
+history_used = None  # keeps the history set alive
+
+def set_history(History history=None):
+    """Predict resources of every run of the process from history and update it.
+
+    Prediction is reported as stat['predicted']. None stops using history.
+    """
+    global history_used
+    saferun_set_history(history.history if history is not None else NULL)
+    history_used = history
 
 cdef class Instance:
     """Instance(cgroup_name, log_level=LOG_INFO, log_file=sys.stderr)
@@ -83,23 +176,138 @@ cdef class Instance:
     def __dealloc__(self):
         saferun_fini(self.inst)
 
+    def set_qos(self, name, cpu_shares=1024, cpu_quota=0):
+        """Add CPU QoS class or change an existing one.
+
+        cpu_shares -- relative CPU weight
+        cpu_quota  -- CPU bandwidth in thousandths of a core, at least 10,
+                      0 means unlimited
+        """
+        if saferun_set_qos(self.inst, name, cpu_shares, cpu_quota) != 0:
+            raise ValueError("can't set QoS class %s" % name)
+
+    def set_persistent(self, persistent=True):
+        """Keep cgroup between runs instead of recreating it every time."""
+        saferun_set_persistent(self.inst, 1 if persistent else 0)
+
+    def set_perf(self, enabled=True):
+        """Count instructions, cycles and task-clock of every run."""
+        saferun_set_perf(self.inst, 1 if enabled else 0)
+
+    def set_calibration(self, reference=0, normalize=True):
+        """Measure speed of the host by a reference workload.
+
+        reference -- CPU time of the workload on the reference host in
+                     milliseconds, 0 is the built-in one
+        normalize -- take time limits in reference milliseconds
+        stat['ref_time'] and stat['ref_rtime'] are in reference milliseconds,
+        call calibrate() to measure the speed again.
+        """
+        if saferun_set_calibration(self.inst, reference, 0, 1 if normalize else 0) != 0:
+            raise RuntimeError("can't calibrate host speed")
+
+    def calibrate(self):
+        """Measure speed of the host again and return it."""
+        if saferun_calibrate(self.inst) != 0:
+            raise RuntimeError("can't calibrate host speed")
+        return self.inst.speed
+
+    def warm_add(self, path, lock=False):
+        """Read file, or all files under dir, to page cache and keep them mapped.
+
+        lock -- also lock them in memory
+        """
+        if saferun_warm_add(self.inst, path, 1 if lock else 0) != 0:
+            raise IOError("can't warm %s" % path)
+
+    def warm_start(self, interval=10000):
+        """Re-read evicted pages of warm files every interval milliseconds."""
+        if saferun_warm_start(self.inst, interval) != 0:
+            raise RuntimeError("can't start re-warming")
+
+    def warm_residency(self):
+        """Return (resident, total) bytes of warm files in page cache."""
+        cdef long long resident, total
+        saferun_warm_residency(self.inst, &resident, &total)
+        return resident, total
+
+    def run_pipeline(self, Jail jail, steps):
+        """Run steps one by one in the same jail and cgroup.
+
+        steps -- list of Task or (Task, stdin, stdout, stderr), jail and
+                 instance of the tasks are ignored
+        Stops on the first step with result other than OK, returns list
+        of statistics of steps run, or None on library error.
+        """
+        cdef int count = len(steps), done, i
+        cdef saferun_task task
+        cdef saferun_step *c_steps = <saferun_step *>stdlib.malloc(sizeof(saferun_step) * count)
+        cdef saferun_stat *stats = <saferun_stat *>stdlib.malloc(sizeof(saferun_stat) * count)
+        cdef saferun_inst *inst = self.inst
+        cdef Task t
+
+        try:
+            for i, step in enumerate(steps):
+                if isinstance(step, Task):
+                    step = (step, None, None, None)
+                t = step[0]
+                task = t._task(step[1], step[2], step[3])
+                c_steps[i].limits, c_steps[i].argv, c_steps[i].qos = task.limits, task.argv, task.qos
+                c_steps[i].isolation = task.isolation
+                c_steps[i].stdin_fd, c_steps[i].stdout_fd, c_steps[i].stderr_fd = task.stdin_fd, task.stdout_fd, task.stderr_fd
+
+            with nogil:
+                done = saferun_pipeline_run(inst, &jail._jail, c_steps, count, stats)
+            if done < 0:
+                return None
+            return [stats[i] for i in range(done)]
+        finally:
+            stdlib.free(c_steps)
+            stdlib.free(stats)
+
+    def pause(self):
+        """Freeze the running task, paused time is not counted as real time.
+
+        Can be called from other thread while Task.run is waiting.
+        """
+        if saferun_pause(self.inst) != 0:
+            raise RuntimeError("can't pause, is freezer cgroup mounted?")
+
+    def resume(self):
+        """Thaw the task frozen by pause."""
+        if saferun_resume(self.inst) != 0:
+            raise RuntimeError("can't resume")
+
 cdef class Jail:
-    """Jail(chroot=None, chdir=None, hostname=None, uid=0, gid=0)
+    """Jail(chroot=None, chdir=None, hostname=None, uid=0, gid=0,
+            no_aslr=False, clean_env=False, pin_cpu=None)
 
     Arguments:
 
-    chroot   -- dir to chroot
-    chdir    -- dir to chdir
-    hostname -- change hostname to this
-    uid, gid -- change uid and gid to this
+    chroot    -- dir to chroot
+    chdir     -- dir to chdir
+    hostname  -- change hostname to this
+    uid, gid  -- change uid and gid to this
+    no_aslr   -- disable address space randomization
+    clean_env -- run with fixed minimal environment
+    pin_cpu   -- run only on this CPU
     """
     cdef saferun_jail _jail
     cdef bytes chroot, chdir, hostname
 
-    def __cinit__(self, chroot=None, chdir=None, hostname=None, uid=0, gid=0):
+    def __cinit__(self, chroot=None, chdir=None, hostname=None, uid=0, gid=0,
+                  no_aslr=False, clean_env=False, pin_cpu=None):
         self.hostname, self.chroot, self.chdir = hostname, chroot, chdir
         
-        self._jail = saferun_jail(NULL, NULL, NULL, uid = uid, gid = gid)
+        string.memset(&self._jail, 0, sizeof(saferun_jail))
+        self._jail.uid, self._jail.gid = uid, gid
+        if no_aslr:
+            self._jail.flags |= SAFERUN_JAIL_NO_ASLR
+        if clean_env:
+            self._jail.flags |= SAFERUN_JAIL_CLEAN_ENV
+        if pin_cpu is not None:
+            self._jail.flags |= SAFERUN_JAIL_PIN_CPU
+            self._jail.cpu = pin_cpu
         if hostname is not None:
             self._jail.hostname = self.hostname
         if chdir is not None:
@@ -108,24 +316,47 @@ cdef class Jail:
             self._jail.chroot = self.chroot
 
 cdef class Limits:
-    """Limits(time = 1000, real_time = 2000, memory = 64*1024*1024)
+    """Limits(time = 1000, real_time = 2000, memory = 64*1024*1024,
+              io_read_bps = 0, io_write_bps = 0, io_read_iops = 0, io_write_iops = 0,
+              io_write = 0, cpu_quota = 0, instructions = 0, idle = 0)
+
+    Zero io_* limit means no limit.
+    cpu_quota is in thousandths of a core, zero means the one of QoS class.
+    instructions limits user space instructions retired, zero means no limit.
+    idle ends the task with IL after that many milliseconds without CPU
+    progress, zero means no limit.
     """
     cdef saferun_limits _limits
     
-    def __cinit__(self, time = 1000, real_time = 2000, memory = 64*1024*1024):
-        self._limits = saferun_limits(rtime=real_time, time=time, mem=memory)
+    def __cinit__(self, time = 1000, real_time = 2000, memory = 64*1024*1024,
+                  io_read_bps = 0, io_write_bps = 0, io_read_iops = 0, io_write_iops = 0,
+                  io_write = 0, cpu_quota = 0, instructions = 0, idle = 0):
+        string.memset(&self._limits, 0, sizeof(saferun_limits))
+        self._limits.rtime, self._limits.time, self._limits.mem = real_time, time, memory
+        self._limits.io_read_bps, self._limits.io_write_bps = io_read_bps, io_write_bps
+        self._limits.io_read_iops, self._limits.io_write_iops = io_read_iops, io_write_iops
+        self._limits.io_write = io_write
+        self._limits.cpu_quota = cpu_quota
+        self._limits.instructions = instructions
+        self._limits.idle = idle
 
 cdef class Task:
-    """Task(instance, jail, limits, argv)
+    """Task(instance, jail, limits, argv, qos=None, isolation=None)
+
+    qos       -- name of CPU QoS class, see Instance.set_qos
+    isolation -- name of isolation profile, see set_isolation, None is "full"
     """
     cdef Instance inst
     cdef Jail jail
     cdef Limits limits
     cdef tuple argv
+    cdef bytes qos
+    cdef bytes isolation
     cdef char **_argv
 
-    def __cinit__(self, instance, jail, limits, argv):
-        self.inst, self.jail, self.limits, self.argv = instance, jail, limits, argv
+    def __cinit__(self, instance, jail, limits, argv, qos=None, isolation=None):
+        self.inst, self.jail, self.limits, self.argv, self.qos = instance, jail, limits, argv, qos
+        self.isolation = isolation
 
         #converting argv
         cdef Py_ssize_t count = len(self.argv)
@@ -137,23 +368,240 @@ cdef class Task:
     def __dealloc__(self):
         stdlib.free(self._argv)
 
-    def run(self, stdin=None, stdout=None, stderr=None):
+    cdef saferun_task _task(self, stdin, stdout, stderr):
+        cdef saferun_task task
+        string.memset(&task, 0, sizeof(saferun_task))
+        task.jail, task.limits, task.argv = &self.jail._jail, &self.limits._limits, self._argv
+        task.stdin_fd, task.stdout_fd, task.stderr_fd = get_fd(stdin), get_fd(stdout), get_fd(stderr)
+        if self.qos is not None:
+            task.qos = self.qos
+        if self.isolation is not None:
+            task.isolation = self.isolation
+        return task
+
+    def run(self, stdin=None, stdout=None, stderr=None, profile=None, profile_freq=99):
         """Run task in secured environment.
 
         If stdin, stdout or stderr is not None and is a file object,
         then stdin, stdout or stderr of program is redirected to it.
+        If profile is a file object, stacks of the program are sampled
+        profile_freq times a second and written to it in folded format.
         """
         cdef saferun_stat stat
-        cdef saferun_task task = saferun_task(
-                &self.jail._jail,
-                &self.limits._limits,
-                self._argv,
-                get_fd(stdin),
-                get_fd(stdout),
-                get_fd(stderr))
+        cdef saferun_task task = self._task(stdin, stdout, stderr)
+        if profile is not None:
+            profile.flush()
+            task.profile_fd, task.profile_freq = get_fd(profile), profile_freq
         
-        cdef int error = saferun_run(self.inst.inst, &task, &stat)
+        cdef saferun_inst *inst = self.inst.inst
+        cdef int error
+
+        # let other threads pause or resume the instance meanwhile
+        with nogil:
+            error = saferun_run(inst, &task, &stat)
+        if error != 0:
+            return None
+
+        return stat
+
+    def bench(self, warmup=0, repeat=10, stdin=None, stdout=None, stderr=None):
+        """Run task warmup+repeat times in the same cgroup.
+
+        Returns dict with runs count, statistics of the last run and
+        min, median, mean, mad and p95 of time, rtime, mem and spawn (microseconds)
+        over measured runs, or None on library error. Stdin file is rewound before every run.
+        """
+        cdef saferun_bench bench
+        cdef saferun_task task = self._task(stdin, stdout, stderr)
+
+        cdef int error = saferun_bench_run(self.inst.inst, &task, warmup, repeat, &bench)
+        if error < 0:
+            return None
+
+        return {'runs': bench.runs, 'last': bench.last,
+                'time': bench.time, 'rtime': bench.rtime, 'mem': bench.mem,
+                'spawn': bench.spawn}
+
+    def run_remote(self, address, stdin=None, stdout=None, stderr=None):
+        """Run task by srund listening on unix socket address.
+
+        Instance of the task is not used, daemon has its own.
+        """
+        cdef saferun_stat stat
+        cdef saferun_task task = self._task(stdin, stdout, stderr)
+
+        cdef int error = saferun_remote_run(address, &task, &stat)
         if error != 0:
             return None
 
         return stat
+
+cdef class ForkServer:
+    """ForkServer(task, stdout=None, stderr=None)
+
+    Language runtime started once by task, like saferun-forkserver.py,
+    tests are forked from it. Cgroup of the task instance is used by the
+    server until stop. Real time limit of the task is the time to start.
+    """
+    cdef saferun_forkserver *server
+    cdef Task task
+
+    def __cinit__(self, Task task, stdout=None, stderr=None):
+        cdef saferun_task t = task._task(None, stdout, stderr)
+        self.task = task
+        self.server = saferun_forkserver_start(task.inst.inst, &t)
+        if self.server == NULL:
+            raise RuntimeError("can't start fork server %s" % task.argv[0])
+
+    def __dealloc__(self):
+        self.stop()
+
+    def run(self, Task test, stdin=None, stdout=None, stderr=None):
+        """Run test forked from the server in cgroup of test instance.
+
+        argv of the test is passed to the server, its jail is ignored.
+        Returns None on library error.
+        """
+        cdef saferun_stat stat
+        cdef saferun_task t = test._task(stdin, stdout, stderr)
+        cdef saferun_inst *inst = test.inst.inst
+        cdef int error
+
+        if self.server == NULL:
+            raise RuntimeError("fork server is stopped")
+        for f in (stdout, stderr):
+            if f is not None:
+                f.flush()
+        with nogil:
+            error = saferun_forkserver_run(self.server, inst, &t, &stat)
+        if error != 0:
+            return None
+
+        return stat
+
+    def stop(self):
+        """Kill the server and remove its cgroup."""
+        saferun_forkserver_stop(self.server)
+        self.server = NULL
+
+cdef class Cache:
+    """Cache(dir, slots=4096, verify=0)
+
+    On-disk cache of run results, keyed by executable, stdin,
+    argv, jail and limits of the task.
+
+    dir    -- directory of the cache, created if needed
+    slots  -- max cached results of a new cache
+    verify -- fraction of hits to run again for checking
+    """
+    cdef saferun_cache *cache
+
+    def __cinit__(self, dir, slots=4096, verify=0):
+        self.cache = saferun_cache_open(dir, slots)
+        if self.cache == NULL:
+            raise IOError("can't open cache in %s" % dir)
+        if saferun_cache_set_verify(self.cache, verify) != 0:
+            raise ValueError("verify rate must be from 0 to 1")
+
+    def __dealloc__(self):
+        saferun_cache_close(self.cache)
+
+    def run(self, Task task, stdin=None, stdout=None, stderr=None):
+        """Run task, or take its result and output from cache.
+
+        stat['cached'] is 1 if the result was taken from cache.
+        """
+        cdef saferun_stat stat
+        cdef saferun_task t = task._task(stdin, stdout, stderr)
+        cdef saferun_inst *inst = task.inst.inst
+        cdef int error
+
+        for f in (stdout, stderr):
+            if f is not None:
+                f.flush()
+        with nogil:
+            error = saferun_cache_run(self.cache, inst, &t, &stat)
+        if error != 0:
+            return None
+
+        return stat
+
+    def invalidate(self, Task task, stdin=None, stdout=None, stderr=None):
+        """Remove cached result of task with given stdin."""
+        cdef saferun_task t = task._task(stdin, stdout, stderr)
+        return saferun_cache_invalidate(self.cache, &t) == 0
+
+    def clear(self):
+        """Remove all cached results."""
+        if saferun_cache_clear(self.cache) != 0:
+            raise IOError("can't clear cache")
+
+    def info(self):
+        """Cache counters: slots, entries, hits, misses, verified and mismatches."""
+        cdef saferun_cache_info info
+        saferun_cache_get_info(self.cache, &info)
+        return info
+
+cdef class JournalReader:
+    """JournalReader(dir, start=0)
+
+    Iterator over records of journal in dir with seq not less than start.
+    Iteration stops at the end of written records, it can be continued
+    later, when new records are appended.
+    """
+    cdef saferun_journal_reader *reader
+
+    def __cinit__(self, dir, start=0):
+        self.reader = saferun_journal_reader_open(dir, start)
+        if self.reader == NULL:
+            raise IOError("can't open journal in %s" % dir)
+
+    def __dealloc__(self):
+        saferun_journal_reader_close(self.reader)
+
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        cdef saferun_journal_record rec
+        cdef int ret = saferun_journal_next(self.reader, &rec)
+        if ret < 0:
+            raise IOError("can't read journal")
+        if ret > 0:
+            raise StopIteration
+
+        return {'seq': rec.seq, 'time': rec.time, 'ret': rec.ret, 'argc': rec.argc,
+                'uid': rec.uid, 'gid': rec.gid, 'limits': rec.limits, 'stat': rec.stat,
+                'argv': (<char*>rec.argv)[:rec.argv_len].split(b'\0')[:-1]}
+
+    property skipped:
+        """Number of torn records skipped, they are left by crashed writers."""
+        def __get__(self):
+            return saferun_journal_skipped(self.reader)
+
+cdef class History:
+    """History(path, slots=65536)
+
+    On-disk moving averages of time, rtime and memory of runs, keyed
+    by executable and argv of the task.
+
+    path  -- file of the history, created if needed
+    slots -- max remembered tasks of a new history
+    """
+    cdef saferun_history *history
+
+    def __cinit__(self, path, slots=65536):
+        self.history = saferun_history_open(path, slots)
+        if self.history == NULL:
+            raise IOError("can't open history %s" % path)
+
+    def __dealloc__(self):
+        saferun_history_close(self.history)
+
+    def predict(self, Task task):
+        """Expected usage of task: runs, time, rtime and mem, runs is 0 if unknown."""
+        cdef saferun_prediction prediction
+        cdef saferun_task t = task._task(None, None, None)
+        if saferun_history_predict(self.history, &t, &prediction) != 0:
+            raise ValueError("bad task")
+        return prediction
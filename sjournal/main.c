@@ -0,0 +1,98 @@
+//Author: Ankudinov Alexander
+
+#include <saferun.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "config.h"
+
+/* How often new records are checked with --follow, in microseconds */
+#define FOLLOW_DELAY (200*1000)
+
+gint64 from_seq = 0;
+gboolean follow = FALSE;
+gboolean verify = FALSE;
+gboolean show_version = FALSE;
+
+static GOptionEntry entries[] =
+{
+    { "from",    'f', 0, G_OPTION_ARG_INT64, &from_seq,     "Start from record with this seq", "N" },
+    { "follow",   0 , 0, G_OPTION_ARG_NONE,  &follow,       "Wait for new records, like tail -f", NULL },
+    { "verify",   0 , 0, G_OPTION_ARG_NONE,  &verify,       "Report torn records and fail if there are some", NULL },
+    { "version", 'v', 0, G_OPTION_ARG_NONE,  &show_version, "Show version and exit", NULL },
+    { NULL }
+};
+
+char * result_str[] = {"OK", "RE", "TL", "ML", "SV", "OL", "WA", "SK", "IL"};
+
+void print_record(const struct saferun_journal_record *r)
+{
+    int i;
+
+    printf("%llu %lld ret=%d", r->seq, r->time, r->ret);
+    if (!r->ret)
+        printf(" result=%s time=%ld rtime=%ld mem=%lld status=%d",
+               result_str[r->stat.result], r->stat.time, r->stat.rtime,
+               r->stat.mem, r->stat.status);
+    printf(" uid=%d gid=%d argv=", (int) r->uid, (int) r->gid);
+
+    // arguments are separated by zeros
+    for (i = 0; i < r->argv_len; ++i)
+        putchar(r->argv[i] ? r->argv[i] : (i + 1 < r->argv_len ? ' ' : '\n'));
+    if (!r->argv_len)
+        putchar('\n');
+}
+
+int main(int argc, char *argv[])
+{
+    GError *error = NULL;
+    GOptionContext *context;
+    struct saferun_journal_record record;
+    int ret;
+
+    context = g_option_context_new("dir - print records of saferun journal");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        printf("option parsing failed: %s\n", error->message);
+        printf("see --help for more information\n");
+        return 1;
+    }
+
+    if (show_version) {
+        g_printf("version: %s\n", SJOURNAL_VERSION);
+        return 1;
+    }
+
+    if (argc != 2) {
+        g_print ("Error: journal dir is needed\n");
+        return 1;
+    }
+
+    saferun_set_logging(2, SAFERUN_LOG_WARN);
+    saferun_journal_reader *reader = saferun_journal_reader_open(argv[1], from_seq);
+    if (!reader)
+        return 1;
+
+    while ((ret = saferun_journal_next(reader, &record)) >= 0) {
+        if (!ret) {
+            print_record(&record);
+            continue;
+        }
+        if (!follow)
+            break;
+        fflush(stdout);
+        usleep(FOLLOW_DELAY);
+    }
+
+    long long skipped = saferun_journal_skipped(reader);
+    saferun_journal_reader_close(reader);
+
+    if (verify)
+        fprintf(stderr, "torn records: %lld\n", skipped);
+
+    return ret < 0 || (verify && skipped) ? 1 : 0;
+}
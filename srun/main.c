@@ -15,6 +15,7 @@ struct saferun_jail jail;
 struct saferun_limits limits;
 struct saferun_task task;
 struct saferun_stat stat;
+struct saferun_bench bench;
 
 gchar *user;
 gchar *group;
@@ -22,6 +23,25 @@ gchar *in_file;
 gchar *out_file;
 gchar *err_file;
 gchar *log_file;
+gchar *trace_file;
+gchar *metrics_file;
+gchar *remote;
+gchar *qos;
+gchar *isolation;
+gchar *cache_dir;
+gchar *history_file;
+gchar *profile_file;
+gint profile_freq = 99;
+gdouble cache_verify = 0;
+gint cpu_shares = 0;
+gboolean count_perf = FALSE;
+gboolean normalize = FALSE;
+gdouble reference = 0;
+gint repeat = 0;
+gint warmup = 0;
+gint pin_cpu = -1;
+gboolean no_aslr = FALSE;
+gboolean clean_env = FALSE;
 gboolean show_version = FALSE;
 gboolean debug_lib = FALSE;
 int log_fd;
@@ -32,10 +52,27 @@ static GOptionEntry entries[] =
     { "mem",      'm', 0, G_OPTION_ARG_INT64,  &limits.mem,    "Memory limit in bytes", "N" },
     { "time",     't', 0, G_OPTION_ARG_INT,    &limits.time,   "User+System time limit in milliseconds", "N" },
     { "rtime",    'r', 0, G_OPTION_ARG_INT,    &limits.rtime,  "Real time limit in milliseconds", "N" },
+    { "io-read-bps",   0, 0, G_OPTION_ARG_INT64, &limits.io_read_bps,   "Disk read bandwidth limit in bytes per second", "N" },
+    { "io-write-bps",  0, 0, G_OPTION_ARG_INT64, &limits.io_write_bps,  "Disk write bandwidth limit in bytes per second", "N" },
+    { "io-read-iops",  0, 0, G_OPTION_ARG_INT64, &limits.io_read_iops,  "Disk read operations per second limit", "N" },
+    { "io-write-iops", 0, 0, G_OPTION_ARG_INT64, &limits.io_write_iops, "Disk write operations per second limit", "N" },
+    { "io-write",      0, 0, G_OPTION_ARG_INT64, &limits.io_write,      "Kill program if it writes more bytes to disk", "N" },
+    { "cpu-quota",     0, 0, G_OPTION_ARG_INT,   &limits.cpu_quota,     "CPU bandwidth limit in thousandths of a core, at least 10", "N" },
+    { "cpu-shares",    0, 0, G_OPTION_ARG_INT,   &cpu_shares,           "Relative CPU weight (default is 1024)", "N" },
+    { "qos",           0, 0, G_OPTION_ARG_STRING, &qos,                 "CPU QoS class of the task, defined by srund", "name" },
+    { "isolation",     0, 0, G_OPTION_ARG_STRING, &isolation,           "Isolation profile: full (default) or accounting, for trusted programs", "name" },
+    { "instructions",  0, 0, G_OPTION_ARG_INT64, &limits.instructions,  "Limit of user space instructions retired", "N" },
+    { "idle",          0, 0, G_OPTION_ARG_INT,   &limits.idle,          "Kill program if it makes no CPU progress for this many milliseconds", "N" },
+    { "perf",          0, 0, G_OPTION_ARG_NONE,  &count_perf,           "Count instructions, cycles and task-clock", NULL },
+    { "normalize",     0, 0, G_OPTION_ARG_NONE,  &normalize,            "Take time limits in reference milliseconds of calibrated host speed", NULL },
+    { "reference",     0, 0, G_OPTION_ARG_DOUBLE, &reference,           "CPU time of reference workload on reference host in milliseconds", "ms" },
     
     { "hostname",  0 , 0, G_OPTION_ARG_STRING, &jail.hostname, "Change computer hostname", "name" },
     { "chroot",   'c', 0, G_OPTION_ARG_STRING, &jail.chroot,   "Do a chroot", "dir" },
     { "chdir",    'd', 0, G_OPTION_ARG_STRING, &jail.chdir,    "Change working directory (after chroot)", "dir" },
+    { "no-aslr",   0 , 0, G_OPTION_ARG_NONE,   &no_aslr,       "Disable address space randomization", NULL },
+    { "clean-env", 0 , 0, G_OPTION_ARG_NONE,   &clean_env,     "Run program with fixed minimal environment", NULL },
+    { "pin-cpu",   0 , 0, G_OPTION_ARG_INT,    &pin_cpu,       "Run program only on this CPU", "N" },
     { "user",     'u', 0, G_OPTION_ARG_STRING, &user,          "Run program as this user", "name" },
     { "group",    'g', 0, G_OPTION_ARG_STRING, &group,         "Run program as this group", "name" },
     
@@ -43,6 +80,19 @@ static GOptionEntry entries[] =
     { "out", 'o', 0, G_OPTION_ARG_FILENAME, &out_file, "Redirect program stdout to file", "file" },
     { "err", 'e', 0, G_OPTION_ARG_FILENAME, &err_file, "Redirect program stderr to file", "file" },
     { "log", 'l', 0, G_OPTION_ARG_FILENAME, &log_file, "Write libsaferun log to file", "file" },
+    { "profile", 0, 0, G_OPTION_ARG_FILENAME, &profile_file, "Sample stacks of the program and write them in folded format", "file" },
+    { "profile-freq", 0, 0, G_OPTION_ARG_INT, &profile_freq, "Samples per second, used with --profile", "N" },
+    { "trace", 0, 0, G_OPTION_ARG_FILENAME, &trace_file, "Write Chrome trace of the run to file", "file" },
+    { "metrics", 0, 0, G_OPTION_ARG_FILENAME, &metrics_file, "Write Prometheus metrics to file or unix socket on exit", "path" },
+    
+    { "repeat",   0, 0, G_OPTION_ARG_INT,      &repeat,      "Run program N times and show timing statistics", "N" },
+    { "warmup",   0, 0, G_OPTION_ARG_INT,      &warmup,      "Runs before measuring, used with --repeat", "N" },
+    
+    { "cache",        0, 0, G_OPTION_ARG_FILENAME, &cache_dir,    "Take result from cache in dir if the same task was run before", "dir" },
+    { "cache-verify", 0, 0, G_OPTION_ARG_DOUBLE,   &cache_verify, "Fraction of cache hits to run again for checking", "rate" },
+    { "history",      0, 0, G_OPTION_ARG_FILENAME, &history_file, "Predict usage from past runs of the program in file and update it", "file" },
+    
+    { "remote",   0, 0, G_OPTION_ARG_FILENAME, &remote,      "Run program by srund listening on this unix socket", "path" },
     
     { "version",  'v', 0, G_OPTION_ARG_NONE,   &show_version,  "Show version and exit", NULL },
     { "debug",  0, 0, G_OPTION_ARG_NONE,   &debug_lib,  "Show debug output of the library", NULL },
@@ -53,7 +103,8 @@ void set_default_options()
 {
     user = "nobody";
     group = "nogroup";
-    in_file = out_file = err_file = log_file = NULL;
+    in_file = out_file = err_file = log_file = trace_file = metrics_file = NULL;
+    remote = qos = isolation = cache_dir = history_file = profile_file = NULL;
     
     limits.mem = 64*1024*1024;
     limits.time = 1000;
@@ -89,6 +140,14 @@ void parse_options(int argc, char *argv[])
     
     jail.uid = uid_by_name(user);
     jail.gid = gid_by_name(group);
+    if (no_aslr)
+        jail.flags |= SAFERUN_JAIL_NO_ASLR;
+    if (clean_env)
+        jail.flags |= SAFERUN_JAIL_CLEAN_ENV;
+    if (pin_cpu >= 0) {
+        jail.flags |= SAFERUN_JAIL_PIN_CPU;
+        jail.cpu = pin_cpu;
+    }
 
     if (in_file)
         task.stdin_fd = openfd(in_file, "r"); 
@@ -98,14 +157,26 @@ void parse_options(int argc, char *argv[])
         task.stderr_fd = openfd(err_file, "w");
     if (log_file)
         log_fd = openfd(log_file, "w");
+    if (profile_file) {
+        task.profile_fd = openfd(profile_file, "w");
+        task.profile_freq = profile_freq;
+    }
 
     if (debug_lib)
         log_priority = SAFERUN_LOG_TRACE; //show all messages
 
     task.argv = &argv[1];
+    task.qos = qos;
+    task.isolation = isolation;
 }
 
-char * result_str[] = {"OK", "RE", "TL", "ML", "SV"};
+char * result_str[] = {"OK", "RE", "TL", "ML", "SV", "OL", "WA", "SK", "IL"};
+
+void print_summary(const char *name, const struct saferun_summary *s)
+{
+    printf("%s: min = %.0f median = %.1f mean = %.1f mad = %.1f p95 = %.0f\n",
+           name, s->min, s->median, s->mean, s->mad, s->p95);
+}
 
 int main(int argc, char *argv[])
 {
@@ -122,23 +193,123 @@ int main(int argc, char *argv[])
         return 1;
     }
     
-    char cgname[21];
-    snprintf(cgname, 20, "srun%d", getpid());
     saferun_set_logging(log_fd, log_priority);
-    saferun_inst * inst = saferun_init(cgname);
-    
-    int res = saferun_run(inst, &task, &stat);
+    saferun_set_tracing(trace_file != NULL);
+
+    if (repeat && remote) {
+        g_print ("Error: --repeat can`t be used with --remote\n");
+        return 1;
+    }
+
+    if (cache_dir && (repeat || remote)) {
+        g_print ("Error: --cache can`t be used with --repeat or --remote\n");
+        return 1;
+    }
+
+    if (normalize && remote) {
+        g_print ("Error: --normalize can`t be used with --remote, srund normalizes\n");
+        return 1;
+    }
+
+    if (history_file && remote) {
+        g_print ("Error: --history can`t be used with --remote\n");
+        return 1;
+    }
+
+    saferun_history *history = NULL;
+    if (history_file) {
+        history = saferun_history_open(history_file, 65536);
+        if (!history) {
+            g_print ("Error: can`t open history %s\n", history_file);
+            return 1;
+        }
+        saferun_set_history(history);
+    }
+
+    saferun_inst * inst = NULL;
+    int res;
+    if (remote) {
+        res = saferun_remote_run(remote, &task, &stat);
+    } else {
+        char cgname[21];
+        snprintf(cgname, 20, "srun%d", getpid());
+        inst = saferun_init(cgname);
+
+        if (inst && count_perf)
+            saferun_set_perf(inst, 1);
+
+        if (inst && normalize && saferun_set_calibration(inst, reference, 0, 1))
+            g_print ("Warning: can`t calibrate host speed, limits are not scaled\n");
+
+        if (inst && cpu_shares) {
+            saferun_set_qos(inst, "srun", cpu_shares, 0);
+            task.qos = "srun";
+        }
+
+        if (repeat) {
+            res = saferun_bench_run(inst, &task, warmup, repeat, &bench);
+            // failed run stops the benchmark, but it`s not a library error
+            if (res == 1)
+                res = 0;
+            stat = bench.last;
+        } else if (cache_dir) {
+            saferun_cache *cache = saferun_cache_open(cache_dir, 4096);
+            if (cache && saferun_cache_set_verify(cache, cache_verify))
+                g_print ("Warning: cache verify rate must be from 0 to 1\n");
+            res = cache ? saferun_cache_run(cache, inst, &task, &stat) : -1;
+            saferun_cache_close(cache);
+        } else {
+            res = saferun_run(inst, &task, &stat);
+        }
+    }
     
     if (res) {
         printf("Error: library error\n");
     } else {
         printf("\nresult = %s\nmem = %lld\ntime = %ld\nrtime = %ld\nstatus = %d\n",
                result_str[stat.result], stat.mem, stat.time, stat.rtime, stat.status);
+        printf("io_read = %lld\nio_write = %lld\nio_read_ops = %lld\nio_write_ops = %lld\n",
+               stat.io_read, stat.io_write, stat.io_read_ops, stat.io_write_ops);
+        printf("throttled_periods = %lld\nthrottled_time = %ld\n",
+               stat.throttled_periods, stat.throttled_time);
+        if (remote)
+            printf("queue_time = %lld\n", stat.queue_time);
+        if (cache_dir)
+            printf("cached = %d\n", stat.cached);
+        if (history_file)
+            printf("predicted_runs = %d\npredicted_time = %ld\npredicted_rtime = %ld\npredicted_mem = %lld\n",
+                   stat.predicted.runs, stat.predicted.time, stat.predicted.rtime, stat.predicted.mem);
+        if (normalize)
+            printf("ref_time = %ld\nref_rtime = %ld\nspeed = %.3f\n",
+                   stat.ref_time, stat.ref_rtime, stat.speed);
+        if (count_perf || limits.instructions)
+            printf("instructions = %lld\ncycles = %lld\ntask_clock = %lld\n",
+                   stat.instructions, stat.cycles, stat.task_clock);
         print_exit_status(stat.status);
+        if (repeat) {
+            printf("runs = %d\n", bench.runs);
+            print_summary("time", &bench.time);
+            print_summary("rtime", &bench.rtime);
+            print_summary("mem", &bench.mem);
+            print_summary("spawn", &bench.spawn);
+        }
+    }
+
+    if (trace_file) {
+        int i;
+        for (i = 0; i < SAFERUN_PHASE_COUNT; ++i)
+            printf("phase %s = %lld\n", saferun_phase_name(i), stat.phase_time[i]);
+        saferun_trace_dump(openfd(trace_file, "w"));
     }
     
+    if (metrics_file)
+        saferun_metrics_write(metrics_file);
+    
     saferun_fini(inst);
 
+    saferun_set_history(NULL);
+    saferun_history_close(history);
+
     if (!res && !stat.result)
         return 0;
     else
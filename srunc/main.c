@@ -0,0 +1,316 @@
+//Author: Ankudinov Alexander
+
+#define _GNU_SOURCE
+
+#include <saferun.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/wait.h>
+
+#include <glib.h>
+
+#include "config.h"
+
+/* Max words in a job line: id, three stdio files and argv */
+#define MAX_WORDS 1024
+
+struct saferun_jail jail;
+struct saferun_limits limits;
+
+gchar **worker_addresses;
+gchar *secret_file;
+gchar *jobs_file;
+gchar *user;
+gchar *group;
+gchar *qos;
+gchar *log_file;
+gint retries;
+gint window;
+gboolean send_paths = FALSE;
+gboolean show_version = FALSE;
+gboolean debug_lib = FALSE;
+int log_fd;
+int log_priority;
+
+static GOptionEntry entries[] =
+{
+    { "worker",  'w', 0, G_OPTION_ARG_FILENAME_ARRAY, &worker_addresses, "Address of srund, unix socket path or tcp:host:port", "address" },
+    { "secret",   0 , 0, G_OPTION_ARG_FILENAME, &secret_file, "File with secret shared with srund, needed for TCP workers", "file" },
+    { "jobs",    'j', 0, G_OPTION_ARG_FILENAME, &jobs_file, "Read jobs from file instead of stdin", "file" },
+    { "retries",  0 , 0, G_OPTION_ARG_INT,      &retries,   "Resend a job this many times if its worker is lost", "N" },
+    { "window",   0 , 0, G_OPTION_ARG_INT,      &window,    "Max jobs submitted and not finished", "N" },
+    { "paths",    0 , 0, G_OPTION_ARG_NONE,     &send_paths, "Send stdio paths instead of fds, default if some worker is on TCP", NULL },
+
+    { "mem",     'm', 0, G_OPTION_ARG_INT64,    &limits.mem,   "Memory limit in bytes", "N" },
+    { "time",    't', 0, G_OPTION_ARG_INT,      &limits.time,  "User+System time limit in milliseconds", "N" },
+    { "rtime",   'r', 0, G_OPTION_ARG_INT,      &limits.rtime, "Real time limit in milliseconds", "N" },
+    { "idle",    0 , 0, G_OPTION_ARG_INT,      &limits.idle,  "Kill program if it makes no CPU progress for this many milliseconds", "N" },
+    { "qos",      0 , 0, G_OPTION_ARG_STRING,   &qos,          "CPU QoS class of the tasks, defined by srund", "name" },
+
+    { "chroot",  'c', 0, G_OPTION_ARG_STRING,   &jail.chroot,  "Do a chroot", "dir" },
+    { "chdir",   'd', 0, G_OPTION_ARG_STRING,   &jail.chdir,   "Change working directory (after chroot)", "dir" },
+    { "user",    'u', 0, G_OPTION_ARG_STRING,   &user,         "Run programs as this user", "name" },
+    { "group",   'g', 0, G_OPTION_ARG_STRING,   &group,        "Run programs as this group", "name" },
+
+    { "log",     'l', 0, G_OPTION_ARG_FILENAME, &log_file,     "Write libsaferun log to file", "file" },
+    { "version", 'v', 0, G_OPTION_ARG_NONE,     &show_version, "Show version and exit", NULL },
+    { "debug",    0 , 0, G_OPTION_ARG_NONE,     &debug_lib,    "Show debug output of the library", NULL },
+    { NULL }
+};
+
+void set_default_options()
+{
+    worker_addresses = NULL;
+    jobs_file = secret_file = qos = log_file = NULL;
+    user = "nobody";
+    group = "nogroup";
+    retries = 2;
+    window = 1024;
+
+    limits.mem = 64*1024*1024;
+    limits.time = 1000;
+    limits.rtime = 2 * limits.time;
+
+    log_fd = 2;
+    log_priority = SAFERUN_LOG_WARN;
+}
+
+void parse_options(int argc, char *argv[])
+{
+    GError *error = NULL;
+    GOptionContext *context;
+    struct passwd *pw;
+    struct group *gr;
+    gchar **w;
+
+    context = g_option_context_new("- run jobs on several srund workers");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        printf("option parsing failed: %s\n", error->message);
+        printf("see --help for more information\n");
+        exit(1);
+    }
+
+    if (show_version)
+        return;
+
+    if (!worker_addresses || !*worker_addresses) {
+        printf("at least one worker is needed\n");
+        exit(1);
+    }
+    if (retries < 0 || window <= 0) {
+        printf("retries can`t be negative and window must be positive\n");
+        exit(1);
+    }
+
+    // fds can`t be passed over TCP
+    for (w = worker_addresses; *w; ++w)
+        if (!strncmp(*w, "tcp:", 4))
+            send_paths = TRUE;
+
+    pw = getpwnam(user);
+    gr = getgrnam(group);
+    if (!pw || !gr) {
+        printf("unknown user or group\n");
+        exit(1);
+    }
+    jail.uid = pw->pw_uid;
+    jail.gid = gr->gr_gid;
+
+    if (log_file) {
+        log_fd = open(log_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (log_fd < 0) {
+            perror("can`t open log file");
+            exit(1);
+        }
+    }
+    if (debug_lib)
+        log_priority = SAFERUN_LOG_TRACE;
+}
+
+/**
+ * Make path absolute, worker can`t know our current dir
+ *
+ * @return NULL if the path is too long
+ */
+char *absolute_path(const char *path, char *buf)
+{
+    char cwd[MAXPATHLEN];
+    int len;
+
+    if (path[0] == '/' || !getcwd(cwd, sizeof(cwd)))
+        len = snprintf(buf, MAXPATHLEN, "%s", path);
+    else
+        len = snprintf(buf, MAXPATHLEN, "%s/%s", cwd, path);
+    return len < MAXPATHLEN ? buf : NULL;
+}
+
+/**
+ * Parse job line and submit it.
+ *
+ * Line is "<id> <stdin> <stdout> <stderr> <program> [args...]", "-" is no file.
+ *
+ * @return -1 on error, 0 otherwise
+ */
+int submit_line(saferun_coord *coord, char *line, int lineno)
+{
+    char *words[MAX_WORDS + 1], *save = NULL, *word;
+    char path_buf[3][MAXPATHLEN];
+    const char *paths[3];
+    int fds[3] = {-1, -1, -1};
+    int count = 0, i, ret;
+    struct saferun_task task;
+    char *end;
+
+    for (word = strtok_r(line, " \t\n", &save); word && count < MAX_WORDS;
+         word = strtok_r(NULL, " \t\n", &save))
+        words[count++] = word;
+    words[count] = NULL;
+
+    if (!count || words[0][0] == '#')
+        return 0;
+
+    unsigned id = strtoul(words[0], &end, 10);
+    if (count < 5 || *end) {
+        fprintf(stderr, "Error: bad job at line %d\n", lineno);
+        return -1;
+    }
+
+    memset(&task, 0, sizeof(task));
+    task.jail = &jail;
+    task.limits = &limits;
+    task.argv = &words[4];
+    task.qos = qos;
+
+    for (i = 0; i < 3; ++i) {
+        const char *file = words[1 + i];
+        paths[i] = NULL;
+        if (!strcmp(file, "-"))
+            continue;
+
+        if (send_paths) {
+            paths[i] = absolute_path(file, path_buf[i]);
+            if (!paths[i]) {
+                fprintf(stderr, "Error: path %s of job %u is too long\n", file, id);
+                ret = -1;
+                goto out;
+            }
+        } else {
+            fds[i] = i ? open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)
+                       : open(file, O_RDONLY | O_CLOEXEC);
+            if (fds[i] < 0) {
+                fprintf(stderr, "Error: can`t open %s for job %u\n", file, id);
+                ret = -1;
+                goto out;
+            }
+        }
+    }
+
+    task.stdin_fd = fds[0];
+    task.stdout_fd = fds[1];
+    task.stderr_fd = fds[2];
+    ret = saferun_coord_submit(coord, id, &task, send_paths ? paths : NULL);
+    if (ret)
+        fprintf(stderr, "Error: can`t submit job %u\n", id);
+
+out:
+    // coordinator keeps its own copies of fds
+    for (i = 0; i < 3; ++i)
+        if (fds[i] >= 0)
+            close(fds[i]);
+    return ret;
+}
+
+char * result_str[] = {"OK", "RE", "TL", "ML", "SV", "OL", "WA", "SK", "IL"};
+
+/**
+ * Print result as soon as it comes, one line per job
+ *
+ * @return 1 if the job is not OK, 0 otherwise
+ */
+int print_result(const struct saferun_coord_result *r)
+{
+    const char *worker = r->worker >= 0 ? worker_addresses[r->worker] : "-";
+
+    if (r->ret) {
+        printf("%u error worker=%s attempts=%d\n", r->id, worker, r->attempts);
+    } else {
+        const struct saferun_stat *s = &r->stat;
+        printf("%u %s time=%ld rtime=%ld mem=%lld status=%d worker=%s attempts=%d\n",
+               r->id, result_str[s->result], s->time, s->rtime, s->mem, s->status,
+               worker, r->attempts);
+    }
+    fflush(stdout);
+
+    return r->ret || r->stat.result != _OK;
+}
+
+int main(int argc, char *argv[])
+{
+    struct saferun_coord_result result;
+    struct saferun_coord_worker info;
+    int count = 0, lineno = 0, failed = 0, i;
+    char *line = NULL;
+    size_t size = 0;
+
+    set_default_options();
+    parse_options(argc, argv);
+
+    if (show_version) {
+        g_printf("version: %s\n", SRUNC_VERSION);
+        return 1;
+    }
+
+    FILE *jobs = jobs_file ? fopen(jobs_file, "r") : stdin;
+    if (!jobs) {
+        perror("can`t open jobs file");
+        return 1;
+    }
+
+    saferun_set_logging(log_fd, log_priority);
+    if (secret_file && saferun_remote_set_secret(secret_file))
+        return 1;
+
+    while (worker_addresses[count])
+        ++count;
+    saferun_coord *coord = saferun_coord_create((const char *const *)worker_addresses, count, retries);
+    if (!coord) {
+        fprintf(stderr, "Error: can`t create coordinator\n");
+        return 1;
+    }
+
+    int in_flight = 0;
+    while (getline(&line, &size, jobs) != -1) {
+        ++lineno;
+        if (submit_line(coord, line, lineno)) {
+            failed = 1;
+            continue;
+        }
+
+        // keep at most window jobs in flight, stream results meanwhile
+        ++in_flight;
+        while (saferun_coord_wait(coord, &result, in_flight < window ? 0 : -1) == 0) {
+            failed |= print_result(&result);
+            --in_flight;
+        }
+    }
+    free(line);
+
+    while (saferun_coord_wait(coord, &result, -1) == 0)
+        failed |= print_result(&result);
+
+    for (i = 0; i < count; ++i)
+        if (!saferun_coord_get_worker(coord, i, &info))
+            fprintf(stderr, "worker %s: done = %lld stolen = %lld failures = %lld\n",
+                    worker_addresses[i], info.done, info.stolen, info.failures);
+
+    saferun_coord_destroy(coord);
+    return failed;
+}
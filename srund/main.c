@@ -0,0 +1,898 @@
+//Author: Ankudinov Alexander
+
+#define _GNU_SOURCE
+
+#include <saferun.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+#include "config.h"
+
+/**
+ * Client connection, shared by its reader thread and all its jobs.
+ * Socket is closed when the last of them is done.
+ */
+struct conn {
+    int sock;
+    int refs;
+    struct saferun_remote_peer peer;
+    int closed;           /**< client is gone, its jobs must not run, @see drop_jobs */
+    struct job *running;  /**< jobs run by workers now */
+    int jobs;             /**< jobs queued or running, at most max_jobs */
+    pthread_cond_t done;  /**< wakes reader waiting for jobs under max_jobs */
+    pthread_mutex_t lock; /**< protects refs, closed, running, jobs and writing replies */
+};
+
+/**
+ * Task waiting for a worker or run by it.
+ */
+struct job {
+    struct conn *conn;
+    unsigned id;
+    saferun_task *task;
+    long long predicted; /**< real time of the task, in milliseconds, used with --history */
+    long long queued;    /**< when the job was queued, in milliseconds */
+    saferun_inst *inst;  /**< running the job */
+    struct job *next;    /**< in the queue, or in running jobs of the connection */
+};
+
+gchar *socket_path;
+gchar *secret_file;
+gboolean listen_any = FALSE;
+gchar *io_root;
+gchar *task_user;
+gchar *task_group;
+gchar **allowed_users;
+gchar **allowed_chroots;
+struct saferun_remote_policy policy;
+uid_t *allowed_uids;
+int allowed_count = 0;
+gchar *cgroup_prefix;
+gchar **qos_classes;
+gchar *log_file;
+gchar *metrics_file;
+gint workers;
+gint max_jobs;
+gint max_wait;
+gchar **warm_paths;
+gchar **warm_lock_paths;
+gint warm_interval;
+saferun_inst *warm_inst;
+gchar *journal_dir;
+gint journal_segment;
+gint journal_keep;
+saferun_journal *journal;
+gchar *history_file;
+gint history_slots;
+gint aging;
+saferun_history *history;
+gboolean calibrate = FALSE;
+gboolean normalize = FALSE;
+gdouble reference;
+gint calibrate_interval;
+struct saferun_admission admission;
+gboolean show_version = FALSE;
+gboolean debug_lib = FALSE;
+int log_priority;
+
+saferun_pool *pool;
+int listen_sock = -1;
+volatile sig_atomic_t stop = 0;
+volatile sig_atomic_t dump_metrics = 0;
+
+pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+struct job *queue_head, *queue_tail;
+int queue_length = 0;
+int queue_closed = 0;
+
+static GOptionEntry entries[] =
+{
+    { "socket",  's', 0, G_OPTION_ARG_FILENAME, &socket_path,   "Listen on this unix socket, or on tcp:host:port, empty host is loopback", "path" },
+    { "secret",   0 , 0, G_OPTION_ARG_FILENAME, &secret_file,   "File with secret shared with clients, needed over TCP", "file" },
+    { "listen-any", 0, 0, G_OPTION_ARG_NONE,    &listen_any,    "Allow TCP socket on all interfaces, like tcp:0.0.0.0:port", NULL },
+    { "io-root",  0 , 0, G_OPTION_ARG_FILENAME, &io_root,       "Accept stdio paths of tasks inside of this dir, needed over TCP", "dir" },
+    { "task-user",  0, 0, G_OPTION_ARG_STRING, &task_user,  "Run every task as this user, whatever client asks", "name" },
+    { "task-group", 0, 0, G_OPTION_ARG_STRING, &task_group, "Run every task with this group, with --task-user", "name" },
+    { "allow-user", 0, 0, G_OPTION_ARG_STRING_ARRAY, &allowed_users, "Accept connections of this user besides root and the daemon user, its tasks run as itself", "name" },
+    { "chroot",     0, 0, G_OPTION_ARG_FILENAME_ARRAY, &allowed_chroots, "Allow tasks to chroot to this dir", "dir" },
+    { "workers", 'w', 0, G_OPTION_ARG_INT,      &workers,       "Number of tasks run concurrently", "N" },
+    { "max-jobs", 0 , 0, G_OPTION_ARG_INT,      &max_jobs,      "Max tasks queued or running per client, its requests are not read over it", "N" },
+    { "cgroup",   0 , 0, G_OPTION_ARG_STRING,   &cgroup_prefix, "Prefix of cgroup names", "name" },
+    { "qos",      0 , 0, G_OPTION_ARG_STRING_ARRAY, &qos_classes, "Add CPU QoS class, quota is in thousandths of a core", "name:shares:quota" },
+
+    { "max-running",     0, 0, G_OPTION_ARG_INT,    &admission.max_running,     "Max tasks run concurrently, less than workers to keep spare instances", "N" },
+    { "cpu-pressure",    0, 0, G_OPTION_ARG_DOUBLE, &admission.cpu_pressure,    "Delay tasks while CPU pressure (some avg10) is over this percent", "P" },
+    { "memory-pressure", 0, 0, G_OPTION_ARG_DOUBLE, &admission.memory_pressure, "Delay tasks while memory pressure is over this percent", "P" },
+    { "io-pressure",     0, 0, G_OPTION_ARG_DOUBLE, &admission.io_pressure,     "Delay tasks while I/O pressure is over this percent", "P" },
+    { "max-wait",        0, 0, G_OPTION_ARG_INT,    &max_wait,                  "Start delayed task anyway after this wait in milliseconds", "N" },
+    { "max-memory",      0, 0, G_OPTION_ARG_INT64,  &admission.max_memory,      "Max sum of predicted memory of running tasks in bytes", "N" },
+
+    { "history",       0, 0, G_OPTION_ARG_FILENAME, &history_file,  "Predict tasks by history of their runs in file and run shortest first", "file" },
+    { "history-slots", 0, 0, G_OPTION_ARG_INT,      &history_slots, "Number of tasks kept in a new history file", "N" },
+    { "aging",         0, 0, G_OPTION_ARG_INT,      &aging,         "Milliseconds of predicted time a queued task gains per second of waiting", "N" },
+
+    { "calibrate",          0, 0, G_OPTION_ARG_NONE,   &calibrate,          "Measure host speed and report times in reference milliseconds too", NULL },
+    { "normalize",          0, 0, G_OPTION_ARG_NONE,   &normalize,          "Take time limits in reference milliseconds, implies --calibrate", NULL },
+    { "reference",          0, 0, G_OPTION_ARG_DOUBLE, &reference,          "CPU time of reference workload on reference host in milliseconds", "ms" },
+    { "calibrate-interval", 0, 0, G_OPTION_ARG_INT,    &calibrate_interval, "Measure host speed again every N milliseconds, 0 never", "N" },
+
+    { "warm",          0, 0, G_OPTION_ARG_FILENAME_ARRAY, &warm_paths,      "Keep file or dir (jail image, toolchain) in page cache", "path" },
+    { "warm-lock",     0, 0, G_OPTION_ARG_FILENAME_ARRAY, &warm_lock_paths, "Keep file or dir locked in memory", "path" },
+    { "warm-interval", 0, 0, G_OPTION_ARG_INT,            &warm_interval,   "Check page cache residency of warm files every N milliseconds", "N" },
+
+    { "journal",         0, 0, G_OPTION_ARG_FILENAME, &journal_dir,     "Append record of every run to journal in dir", "dir" },
+    { "journal-segment", 0, 0, G_OPTION_ARG_INT,      &journal_segment, "Size of journal segment file in megabytes", "N" },
+    { "journal-keep",    0, 0, G_OPTION_ARG_INT,      &journal_keep,    "Remove older journal segments than the last N", "N" },
+
+    { "log",     'l', 0, G_OPTION_ARG_FILENAME, &log_file,      "Write log to file", "file" },
+    { "metrics",  0 , 0, G_OPTION_ARG_FILENAME, &metrics_file,  "Write Prometheus metrics to file or unix socket on SIGUSR1 and on exit", "path" },
+
+    { "version", 'v', 0, G_OPTION_ARG_NONE,     &show_version,  "Show version and exit", NULL },
+    { "debug",    0 , 0, G_OPTION_ARG_NONE,     &debug_lib,     "Show debug output of the library", NULL },
+    { NULL }
+};
+
+void set_default_options()
+{
+    socket_path = "/var/run/srund.sock";
+    secret_file = NULL;
+    io_root = NULL;
+    task_user = task_group = NULL;
+    allowed_users = allowed_chroots = NULL;
+    cgroup_prefix = "srund";
+    qos_classes = NULL;
+    log_file = metrics_file = NULL;
+    workers = 4;
+    max_jobs = 1024;
+    warm_paths = warm_lock_paths = NULL;
+    warm_interval = 10000;
+    journal_dir = NULL;
+    journal_segment = 64;
+    journal_keep = 0;
+    history_file = NULL;
+    history_slots = 65536;
+    aging = 1000;
+    reference = 0;
+    calibrate_interval = 600000;
+    log_priority = SAFERUN_LOG_WARN;
+}
+
+void parse_options(int argc, char *argv[])
+{
+    GError *error = NULL;
+    GOptionContext *context;
+
+    context = g_option_context_new("- run saferun tasks sent over unix or TCP socket");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        printf("option parsing failed: %s\n", error->message);
+        printf("see --help for more information\n");
+        exit(1);
+    }
+
+    if (workers <= 0 || max_jobs <= 0) {
+        printf("number of workers and max jobs must be positive\n");
+        exit(1);
+    }
+
+    if (history_slots <= 0 || aging < 0) {
+        printf("history slots must be positive and aging can`t be negative\n");
+        exit(1);
+    }
+
+    if (reference < 0 || calibrate_interval < 0) {
+        printf("reference time and calibration interval can`t be negative\n");
+        exit(1);
+    }
+
+    if (journal_segment <= 0 || journal_keep < 0) {
+        printf("journal segment size must be positive and kept segments can`t be negative\n");
+        exit(1);
+    }
+
+    admission.max_wait = max_wait;
+    if (admission.max_running < 0 || admission.max_wait < 0) {
+        printf("max running tasks and max wait can`t be negative\n");
+        exit(1);
+    }
+
+    if (!task_user != !task_group) {
+        printf("--task-user and --task-group must be given together\n");
+        exit(1);
+    }
+
+    if (!strncmp(socket_path, "tcp:", 4) && !secret_file) {
+        printf("TCP socket needs --secret\n");
+        exit(1);
+    }
+
+    if (debug_lib)
+        log_priority = SAFERUN_LOG_TRACE;
+}
+
+/**
+ * Fill policy of tasks accepted from clients
+ *
+ * Tasks never run as root, so --task-user can`t be root either.
+ */
+void setup_policy()
+{
+    struct passwd *pw;
+    struct group *gr;
+    gchar **name;
+
+    policy.io_root = io_root;
+    policy.chroots = (const char *const *) allowed_chroots;
+
+    if (task_user) {
+        pw = getpwnam(task_user);
+        gr = getgrnam(task_group);
+        if (!pw || !gr || !pw->pw_uid || !gr->gr_gid) {
+            fprintf(stderr, "Error: task user and group must exist and can`t be root\n");
+            exit(1);
+        }
+        policy.uid = pw->pw_uid;
+        policy.gid = gr->gr_gid;
+    }
+
+    for (name = allowed_users; name && *name; ++name)
+        ++allowed_count;
+    allowed_uids = malloc((allowed_count + 1) * sizeof(uid_t));
+    for (allowed_count = 0, name = allowed_users; name && *name; ++name) {
+        pw = getpwnam(*name);
+        if (!pw) {
+            fprintf(stderr, "Error: unknown user %s\n", *name);
+            exit(1);
+        }
+        allowed_uids[allowed_count++] = pw->pw_uid;
+    }
+}
+
+/**
+ * Check if peer may use the daemon
+ *
+ * Root and the daemon user are trusted, other users must be allowed.
+ */
+int peer_allowed(const struct saferun_remote_peer *peer)
+{
+    int i;
+
+    if (peer->trusted)
+        return 1;
+
+    for (i = 0; i < allowed_count; ++i)
+        if (allowed_uids[i] == peer->uid)
+            return 1;
+    return 0;
+}
+
+void conn_put(struct conn *conn)
+{
+    pthread_mutex_lock(&conn->lock);
+    int refs = --conn->refs;
+    pthread_mutex_unlock(&conn->lock);
+
+    if (refs)
+        return;
+
+    close(conn->sock);
+    pthread_cond_destroy(&conn->done);
+    pthread_mutex_destroy(&conn->lock);
+    free(conn);
+}
+
+/**
+ * Free job and release its connection, reader may read the next request
+ */
+void free_job(struct job *job)
+{
+    struct conn *conn = job->conn;
+
+    pthread_mutex_lock(&conn->lock);
+    --conn->jobs;
+    pthread_cond_signal(&conn->done);
+    pthread_mutex_unlock(&conn->lock);
+
+    conn_put(conn);
+    free(job);
+}
+
+long long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / (1000*1000);
+}
+
+void push_job(struct job *job)
+{
+    struct saferun_prediction prediction;
+
+    job->predicted = job->task->limits->rtime;
+    if (history && !saferun_history_predict(history, job->task, &prediction) && prediction.runs)
+        job->predicted = prediction.rtime;
+    job->queued = now_ms();
+
+    pthread_mutex_lock(&queue_lock);
+    job->next = NULL;
+    if (queue_tail)
+        queue_tail->next = job;
+    else
+        queue_head = job;
+    queue_tail = job;
+    ++queue_length;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/**
+ * Take job out of the queue, prev is the job before it or NULL
+ *
+ * Should be called with queue_lock held.
+ */
+void unlink_job(struct job *job, struct job *prev)
+{
+    if (prev)
+        prev->next = job->next;
+    else
+        queue_head = job->next;
+    if (queue_tail == job)
+        queue_tail = prev;
+    --queue_length;
+}
+
+/**
+ * Find job to run next.
+ *
+ * Without history it`s the first one. With history it`s the one with
+ * the least predicted real time (real time limit for new tasks), which
+ * is lowered by aging for every second of waiting, so long tasks
+ * are not starved by a stream of short ones.
+ *
+ * Should be called with queue_lock held.
+ *
+ * @param prev  where to write the job before it or NULL
+ */
+struct job *next_job(struct job **prev)
+{
+    struct job *job, *p, *best = queue_head;
+    long long now, score, best_score = 0;
+
+    *prev = NULL;
+    if (!history)
+        return best;
+
+    now = now_ms();
+    for (p = NULL, job = queue_head; job; p = job, job = job->next) {
+        score = job->predicted - (now - job->queued) * aging / 1000;
+        if (job == queue_head || score < best_score) {
+            best = job;
+            best_score = score;
+            *prev = p;
+        }
+    }
+    return best;
+}
+
+/**
+ * Take next job, waits if there is none.
+ *
+ * @return NULL if the queue is closed and empty
+ */
+struct job *pop_job()
+{
+    struct job *job, *prev;
+
+    pthread_mutex_lock(&queue_lock);
+    while (!queue_head && !queue_closed)
+        pthread_cond_wait(&queue_cond, &queue_lock);
+
+    job = next_job(&prev);
+    if (job)
+        unlink_job(job, prev);
+    pthread_mutex_unlock(&queue_lock);
+
+    return job;
+}
+
+/**
+ * Take job of the connection with given id out of the queue
+ *
+ * @return NULL if the job is not in the queue, it`s taken by a worker then
+ */
+struct job *remove_job(struct conn *conn, unsigned id)
+{
+    struct job *job, *prev = NULL;
+
+    pthread_mutex_lock(&queue_lock);
+    for (job = queue_head; job; prev = job, job = job->next)
+        if (job->conn == conn && job->id == id)
+            break;
+
+    if (job)
+        unlink_job(job, prev);
+    pthread_mutex_unlock(&queue_lock);
+
+    return job;
+}
+
+void send_reply(struct conn *conn, unsigned id, int ret, const struct saferun_stat *stat)
+{
+    pthread_mutex_lock(&conn->lock);
+    saferun_remote_reply(conn->sock, id, ret, stat);
+    pthread_mutex_unlock(&conn->lock);
+}
+
+/**
+ * Reply load of the daemon, jobs waiting for a worker are counted as queued
+ */
+void send_status(struct conn *conn, unsigned id)
+{
+    struct saferun_remote_load load;
+
+    saferun_remote_get_load(&load);
+    pthread_mutex_lock(&queue_lock);
+    load.queued += queue_length;
+    pthread_mutex_unlock(&queue_lock);
+
+    pthread_mutex_lock(&conn->lock);
+    saferun_remote_status(conn->sock, id, &load);
+    pthread_mutex_unlock(&conn->lock);
+}
+
+/**
+ * Cancel job which is not taken by a worker yet, coordinator moves it
+ * to another daemon then. Started job is replied as usual.
+ */
+void cancel_job(struct conn *conn, unsigned id)
+{
+    struct job *job = remove_job(conn, id);
+    if (!job)
+        return;
+
+    saferun_remote_free(job->task);
+    send_reply(conn, id, SAFERUN_REMOTE_CANCELLED, NULL);
+    free_job(job);
+}
+
+/**
+ * Give up jobs of closed connection.
+ *
+ * Client may send them to another daemon, so they must not run here
+ * anymore: queued jobs are dropped and running ones are killed.
+ * Socket is closed when the last of them is done, so the client knows
+ * that they are gone.
+ */
+void drop_jobs(struct conn *conn)
+{
+    struct job *job, *prev = NULL, *next;
+
+    pthread_mutex_lock(&conn->lock);
+    conn->closed = 1;
+    for (job = conn->running; job; job = job->next)
+        saferun_cancel(job->inst, 1);
+    pthread_mutex_unlock(&conn->lock);
+
+    pthread_mutex_lock(&queue_lock);
+    for (job = queue_head; job; job = next) {
+        next = job->next;
+        if (job->conn != conn) {
+            prev = job;
+            continue;
+        }
+        unlink_job(job, prev);
+        saferun_remote_free(job->task);
+        free_job(job);
+    }
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/**
+ * Run job on the instance, unless its connection is closed
+ *
+ * @return -1 if the job is not run or saferun_run() failed
+ */
+int run_job(struct job *job, saferun_inst *inst, struct saferun_stat *stat)
+{
+    struct conn *conn = job->conn;
+    struct job **p;
+    int ret;
+
+    pthread_mutex_lock(&conn->lock);
+    int closed = conn->closed;
+    if (!closed) {
+        job->inst = inst;
+        job->next = conn->running;
+        conn->running = job;
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    if (closed)
+        return -1;
+    ret = saferun_run(inst, job->task, stat);
+
+    pthread_mutex_lock(&conn->lock);
+    for (p = &conn->running; *p != job; p = &(*p)->next)
+        ;
+    *p = job->next;
+    // instance goes back to the pool, its next run must not be cancelled
+    saferun_cancel(inst, 0);
+    pthread_mutex_unlock(&conn->lock);
+    return ret;
+}
+
+void *worker(void *arg)
+{
+    struct job *job;
+    (void) arg;
+
+    saferun_set_logging(2, log_priority);
+    saferun_set_admission(&admission);
+
+    while ((job = pop_job())) {
+        struct saferun_stat stat;
+        memset(&stat, 0, sizeof(stat));
+
+        saferun_inst *inst = saferun_pool_acquire(pool);
+        int ret = run_job(job, inst, &stat);
+        saferun_pool_release(pool, inst);
+
+        // close stdio before reply, so client sees EOF on its pipes
+        saferun_remote_free(job->task);
+
+        send_reply(job->conn, job->id, ret, &stat);
+
+        free_job(job);
+    }
+
+    return NULL;
+}
+
+/**
+ * Wait until the client has less than max_jobs jobs.
+ *
+ * Requests are not read meanwhile, so the socket is polled every second
+ * to notice that the client is gone.
+ *
+ * @return 0 if the client closed connection
+ */
+int wait_jobs(struct conn *conn)
+{
+    struct pollfd pfd;
+    struct timespec deadline;
+    int alive = 1;
+
+    pthread_mutex_lock(&conn->lock);
+    while (conn->jobs >= max_jobs) {
+        pfd.fd = conn->sock;
+        pfd.events = POLLRDHUP;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 0) > 0) {
+            alive = 0;
+            break;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        ++deadline.tv_sec;
+        pthread_cond_timedwait(&conn->done, &conn->lock, &deadline);
+    }
+    pthread_mutex_unlock(&conn->lock);
+    return alive;
+}
+
+/**
+ * Read requests from client until it closes connection, its jobs
+ * are given up then.
+ *
+ * Peer is checked first, over TCP it`s a handshake which can take a while,
+ * so it`s done here and not in the accepting thread.
+ * Tasks are run concurrently, so replies can come in any order.
+ * While the client has max_jobs jobs, its requests are left in the
+ * socket, so a client can`t fill memory of the daemon with its queue.
+ */
+void *reader(void *arg)
+{
+    struct conn *conn = arg;
+    saferun_task *task;
+    unsigned id;
+    int type;
+
+    if (saferun_remote_get_peer(conn->sock, &conn->peer) || !peer_allowed(&conn->peer)) {
+        fprintf(stderr, "Warning: connection of user %d is refused\n", (int) conn->peer.uid);
+        conn_put(conn);
+        return NULL;
+    }
+
+    while (wait_jobs(conn)) {
+        task = saferun_remote_recv_request(conn->sock, &id, &type, &policy, &conn->peer);
+        if (!type)
+            break;
+
+        if (type == SAFERUN_REMOTE_STATUS) {
+            send_status(conn, id);
+            continue;
+        }
+        if (type == SAFERUN_REMOTE_CANCEL) {
+            cancel_job(conn, id);
+            continue;
+        }
+        if (!task) {
+            // stdio of the task can`t be opened, connection is fine
+            send_reply(conn, id, -1, NULL);
+            continue;
+        }
+
+        struct job *job = malloc(sizeof(struct job));
+        if (!job) {
+            saferun_remote_free(task);
+            break;
+        }
+
+        pthread_mutex_lock(&conn->lock);
+        ++conn->refs;
+        ++conn->jobs;
+        pthread_mutex_unlock(&conn->lock);
+
+        job->conn = conn;
+        job->id = id;
+        job->task = task;
+        push_job(job);
+    }
+
+    drop_jobs(conn);
+    conn_put(conn);
+    return NULL;
+}
+
+void on_signal(int sig)
+{
+    if (sig == SIGUSR1) {
+        dump_metrics = 1;
+        return;
+    }
+
+    stop = 1;
+    // wakes up accept() in main thread
+    shutdown(listen_sock, SHUT_RDWR);
+}
+
+void setup_signals()
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    // no SA_RESTART, so accept() is interrupted
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    signal(SIGPIPE, SIG_IGN);
+}
+
+/**
+ * Start thread with handled signals blocked, so they are delivered to
+ * main thread only and interrupt its accept(), not reads of workers.
+ */
+int start_thread(pthread_t *thread, void *(*fn)(void *), void *arg)
+{
+    sigset_t set, old;
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGUSR1);
+
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    int ret = pthread_create(thread, NULL, fn, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return ret;
+}
+
+/**
+ * Read declared files to page cache
+ *
+ * Page cache is shared, so files are warmed by a separate instance,
+ * which never runs tasks.
+ */
+void setup_warm()
+{
+    char cgname[64];
+    gchar **path;
+
+    if (!warm_paths && !warm_lock_paths)
+        return;
+
+    snprintf(cgname, sizeof(cgname), "%s-warm", cgroup_prefix);
+    warm_inst = saferun_init(cgname);
+    if (!warm_inst) {
+        fprintf(stderr, "Error: can`t create instance for warming\n");
+        exit(1);
+    }
+
+    for (path = warm_paths; path && *path; ++path)
+        if (saferun_warm_add(warm_inst, *path, 0))
+            fprintf(stderr, "Warning: can`t warm %s\n", *path);
+    for (path = warm_lock_paths; path && *path; ++path)
+        if (saferun_warm_add(warm_inst, *path, 1))
+            fprintf(stderr, "Warning: can`t warm %s\n", *path);
+
+    if (warm_interval > 0)
+        saferun_warm_start(warm_inst, warm_interval);
+}
+
+void setup_journal()
+{
+    if (!journal_dir)
+        return;
+
+    journal = saferun_journal_open(journal_dir, journal_segment * 1024LL * 1024, journal_keep);
+    if (!journal) {
+        fprintf(stderr, "Error: can`t open journal in %s\n", journal_dir);
+        exit(1);
+    }
+    saferun_set_journal(journal);
+}
+
+void setup_history()
+{
+    if (!history_file)
+        return;
+
+    history = saferun_history_open(history_file, history_slots);
+    if (!history) {
+        fprintf(stderr, "Error: can`t open history %s\n", history_file);
+        exit(1);
+    }
+    saferun_set_history(history);
+}
+
+void setup_qos()
+{
+    char name[32];
+    long shares, quota;
+    gchar **qos;
+
+    for (qos = qos_classes; qos && *qos; ++qos) {
+        quota = 0;
+        if (sscanf(*qos, "%31[^:]:%ld:%ld", name, &shares, &quota) < 2
+                || saferun_pool_set_qos(pool, name, shares, quota)) {
+            fprintf(stderr, "Error: bad QoS class '%s'\n", *qos);
+            exit(1);
+        }
+    }
+}
+
+void setup_calibration()
+{
+    if (!calibrate && !normalize)
+        return;
+
+    if (saferun_pool_set_calibration(pool, reference, calibrate_interval, normalize)) {
+        fprintf(stderr, "Error: can`t calibrate host speed\n");
+        exit(1);
+    }
+}
+
+void serve()
+{
+    while (!stop) {
+        if (dump_metrics && metrics_file) {
+            dump_metrics = 0;
+            saferun_metrics_write(metrics_file);
+        }
+
+        int sock = accept4(listen_sock, NULL, NULL, SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (errno != EINTR && !stop)
+                perror("accept");
+            continue;
+        }
+
+        struct conn *conn = malloc(sizeof(struct conn));
+        pthread_t thread;
+        if (!conn) {
+            close(sock);
+            continue;
+        }
+        conn->sock = sock;
+        conn->refs = 1;
+        conn->closed = 0;
+        conn->running = NULL;
+        conn->jobs = 0;
+        pthread_cond_init(&conn->done, NULL);
+        pthread_mutex_init(&conn->lock, NULL);
+
+        if (start_thread(&thread, reader, conn)) {
+            perror("pthread_create");
+            conn_put(conn);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    pthread_t *threads;
+    int i;
+
+    set_default_options();
+    parse_options(argc, argv);
+
+    if (show_version) {
+        g_printf("version: %s\n", SRUND_VERSION);
+        return 1;
+    }
+
+    // all threads log to stderr, so it goes to log file
+    if (log_file && !freopen(log_file, "a", stderr)) {
+        perror("can`t open log file");
+        return 1;
+    }
+    saferun_set_logging(2, log_priority);
+    saferun_set_admission(&admission);
+    setup_policy();
+    if (secret_file && saferun_remote_set_secret(secret_file))
+        return 1;
+
+    pool = saferun_pool_create(cgroup_prefix, workers);
+    if (!pool) {
+        fprintf(stderr, "Error: can`t create pool of %d instances\n", workers);
+        return 1;
+    }
+    setup_qos();
+    setup_calibration();
+    setup_warm();
+    setup_journal();
+    setup_history();
+
+    listen_sock = saferun_remote_listen(socket_path, listen_any ? SAFERUN_LISTEN_ANY : 0);
+    if (listen_sock < 0) {
+        saferun_pool_destroy(pool);
+        return 1;
+    }
+    setup_signals();
+
+    threads = malloc(workers * sizeof(pthread_t));
+    for (i = 0; i < workers; ++i)
+        start_thread(&threads[i], worker, NULL);
+
+    serve();
+
+    // finish queued tasks, readers of connections are just abandoned
+    pthread_mutex_lock(&queue_lock);
+    queue_closed = 1;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+
+    for (i = 0; i < workers; ++i)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    close(listen_sock);
+    if (strncmp(socket_path, "tcp:", 4))
+        unlink(socket_path);
+    saferun_pool_destroy(pool);
+    saferun_fini(warm_inst);
+    saferun_journal_close(journal);
+    saferun_set_history(NULL);
+    saferun_history_close(history);
+
+    if (metrics_file)
+        saferun_metrics_write(metrics_file);
+
+    return 0;
+}